@@ -16,6 +16,9 @@
  * limitations under the License.
  */
 #include "moloch.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "arkimeconfig.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -25,6 +28,7 @@
 #include <sys/resource.h>
 #include <sys/statvfs.h>
 #include <fcntl.h>
+#include <sys/file.h>
 #include <arpa/inet.h>
 #include <dirent.h>
 #include "patricia.h"
@@ -61,8 +65,27 @@ extern char            *moloch_char_to_hex;
 extern unsigned char    moloch_char_to_hexstr[256][3];
 extern unsigned char    moloch_hex_to_char[256][256];
 
-LOCAL uint32_t          nextFileNum;
-LOCAL MOLOCH_LOCK_DEFINE(nextFileNum);
+/* File numbers are reserved from the fn- sequence in blocks ahead of time.
+ * The unused part of the blocks is saved in fileNumLeaseFile on exit, and the
+ * next capture with the same node claims it by deleting the file under flock.
+ * Nothing is on disk while running, so a crash just loses the numbers.
+ *
+ * A sync reservation can run while the background one is between its two
+ * requests, and their blocks can then overlap.  Each sync reservation bumps
+ * fileNumSyncGen, and a background block is only used if no sync reservation
+ * started after it did.
+ */
+LOCAL uint32_t          fileNumNext, fileNumEnd;
+LOCAL uint32_t          fileNumSpareNext, fileNumSpareEnd;
+LOCAL uint32_t          fileNumBlockSize;
+LOCAL int               fileNumReserving;
+LOCAL uint32_t          fileNumReservingGen;
+LOCAL uint32_t          fileNumSyncGen;
+LOCAL char              fileNumLeaseFile[PATH_MAX];
+LOCAL MOLOCH_LOCK_DEFINE(fileNum);
+
+LOCAL GHashTable       *fileExistsCache;
+LOCAL MOLOCH_LOCK_DEFINE(fileExistsCache);
 
 LOCAL struct timespec   startHealthCheck;
 LOCAL uint64_t          esHealthMS;
@@ -109,6 +132,17 @@ void moloch_db_free_local_ip(MolochIpInfo_t *ii)
     MOLOCH_TYPE_FREE(MolochIpInfo_t, ii);
 }
 /******************************************************************************/
+// session is NULL on serializer threads, the tags were already added on the packet thread
+LOCAL void moloch_db_local_ip_tags(MolochSession_t *session, const MolochIpInfo_t *ii)
+{
+    if (!session)
+        return;
+
+    for (int t = 0; t < ii->numtags; t++) {
+        moloch_field_string_add(config.tagsStringField, session, ii->tagsStr[t], -1, TRUE);
+    }
+}
+/******************************************************************************/
 LOCAL MolochIpInfo_t *moloch_db_get_local_ip6(MolochSession_t *session, struct in6_addr *ip)
 {
     patricia_node_t *node;
@@ -123,20 +157,56 @@ LOCAL MolochIpInfo_t *moloch_db_get_local_ip6(MolochSession_t *session, struct i
 
 
     MolochIpInfo_t *ii = node->data;
-    int t;
-
-    for (t = 0; t < ii->numtags; t++) {
-        moloch_field_string_add(config.tagsStringField, session, ii->tagsStr[t], -1, TRUE);
-    }
-
+    moloch_db_local_ip_tags(session, ii);
     return ii;
 }
 
 /******************************************************************************/
-LOCAL void moloch_db_js0n_str(BSB * bsb, unsigned char * in, gboolean utf8)
+// Bytes that are copied as is, everything else goes through the switch below
+#define MOLOCH_JS0N_CLEAN(c) ((c) >= 0x20 && (c) < 0x80 && (c) != '"' && (c) != '\\' && (c) != '/')
+
+/* Escape [in, end) into bsb.  Clean runs are found 16 bytes at a time and
+ * copied with one memcpy, the rest is byte at a time.  Returns FALSE if a utf8
+ * sequence was cut short by a NUL, which ends the string.
+ */
+LOCAL gboolean moloch_db_js0n_escape(BSB *bsb, unsigned char *in, unsigned char *end, gboolean utf8)
 {
-    BSB_EXPORT_u08(*bsb, '"');
-    while (*in) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i bslash = _mm_set1_epi8('\\');
+#endif
+
+    while (in < end) {
+        unsigned char *clean = in;
+
+#ifdef __SSE2__
+        while (end - in >= 16) {
+            const __m128i v = _mm_loadu_si128((const __m128i *)in);
+            // Signed compare catches both control characters and high bit bytes
+            __m128i bad = _mm_cmplt_epi8(v, space);
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, quote));
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, slash));
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, bslash));
+
+            const int mask = _mm_movemask_epi8(bad);
+            if (mask) {
+                in += __builtin_ctz(mask);
+                break;
+            }
+            in += 16;
+        }
+#endif
+        while (in < end && MOLOCH_JS0N_CLEAN(*in))
+            in++;
+
+        if (in > clean)
+            BSB_EXPORT_ptr(*bsb, clean, (in - clean));
+
+        if (in >= end)
+            break;
+
         switch(*in) {
         case '\b':
             BSB_EXPORT_cstr(*bsb, "\\b");
@@ -167,34 +237,35 @@ LOCAL void moloch_db_js0n_str(BSB * bsb, unsigned char * in, gboolean utf8)
                 BSB_EXPORT_sprintf(*bsb, "\\u%04x", *in);
             } else if (utf8) {
                 if ((*in & 0xf0) == 0xf0) {
-                    if (!in[1] || !in[2] || !in[3]) goto end;
+                    if (!in[1] || !in[2] || !in[3]) return FALSE;
                     BSB_EXPORT_ptr(*bsb, in, 4);
                     in += 3;
                 } else if ((*in & 0xf0) == 0xe0) {
-                    if (!in[1] || !in[2]) goto end;
+                    if (!in[1] || !in[2]) return FALSE;
                     BSB_EXPORT_ptr(*bsb, in, 3);
                     in += 2;
                 } else if ((*in & 0xf0) == 0xd0) {
-                    if (!in[1]) goto end;
+                    if (!in[1]) return FALSE;
                     BSB_EXPORT_ptr(*bsb, in, 2);
                     in += 1;
                 } else {
                     BSB_EXPORT_u08(*bsb, *in);
                 }
             } else {
-                if(*in & 0x80) {
-                    BSB_EXPORT_u08(*bsb, (0xc0 | (*in >> 6)));
-                    BSB_EXPORT_u08(*bsb, (0x80 | (*in & 0x3f)));
-                } else {
-                    BSB_EXPORT_u08(*bsb, *in);
-                }
+                BSB_EXPORT_u08(*bsb, (0xc0 | (*in >> 6)));
+                BSB_EXPORT_u08(*bsb, (0x80 | (*in & 0x3f)));
             }
             break;
         }
         in++;
     }
-
-end:
+    return TRUE;
+}
+/******************************************************************************/
+LOCAL void moloch_db_js0n_str(BSB * bsb, unsigned char * in, gboolean utf8)
+{
+    BSB_EXPORT_u08(*bsb, '"');
+    moloch_db_js0n_escape(bsb, in, in + strlen((char *)in), utf8);
     BSB_EXPORT_u08(*bsb, '"');
 }
 
@@ -205,75 +276,97 @@ LOCAL void moloch_db_js0n_str_unquoted(BSB * bsb, unsigned char * in, int len, g
     if (len == -1)
         len = strlen((char *)in);
 
-    unsigned char *end = in + len;
+    moloch_db_js0n_escape(bsb, in, in + len, utf8);
+}
 
-    while (in < end) {
-        switch(*in) {
-        case '\b':
-            BSB_EXPORT_cstr(*bsb, "\\b");
-            break;
-        case '\n':
-            BSB_EXPORT_cstr(*bsb, "\\n");
-            break;
-        case '\r':
-            BSB_EXPORT_cstr(*bsb, "\\r");
-            break;
-        case '\f':
-            BSB_EXPORT_cstr(*bsb, "\\f");
-            break;
-        case '\t':
-            BSB_EXPORT_cstr(*bsb, "\\t");
-            break;
-        case '"':
-            BSB_EXPORT_cstr(*bsb, "\\\"");
-            break;
-        case '\\':
-            BSB_EXPORT_cstr(*bsb, "\\\\");
-            break;
-        case '/':
-            BSB_EXPORT_cstr(*bsb, "\\/");
-            break;
-        default:
-            if(*in < 32) {
-                BSB_EXPORT_sprintf(*bsb, "\\u%04x", *in);
-            } else if (utf8) {
-                if ((*in & 0xf0) == 0xf0) {
-                    if (!in[1] || !in[2] || !in[3]) return;
-                    BSB_EXPORT_ptr(*bsb, in, 4);
-                    in += 3;
-                } else if ((*in & 0xf0) == 0xe0) {
-                    if (!in[1] || !in[2]) return;
-                    BSB_EXPORT_ptr(*bsb, in, 3);
-                    in += 2;
-                } else if ((*in & 0xf0) == 0xd0) {
-                    if (!in[1]) return;
-                    BSB_EXPORT_ptr(*bsb, in, 2);
-                    in += 1;
-                } else {
-                    BSB_EXPORT_u08(*bsb, *in);
-                }
-            } else {
-                if(*in & 0x80) {
-                    BSB_EXPORT_u08(*bsb, (0xc0 | (*in >> 6)));
-                    BSB_EXPORT_u08(*bsb, (0x80 | (*in & 0x3f)));
-                } else {
-                    BSB_EXPORT_u08(*bsb, *in);
-                }
-            }
-            break;
-        }
-        in++;
+/******************************************************************************/
+/* Per thread cache of moloch_db_geo_lookup6 results since most sessions are
+ * with the same few thousand servers.  Sets of MOLOCH_GEO_CACHE_WAYS entries,
+ * each entry is one cache line, LRU within a set.  Entries point into the
+ * mmdb, rir and local ip data, so every reload bumps geoCacheGen to invalidate
+ * them all before the old data is freed later.
+ */
+#define MOLOCH_GEO_CACHE_WAYS 4
+#define MOLOCH_GEO_CACHE_MAX  128
+
+typedef struct {
+    struct in6_addr          addr;
+    MolochIpInfo_t          *ii;
+    char                    *country;
+    char                    *asStr;
+    char                    *rir;
+    uint32_t                 asNum;
+    int                      asLen;
+    uint32_t                 gen;
+    uint32_t                 used;
+} __attribute__((aligned(64))) MolochGeoCacheEntry_t;
+
+typedef struct {
+    MolochGeoCacheEntry_t   *entries;
+    uint32_t                 mask;
+    uint32_t                 clock;
+    uint64_t                 hits;
+    uint64_t                 misses;
+} MolochGeoCache_t;
+
+LOCAL uint32_t               geoCacheSize;
+LOCAL uint32_t               geoCacheGen = 1;
+LOCAL MolochGeoCache_t      *geoCaches[MOLOCH_GEO_CACHE_MAX];
+LOCAL int                    numGeoCaches;
+LOCAL __thread MolochGeoCache_t *geoCache;
+
+/******************************************************************************/
+LOCAL MolochGeoCache_t *moloch_db_geo_cache_create()
+{
+    int id = MOLOCH_THREAD_INCROLD(numGeoCaches);
+    if (id >= MOLOCH_GEO_CACHE_MAX) {
+        if (id == MOLOCH_GEO_CACHE_MAX)
+            LOG("WARNING - More than %d threads doing geo lookups, not caching the rest", MOLOCH_GEO_CACHE_MAX);
+        return NULL;
     }
+
+    uint32_t sets = 1;
+    while (sets * MOLOCH_GEO_CACHE_WAYS < geoCacheSize)
+        sets <<= 1;
+
+    MolochGeoCache_t *cache = MOLOCH_TYPE_ALLOC0(MolochGeoCache_t);
+    if (posix_memalign((void **)&cache->entries, 64, sets * MOLOCH_GEO_CACHE_WAYS * sizeof(MolochGeoCacheEntry_t)) != 0)
+        LOGEXIT("ERROR - Couldn't allocate geo lookup cache");
+    memset(cache->entries, 0, sets * MOLOCH_GEO_CACHE_WAYS * sizeof(MolochGeoCacheEntry_t));
+    cache->mask = sets - 1;
+
+    geoCaches[id] = cache;
+    return cache;
+}
+/******************************************************************************/
+// Call after the new geo data is in place, the old data must still be valid until freed later
+LOCAL void moloch_db_geo_cache_invalidate()
+{
+    __sync_add_and_fetch(&geoCacheGen, 1);
 }
+/******************************************************************************/
+LOCAL void moloch_db_geo_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+    *hits = *misses = 0;
 
+    const int num = MIN(numGeoCaches, MOLOCH_GEO_CACHE_MAX);
+    for (int i = 0; i < num; i++) {
+        if (!geoCaches[i])
+            continue;
+        *hits += geoCaches[i]->hits;
+        *misses += geoCaches[i]->misses;
+    }
+}
 /******************************************************************************/
-void moloch_db_geo_lookup6(MolochSession_t *session, struct in6_addr addr, char **g, uint32_t *asNum, char **asStr, int *asLen, char **rir)
+LOCAL void moloch_db_geo_lookup6_full(MolochSession_t *session, struct in6_addr addr, char **g, uint32_t *asNum, char **asStr, int *asLen, char **rir, MolochIpInfo_t **localIi)
 {
     *g = *asStr = *rir = 0;
+    *localIi = 0;
 
     if (ipTree4) {
         MolochIpInfo_t *ii;
         if ((ii = moloch_db_get_local_ip6(session, &addr))) {
+            *localIi = ii;
             *g = ii->country;
             *asNum = ii->asNum;
             *asStr = ii->asStr;
@@ -335,6 +428,62 @@ void moloch_db_geo_lookup6(MolochSession_t *session, struct in6_addr addr, char
     }
 }
 /******************************************************************************/
+void moloch_db_geo_lookup6(MolochSession_t *session, struct in6_addr addr, char **g, uint32_t *asNum, char **asStr, int *asLen, char **rir)
+{
+    MolochIpInfo_t *ii;
+
+    if (!geoCacheSize || (!geoCache && !(geoCache = moloch_db_geo_cache_create()))) {
+        moloch_db_geo_lookup6_full(session, addr, g, asNum, asStr, asLen, rir, &ii);
+        return;
+    }
+
+    // Read the generation before any of the geo data it guards
+    const uint32_t gen = __atomic_load_n(&geoCacheGen, __ATOMIC_ACQUIRE);
+    const uint32_t *w = (uint32_t *)addr.s6_addr;
+    const uint32_t h = ((uint64_t)(w[0] ^ w[1] ^ w[2] ^ w[3]) * 0x9E3779B97F4A7C15ULL) >> 32;
+    MolochGeoCacheEntry_t *set = geoCache->entries + (h & geoCache->mask) * MOLOCH_GEO_CACHE_WAYS;
+    MolochGeoCacheEntry_t *entry = set;
+
+    for (int i = 0; i < MOLOCH_GEO_CACHE_WAYS; i++) {
+        if (set[i].gen != gen) {
+            if (entry->gen == gen)
+                entry = &set[i];
+            continue;
+        }
+
+        if (memcmp(&set[i].addr, &addr, sizeof(addr)) == 0) {
+            entry = &set[i];
+            entry->used = ++geoCache->clock;
+            geoCache->hits++;
+
+            if (entry->ii)
+                moloch_db_local_ip_tags(session, entry->ii);
+            *g = entry->country;
+            *asNum = entry->asNum;
+            *asStr = entry->asStr;
+            *asLen = entry->asLen;
+            *rir = entry->rir;
+            return;
+        }
+
+        if (entry->gen == gen && set[i].used < entry->used)
+            entry = &set[i];
+    }
+
+    geoCache->misses++;
+    moloch_db_geo_lookup6_full(session, addr, g, asNum, asStr, asLen, rir, &ii);
+
+    entry->addr = addr;
+    entry->ii = ii;
+    entry->country = *g;
+    entry->asNum = *asStr ? *asNum : 0;
+    entry->asStr = *asStr;
+    entry->asLen = *asStr ? *asLen : 0;
+    entry->rir = *rir;
+    entry->gen = gen;
+    entry->used = ++geoCache->clock;
+}
+/******************************************************************************/
 LOCAL void moloch_db_send_bulk_cb(int code, unsigned char *data, int data_len, gpointer UNUSED(uw))
 {
     if (code != 200)
@@ -414,6 +563,9 @@ gchar *moloch_db_community_id(MolochSession_t *session)
     return b64;
 }
 /******************************************************************************/
+#define MOLOCH_DB_MAX_SERIALIZERS 16
+
+// Packet threads use dbInfo[thread], serializer n uses dbInfo[config.packetThreads + n]
 LOCAL struct {
     char   *json;
     BSB     bsb;
@@ -423,7 +575,30 @@ LOCAL struct {
     short   sortedFieldsIndex[MOLOCH_FIELDS_DB_MAX];
     short   sortedFieldsIndexCnt;
     MOLOCH_LOCK_EXTERN(lock);
-} dbInfo[MOLOCH_MAX_PACKET_THREADS];
+} dbInfo[MOLOCH_MAX_PACKET_THREADS + MOLOCH_DB_MAX_SERIALIZERS];
+
+/* Sessions waiting for a serializer thread, the snapshot session owns
+ * everything that gets written so the packet thread can move on.
+ */
+typedef struct moloch_db_save {
+    struct moloch_db_save *dbs_next, *dbs_prev;
+    MolochSession_t       *snapshot;
+    struct timeval         currentTime;
+    uint32_t               jsonSize;
+    char                   id[100];
+    char                   prefix[100];
+} MolochDbSave_t;
+
+typedef struct {
+    struct moloch_db_save *dbs_next, *dbs_prev;
+    int                    dbs_count;
+} MolochDbSaveHead_t;
+
+LOCAL MolochDbSaveHead_t     saveQ;
+LOCAL MOLOCH_LOCK_DEFINE(saveQ);
+LOCAL MOLOCH_COND_DEFINE(saveQ);
+LOCAL int                    saveInProgress;
+LOCAL int                    serializerThreads;
 
 #define MAX_IPS 2000
 
@@ -472,12 +647,13 @@ int moloch_db_field_sort(const void *a, const void *b) {
     return strcmp(config.fields[*(short *)a]->dbFieldFull, config.fields[*(short *)b]->dbFieldFull);
 }
 
-void moloch_db_save_session(MolochSession_t *session, int final)
+/******************************************************************************/
+/* Build the bulk json for a session into dbInfo[slot], runs on the packet
+ * thread for inline saves or on a serializer thread for a detached snapshot
+ */
+LOCAL void moloch_db_session_json(const int slot, MolochSession_t *session, int final, const char *id, const char *prefix, uint32_t jsonSize, struct timeval currentTime)
 {
     uint32_t               i;
-    char                   id[100];
-    uint32_t               id_len;
-    uuid_t                 uuid;
     MolochString_t        *hstring;
     MolochInt_t           *hint;
     MolochStringHashStd_t *shash;
@@ -486,151 +662,53 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     GHashTableIter         iter;
     unsigned char         *startPtr;
     unsigned char         *dataPtr;
-    uint32_t               jsonSize;
     gpointer               ikey;
     char                   ipsrc[INET6_ADDRSTRLEN];
     char                   ipdst[INET6_ADDRSTRLEN];
 
-    /* Let the plugins finish */
-    if (pluginsCbs & MOLOCH_PLUGIN_SAVE)
-        moloch_plugins_cb_save(session, final);
-
-    /* Don't save spi data for session */
-    if (session->stopSPI)
-        return;
+    // Only the packet thread may add fields to the session
+    MolochSession_t       *tagSession = slot < config.packetThreads ? session : NULL;
 
-    /* No Packets */
-    if (!config.dryRun && !session->filePosArray->len)
-        return;
-
-    /* Not enough packets */
-    if (session->packets[0] + session->packets[1] < session->minSaving) {
-        return;
-    }
-
-    if (moloch_writer_index) {
-        moloch_writer_index(session);
-    }
-
-    /* jsonSize is an estimate of how much space it will take to encode the session */
-    jsonSize = 1300 + session->filePosArray->len*17 + 11*session->fileNumArray->len;
-    if (config.enablePacketLen) {
-        jsonSize += 10*session->fileLenArray->len;
-    }
-
-    for (int pos = 0; pos < session->maxFields; pos++) {
-        if (session->fields[pos]) {
-            jsonSize += session->fields[pos]->jsonSize;
-        }
-    }
-
-    MOLOCH_THREAD_INCR(totalSessions);
-    session->segments++;
-
-    const int thread = session->thread;
+    MOLOCH_LOCK(dbInfo[slot].lock);
 
     /* Rebuild field order, we keep a sort list of fields per thread */
-    if (session->maxFields > dbInfo[thread].sortedFieldsIndexCnt) {
+    if (session->maxFields > dbInfo[slot].sortedFieldsIndexCnt) {
         for (int f = 0; f < session->maxFields; f++) {
-            dbInfo[thread].sortedFieldsIndex[f] = f;
-        }
-        qsort(&dbInfo[thread].sortedFieldsIndex, session->maxFields, 2, moloch_db_field_sort);
-        dbInfo[thread].sortedFieldsIndexCnt = session->maxFields;
-    }
-
-    /* figure out ES index name per thread, can change every second */
-    if (dbInfo[thread].prefixTime != session->lastPacket.tv_sec) {
-        dbInfo[thread].prefixTime = session->lastPacket.tv_sec;
-
-        struct tm tmp;
-        gmtime_r(&dbInfo[thread].prefixTime, &tmp);
-
-        switch(config.rotate) {
-        case MOLOCH_ROTATE_HOURLY:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, tmp.tm_hour);
-            break;
-        case MOLOCH_ROTATE_HOURLY2:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/2)*2);
-            break;
-        case MOLOCH_ROTATE_HOURLY3:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/3)*3);
-            break;
-        case MOLOCH_ROTATE_HOURLY4:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/4)*4);
-            break;
-        case MOLOCH_ROTATE_HOURLY6:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/6)*6);
-            break;
-        case MOLOCH_ROTATE_HOURLY8:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/8)*8);
-            break;
-        case MOLOCH_ROTATE_HOURLY12:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/12)*12);
-            break;
-        case MOLOCH_ROTATE_DAILY:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday);
-            break;
-        case MOLOCH_ROTATE_WEEKLY:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02dw%02d", tmp.tm_year%100, tmp.tm_yday/7);
-            break;
-        case MOLOCH_ROTATE_MONTHLY:
-            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02dm%02d", tmp.tm_year%100, tmp.tm_mon+1);
-            break;
+            dbInfo[slot].sortedFieldsIndex[f] = f;
         }
+        qsort(&dbInfo[slot].sortedFieldsIndex, session->maxFields, 2, moloch_db_field_sort);
+        dbInfo[slot].sortedFieldsIndexCnt = session->maxFields;
     }
 
-    if (!config.autoGenerateId || session->rootId == (void *)1L) {
-        id_len = snprintf(id, sizeof(id), "%s-", dbInfo[thread].prefix);
-
-        uuid_generate(uuid);
-        gint state = 0, save = 0;
-        id_len += g_base64_encode_step((guchar*)&myPid, 2, FALSE, id + id_len, &state, &save);
-        id_len += g_base64_encode_step(uuid, sizeof(uuid_t), FALSE, id + id_len, &state, &save);
-        id_len += g_base64_encode_close(FALSE, id + id_len, &state, &save);
-        id[id_len] = 0;
-
-        for (i = 0; i < id_len; i++) {
-            if (id[i] == '+') id[i] = '-';
-            else if (id[i] == '/') id[i] = '_';
-        }
-
-        if (session->rootId == (void*)1L)
-            session->rootId = g_strdup(id);
-    }
-
-    struct timeval currentTime;
-    gettimeofday(&currentTime, NULL);
-
-    MOLOCH_LOCK(dbInfo[thread].lock);
     /* If no room left to add, send the buffer */
-    if (dbInfo[thread].json && (uint32_t)BSB_REMAINING(dbInfo[thread].bsb) < jsonSize) {
-        if (BSB_LENGTH(dbInfo[thread].bsb) > 0) {
-            sendBulkFunc(dbInfo[thread].json, BSB_LENGTH(dbInfo[thread].bsb));
+    if (dbInfo[slot].json && (uint32_t)BSB_REMAINING(dbInfo[slot].bsb) < jsonSize) {
+        if (BSB_LENGTH(dbInfo[slot].bsb) > 0) {
+            sendBulkFunc(dbInfo[slot].json, BSB_LENGTH(dbInfo[slot].bsb));
         } else {
-            moloch_http_free_buffer(dbInfo[thread].json);
+            moloch_http_free_buffer(dbInfo[slot].json);
         }
-        dbInfo[thread].json = 0;
-        dbInfo[thread].lastSave = currentTime.tv_sec;
+        dbInfo[slot].json = 0;
+        dbInfo[slot].lastSave = currentTime.tv_sec;
     }
 
     /* Allocate a new buffer using the max of the bulk size or estimated size. */
-    if (!dbInfo[thread].json) {
+    if (!dbInfo[slot].json) {
         const int size = MAX(config.dbBulkSize, jsonSize);
-        dbInfo[thread].json = moloch_http_get_buffer(size);
-        BSB_INIT(dbInfo[thread].bsb, dbInfo[thread].json, size);
+        dbInfo[slot].json = moloch_http_get_buffer(size);
+        BSB_INIT(dbInfo[slot].bsb, dbInfo[slot].json, size);
     }
 
     uint32_t timediff = (uint32_t) ((session->lastPacket.tv_sec - session->firstPacket.tv_sec)*1000 +
                                     (session->lastPacket.tv_usec - session->firstPacket.tv_usec)/1000);
 
-    BSB jbsb = dbInfo[thread].bsb;
+    BSB jbsb = dbInfo[slot].bsb;
 
     startPtr = BSB_WORK_PTR(jbsb);
 
     if (config.autoGenerateId) {
-        BSB_EXPORT_sprintf(jbsb, "{\"index\": {\"_index\": \"%ssessions3-%s\"}}\n", config.prefix, dbInfo[thread].prefix);
+        BSB_EXPORT_sprintf(jbsb, "{\"index\": {\"_index\": \"%ssessions3-%s\"}}\n", config.prefix, prefix);
     } else {
-        BSB_EXPORT_sprintf(jbsb, "{\"index\": {\"_index\": \"%ssessions3-%s\", \"_id\": \"%s\"}}\n", config.prefix, dbInfo[thread].prefix, id);
+        BSB_EXPORT_sprintf(jbsb, "{\"index\": {\"_index\": \"%ssessions3-%s\", \"_id\": \"%s\"}}\n", config.prefix, prefix, id);
     }
 
     dataPtr = BSB_WORK_PTR(jbsb);
@@ -658,35 +736,35 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                            "\"srcZero\":%d,"
                            "\"dstZero\":%d"
                            "},",
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_ACK],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_FIN],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_RST],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_URG],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_SRC_ZERO],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_DST_ZERO]
+                           session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_SYN],
+                           session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK],
+                           session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_ACK],
+                           session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_PSH],
+                           session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_FIN],
+                           session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_RST],
+                           session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_URG],
+                           session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_SRC_ZERO],
+                           session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_DST_ZERO]
                            );
 
-        if (session->synTime && session->ackTime) {
-            BSB_EXPORT_sprintf(jbsb, "\"initRTT\":%u,", ((session->ackTime - session->synTime)/2000));
+        if (session->cold->synTime && session->cold->ackTime) {
+            BSB_EXPORT_sprintf(jbsb, "\"initRTT\":%u,", ((session->cold->ackTime - session->cold->synTime)/2000));
         }
 
     }
 
-    if (session->firstBytesLen[0] > 0) {
+    if (session->cold->firstBytesLen[0] > 0) {
         BSB_EXPORT_cstr(jbsb, "\"srcPayload8\":\"");
-        for (i = 0; i < session->firstBytesLen[0]; i++) {
-            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->firstBytes[0][i]], 2);
+        for (i = 0; i < session->cold->firstBytesLen[0]; i++) {
+            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->cold->firstBytes[0][i]], 2);
         }
         BSB_EXPORT_cstr(jbsb, "\",");
     }
 
-    if (session->firstBytesLen[1] > 0) {
+    if (session->cold->firstBytesLen[1] > 0) {
         BSB_EXPORT_cstr(jbsb, "\"dstPayload8\":\"");
-        for (i = 0; i < session->firstBytesLen[1]; i++) {
-            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->firstBytes[1][i]], 2);
+        for (i = 0; i < session->cold->firstBytesLen[1]; i++) {
+            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->cold->firstBytes[1][i]], 2);
         }
         BSB_EXPORT_cstr(jbsb, "\",");
     }
@@ -710,8 +788,8 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         uint32_t asNum1, asNum2;
         int asLen1, asLen2;
 
-        moloch_db_geo_lookup6(session, session->addr1, &g1, &asNum1, &asStr1, &asLen1, &rir1);
-        moloch_db_geo_lookup6(session, session->addr2, &g2, &asNum2, &asStr2, &asLen2, &rir2);
+        moloch_db_geo_lookup6(tagSession, session->addr1, &g1, &asNum1, &asStr1, &asLen1, &rir1);
+        moloch_db_geo_lookup6(tagSession, session->addr2, &g2, &asNum2, &asStr2, &asLen2, &rir2);
 
         BSB_EXPORT_sprintf(jbsb,
                           "\"source\":{\"ip\":\"%s\","
@@ -848,8 +926,8 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                       session->segments,
                       config.nodeName);
 
-    if (session->rootId) {
-        BSB_EXPORT_sprintf(jbsb, "\"rootId\":\"%s\",", session->rootId);
+    if (session->cold->rootId) {
+        BSB_EXPORT_sprintf(jbsb, "\"rootId\":\"%s\",", session->cold->rootId);
     }
     BSB_EXPORT_cstr(jbsb, "\"packetPos\":[");
     if (config.gapPacketPos) {
@@ -916,8 +994,8 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     }
 
     int inGroupNum = 0;
-    for (int sortedFieldsIndexPos = 0; sortedFieldsIndexPos < dbInfo[thread].sortedFieldsIndexCnt; sortedFieldsIndexPos++) {
-        const int pos = dbInfo[thread].sortedFieldsIndex[sortedFieldsIndexPos];
+    for (int sortedFieldsIndexPos = 0; sortedFieldsIndexPos < dbInfo[slot].sortedFieldsIndexCnt; sortedFieldsIndexPos++) {
+        const int pos = dbInfo[slot].sortedFieldsIndex[sortedFieldsIndexPos];
         if (pos >= session->maxFields || !session->fields[pos])
             continue;
 
@@ -1096,7 +1174,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             char                 *rir;
 
             ikey = session->fields[pos]->ip;
-            moloch_db_geo_lookup6(session, *(struct in6_addr *)ikey, &g, &asNum, &asStr, &asLen, &rir);
+            moloch_db_geo_lookup6(tagSession, *(struct in6_addr *)ikey, &g, &asNum, &asStr, &asLen, &rir);
             if (g) {
                 BSB_EXPORT_sprintf(jbsb, "\"%.*sGEO\":\"%2.2s\",", config.fields[pos]->dbFieldLen-2, config.fields[pos]->dbField, g);
             }
@@ -1148,7 +1226,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
             g_hash_table_iter_init (&iter, ghash);
             while (g_hash_table_iter_next (&iter, &ikey, NULL)) {
-                moloch_db_geo_lookup6(session, *(struct in6_addr *)ikey, &g[cnt], &asNum[cnt], &asStr[cnt], &asLen[cnt], &rir[cnt]);
+                moloch_db_geo_lookup6(tagSession, *(struct in6_addr *)ikey, &g[cnt], &asNum[cnt], &asStr[cnt], &asLen[cnt], &rir[cnt]);
                 cnt++;
                 if (cnt >= MAX_IPS)
                     break;
@@ -1253,71 +1331,360 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     BSB_EXPORT_sprintf(jbsb, "\"remainingDays\":%" PRId64 ",", ((int64_t)certs->notAfter - currentTime.tv_sec)/(60*60*24));
                 }
 
-                BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
+                BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
+
+                moloch_field_certsinfo_free(certs);
+                i++;
+
+                BSB_EXPORT_u08(jbsb, '}');
+                BSB_EXPORT_u08(jbsb, ',');
+            );
+            MOLOCH_TYPE_FREE(MolochCertsInfoHashStd_t, cihash);
+
+            BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
+            BSB_EXPORT_cstr(jbsb, "],");
+        }
+        } /* switch */
+        if (freeField) {
+            MOLOCH_TYPE_FREE(MolochField_t, session->fields[pos]);
+            session->fields[pos] = 0;
+        }
+    }
+
+    if (inGroupNum) {
+        BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
+        BSB_EXPORT_cstr(jbsb, "},");
+    }
+
+    BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
+    BSB_EXPORT_cstr(jbsb, "}\n");
+
+    if (BSB_IS_ERROR(jbsb)) {
+        LOG("ERROR - Ran out of memory creating DB record supposed to be %u", jsonSize);
+        goto cleanup;
+    }
+
+    MOLOCH_THREAD_INCR_NUM(totalSessionBytes, (int)(BSB_WORK_PTR(jbsb)-dataPtr));
+
+    if (config.dryRun) {
+        if (config.tests) {
+            static int outputed;
+
+            MOLOCH_LOCK(outputed);
+            outputed++;
+            const int hlen = dataPtr - startPtr;
+            fprintf(stderr, "  %s{\"header\":%.*s,\n  \"body\":%.*s}\n", (outputed==1 ? "":","), hlen-1, dbInfo[slot].json, (int)(BSB_LENGTH(jbsb)-hlen-1), dbInfo[slot].json+hlen);
+            fflush(stderr);
+            MOLOCH_UNLOCK(outputed);
+        } else if (config.debug) {
+            LOG("%.*s\n", (int)BSB_LENGTH(jbsb), dbInfo[slot].json);
+        }
+        BSB_INIT(jbsb, dbInfo[slot].json, BSB_SIZE(jbsb));
+        goto cleanup;
+    }
+
+    if (config.noSPI) {
+        BSB_INIT(jbsb, dbInfo[slot].json, BSB_SIZE(jbsb));
+        goto cleanup;
+    }
+
+    if (jsonSize < (uint32_t)(BSB_WORK_PTR(jbsb) - startPtr)) {
+        LOG("WARNING - %s BIGGER than expected json %u %d\n", id, jsonSize,  (int)(BSB_WORK_PTR(jbsb) - startPtr));
+        if (config.debug)
+            LOG("Data:\n%.*s\n", (int)(BSB_WORK_PTR(jbsb) - startPtr), startPtr);
+    }
+cleanup:
+    dbInfo[slot].bsb = jbsb;
+    MOLOCH_UNLOCK(dbInfo[slot].lock);
+}
+/******************************************************************************/
+LOCAL MolochField_t *moloch_db_field_copy(int pos, const MolochField_t *field)
+{
+    MolochField_t *copy = MOLOCH_TYPE_ALLOC(MolochField_t);
+    memcpy(copy, field, sizeof(MolochField_t));
+
+    if (config.fields[pos]->type == MOLOCH_FIELD_TYPE_STR) {
+        copy->str = g_strdup(field->str);
+        return copy;
+    }
+
+    MolochString_t        *hstring;
+    MolochStringHashStd_t *shash = MOLOCH_TYPE_ALLOC(MolochStringHashStd_t);
+    HASH_INIT(s_, *shash, moloch_string_hash, moloch_string_ncmp);
+    HASH_FORALL(s_, *field->shash, hstring,
+        MolochString_t *dup = MOLOCH_TYPE_ALLOC(MolochString_t);
+        dup->str = g_strndup(hstring->str, hstring->len);
+        dup->len = hstring->len;
+        dup->utf8 = hstring->utf8;
+        dup->uw = hstring->uw;
+        HASH_ADD(s_, *shash, dup->str, dup);
+    );
+    copy->shash = shash;
+    return copy;
+}
+/******************************************************************************/
+/* Add the local ip tags for every ip the json will have, the same ones the
+ * geo lookups in moloch_db_session_json would add inline
+ */
+LOCAL void moloch_db_session_local_ip_tags(MolochSession_t *session)
+{
+    GHashTableIter iter;
+    gpointer       ikey;
+    int            pos;
+
+    if (!ipTree4)
+        return;
+
+    if (session->ipProtocol) {
+        moloch_db_get_local_ip6(session, &session->addr1);
+        moloch_db_get_local_ip6(session, &session->addr2);
+    }
+
+    for (pos = 0; pos < session->maxFields; pos++) {
+        if (!session->fields[pos] || (config.fields[pos]->flags & (MOLOCH_FIELD_FLAG_DISABLED | MOLOCH_FIELD_FLAG_NOSAVE)))
+            continue;
+
+        if (config.fields[pos]->type == MOLOCH_FIELD_TYPE_IP) {
+            moloch_db_get_local_ip6(session, (struct in6_addr *)session->fields[pos]->ip);
+        } else if (config.fields[pos]->type == MOLOCH_FIELD_TYPE_IP_GHASH) {
+            int cnt = 0;
+            g_hash_table_iter_init(&iter, session->fields[pos]->ghash);
+            while (cnt++ < MAX_IPS && g_hash_table_iter_next(&iter, &ikey, NULL)) {
+                moloch_db_get_local_ip6(session, (struct in6_addr *)ikey);
+            }
+        }
+    }
+}
+/******************************************************************************/
+/* Detach everything a save writes into a snapshot session that a serializer
+ * thread owns.  Fields the save would free are moved, linked session fields
+ * that outlive a mid save are copied.  NULL means the save has to stay inline.
+ */
+LOCAL MolochSession_t *moloch_db_session_detach(MolochSession_t *session, int final)
+{
+    int pos;
+
+    for (pos = 0; !final && pos < session->maxFields; pos++) {
+        if (!session->fields[pos] || (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_LINKED_SESSIONS) == 0)
+            continue;
+        if (config.fields[pos]->type != MOLOCH_FIELD_TYPE_STR && config.fields[pos]->type != MOLOCH_FIELD_TYPE_STR_HASH)
+            return NULL;
+    }
+
+    // Tagging adds fields, so it happens here on the packet thread
+    moloch_db_session_local_ip_tags(session);
+
+    MolochSession_t *snapshot;
+    if (posix_memalign((void **)&snapshot, 64, MOLOCH_SESSION_ALLOC_SIZE) != 0)
+        LOGEXIT("ERROR - Couldn't allocate session snapshot");
+    memcpy(snapshot, session, MOLOCH_SESSION_ALLOC_SIZE);
+    snapshot->cold = (MolochSessionCold_t *)(snapshot + 1);
+    snapshot->tcp_next = snapshot->tcp_prev = NULL;
+    snapshot->q_next = snapshot->q_prev = NULL;
+    memset(&snapshot->timer, 0, sizeof(snapshot->timer));
+    snapshot->pluginData = NULL;
+    DLL_INIT(td_, &snapshot->tcpData);
+
+    snapshot->cold->parserInfo = NULL;
+    if (session->cold->rootId)
+        snapshot->cold->rootId = g_strdup(session->cold->rootId);
+
+    session->filePosArray = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), final ? 0 : 100);
+    if (config.enablePacketLen) {
+        session->fileLenArray = g_array_sized_new(FALSE, FALSE, sizeof(uint16_t), final ? 0 : 100);
+    }
+    session->fileNumArray = g_array_new(FALSE, FALSE, 4);
+
+    snapshot->fields = MOLOCH_SIZE_ALLOC0(fields, sizeof(MolochField_t *)*session->maxFields);
+    for (pos = 0; pos < session->maxFields; pos++) {
+        if (!session->fields[pos])
+            continue;
+
+        const int flags = config.fields[pos]->flags;
+        if (flags & (MOLOCH_FIELD_FLAG_DISABLED | MOLOCH_FIELD_FLAG_NOSAVE))
+            continue;
+
+        if (final || (flags & MOLOCH_FIELD_FLAG_LINKED_SESSIONS) == 0) {
+            snapshot->fields[pos] = session->fields[pos];
+            session->fields[pos] = 0;
+        } else {
+            snapshot->fields[pos] = moloch_db_field_copy(pos, session->fields[pos]);
+        }
+    }
+
+    return snapshot;
+}
+/******************************************************************************/
+LOCAL void moloch_db_session_snapshot_free(MolochSession_t *snapshot)
+{
+    g_array_free(snapshot->filePosArray, TRUE);
+    if (config.enablePacketLen) {
+        g_array_free(snapshot->fileLenArray, TRUE);
+    }
+    g_array_free(snapshot->fileNumArray, TRUE);
+
+    g_free(snapshot->cold->rootId);
+
+    // Anything the json build didn't consume
+    moloch_field_free(snapshot);
+
+    free(snapshot);
+}
+/******************************************************************************/
+LOCAL void *moloch_db_serializer_thread(void *serializerp)
+{
+    const int slot = config.packetThreads + (int)(long)serializerp;
+
+    while (1) {
+        MolochDbSave_t *save;
+
+        MOLOCH_LOCK(saveQ);
+        while (DLL_COUNT(dbs_, &saveQ) == 0) {
+            MOLOCH_COND_WAIT(saveQ);
+        }
+        DLL_POP_HEAD(dbs_, &saveQ, save);
+        saveInProgress++;
+        MOLOCH_UNLOCK(saveQ);
+
+        moloch_db_session_json(slot, save->snapshot, TRUE, save->id, save->prefix, save->jsonSize, save->currentTime);
+        moloch_db_session_snapshot_free(save->snapshot);
+        MOLOCH_TYPE_FREE(MolochDbSave_t, save);
+
+        MOLOCH_LOCK(saveQ);
+        saveInProgress--;
+        MOLOCH_UNLOCK(saveQ);
+    }
+    return NULL;
+}
+/******************************************************************************/
+void moloch_db_save_session(MolochSession_t *session, int final)
+{
+    uint32_t               i;
+    char                   id[100];
+    uint32_t               id_len;
+    uuid_t                 uuid;
+    uint32_t               jsonSize;
+
+    /* Let the plugins finish */
+    if (pluginsCbs & MOLOCH_PLUGIN_SAVE)
+        moloch_plugins_cb_save(session, final);
+
+    /* Don't save spi data for session */
+    if (session->stopSPI)
+        return;
+
+    /* No Packets */
+    if (!config.dryRun && !session->filePosArray->len)
+        return;
+
+    /* Not enough packets */
+    if (session->packets[0] + session->packets[1] < session->minSaving) {
+        return;
+    }
+
+    if (moloch_writer_index) {
+        moloch_writer_index(session);
+    }
+
+    /* jsonSize is an estimate of how much space it will take to encode the session */
+    jsonSize = 1300 + session->filePosArray->len*17 + 11*session->fileNumArray->len;
+    if (config.enablePacketLen) {
+        jsonSize += 10*session->fileLenArray->len;
+    }
+
+    for (int pos = 0; pos < session->maxFields; pos++) {
+        if (session->fields[pos]) {
+            jsonSize += session->fields[pos]->jsonSize;
+        }
+    }
+
+    MOLOCH_THREAD_INCR(totalSessions);
+    session->segments++;
+
+    const int thread = session->thread;
 
-                moloch_field_certsinfo_free(certs);
-                i++;
+    /* figure out ES index name per thread, can change every second */
+    if (dbInfo[thread].prefixTime != session->lastPacket.tv_sec) {
+        dbInfo[thread].prefixTime = session->lastPacket.tv_sec;
 
-                BSB_EXPORT_u08(jbsb, '}');
-                BSB_EXPORT_u08(jbsb, ',');
-            );
-            MOLOCH_TYPE_FREE(MolochCertsInfoHashStd_t, cihash);
+        struct tm tmp;
+        gmtime_r(&dbInfo[thread].prefixTime, &tmp);
 
-            BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
-            BSB_EXPORT_cstr(jbsb, "],");
-        }
-        } /* switch */
-        if (freeField) {
-            MOLOCH_TYPE_FREE(MolochField_t, session->fields[pos]);
-            session->fields[pos] = 0;
+        switch(config.rotate) {
+        case MOLOCH_ROTATE_HOURLY:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, tmp.tm_hour);
+            break;
+        case MOLOCH_ROTATE_HOURLY2:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/2)*2);
+            break;
+        case MOLOCH_ROTATE_HOURLY3:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/3)*3);
+            break;
+        case MOLOCH_ROTATE_HOURLY4:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/4)*4);
+            break;
+        case MOLOCH_ROTATE_HOURLY6:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/6)*6);
+            break;
+        case MOLOCH_ROTATE_HOURLY8:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/8)*8);
+            break;
+        case MOLOCH_ROTATE_HOURLY12:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02dh%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday, (tmp.tm_hour/12)*12);
+            break;
+        case MOLOCH_ROTATE_DAILY:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02d%02d%02d", tmp.tm_year%100, tmp.tm_mon+1, tmp.tm_mday);
+            break;
+        case MOLOCH_ROTATE_WEEKLY:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02dw%02d", tmp.tm_year%100, tmp.tm_yday/7);
+            break;
+        case MOLOCH_ROTATE_MONTHLY:
+            snprintf(dbInfo[thread].prefix, sizeof(dbInfo[thread].prefix), "%02dm%02d", tmp.tm_year%100, tmp.tm_mon+1);
+            break;
         }
     }
 
-    if (inGroupNum) {
-        BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
-        BSB_EXPORT_cstr(jbsb, "},");
-    }
+    if (!config.autoGenerateId || session->cold->rootId == (void *)1L) {
+        id_len = snprintf(id, sizeof(id), "%s-", dbInfo[thread].prefix);
 
-    BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
-    BSB_EXPORT_cstr(jbsb, "}\n");
+        uuid_generate(uuid);
+        gint state = 0, save = 0;
+        id_len += g_base64_encode_step((guchar*)&myPid, 2, FALSE, id + id_len, &state, &save);
+        id_len += g_base64_encode_step(uuid, sizeof(uuid_t), FALSE, id + id_len, &state, &save);
+        id_len += g_base64_encode_close(FALSE, id + id_len, &state, &save);
+        id[id_len] = 0;
 
-    if (BSB_IS_ERROR(jbsb)) {
-        LOG("ERROR - Ran out of memory creating DB record supposed to be %u", jsonSize);
-        goto cleanup;
+        for (i = 0; i < id_len; i++) {
+            if (id[i] == '+') id[i] = '-';
+            else if (id[i] == '/') id[i] = '_';
+        }
+
+        if (session->cold->rootId == (void*)1L)
+            session->cold->rootId = g_strdup(id);
     }
 
-    MOLOCH_THREAD_INCR_NUM(totalSessionBytes, (int)(BSB_WORK_PTR(jbsb)-dataPtr));
+    struct timeval currentTime;
+    gettimeofday(&currentTime, NULL);
 
-    if (config.dryRun) {
-        if (config.tests) {
-            static int outputed;
+    if (serializerThreads) {
+        MolochSession_t *snapshot = moloch_db_session_detach(session, final);
+        if (snapshot) {
+            MolochDbSave_t *save = MOLOCH_TYPE_ALLOC(MolochDbSave_t);
+            save->snapshot = snapshot;
+            save->currentTime = currentTime;
+            save->jsonSize = jsonSize;
+            memcpy(save->id, id, sizeof(save->id));
+            memcpy(save->prefix, dbInfo[thread].prefix, sizeof(save->prefix));
 
-            MOLOCH_LOCK(outputed);
-            outputed++;
-            const int hlen = dataPtr - startPtr;
-            fprintf(stderr, "  %s{\"header\":%.*s,\n  \"body\":%.*s}\n", (outputed==1 ? "":","), hlen-1, dbInfo[thread].json, (int)(BSB_LENGTH(jbsb)-hlen-1), dbInfo[thread].json+hlen);
-            fflush(stderr);
-            MOLOCH_UNLOCK(outputed);
-        } else if (config.debug) {
-            LOG("%.*s\n", (int)BSB_LENGTH(jbsb), dbInfo[thread].json);
+            MOLOCH_LOCK(saveQ);
+            DLL_PUSH_TAIL(dbs_, &saveQ, save);
+            MOLOCH_COND_SIGNAL(saveQ);
+            MOLOCH_UNLOCK(saveQ);
+            return;
         }
-        BSB_INIT(jbsb, dbInfo[thread].json, BSB_SIZE(jbsb));
-        goto cleanup;
-    }
-
-    if (config.noSPI) {
-        BSB_INIT(jbsb, dbInfo[thread].json, BSB_SIZE(jbsb));
-        goto cleanup;
     }
 
-    if (jsonSize < (uint32_t)(BSB_WORK_PTR(jbsb) - startPtr)) {
-        LOG("WARNING - %s BIGGER than expected json %u %d\n", id, jsonSize,  (int)(BSB_WORK_PTR(jbsb) - startPtr));
-        if (config.debug)
-            LOG("Data:\n%.*s\n", (int)(BSB_WORK_PTR(jbsb) - startPtr), startPtr);
-    }
-cleanup:
-    dbInfo[thread].bsb = jbsb;
-    MOLOCH_UNLOCK(dbInfo[thread].lock);
+    moloch_db_session_json(thread, session, final, id, dbInfo[thread].prefix, jsonSize, currentTime);
 }
 /******************************************************************************/
 LOCAL uint64_t zero_atoll(char *v) {
@@ -1476,6 +1843,7 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
     static uint64_t       lastFragsDropped[NUMBER_OF_STATS];
     static uint64_t       lastOverloadDropped[NUMBER_OF_STATS];
     static uint64_t       lastESDropped[NUMBER_OF_STATS];
+    static uint64_t       lastESCompressUsecs[NUMBER_OF_STATS];
     static uint64_t       lastDupDropped[NUMBER_OF_STATS];
     static struct rusage  lastUsage[NUMBER_OF_STATS];
     static struct timeval lastTime[NUMBER_OF_STATS];
@@ -1544,6 +1912,23 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
     double   memMax = moloch_db_memory_max();
     float    memUse = mem/memMax*100.0;
 
+    uint64_t batchHist[MOLOCH_PACKET_BATCH_HIST_MAX];
+    char     batchHistStr[MOLOCH_PACKET_BATCH_HIST_MAX * 21];
+    int      batchHistLen = 0;
+    moloch_packet_batch_hist(batchHist);
+    for (i = 0; i < MOLOCH_PACKET_BATCH_HIST_MAX; i++) {
+        batchHistLen += snprintf(batchHistStr + batchHistLen, sizeof(batchHistStr) - batchHistLen, "%s%" PRIu64, i ? "," : "", batchHist[i]);
+    }
+
+    uint64_t poolInUse, poolFree, poolRemoteReturns;
+    moloch_pool_stats(&poolInUse, &poolFree, &poolRemoteReturns);
+
+    uint64_t geoCacheHits, geoCacheMisses;
+    moloch_db_geo_cache_stats(&geoCacheHits, &geoCacheMisses);
+
+    uint64_t esCompressIn, esCompressOut, esCompressUsecs;
+    moloch_http_compress_stats(esServer, &esCompressIn, &esCompressOut, &esCompressUsecs);
+
 #ifndef __SANITIZE_ADDRESS__
     if (config.maxMemPercentage != 100 && memUse > config.maxMemPercentage) {
         LOG("Aborting, max memory percentage reached: %.2f > %u", memUse, config.maxMemPercentage);
@@ -1597,7 +1982,15 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
         "\"deltaDupDropped\": %" PRIu64 ","
         "\"esHealthMS\": %" PRIu64 ","
         "\"deltaMS\": %" PRIu64 ","
-        "\"startTime\": %" PRIu64
+        "\"startTime\": %" PRIu64 ","
+        "\"packetBatchSizes\": [%s],"
+        "\"poolInUse\": %" PRIu64 ","
+        "\"poolFree\": %" PRIu64 ","
+        "\"poolRemoteReturns\": %" PRIu64 ","
+        "\"geoCacheHits\": %" PRIu64 ","
+        "\"geoCacheMisses\": %" PRIu64 ","
+        "\"esCompressRatio\": %.2f,"
+        "\"deltaESCompressMS\": %" PRIu64
         "}",
         VERSION,
         config.nodeName,
@@ -1641,7 +2034,15 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
         (dupDropped - lastDupDropped[n]),
         esHealthMS,
         diffms,
-        (uint64_t)startTime.tv_sec);
+        (uint64_t)startTime.tv_sec,
+        batchHistStr,
+        poolInUse,
+        poolFree,
+        poolRemoteReturns,
+        geoCacheHits,
+        geoCacheMisses,
+        esCompressOut ? (double)esCompressIn/esCompressOut : 1.0,
+        (esCompressUsecs - lastESCompressUsecs[n])/1000);
 
     lastTime[n]            = currentTime;
     lastBytes[n]           = totalBytes;
@@ -1654,6 +2055,7 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
     lastFragsDropped[n]    = fragsDropped;
     lastOverloadDropped[n] = overloadDropped;
     lastESDropped[n]       = esDropped;
+    lastESCompressUsecs[n] = esCompressUsecs;
     lastDupDropped[n]      = dupDropped;
     lastUsage[n]           = usage;
 
@@ -1695,7 +2097,7 @@ LOCAL gboolean moloch_db_flush_gfunc (gpointer user_data )
 
     gettimeofday(&currentTime, NULL);
 
-    for (thread = 0; thread < config.packetThreads; thread++) {
+    for (thread = 0; thread < config.packetThreads + serializerThreads; thread++) {
         MOLOCH_LOCK(dbInfo[thread].lock);
         if (dbInfo[thread].json && BSB_LENGTH(dbInfo[thread].bsb) > 0 &&
             ((currentTime.tv_sec - dbInfo[thread].lastSave) >= config.dbFlushTimeout || user_data == (gpointer)1)) {
@@ -1828,11 +2230,200 @@ uint32_t moloch_db_get_sequence_number_sync(char *name)
     }
 }
 /******************************************************************************/
+// Called on exit with the fileNum lock, written to a new file and renamed into place
+LOCAL void moloch_db_fn_lease_save()
+{
+    if (!fileNumLeaseFile[0] || (fileNumNext == fileNumEnd && fileNumSpareNext == fileNumSpareEnd))
+        return;
+
+    char tmpFilename[PATH_MAX + 10];
+    snprintf(tmpFilename, sizeof(tmpFilename), "%s.XXXXXX", fileNumLeaseFile);
+
+    int fd = mkstemp(tmpFilename);
+    if (fd < 0) {
+        LOG("ERROR - Couldn't open `%s` to save file numbers - %s", tmpFilename, strerror(errno));
+        return;
+    }
+
+    char buf[400];
+    int  len = snprintf(buf, sizeof(buf), "%s %s %u %u %u %u\n", config.prefix[0] ? config.prefix : "-", config.nodeName,
+                        fileNumNext, fileNumEnd, fileNumSpareNext, fileNumSpareEnd);
+    if (write(fd, buf, len) != len) {
+        LOG("ERROR - Couldn't write `%s` - %s", tmpFilename, strerror(errno));
+        close(fd);
+        unlink(tmpFilename);
+        return;
+    }
+    close(fd);
+
+    if (rename(tmpFilename, fileNumLeaseFile) != 0) {
+        LOG("ERROR - Couldn't rename `%s` to `%s` - %s", tmpFilename, fileNumLeaseFile, strerror(errno));
+        unlink(tmpFilename);
+    }
+}
+/******************************************************************************/
+/* Pick up the numbers left over from the last run, as long as the sequence has
+ * moved past them.  The file is deleted while holding an exclusive flock, so
+ * only one capture can claim it; anyone who opened it first finds it unlinked.
+ */
+LOCAL void moloch_db_fn_lease_load(uint32_t version)
+{
+    char     prefix[100];
+    char     nodeName[200];
+    char     buf[400];
+    uint32_t next, end, spareNext, spareEnd;
+
+    if (!fileNumLeaseFile[0])
+        return;
+
+    int fd = open(fileNumLeaseFile, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+        return;
+
+    struct stat sb;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &sb) != 0 || sb.st_nlink == 0 || sb.st_uid != geteuid()) {
+        close(fd);
+        return;
+    }
+
+    const int len = read(fd, buf, sizeof(buf) - 1);
+    buf[MAX(len, 0)] = 0;
+    unlink(fileNumLeaseFile);
+    close(fd);
+
+    int cnt = sscanf(buf, "%99s %199s %u %u %u %u", prefix, nodeName, &next, &end, &spareNext, &spareEnd);
+
+    if (cnt != 6 ||
+        strcmp(prefix, config.prefix[0] ? config.prefix : "-") != 0 ||
+        strcmp(nodeName, config.nodeName) != 0 ||
+        next > end || spareNext > spareEnd ||
+        end > version + 1 || spareEnd > version + 1) {
+        LOG("WARNING - Ignoring `%s`, it doesn't match the fn-%s sequence", fileNumLeaseFile, config.nodeName);
+        return;
+    }
+
+    fileNumNext      = next;
+    fileNumEnd       = end;
+    fileNumSpareNext = spareNext;
+    fileNumSpareEnd  = spareEnd;
+    if (config.debug)
+        LOG("Using file numbers %u-%u and %u-%u from `%s`", next, end, spareNext, spareEnd, fileNumLeaseFile);
+}
+/******************************************************************************/
+// Must hold the fileNum lock
+LOCAL void moloch_db_fn_add_block(uint32_t first, uint32_t end)
+{
+    if (fileNumNext == fileNumEnd) {
+        fileNumNext = first;
+        fileNumEnd = end;
+    } else {
+        fileNumSpareNext = first;
+        fileNumSpareEnd = end;
+    }
+}
+/******************************************************************************/
+/* Once the sequence has handed out first, move its version forward to reserve
+ * the rest of the block.  Returns the end of the block, just first + 1 if
+ * someone else moved the sequence in between.
+ */
+LOCAL uint32_t moloch_db_fn_block_end(uint32_t first, unsigned char *data, int data_len)
+{
+    uint32_t       version_len;
+    unsigned char *version = moloch_js0n_get(data, data_len, "_version", &version_len);
+
+    if (version && version_len && (uint32_t)atoi((char *)version) == first + fileNumBlockSize - 1)
+        return first + fileNumBlockSize;
+
+    LOG("WARNING - Couldn't reserve file numbers %u-%u: %.*s", first, first + fileNumBlockSize - 1, data_len, data);
+    return first + 1;
+}
+/******************************************************************************/
+LOCAL int moloch_db_fn_block_key(char *key, int size, uint32_t first)
+{
+    return snprintf(key, size, "/%ssequence/_doc/fn-%s?version_type=external&version=%u", config.prefix, config.nodeName, first + fileNumBlockSize - 1);
+}
+/******************************************************************************/
+// Must hold the fileNum lock
+LOCAL void moloch_db_fn_reserve_sync()
+{
+    char     key[200];
+    int      key_len;
+    size_t   data_len;
+
+    fileNumSyncGen++;
+    snprintf(key, sizeof(key), "fn-%s", config.nodeName);
+    const uint32_t first = moloch_db_get_sequence_number_sync(key);
+    uint32_t end = first + 1;
+
+    if (fileNumBlockSize > 1) {
+        key_len = moloch_db_fn_block_key(key, sizeof(key), first);
+        unsigned char *data = moloch_http_send_sync(esServer, "POST", key, key_len, "{}", 2, NULL, &data_len);
+        end = moloch_db_fn_block_end(first, data, data_len);
+        if (data)
+            free(data);
+    }
+    moloch_db_fn_add_block(first, end);
+}
+/******************************************************************************/
+LOCAL void moloch_db_fn_block_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer uw)
+{
+    const uint32_t first = (uint32_t)(long)uw;
+    const uint32_t end = moloch_db_fn_block_end(first, data, data_len);
+
+    MOLOCH_LOCK(fileNum);
+    if (fileNumReservingGen == fileNumSyncGen)
+        moloch_db_fn_add_block(first, end);
+    else if (config.debug)
+        LOG("Dropping file numbers %u-%u, a sync reservation ran while reserving them", first, end - 1);
+    fileNumReserving = 0;
+    MOLOCH_UNLOCK(fileNum);
+}
+/******************************************************************************/
 LOCAL void moloch_db_fn_seq_cb(uint32_t newSeq, gpointer UNUSED(uw))
 {
-    MOLOCH_LOCK(nextFileNum);
-    nextFileNum = newSeq;
-    MOLOCH_UNLOCK(nextFileNum);
+    MOLOCH_LOCK(fileNum);
+    if (fileNumReservingGen != fileNumSyncGen || fileNumBlockSize == 1) {
+        if (fileNumReservingGen == fileNumSyncGen)
+            moloch_db_fn_add_block(newSeq, newSeq + 1);
+        fileNumReserving = 0;
+        MOLOCH_UNLOCK(fileNum);
+        return;
+    }
+    MOLOCH_UNLOCK(fileNum);
+
+    char key[200];
+    int  key_len = moloch_db_fn_block_key(key, sizeof(key), newSeq);
+    char *json = moloch_http_get_buffer(MOLOCH_HTTP_BUFFER_SIZE);
+    int   json_len = snprintf(json, MOLOCH_HTTP_BUFFER_SIZE, "{}");
+    moloch_http_schedule(esServer, "POST", key, key_len, json, json_len, NULL, MOLOCH_HTTP_PRIORITY_BEST, moloch_db_fn_block_cb, (gpointer)(long)newSeq);
+}
+/******************************************************************************/
+/* Must hold the fileNum lock.  Hands out the next file number, only waits on
+ * the db if the background reservation hasn't kept up.
+ */
+LOCAL uint32_t moloch_db_fn_next()
+{
+    if (fileNumNext == fileNumEnd) {
+        fileNumNext = fileNumSpareNext;
+        fileNumEnd = fileNumSpareEnd;
+        fileNumSpareNext = fileNumSpareEnd = 0;
+    }
+
+    if (fileNumNext == fileNumEnd)
+        moloch_db_fn_reserve_sync();
+
+    const uint32_t num = fileNumNext++;
+
+    // Start on the next block once half of this one is used
+    if (!fileNumReserving && fileNumSpareNext == fileNumSpareEnd && fileNumEnd - fileNumNext <= fileNumBlockSize / 2) {
+        char key[200];
+        snprintf(key, sizeof(key), "fn-%s", config.nodeName);
+        fileNumReserving = 1;
+        fileNumReservingGen = fileNumSyncGen;
+        moloch_db_get_sequence_number(key, moloch_db_fn_seq_cb, 0);
+    }
+
+    return num;
 }
 /******************************************************************************/
 LOCAL void moloch_db_load_file_num()
@@ -1843,6 +2434,13 @@ LOCAL void moloch_db_load_file_num()
     unsigned char     *data;
     uint32_t           found_len;
     unsigned char     *found = 0;
+    uint32_t           version_len;
+    unsigned char     *version = 0;
+
+    fileNumBlockSize = moloch_config_int(NULL, "fileNumBlockSize", config.pcapReadOffline ? 100 : 10, 1, 100000);
+    // Capture owns the first pcapDir, without one the leftover numbers are just lost
+    if (config.pcapDir && config.pcapDir[0])
+        snprintf(fileNumLeaseFile, sizeof(fileNumLeaseFile), "%s/%s%s.filenums", config.pcapDir[0], config.prefix, config.nodeName);
 
     /* First see if we have the new style number or not */
     key_len = snprintf(key, sizeof(key), "/%ssequence/_doc/fn-%s", config.prefix, config.nodeName);
@@ -1854,14 +2452,17 @@ LOCAL void moloch_db_load_file_num()
 
         key_len = snprintf(key, sizeof(key), "/%ssequence/_doc/fn-%s?version_type=external&version=100", config.prefix, config.nodeName);
         data = moloch_http_send_sync(esServer, "POST", key, key_len, "{}", 2, NULL, NULL);
+    } else if (found && (version = moloch_js0n_get(data, data_len, "_version", &version_len))) {
+        moloch_db_fn_lease_load(atoi((char *)version));
     }
     if (data)
         free(data);
 
-    if (!config.pcapReadOffline) {
-        /* If doing a live file create a file number now */
-        snprintf(key, sizeof(key), "fn-%s", config.nodeName);
-        nextFileNum = moloch_db_get_sequence_number_sync(key);
+    if (!config.pcapReadOffline && fileNumNext == fileNumEnd) {
+        /* If doing a live file reserve file numbers now */
+        MOLOCH_LOCK(fileNum);
+        moloch_db_fn_reserve_sync();
+        MOLOCH_UNLOCK(fileNum);
     }
 }
 /******************************************************************************/
@@ -1915,18 +2516,8 @@ char *moloch_db_create_file_full(time_t firstPacket, const char *name, uint64_t
 
     BSB_INIT(jbsb, json, MOLOCH_HTTP_BUFFER_SIZE);
 
-    MOLOCH_LOCK(nextFileNum);
-    snprintf(key, sizeof(key), "fn-%s", config.nodeName);
-    if (nextFileNum == 0) {
-        /* If doing an offline file OR the last async call hasn't returned, just get a sync filenum */
-        num = moloch_db_get_sequence_number_sync(key);
-    } else {
-        /* If doing a live file, use current file num and schedule the next one */
-        num = nextFileNum;
-        nextFileNum = 0; /* Don't reuse number */
-        moloch_db_get_sequence_number(key, moloch_db_fn_seq_cb, 0);
-    }
-
+    MOLOCH_LOCK(fileNum);
+    num = moloch_db_fn_next();
 
     char numstr[100];
     snprintf(numstr, sizeof(numstr), "%u", num);
@@ -2062,7 +2653,7 @@ char *moloch_db_create_file_full(time_t firstPacket, const char *name, uint64_t
 
     moloch_http_schedule(esServer, "POST", key, key_len, json, BSB_LENGTH(jbsb), NULL, MOLOCH_HTTP_PRIORITY_BEST, NULL, NULL);
 
-    MOLOCH_UNLOCK(nextFileNum);
+    MOLOCH_UNLOCK(fileNum);
 
     if (config.logFileCreation)
         LOG("Creating file %u with key >%s< using >%.*s<", num, key, (int)BSB_LENGTH(jbsb), json);
@@ -2154,6 +2745,7 @@ LOCAL void moloch_db_load_geo_country(char *name)
         moloch_free_later(geoCountry, (GDestroyNotify) moloch_db_free_mmdb);
     }
     geoCountry = country;
+    moloch_db_geo_cache_invalidate();
 }
 /******************************************************************************/
 LOCAL void moloch_db_load_geo_asn(char *name)
@@ -2168,6 +2760,7 @@ LOCAL void moloch_db_load_geo_asn(char *name)
         moloch_free_later(geoASN, (GDestroyNotify) moloch_db_free_mmdb);
     }
     geoASN = asn;
+    moloch_db_geo_cache_invalidate();
 }
 /******************************************************************************/
 LOCAL void moloch_db_load_rir(char *name)
@@ -2214,6 +2807,7 @@ LOCAL void moloch_db_load_rir(char *name)
         }
     }
     fclose(fp);
+    moloch_db_geo_cache_invalidate();
 }
 /******************************************************************************/
 LOCAL void moloch_db_free_oui(patricia_tree_t *oui)
@@ -2476,12 +3070,147 @@ void moloch_db_update_filesize(uint32_t fileid, uint64_t filesize, uint64_t pack
     moloch_http_schedule(esServer, "POST", key, key_len, json, json_len, NULL, MOLOCH_HTTP_PRIORITY_DROPABLE, NULL, NULL);
 }
 /******************************************************************************/
+LOCAL gboolean moloch_db_file_name_plain(const char *name)
+{
+    for (; *name; name++) {
+        if (*name == '"' || *name == '\\' || (uint8_t)*name < 0x20)
+            return FALSE;
+    }
+    return TRUE;
+}
+/******************************************************************************/
+/* Look up which of the files were already processed with one search per 1000
+ * files, moloch_db_file_exists answers from the results instead of searching
+ * for each file.  Names that would need escaping are left to the slow path.
+ */
+void moloch_db_file_exists_prefetch(char **filenames, int num)
+{
+    char                   key[200];
+    int                    key_len;
+    size_t                 data_len;
+
+    key_len = snprintf(key, sizeof(key), "/%sfiles/_search?rest_total_hits_as_int", config.prefix);
+
+    for (int start = 0; start < num; start += 1000) {
+        const int end = MIN(num, start + 1000);
+        int       size = 1000;
+
+        for (int i = start; i < end; i++)
+            size += strlen(filenames[i]) + 3;
+
+        char *json = g_malloc(size);
+        BSB   bsb;
+        BSB_INIT(bsb, json, size);
+
+        /* Files may have been processed more than once, collapse on the name so
+         * each name only comes back once, with its newest num
+         */
+        BSB_EXPORT_sprintf(bsb, "{\"size\":%d,\"_source\":[\"name\",\"num\"],\"sort\":[{\"num\":\"desc\"}],\"collapse\":{\"field\":\"name\"},"
+                                "\"query\":{\"bool\":{\"filter\":[{\"term\":{\"node\":\"%s\"}},{\"terms\":{\"name\":[",
+                                end - start, config.nodeName);
+        int cnt = 0;
+        for (int i = start; i < end; i++) {
+            if (!moloch_db_file_name_plain(filenames[i]))
+                continue;
+            if (cnt++)
+                BSB_EXPORT_u08(bsb, ',');
+            BSB_EXPORT_sprintf(bsb, "\"%s\"", filenames[i]);
+        }
+        BSB_EXPORT_cstr(bsb, "]}}]}}}");
+
+        if (cnt == 0 || BSB_IS_ERROR(bsb)) {
+            g_free(json);
+            continue;
+        }
+
+        unsigned char *data = moloch_http_send_sync(esServer, "POST", key, key_len, json, BSB_LENGTH(bsb), NULL, &data_len);
+        g_free(json);
+
+        uint32_t       hits_len;
+        unsigned char *hits = moloch_js0n_get(data, data_len, "hits", &hits_len);
+        uint32_t       ahits_len = 0;
+        unsigned char *ahits = hits ? moloch_js0n_get(hits, hits_len, "hits", &ahits_len) : NULL;
+
+        if (!ahits) {
+            LOG("ERROR - Couldn't check which files exist: %.*s", (int)data_len, data);
+            if (data)
+                free(data);
+            continue;
+        }
+
+        uint32_t       total_len;
+        unsigned char *total = moloch_js0n_get(hits, hits_len, "total", &total_len);
+        const int      hitsTotal = total ? atoi((char *)total) : INT_MAX;
+
+        uint32_t *out = g_malloc0(sizeof(uint32_t) * 2 * ((end - start) + 1));
+        js0n(ahits, ahits_len, out, sizeof(uint32_t) * 2 * ((end - start) + 1));
+        int numHits = 0;
+        while (out[numHits * 2])
+            numHits++;
+
+        MOLOCH_LOCK(fileExistsCache);
+        if (!fileExistsCache)
+            fileExistsCache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+        /* Everything asked about is missing unless it is in the results, as long
+         * as the results weren't cut off by size
+         */
+        if (numHits < end - start || hitsTotal <= end - start) {
+            for (int i = start; i < end; i++) {
+                if (moloch_db_file_name_plain(filenames[i]) && !g_hash_table_contains(fileExistsCache, filenames[i]))
+                    g_hash_table_insert(fileExistsCache, g_strdup(filenames[i]), NULL);
+            }
+        }
+
+        for (int i = 0; out[i]; i += 2) {
+            uint32_t       source_len;
+            unsigned char *source = moloch_js0n_get(ahits + out[i], out[i+1], "_source", &source_len);
+            uint32_t       name_len, fnum_len;
+            unsigned char *name = moloch_js0n_get(source, source_len, "name", &name_len);
+            unsigned char *fnum = moloch_js0n_get(source, source_len, "num", &fnum_len);
+
+            if (!name || !fnum)
+                continue;
+
+            char *filename = g_strndup((char *)name, name_len);
+            if (g_hash_table_lookup(fileExistsCache, filename)) {
+                g_free(filename);
+                continue;
+            }
+            g_hash_table_replace(fileExistsCache, filename, GUINT_TO_POINTER(atoi((char *)fnum) + 1));
+        }
+        MOLOCH_UNLOCK(fileExistsCache);
+
+        g_free(out);
+        free(data);
+    }
+}
+/******************************************************************************/
 gboolean moloch_db_file_exists(const char *filename, uint32_t *outputId)
 {
     size_t                 data_len;
     char                   key[2000];
     int                    key_len;
 
+    if (fileExistsCache) {
+        gpointer value;
+
+        MOLOCH_LOCK(fileExistsCache);
+        gboolean cached = g_hash_table_lookup_extended(fileExistsCache, filename, NULL, &value);
+        // Missing files are only answered once, they are probably about to be processed
+        if (cached && !value)
+            g_hash_table_remove(fileExistsCache, filename);
+        MOLOCH_UNLOCK(fileExistsCache);
+
+        if (cached) {
+            if (!value)
+                return FALSE;
+            if (outputId)
+                *outputId = GPOINTER_TO_UINT(value) - 1;
+            return TRUE;
+        }
+    }
+
     key_len = snprintf(key, sizeof(key), "/%sfiles/_search?rest_total_hits_as_int&size=1&sort=num:desc&q=node:%s+AND+name:\"%s\"", config.prefix, config.nodeName, filename);
 
     unsigned char *data = moloch_http_get(esServer, key, key_len, &data_len);
@@ -2535,8 +3264,18 @@ gboolean moloch_db_file_exists(const char *filename, uint32_t *outputId)
 /******************************************************************************/
 int moloch_db_can_quit()
 {
+    MOLOCH_LOCK(saveQ);
+    const int saving = DLL_COUNT(dbs_, &saveQ) + saveInProgress;
+    MOLOCH_UNLOCK(saveQ);
+
+    if (saving > 0) {
+        if (config.debug)
+            LOG ("Can't quit, saveQ %d", saving);
+        return 1;
+    }
+
     int thread;
-    for (thread = 0; thread < config.packetThreads; thread++) {
+    for (thread = 0; thread < config.packetThreads + serializerThreads; thread++) {
         // Make sure we can lock, that means a save isn't in progress
         MOLOCH_LOCK(dbInfo[thread].lock);
         if (dbInfo[thread].json && BSB_LENGTH(dbInfo[thread].bsb) > 0) {
@@ -2595,7 +3334,24 @@ void moloch_db_init()
         MOLOCH_UNLOCK(outputed);
     }
     if (!config.dryRun) {
-        esServer = moloch_http_create_server(config.elasticsearch, config.maxESConns, config.maxESRequests, config.compressES);
+        int compress = MOLOCH_HTTP_COMPRESS_NONE;
+        if (config.compressES) {
+            char *compressESMethod = moloch_config_str(NULL, "compressESMethod", "gzip");
+            if (strcmp(compressESMethod, "gzip") == 0) {
+                compress = MOLOCH_HTTP_COMPRESS_GZIP;
+#ifdef HAVE_ZSTD
+            } else if (strcmp(compressESMethod, "zstd") == 0) {
+                compress = MOLOCH_HTTP_COMPRESS_ZSTD;
+#else
+            } else if (strcmp(compressESMethod, "zstd") == 0) {
+                CONFIGEXIT("compressESMethod 'zstd' requires capture built with zstd, use 'gzip' instead");
+#endif
+            } else {
+                CONFIGEXIT("Unknown compressESMethod '%s'", compressESMethod);
+            }
+            g_free(compressESMethod);
+        }
+        esServer = moloch_http_create_server(config.elasticsearch, config.maxESConns, config.maxESRequests, compress);
 
         static char *headers[4] = {"Content-Type: application/json", "Expect:", NULL, NULL};
 
@@ -2644,6 +3400,8 @@ void moloch_db_init()
 
     moloch_add_can_quit(moloch_db_can_quit, "DB");
 
+    geoCacheSize = moloch_config_int(NULL, "geoLookupCacheSize", 8192, 0, 1024*1024);
+
     // Find the first geo file that exists in our list and use that one.
     // If none could be loaded, and setting not blank, print out warning
     struct stat     sb;
@@ -2689,11 +3447,20 @@ void moloch_db_init()
     ecsEventProvider = moloch_config_str(NULL, "ecsEventProvider", NULL);
     ecsEventDataset = moloch_config_str(NULL, "ecsEventDataset", NULL);
 
+    serializerThreads = moloch_config_int(NULL, "dbSerializerThreads", 0, 0, MOLOCH_DB_MAX_SERIALIZERS);
+
     int thread;
-    for (thread = 0; thread < config.packetThreads; thread++) {
+    for (thread = 0; thread < config.packetThreads + serializerThreads; thread++) {
         MOLOCH_LOCK_INIT(dbInfo[thread].lock);
         dbInfo[thread].prefixTime = -1;
     }
+
+    DLL_INIT(dbs_, &saveQ);
+    for (thread = 0; thread < serializerThreads; thread++) {
+        char name[100];
+        snprintf(name, sizeof(name), "moloch-dbser%d", thread);
+        g_thread_unref(g_thread_new(name, &moloch_db_serializer_thread, (gpointer)(long)thread));
+    }
 }
 /******************************************************************************/
 void moloch_db_exit()
@@ -2717,6 +3484,10 @@ void moloch_db_exit()
 
         moloch_db_flush_gfunc((gpointer)1);
         dbExit = 1;
+
+        MOLOCH_LOCK(fileNum);
+        moloch_db_fn_lease_save();
+        MOLOCH_UNLOCK(fileNum);
         if (!config.noStats) {
             moloch_db_update_stats(0, 1);
         }
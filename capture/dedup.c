@@ -16,113 +16,186 @@
  * limitations under the License.
  */
 
-/* Circular array of chained hashtable where space is preallocated and 
- * there is a count array of elements per hashtable slot. We stop
- * searching the oldest hashtable and wipe its count array.
+/* Circular array of per second fingerprint tables.  Each table is an array
+ * of DEDUP_BUCKET_SIZE entry buckets, a packet hashes to one bucket and its
+ * fingerprint is stored in the first free entry.  An entry also holds the
+ * generation of the second that added it, so old entries don't match and are
+ * free to reuse without the table ever being wiped.  Nothing takes a lock,
+ * entries are claimed with a compare and swap.
  *
- * We size the hashtable assuming DEDUP_SLOT_FACTOR elements per
- * slot, but actually allow DEDUP_SIZE_FACTOR elements.
- *
- * Currently use md5 on ip + tcp/udp hdr
+ * Uses a seeded 128 bit multiply/fold hash of the ip + tcp/udp hdr, 64 bits
+ * pick the bucket and 48 are kept as the fingerprint.
  */
 
 #include "moloch.h"
-#include <openssl/md5.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 extern MolochConfig_t       config;
 
-// How many items in each hashtable we expect to be used
-#define DEDUP_SLOT_FACTOR   15
-// How many items in each hashtable we actually allow, must be less then 256
-#define DEDUP_SIZE_FACTOR   20
+// Entries per bucket, buckets are sized for at most half of them to be used
+#define DEDUP_BUCKET_SIZE   16
+#define DEDUP_GEN_MASK      0xffffULL
 
 LOCAL uint32_t              dedupSeconds;
-LOCAL uint32_t              dedupSlots;
 LOCAL uint32_t              dedupPackets;
-LOCAL uint32_t              dedupSize;
+LOCAL uint32_t              dedupBuckets;
+LOCAL uint64_t              dedupSeed[4];
 
 typedef struct dedupsecond DedupSeconds_t;
 struct dedupsecond {
-    uint8_t        *md5s;
-    uint8_t        *counts;
+    uint64_t       *entries;
     uint32_t        tv_sec;
     uint32_t        count;
     char            error;
-    MOLOCH_LOCK_EXTERN(lock);
 };
 
 LOCAL DedupSeconds_t *seconds;
 
+/******************************************************************************/
+LOCAL inline uint64_t arkime_dedup_mix(uint64_t a, uint64_t b)
+{
+    const __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+/******************************************************************************/
+LOCAL inline uint64_t arkime_dedup_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+/******************************************************************************/
+/* Hash the headers 16 bytes at a time, first is the first 16 bytes with the
+ * fields that change per hop already cleared.
+ */
+LOCAL void arkime_dedup_hash(const uint8_t *ptr, int len, const uint8_t *first, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t a1 = len * 0x9E3779B185EBCA87ULL;
+    uint64_t a2 = len * 0xC2B2AE3D27D4EB4FULL;
+
+    for (int i = 0; i < len; i += 16) {
+        uint8_t  tail[16];
+        const uint8_t *p = ptr + i;
+        uint64_t lo, hi;
+
+        if (i == 0) {
+            p = first;
+        } else if (i + 16 > len) {
+            memset(tail, 0, 16);
+            memcpy(tail, ptr + i, len - i);
+            p = tail;
+        }
+        memcpy(&lo, p, 8);
+        memcpy(&hi, p + 8, 8);
+
+        // Mix the position in so reordered blocks don't hash the same
+        const uint64_t pos = i * 0x9E3779B97F4A7C15ULL;
+        a1 += arkime_dedup_mix(lo ^ (dedupSeed[0] + pos), hi ^ (dedupSeed[1] - pos));
+        a2 += arkime_dedup_mix(lo ^ (dedupSeed[2] + pos), hi ^ (dedupSeed[3] - pos));
+    }
+
+    *h1 = arkime_dedup_avalanche(a1);
+    *h2 = arkime_dedup_avalanche(a2 ^ a1);
+}
+/******************************************************************************/
+LOCAL inline int arkime_dedup_bucket_has(const uint64_t *bucket, uint64_t key)
+{
+#ifdef __SSE2__
+    const __m128i k = _mm_set1_epi64x(key);
+    __m128i       found = _mm_setzero_si128();
+
+    for (int i = 0; i < DEDUP_BUCKET_SIZE; i += 2) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(bucket + i)), k);
+        // A 64 bit entry only matches if both its 32 bit halves do
+        found = _mm_or_si128(found, _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1))));
+    }
+    return _mm_movemask_epi8(found) != 0;
+#else
+    for (int i = 0; i < DEDUP_BUCKET_SIZE; i++) {
+        if (bucket[i] == key)
+            return 1;
+    }
+    return 0;
+#endif
+}
 /******************************************************************************/
 int arkime_dedup_should_drop (const MolochPacket_t *packet, int headerLen)
 {
     struct timespec currentTime;
     clock_gettime(CLOCK_REALTIME_COARSE, &currentTime);
 
-    uint32_t secondSlot = currentTime.tv_sec % dedupSeconds;
+    const uint32_t secondSlot = currentTime.tv_sec % dedupSeconds;
 
     // Create hash, headerLen should be length of ip & tcp/udp header
-    unsigned char md[16];
-    MD5_CTX ctx;
-    MD5_Init(&ctx);
-    uint8_t * const ptr = packet->pkt + packet->ipOffset;
+    const uint8_t * const ptr = packet->pkt + packet->ipOffset;
+    uint8_t first[16];
+    memcpy(first, ptr, 16);
     if ((ptr[0] & 0xf0) == 0x40) {
-        MD5_Update(&ctx, ptr, 8);
-        // Skip TTL (1 byte)
-        MD5_Update(&ctx, ptr+9, 1);
-        // Skip Header checksum (2 byte)
-        MD5_Update(&ctx, ptr+12, headerLen-12);
+        // Skip TTL (1 byte) and Header checksum (2 byte)
+        first[8] = 0;
+        first[10] = first[11] = 0;
     } else {
-        MD5_Update(&ctx, ptr, 7);
         // Skip HOP
-        MD5_Update(&ctx, ptr+8, headerLen-8);
+        first[7] = 0;
     }
-    MD5_Final(md, &ctx);
-    int h = ((uint32_t *)md)[0] % dedupSlots;
-
-    // First see if we need to clean up old slot, and block all new folks while we do
-    // In theory no one should be using this slot because hadn't been searching it for a second.
-    if (seconds[secondSlot].tv_sec != currentTime.tv_sec) {
-        MOLOCH_LOCK(seconds[secondSlot].lock);
-        if (seconds[secondSlot].tv_sec != currentTime.tv_sec) { // Check critical section again
-            if (seconds[secondSlot].error) {
-                LOG ("WARNING - Ran out of room, increase dedupPackets to %u or above. pcount: %u", dedupSlots * DEDUP_SLOT_FACTOR + 1, seconds[secondSlot].count);
-                seconds[secondSlot].error = 0;
-            }
-            memset(seconds[secondSlot].counts, 0, dedupSlots);
-            seconds[secondSlot].count = 0;
-            seconds[secondSlot].tv_sec = currentTime.tv_sec;
+
+    uint64_t h1, h2;
+    arkime_dedup_hash(ptr, headerLen, first, &h1, &h2);
+
+    const uint32_t b = (h1 & (dedupBuckets - 1)) * DEDUP_BUCKET_SIZE;
+    const uint64_t fingerprint = (h2 & ~DEDUP_GEN_MASK) | (DEDUP_GEN_MASK + 1);
+
+    // First one to notice the slot is being reused reports on it, the old entries just stop matching
+    const uint32_t oldSec = seconds[secondSlot].tv_sec;
+    if (oldSec != currentTime.tv_sec &&
+        __sync_bool_compare_and_swap(&seconds[secondSlot].tv_sec, oldSec, currentTime.tv_sec)) {
+        if (seconds[secondSlot].error) {
+            LOG ("WARNING - Ran out of room, increase dedupPackets to %u or above. pcount: %u", dedupPackets * 2, seconds[secondSlot].count);
+            seconds[secondSlot].error = 0;
         }
-        MOLOCH_UNLOCK(seconds[secondSlot].lock);
+        seconds[secondSlot].count = 0;
     }
 
     // Search all valid slots
     for (uint32_t s = 0; s < dedupSeconds; s++) {
+        const uint32_t tv_sec = seconds[s].tv_sec;
 
         // If slot is too old just skip it
-        if (currentTime.tv_sec - dedupSeconds + 1 >= seconds[s].tv_sec ) {
+        if (currentTime.tv_sec - dedupSeconds + 1 >= tv_sec) {
             continue;
         }
 
-        int count = seconds[s].counts[h];
-        for (int c = 0; c < count; c++) {
-            if (memcmp(md, seconds[s].md5s + 16 * (h*DEDUP_SIZE_FACTOR + c), 16) == 0) {
-                return 1;
-            }
+        if (arkime_dedup_bucket_has(seconds[s].entries + b, fingerprint | ((tv_sec / dedupSeconds) & DEDUP_GEN_MASK))) {
+            return 1;
         }
     }
 
-    // Is there space to add
-    if (seconds[secondSlot].counts[h] == DEDUP_SIZE_FACTOR) {
-        seconds[secondSlot].error = 1;
-        return 0;
-    }
+    // Claim the first entry not from this generation
+    const uint64_t gen = (currentTime.tv_sec / dedupSeconds) & DEDUP_GEN_MASK;
+    const uint64_t key = fingerprint | gen;
+    uint64_t *bucket = seconds[secondSlot].entries + b;
+    for (int i = 0; i < DEDUP_BUCKET_SIZE; i++) {
+        const uint64_t old = bucket[i];
+
+        if ((old & DEDUP_GEN_MASK) == gen) {
+            // Another thread just added the same packet
+            if (old == key)
+                return 0;
+            continue;
+        }
 
-    // For now ignore the race condition of search between incr and copy
-    int c = MOLOCH_THREAD_INCROLD(seconds[secondSlot].counts[h]);
-    memcpy(seconds[secondSlot].md5s + 16 * (h*DEDUP_SIZE_FACTOR + c), md, 16);
-    MOLOCH_THREAD_INCR(seconds[secondSlot].count);
+        if (__sync_bool_compare_and_swap(&bucket[i], old, key)) {
+            MOLOCH_THREAD_INCR(seconds[secondSlot].count);
+            return 0;
+        }
+        i--; // Lost the race, look at the entry again
+    }
 
+    // No space to add
+    seconds[secondSlot].error = 1;
     return 0;
 }
 /******************************************************************************/
@@ -133,17 +206,21 @@ void arkime_dedup_init()
 
     dedupSeconds   = moloch_config_int(NULL, "dedupSeconds", 2, 0, 30) + 1; // + 1 because a slot isn't active before being replaced
     dedupPackets   = moloch_config_int(NULL, "dedupPackets", 0xfffff, 0xffff, 0xffffff);
-    dedupSlots     = moloch_get_next_prime(dedupPackets/DEDUP_SLOT_FACTOR);
-    dedupSize      = dedupSlots * DEDUP_SIZE_FACTOR;
+
+    // Power of 2 buckets so that dedupPackets fills between a quarter and a half of the entries
+    dedupBuckets   = 1;
+    while (dedupBuckets * DEDUP_BUCKET_SIZE / 2 < dedupPackets)
+        dedupBuckets <<= 1;
+
+    for (int i = 0; i < 4; i++)
+        dedupSeed[i] = ((uint64_t)g_random_int() << 32) | g_random_int();
 
     if (config.debug)
-        LOG("seconds = %u packets = %u slots = %u size = %u mem=%u", dedupSeconds, dedupPackets, dedupSlots, dedupSize, dedupSeconds *(dedupSlots + dedupSize*16));
+        LOG("seconds = %u packets = %u buckets = %u mem=%lu", dedupSeconds, dedupPackets, dedupBuckets, (unsigned long)dedupSeconds * dedupBuckets * DEDUP_BUCKET_SIZE * 8);
 
     seconds = MOLOCH_SIZE_ALLOC0("dedup seconds", sizeof(DedupSeconds_t) * dedupSeconds);
     for (uint32_t i = 0; i < dedupSeconds; i++) {
-        MOLOCH_LOCK_INIT(seconds[i].lock);
-        seconds[i].counts = MOLOCH_SIZE_ALLOC("dedup counts", dedupSlots);
-        seconds[i].md5s = MOLOCH_SIZE_ALLOC("dedup counts", dedupSize * 16);
+        seconds[i].entries = MOLOCH_SIZE_ALLOC0("dedup entries", (size_t)dedupBuckets * DEDUP_BUCKET_SIZE * 8);
     }
 }
 /******************************************************************************/
@@ -1,4 +1,4 @@
-/* drophash.c - simple hash that locks on writes but not on reads
+/* drophash.c - open addressing hash per port that locks on writes but not on reads
  *              used for dropping packets by ip:port before the packet copy
  *
  * Copyright 2018 AOL Inc. All rights reserved.
@@ -14,6 +14,12 @@
  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
  * See the License for the specific language governing permissions and
  * limitations under the License.
+ *
+ * Readers never lock or wait, they probe until an empty slot.  Writers are
+ * serialized by the group lock, fill in an item before publishing it in a
+ * slot, and mark removed slots as deleted.  Growing builds a new table and
+ * swaps the pointer, old tables and items are only freed with
+ * moloch_free_later so a reader still looking at them is safe.
  */
 
 #include "moloch.h"
@@ -22,10 +28,11 @@
 /******************************************************************************/
 extern MolochConfig_t        config;
 
+#define MOLOCH_DROPHASH_DELETED ((MolochDropHashItem_t *)1)
+
 /******************************************************************************/
 struct molochdrophashitem_t {
     MolochDropHashItem_t *dhg_next, *dhg_prev;
-    MolochDropHashItem_t *hnext;
     uint8_t               key[MOLOCH_SESSIONID_LEN - 1];
     uint32_t              last;
     uint32_t              goodFor;
@@ -34,9 +41,10 @@ struct molochdrophashitem_t {
 };
 
 struct molochdrophash_t {
-    MolochDropHashItem_t **heads;
+    MolochDropHashItem_t **slots;
+    uint32_t               size;     // power of 2
     uint32_t               cnt;
-    uint16_t               num;
+    uint32_t               used;     // cnt plus deleted slots
 };
 
 /******************************************************************************/
@@ -54,70 +62,119 @@ LOCAL inline uint32_t moloch_drophash_hash (const void *key, int len)
 }
 
 /******************************************************************************/
-LOCAL void moloch_drophash_make(MolochDropHashGroup_t *group, int port)
+LOCAL MolochDropHash_t *moloch_drophash_alloc(uint32_t size)
 {
-    int size;
-
-    switch (port) {
-    case 80:
-    case 443:
-    case 25:
-        size = 7919;
-        break;
-    default:
-        size = 409;
-        break;
-    }
-
-    MOLOCH_LOCK(group->lock);
-    if (group->drops[port])
-        goto done;
-
     MolochDropHash_t *hash;
 
-    hash          = MOLOCH_TYPE_ALLOC(MolochDropHash_t);
-    hash->num     = size;
-    hash->heads   = MOLOCH_SIZE_ALLOC0("heads", size * sizeof(MolochDropHashItem_t *));
-    hash->cnt     = 0;
-    group->drops[port] = hash;
-done:
-    MOLOCH_UNLOCK(group->lock);
+    hash          = MOLOCH_TYPE_ALLOC0(MolochDropHash_t);
+    hash->size    = size;
+    hash->slots   = MOLOCH_SIZE_ALLOC0("slots", size * sizeof(MolochDropHashItem_t *));
+    return hash;
 }
 /******************************************************************************/
-int moloch_drophash_add (MolochDropHashGroup_t *group, int port, const void *key, uint32_t current, uint32_t goodFor)
+LOCAL void moloch_drophash_free_hash(void *ptr)
+{
+    MolochDropHash_t *hash = ptr;
+
+    MOLOCH_SIZE_FREE("slots", hash->slots);
+    MOLOCH_TYPE_FREE(MolochDropHash_t, hash);
+}
+/******************************************************************************/
+void moloch_drophash_free(void *ptr)
+{
+    MOLOCH_TYPE_FREE(MolochDropHashItem_t, ptr);
+}
+/******************************************************************************/
+/* Returns the item for key or NULL, and its slot if slot is set.  Safe to call
+ * without the lock, the item stays valid until moloch_free_later frees it.
+ */
+LOCAL inline MolochDropHashItem_t *moloch_drophash_find(const MolochDropHashGroup_t *group, MolochDropHash_t *hash, const void *key, uint32_t *slot)
 {
-    if (!group->drops[port]) {
-        moloch_drophash_make(group, port);
+    const uint32_t mask = hash->size - 1;
+
+    for (uint32_t h = moloch_drophash_hash(key, group->keyLen) & mask; ; h = (h + 1) & mask) {
+        MolochDropHashItem_t *item = __atomic_load_n(&hash->slots[h], __ATOMIC_ACQUIRE);
+        if (!item)
+            return NULL;
+        if (item != MOLOCH_DROPHASH_DELETED && memcmp(key, item->key, group->keyLen) == 0) {
+            if (slot)
+                *slot = h;
+            return item;
+        }
     }
+}
+/******************************************************************************/
+// Must hold the lock
+LOCAL void moloch_drophash_insert(const MolochDropHashGroup_t *group, MolochDropHash_t *hash, MolochDropHashItem_t *item)
+{
+    const uint32_t mask = hash->size - 1;
+    uint32_t       h = moloch_drophash_hash(item->key, group->keyLen) & mask;
 
-    MolochDropHash_t *hash = group->drops[port];
+    while (hash->slots[h] && hash->slots[h] != MOLOCH_DROPHASH_DELETED)
+        h = (h + 1) & mask;
+
+    if (!hash->slots[h])
+        hash->used++;
+    hash->cnt++;
+    __atomic_store_n(&hash->slots[h], item, __ATOMIC_RELEASE);
+}
+/******************************************************************************/
+/* Must hold the lock.  Build a table without the deleted slots, growing it if
+ * it would be more than half full, and swap it in.
+ */
+LOCAL MolochDropHash_t *moloch_drophash_rebuild(MolochDropHashGroup_t *group, int port, MolochDropHash_t *hash)
+{
+    uint32_t size = hash->size;
+    while ((hash->cnt + 1) * 2 > size)
+        size *= 2;
+
+    MolochDropHash_t *newHash = moloch_drophash_alloc(size);
+    for (uint32_t i = 0; i < hash->size; i++) {
+        if (hash->slots[i] && hash->slots[i] != MOLOCH_DROPHASH_DELETED)
+            moloch_drophash_insert(group, newHash, hash->slots[i]);
+    }
 
+    __atomic_store_n(&group->drops[port], newHash, __ATOMIC_RELEASE);
+    moloch_free_later(hash, moloch_drophash_free_hash);
+    return newHash;
+}
+/******************************************************************************/
+int moloch_drophash_add (MolochDropHashGroup_t *group, int port, const void *key, uint32_t current, uint32_t goodFor)
+{
     MolochDropHashItem_t *item;
-    uint32_t              h;
-    if (group->keyLen == 4)
-        h = (*(uint32_t *)key) % hash->num;
-    else
-        h = moloch_drophash_hash(key, group->keyLen) % hash->num;
 
     MOLOCH_LOCK(group->lock);
-    if (hash->heads[h]) {
-        for (item = hash->heads[h]; item; item = item->hnext) {
-            if (memcmp(key, item->key, group->keyLen) == 0) {
-                MOLOCH_UNLOCK(group->lock);
-                return 0;
-            }
+    MolochDropHash_t *hash = group->drops[port];
+    if (!hash) {
+        switch (port) {
+        case 80:
+        case 443:
+        case 25:
+            hash = moloch_drophash_alloc(8192);
+            break;
+        default:
+            hash = moloch_drophash_alloc(512);
+            break;
         }
+        __atomic_store_n(&group->drops[port], hash, __ATOMIC_RELEASE);
     }
 
+    if (moloch_drophash_find(group, hash, key, NULL)) {
+        MOLOCH_UNLOCK(group->lock);
+        return 0;
+    }
+
+    // Always leave a quarter of the slots empty so lookups end quickly
+    if ((hash->used + 1) * 4 > hash->size * 3)
+        hash = moloch_drophash_rebuild(group, port, hash);
+
     item           = MOLOCH_TYPE_ALLOC(MolochDropHashItem_t);
-    item->hnext    = hash->heads[h];
     item->flags    = 0;
     item->port     = port;
     memcpy(item->key, key, group->keyLen);
     item->last     = current;
     item->goodFor  = goodFor;
-    hash->heads[h] = item;
-    hash->cnt++;
+    moloch_drophash_insert(group, hash, item);
 
     DLL_PUSH_TAIL(dhg_, group, item);
     group->changed++;
@@ -126,76 +183,56 @@ int moloch_drophash_add (MolochDropHashGroup_t *group, int port, const void *key
 }
 
 /******************************************************************************/
-int moloch_drophash_should_drop (MolochDropHashGroup_t *group, int port, void *key, uint32_t current)
+/* Remove key, if expected is set only when key still maps to that item so a
+ * newer add of the same key isn't removed instead.
+ */
+LOCAL void moloch_drophash_remove(MolochDropHashGroup_t *group, int port, const void *key, const MolochDropHashItem_t *expected)
 {
+    MOLOCH_LOCK(group->lock);
     MolochDropHash_t *hash = group->drops[port];
+    uint32_t h = 0;
+    MolochDropHashItem_t *item = hash ? moloch_drophash_find(group, hash, key, &h) : NULL;
+
+    if (item && (!expected || item == expected)) {
+        __atomic_store_n(&hash->slots[h], MOLOCH_DROPHASH_DELETED, __ATOMIC_RELEASE);
+        hash->cnt--;
+        DLL_REMOVE(dhg_, group, item);
+        moloch_free_later(item, moloch_drophash_free);
+        group->changed++;
+    }
+    MOLOCH_UNLOCK(group->lock);
+}
+/******************************************************************************/
+int moloch_drophash_should_drop (MolochDropHashGroup_t *group, int port, void *key, uint32_t current)
+{
+    MolochDropHash_t *hash = __atomic_load_n(&group->drops[port], __ATOMIC_ACQUIRE);
 
-    uint32_t              h;
-    if (group->keyLen == 4)
-        h = (*(uint32_t *)key) % hash->num;
-    else
-        h = moloch_drophash_hash(key, group->keyLen) % hash->num;
+    if (!hash)
+        return 0;
 
-    if (!hash->heads[h])
+    // Use the item find matched, the slot may already hold something else
+    MolochDropHashItem_t *item = moloch_drophash_find(group, hash, key, NULL);
+    if (!item)
         return 0;
 
-    MolochDropHashItem_t *item;
-    for (item = hash->heads[h]; item; item = item->hnext) {
-        if (memcmp(key, item->key, group->keyLen) == 0) {
-
-            // Same time as last time, drop
-            if (likely(item->last == current))
-                return 1;
-
-            // Check if within the window, drop
-            if (item->last + item->goodFor >= current) {
-                item->last = current;
-                return 1;
-            }
-
-            // Outside the window, need to remove, don't drop
-            moloch_drophash_delete(group, port, key);
-            return 0;
-        }
+    // Same time as last time, drop
+    if (likely(item->last == current))
+        return 1;
+
+    // Check if within the window, drop
+    if (item->last + item->goodFor >= current) {
+        item->last = current;
+        return 1;
     }
+
+    // Outside the window, need to remove, don't drop
+    moloch_drophash_remove(group, port, key, item);
     return 0;
 }
 /******************************************************************************/
-void moloch_drophash_free(void *ptr)
-{
-    MOLOCH_TYPE_FREE(MolochDropHashItem_t, ptr);
-}
-/******************************************************************************/
 void moloch_drophash_delete (MolochDropHashGroup_t *group, int port, void *key)
 {
-    MolochDropHash_t *hash = group->drops[port];
-
-    MolochDropHashItem_t *item, *parent = NULL;
-    uint32_t              h;
-    if (group->keyLen == 4)
-        h = (*(uint32_t *)key) % hash->num;
-    else
-        h = moloch_drophash_hash(key, group->keyLen) % hash->num;
-
-    if (!hash->heads[h])
-        return;
-
-    MOLOCH_LOCK(group->lock);
-    for (item = hash->heads[h]; item; parent = item, item = item->hnext) {
-        if (memcmp(key, item->key, group->keyLen) == 0) {
-            hash->cnt--;
-            if (parent) {
-                parent->hnext = item->hnext;
-            } else {
-                hash->heads[h] = item->hnext;
-            }
-            DLL_REMOVE(dhg_, group, item);
-            moloch_free_later(item, moloch_drophash_free);
-            group->changed++;
-            break;
-        }
-    }
-    MOLOCH_UNLOCK(group->lock);
+    moloch_drophash_remove(group, port, key, NULL);
 }
 
 /******************************************************************************/
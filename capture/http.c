@@ -26,7 +26,11 @@
 #include <arpa/inet.h>
 #include <curl/curl.h>
 #include "moloch.h"
+#include "arkimeconfig.h"
 #include "zlib.h"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include <errno.h>
 
 //#define MOLOCH_HTTP_DEBUG
@@ -102,6 +106,9 @@ typedef struct {
 
 struct molochhttpserver_t {
     uint64_t                 dropped;
+    uint64_t                 compressIn;
+    uint64_t                 compressOut;
+    uint64_t                 compressUsecs;
     GHashTable              *fd2ev;
     MolochHttpServerName_t  *snames;
     MolochClientAuth_t      *clientAuth;
@@ -125,8 +132,18 @@ struct molochhttpserver_t {
     MolochHttpHeader_cb      headerCb;
 };
 
-LOCAL z_stream z_strm;
-LOCAL MOLOCH_LOCK_DEFINE(z_strm);
+// Compression state belongs to the thread scheduling the request, freed when the thread exits
+typedef struct {
+    z_stream                *zStrm;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx               *zstdCtx;
+#endif
+    char                    *buf;
+    uint32_t                 bufSize;
+} MolochHttpCompress_t;
+
+LOCAL void moloch_http_compress_free(gpointer data);
+LOCAL GPrivate compressState = G_PRIVATE_INIT(moloch_http_compress_free);
 
 LOCAL gboolean moloch_http_send_timer_callback(gpointer);
 LOCAL void moloch_http_add_request(MolochHttpServer_t *server, MolochHttpRequest_t *request, int priority);
@@ -741,6 +758,73 @@ gboolean moloch_http_send(void *serverV, const char *method, const char *key, in
    return moloch_http_schedule(serverV, method, key, key_len, data, data_len, headers, dropable ? MOLOCH_HTTP_PRIORITY_DROPABLE : MOLOCH_HTTP_PRIORITY_NORMAL, func, uw);
 }
 /******************************************************************************/
+LOCAL void moloch_http_compress_free(gpointer data)
+{
+    MolochHttpCompress_t *state = data;
+
+    if (state->zStrm) {
+        deflateEnd(state->zStrm);
+        free(state->zStrm);
+    }
+#ifdef HAVE_ZSTD
+    if (state->zstdCtx)
+        ZSTD_freeCCtx(state->zstdCtx);
+#endif
+    free(state->buf);
+    free(state);
+}
+/******************************************************************************/
+/* Compress data into this thread's buffer, which only grows, so the request
+ * just needs a buffer of the compressed size.  Returns the compressed length
+ * or 0 if it didn't compress to less than the original, *out is set to the
+ * compressed data.
+ */
+LOCAL int moloch_http_compress(int method, const char *data, uint32_t data_len, char **out)
+{
+    MolochHttpCompress_t *state = g_private_get(&compressState);
+    if (!state) {
+        state = calloc(1, sizeof(MolochHttpCompress_t));
+        g_private_set(&compressState, state);
+    }
+
+    if (state->bufSize < data_len) {
+        free(state->buf);
+        state->bufSize = MAX(data_len, MOLOCH_HTTP_BUFFER_SIZE);
+        state->buf = malloc(state->bufSize);
+    }
+    *out = state->buf;
+
+#ifdef HAVE_ZSTD
+    if (method == MOLOCH_HTTP_COMPRESS_ZSTD) {
+        if (!state->zstdCtx) {
+            state->zstdCtx = ZSTD_createCCtx();
+        }
+        size_t outLen = ZSTD_compressCCtx(state->zstdCtx, state->buf, data_len, data, data_len, ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(outLen))
+            return 0;
+        return outLen;
+    }
+#else
+    (void)method;
+#endif
+
+    z_stream *zStrm = state->zStrm;
+    if (!zStrm) {
+        zStrm = state->zStrm = calloc(1, sizeof(z_stream));
+        deflateInit2(zStrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY);
+    }
+
+    zStrm->avail_in   = data_len;
+    zStrm->next_in    = (unsigned char *)data;
+    zStrm->avail_out  = data_len;
+    zStrm->next_out   = (unsigned char *)state->buf;
+    int ret = deflate(zStrm, Z_FINISH);
+    int outLen = data_len - zStrm->avail_out;
+    deflateReset(zStrm);
+
+    return ret == Z_STREAM_END ? outLen : 0;
+}
+/******************************************************************************/
 gboolean moloch_http_schedule(void *serverV, const char *method, const char *key, int32_t key_len, char *data, uint32_t data_len, char **headers, int priority, MolochHttpResponse_cb func, gpointer uw)
 {
     MolochHttpServer_t        *server = serverV;
@@ -798,26 +882,24 @@ gboolean moloch_http_schedule(void *serverV, const char *method, const char *key
 
     // Do we need to compress item
     if (server->compress && data && data_len > 860) {
-        char            *buf = moloch_http_get_buffer(data_len);
-        int              ret;
-
-        MOLOCH_LOCK(z_strm);
-        z_strm.avail_in   = data_len;
-        z_strm.next_in    = (unsigned char *)data;
-        z_strm.avail_out  = data_len;
-        z_strm.next_out   = (unsigned char *)buf;
-        ret = deflate(&z_strm, Z_FINISH);
-        if (ret == Z_STREAM_END) {
-            request->headerList = curl_slist_append(request->headerList, "Content-Encoding: gzip");
+        struct timespec startTime, endTime;
+        clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+        char *compressed;
+        int outLen = moloch_http_compress(server->compress, data, data_len, &compressed);
+
+        clock_gettime(CLOCK_MONOTONIC, &endTime);
+        MOLOCH_THREAD_INCR_NUM(server->compressUsecs, (endTime.tv_sec - startTime.tv_sec) * 1000000 + (endTime.tv_nsec - startTime.tv_nsec) / 1000);
+        MOLOCH_THREAD_INCR_NUM(server->compressIn, data_len);
+
+        if (outLen > 0) {
+            request->headerList = curl_slist_append(request->headerList, server->compress == MOLOCH_HTTP_COMPRESS_ZSTD ? "Content-Encoding: zstd" : "Content-Encoding: gzip");
             MOLOCH_SIZE_FREE(buffer, data);
-            data_len = data_len - z_strm.avail_out;
-            data     = buf;
-        } else {
-            MOLOCH_SIZE_FREE(buffer, buf);
+            data_len = outLen;
+            data     = moloch_http_get_buffer(data_len);
+            memcpy(data, compressed, data_len);
         }
-
-        deflateReset(&z_strm);
-        MOLOCH_UNLOCK(z_strm);
+        MOLOCH_THREAD_INCR_NUM(server->compressOut, data_len);
     }
 
     request->server     = server;
@@ -909,6 +991,14 @@ uint64_t moloch_http_dropped_count(void *serverV)
     return server?server->dropped:0;
 }
 /******************************************************************************/
+void moloch_http_compress_stats(void *serverV, uint64_t *inBytes, uint64_t *outBytes, uint64_t *usecs)
+{
+    MolochHttpServer_t        *server = serverV;
+    *inBytes  = server?server->compressIn:0;
+    *outBytes = server?server->compressOut:0;
+    *usecs    = server?server->compressUsecs:0;
+}
+/******************************************************************************/
 void moloch_http_set_header_cb(void *serverV, MolochHttpHeader_cb cb)
 {
     MolochHttpServer_t        *server = serverV;
@@ -1014,6 +1104,10 @@ void *moloch_http_create_server(const char *hostnames, int maxConns, int maxOuts
     server->snames = malloc(i * sizeof(MolochHttpServerName_t));
     server->maxConns = maxConns;
     server->maxOutstandingRequests = maxOutstandingRequests;
+#ifndef HAVE_ZSTD
+    if (compress == MOLOCH_HTTP_COMPRESS_ZSTD)
+        LOGEXIT("ERROR - zstd compression requested but capture wasn't built with zstd");
+#endif
     server->compress = compress;
     server->maxRetries = 2;
     server->clientAuth = NULL;
@@ -1052,11 +1146,6 @@ void *moloch_http_create_server(const char *hostnames, int maxConns, int maxOuts
 /******************************************************************************/
 void moloch_http_init()
 {
-    z_strm.zalloc = Z_NULL;
-    z_strm.zfree  = Z_NULL;
-    z_strm.opaque = Z_NULL;
-    deflateInit2(&z_strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY);
-
     curl_global_init(CURL_GLOBAL_SSL);
 
     HASH_INIT(h_, connections, moloch_session_hash, (HASH_CMP_FUNC)moloch_http_conn_cmp);
@@ -798,6 +798,7 @@ LLVMFuzzerInitialize(int *UNUSED(argc), char ***UNUSED(argv))
     moloch_session_init();
     moloch_plugins_load(config.plugins);
     moloch_rules_init();
+    moloch_parsers_classify_init();
     moloch_packet_batch_init(&batch);
     return 0;
 }
@@ -830,7 +831,7 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
 
         // LOG("Packet %llu %d", fuzzloch_sessionid, len);
 
-        MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+        MolochPacket_t *packet = MOLOCH_POOL_ALLOC0(MolochPacket_t);
         packet->pktlen         = len;
         packet->pkt            = ptr;
         packet->ts.tv_sec      = ts >> 4;
@@ -894,6 +895,7 @@ int main(int argc, char **argv)
     moloch_session_init();
     moloch_plugins_load(config.plugins);
     moloch_rules_init();
+    moloch_parsers_classify_init();
     g_timeout_add(1, moloch_ready_gfunc, 0);
 
     g_main_loop_run(mainLoop);
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <unistd.h>
 #define __FAVOR_BSD
@@ -291,6 +292,7 @@ typedef struct {
 #define MOLOCH_LOCK_INIT(var)           pthread_mutex_init(&var##_mutex, NULL)
 #define MOLOCH_LOCK(var)                pthread_mutex_lock(&var##_mutex)
 #define MOLOCH_UNLOCK(var)              pthread_mutex_unlock(&var##_mutex)
+#define MOLOCH_TRYLOCK(var)             pthread_mutex_trylock(&var##_mutex)
 
 #define MOLOCH_COND_DEFINE(var)         pthread_cond_t var##_cond = PTHREAD_COND_INITIALIZER
 #define MOLOCH_COND_EXTERN(var)         pthread_cond_t var##_cond
@@ -304,6 +306,7 @@ typedef struct {
 #define MOLOCH_THREAD_INCRNEW(var)       __sync_add_and_fetch(&var, 1);
 #define MOLOCH_THREAD_INCROLD(var)       __sync_fetch_and_add(&var, 1);
 #define MOLOCH_THREAD_INCR_NUM(var, num) __sync_add_and_fetch(&var, num);
+#define MOLOCH_THREAD_DECRNEW(var)       __sync_sub_and_fetch(&var, 1)
 
 /* You are probably looking here because you think 24 is too low, really it isn't.
  * Instead, increase the number of threads used for reading packets.
@@ -557,11 +560,21 @@ struct moloch_pcap_sf_pkthdr {
 #define MOLOCH_PACKET_TUNNEL_GENEVE     0x80
 // Increase tunnel size below
 
+/* Readers that hand out packets pointing into their own memory attach a ref,
+ * the last moloch_packet_free/moloch_packet_copy of those packets calls release
+ */
+typedef struct molochpacketref_t
+{
+    void         (*release)(struct molochpacketref_t *ref);
+    int            refs;
+} MolochPacketRef_t;
+
 typedef struct molochpacket_t
 {
     struct molochpacket_t   *packet_next, *packet_prev;
     struct timeval ts;                  // timestamp
     uint8_t       *pkt;                 // full packet
+    MolochPacketRef_t *ref;             // reader memory pkt points into, zero copy only
     uint64_t       writerFilePos;       // where in output file
     uint64_t       readerFilePos;       // where in input file
     uint32_t       writerFileNum;       // file number in db
@@ -636,89 +649,108 @@ typedef enum {
 /*
  * SPI Data Storage
  */
+/* Timing wheel entry, see pq.c */
+typedef struct moloch_timer {
+    struct moloch_timer   *tw_next, *tw_prev;
+    uint32_t               expire;
+    uint16_t               slot;
+} MolochTimer_t;
+
+/* Session data that is rarely touched, kept after MolochSession_t in the same
+ * allocation so the per packet work stays within a couple of cache lines
+ */
+typedef struct {
+    MolochParserInfo_t    *parserInfo;
+    char                  *rootId;
+
+    uint32_t               synTime;
+    uint32_t               ackTime;
+
+    uint16_t               tcpFlagCnt[MOLOCH_TCPFLAG_MAX];
+    char                   firstBytes[2][8];
+    uint8_t                firstBytesLen[2];
+    uint8_t                parserLen;
+    uint8_t                parserNum;
+} MolochSessionCold_t;
+
 typedef struct moloch_session {
+    /* Hot, touched for every packet */
     struct moloch_session *tcp_next, *tcp_prev;
     struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
+    MolochSessionCold_t   *cold;
+
+    MolochTcpDataHead_t    tcpData;
+    struct timeval         lastPacket;
+    uint64_t               bytes[2];
+    uint32_t               packets[2];
+    uint32_t               tcpSeq[2];
     uint32_t               h_hash;
+    uint16_t               stopSaving;
+    char                   tcpState[2];
+    uint8_t                mProtocol;
+    uint8_t                thread;
+
+    uint16_t               haveTcpSession:1;
+    uint16_t               needSave:1;
+    uint16_t               stopSPI:1;
+    uint16_t               closingQ:1;
+    uint16_t               stopTCP:1;
+    SessionTypes           ses:3;
+    uint16_t               midSave:1;
+    uint16_t               outOfOrder:2;
+    uint16_t               ackedUnseenSegment:2;
+    uint16_t               stopYara:1;
+    uint16_t               diskOverload:1;
+    uint16_t               pq:1;
+    uint16_t               synSet:2;
+    uint16_t               inStoppedSave:1;
 
+    /* Everything else */
     uint8_t                sessionId[MOLOCH_SESSIONID_LEN];
 
+    MolochTimer_t          timer;
+
     MolochField_t        **fields;
 
     void                  **pluginData;
 
-    MolochParserInfo_t    *parserInfo;
-
-    MolochTcpDataHead_t   tcpData;
-    uint32_t              tcpSeq[2];
-    char                  tcpState[2];
-
     GArray                *filePosArray;
     GArray                *fileLenArray;
     GArray                *fileNumArray;
-    char                  *rootId;
 
     struct timeval         firstPacket;
-    struct timeval         lastPacket;
     struct in6_addr        addr1;
     struct in6_addr        addr2;
-    char                   firstBytes[2][8];
 
-    uint64_t               bytes[2];
     uint64_t               databytes[2];
     uint64_t               totalDatabytes[2];
 
     uint32_t               lastFileNum;
     uint32_t               saveTime;
-    uint32_t               packets[2];
-    uint32_t               synTime;
-    uint32_t               ackTime;
 
     uint16_t               port1;
     uint16_t               port2;
     uint16_t               outstandingQueries;
     uint16_t               segments;
-    uint16_t               stopSaving;
-    uint16_t               tcpFlagCnt[MOLOCH_TCPFLAG_MAX];
     uint16_t               maxFields;
 
     uint8_t                consumed[2];
     uint8_t                ipProtocol;
-    uint8_t                mProtocol;
-    uint8_t                firstBytesLen[2];
     uint8_t                ip_tos;
     uint8_t                tcp_flags;
-    uint8_t                parserLen;
-    uint8_t                parserNum;
     uint8_t                minSaving;
-    uint8_t                thread;
+} __attribute__((aligned(64))) MolochSession_t;
 
-    uint16_t               haveTcpSession:1;
-    uint16_t               needSave:1;
-    uint16_t               stopSPI:1;
-    uint16_t               closingQ:1;
-    uint16_t               stopTCP:1;
-    SessionTypes           ses:3;
-    uint16_t               midSave:1;
-    uint16_t               outOfOrder:2;
-    uint16_t               ackedUnseenSegment:2;
-    uint16_t               stopYara:1;
-    uint16_t               diskOverload:1;
-    uint16_t               pq:1;
-    uint16_t               synSet:2;
-    uint16_t               inStoppedSave:1;
-} MolochSession_t;
+_Static_assert(offsetof(MolochSession_t, sessionId) <= 128, "MolochSession_t hot fields should fit in 2 cache lines");
+
+// One allocation holds the session and then its cold block
+#define MOLOCH_SESSION_ALLOC_SIZE (sizeof(MolochSession_t) + sizeof(MolochSessionCold_t))
 
 typedef struct moloch_session_head {
     struct moloch_session *tcp_next, *tcp_prev;
     struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
     int                    tcp_count;
     int                    q_count;
-    int                    h_count;
 } MolochSessionHead_t;
 
 
@@ -882,6 +914,7 @@ void     moloch_db_add_field(char *group, char *kind, char *expression, char *fr
 void     moloch_db_update_field(char *expression, char *name, char *value);
 void     moloch_db_update_filesize(uint32_t fileid, uint64_t filesize, uint64_t packetsSize, uint32_t packets);
 gboolean moloch_db_file_exists(const char *filename, uint32_t *outputId);
+void moloch_db_file_exists_prefetch(char **filenames, int num);
 void     moloch_db_exit();
 void     moloch_db_oui_lookup(int field, MolochSession_t *session, const uint8_t *mac);
 gchar   *moloch_db_community_id(MolochSession_t *session);
@@ -944,6 +977,7 @@ void moloch_parsers_asn_decode_oid(char *buf, int bufsz, const unsigned char *oi
 uint64_t moloch_parsers_asn_parse_time(MolochSession_t *session, int tag, unsigned char* value, int len);
 void moloch_parsers_classify_tcp(MolochSession_t *session, const unsigned char *data, int remaining, int which);
 void moloch_parsers_classify_udp(MolochSession_t *session, const unsigned char *data, int remaining, int which);
+void moloch_parsers_classify_init();
 void moloch_parsers_exit();
 
 const char *moloch_parsers_magic(MolochSession_t *session, int field, const char *data, int len);
@@ -1003,7 +1037,11 @@ unsigned char *moloch_http_get(void *server, char *key, int key_len, size_t *mle
 void moloch_http_exit();
 int moloch_http_queue_length(void *server);
 uint64_t moloch_http_dropped_count(void *server);
+void moloch_http_compress_stats(void *server, uint64_t *inBytes, uint64_t *outBytes, uint64_t *usecs);
 
+#define MOLOCH_HTTP_COMPRESS_NONE      0
+#define MOLOCH_HTTP_COMPRESS_GZIP      1
+#define MOLOCH_HTTP_COMPRESS_ZSTD      2
 void *moloch_http_create_server(const char *hostnames, int maxConns, int maxOutstandingRequests, int compress);
 void moloch_http_set_retries(void *server, uint16_t retries);
 void moloch_http_set_client_cert(void *serverV, char* clientCert, char* clientKey, char* clientKeyPass);
@@ -1097,6 +1135,8 @@ int      moloch_packet_frags_size();
 uint64_t moloch_packet_dropped_frags();
 uint64_t moloch_packet_dropped_overload();
 uint64_t moloch_packet_total_bytes();
+#define  MOLOCH_PACKET_BATCH_HIST_MAX 12
+void     moloch_packet_batch_hist(uint64_t *hist);
 void     moloch_packet_thread_wake(int thread);
 void     moloch_packet_flush();
 void     moloch_packet_process_data(MolochSession_t *session, const uint8_t *data, int len, int which);
@@ -1105,6 +1145,8 @@ void     moloch_packet_add_packet_ip(char *ipstr, int mode);
 void     moloch_packet_batch_init(MolochPacketBatch_t *batch);
 void     moloch_packet_batch_flush(MolochPacketBatch_t *batch);
 void     moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const packet);
+void     moloch_packet_free(MolochPacket_t *packet);
+void     moloch_packet_copy(MolochPacket_t *packet);
 void     moloch_packet_batch_process(MolochPacketBatch_t * batch, MolochPacket_t * const packet, int thread);
 
 void     moloch_packet_set_dltsnap(int dlt, int snaplen);
@@ -1394,6 +1436,42 @@ void moloch_pq_run(int thread, int max);
 void moloch_pq_free(MolochSession_t *session);
 void moloch_pq_flush(int thread);
 
+#define MOLOCH_TIMEWHEEL_BITS   8
+#define MOLOCH_TIMEWHEEL_SIZE   (1 << MOLOCH_TIMEWHEEL_BITS)
+#define MOLOCH_TIMEWHEEL_LEVELS 4
+
+typedef struct {
+    struct moloch_timer   *tw_next, *tw_prev;
+    int                    tw_count;
+} MolochTimerHead_t;
+
+typedef struct {
+    MolochTimerHead_t      slots[MOLOCH_TIMEWHEEL_LEVELS * MOLOCH_TIMEWHEEL_SIZE];
+    MolochTimerHead_t      expired;
+    uint32_t               levelCount[MOLOCH_TIMEWHEEL_LEVELS];
+    uint32_t               now;
+} MolochTimeWheel_t;
+
+void moloch_timewheel_init(MolochTimeWheel_t *tw, uint32_t now);
+void moloch_timewheel_add(MolochTimeWheel_t *tw, MolochTimer_t *timer, uint32_t expire);
+void moloch_timewheel_del(MolochTimeWheel_t *tw, MolochTimer_t *timer);
+void moloch_timewheel_advance(MolochTimeWheel_t *tw, uint32_t now);
+MolochTimer_t *moloch_timewheel_pop(MolochTimeWheel_t *tw);
+#define moloch_timewheel_expired_count(tw) DLL_COUNT(tw_, &(tw)->expired)
+
+/******************************************************************************/
+/*
+ * pool.c
+ */
+void *moloch_pool_alloc(int size, int zero);
+void  moloch_pool_free(void *mem);
+void  moloch_pool_flush();
+void  moloch_pool_stats(uint64_t *inUse, uint64_t *freeCnt, uint64_t *remoteReturns);
+
+#define MOLOCH_POOL_ALLOC(type)     (type *)(moloch_pool_alloc(sizeof(type), 0))
+#define MOLOCH_POOL_ALLOC0(type)    (type *)(moloch_pool_alloc(sizeof(type), 1))
+#define MOLOCH_POOL_FREE(type,mem)  moloch_pool_free(mem)
+
 /******************************************************************************/
 /*
  * js0n.c
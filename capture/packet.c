@@ -86,22 +86,53 @@ LOCAL  MolochPacketHead_t    packetQ[MOLOCH_MAX_PACKET_THREADS];
 LOCAL  uint32_t              overloadDrops[MOLOCH_MAX_PACKET_THREADS];
 LOCAL  uint32_t              overloadDropTimes[MOLOCH_MAX_PACKET_THREADS];
 
-LOCAL  MOLOCH_LOCK_DEFINE(frags);
+/* Optional lock free packet queues.  Each producer (reader) thread gets its own
+ * single producer/single consumer ring per packet thread, so neither side takes
+ * packetQ[t].lock unless the packet thread is parked waiting for work.
+ */
+#define MOLOCH_MAX_PACKET_PRODUCERS 64
+
+typedef struct {
+    uint32_t               head __attribute__((aligned(64))); // Only written by packet thread
+    uint32_t               tail __attribute__((aligned(64))); // Only written by producer thread
+    uint32_t               mask __attribute__((aligned(64)));
+    MolochPacket_t       **slots;
+} MolochPacketRing_t;
+
+LOCAL  gboolean              packetRings;
+LOCAL  uint32_t              packetRingSize;
+LOCAL  int                   packetRingProducers;
+LOCAL  MolochPacketRing_t   *packetRing[MOLOCH_MAX_PACKET_PRODUCERS][MOLOCH_MAX_PACKET_THREADS];
+LOCAL  __thread int          packetRingProducer = -1;
+LOCAL  int                   packetThreadParked[MOLOCH_MAX_PACKET_THREADS];
+
+LOCAL  uint32_t              packetServiceEvery;
+LOCAL  uint64_t              packetBatchHist[MOLOCH_MAX_PACKET_THREADS][MOLOCH_PACKET_BATCH_HIST_MAX];
 
 LOCAL MolochPacketRC moloch_packet_ip4(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL MolochPacketRC moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL MolochPacketRC moloch_packet_frame_relay(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL MolochPacketRC moloch_packet_ether(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 
+/* Fragments are sharded by the hash of src, dst and id so readers only contend
+ * when they see fragments for the same shard.  Each shard has its own lock, hash
+ * and expire list, and gets an equal part of maxFrags so a busy shard only ever
+ * evicts its own oldest.
+ * The key is src(4) dst(4) id(2) zero padded for ip4 or src(16) dst(16) id(4)
+ * for ip6, with the ip version in the last byte.
+ */
+#define MOLOCH_FRAGS_SHARDS   64
+#define MOLOCH_FRAGS_KEY_LEN  37
+
 typedef struct molochfrags_t {
     struct molochfrags_t  *fragh_next, *fragh_prev;
     struct molochfrags_t  *fragl_next, *fragl_prev;
     uint32_t               fragh_bucket;
     uint32_t               fragh_hash;
     MolochPacketHead_t     packets;
-    char                   key[10];
+    uint8_t                key[MOLOCH_FRAGS_KEY_LEN];
     uint32_t               secs;
-    char                   haveNoFlags;
+    char                   haveLast;
 } MolochFrags_t;
 
 typedef struct {
@@ -112,10 +143,19 @@ typedef struct {
     uint32_t               fragl_count;
 } MolochFragsHead_t;
 
-typedef HASH_VAR(h_, MolochFragsHash_t, MolochFragsHead_t, 199337);
+typedef HASH_VAR(h_, MolochFragsHash_t, MolochFragsHead_t, 3119);
+
+typedef struct {
+    MolochFragsHash_t      hash;
+    MolochFragsHead_t      list;
+    MOLOCH_LOCK_EXTERN(lock);
+} MolochFragsShard_t;
 
-LOCAL MolochFragsHash_t          fragsHash;
-LOCAL MolochFragsHead_t          fragsList;
+LOCAL MolochFragsShard_t         fragsShards[MOLOCH_FRAGS_SHARDS];
+LOCAL int                        fragsCount;
+LOCAL uint32_t                   fragsShardMax;
+LOCAL uint32_t                   fragsSweep;
+LOCAL uint32_t moloch_packet_frag_hash(const void *key);
 
 // These are in network byte order
 LOCAL MolochDropHashGroup_t      packetDrop4;
@@ -127,29 +167,54 @@ LOCAL MolochDropHashGroup_t      packetDrop6S;
 #define IPPROTO_IPV4            4
 #endif
 
+/******************************************************************************/
+LOCAL inline void moloch_packet_unref(MolochPacket_t *packet)
+{
+    MolochPacketRef_t *ref = packet->ref;
+    packet->ref = 0;
+    if (MOLOCH_THREAD_DECRNEW(ref->refs) == 0)
+        ref->release(ref);
+}
 /******************************************************************************/
 void moloch_packet_free(MolochPacket_t *packet)
 {
     if (packet->copied) {
-        free(packet->pkt);
+        moloch_pool_free(packet->pkt);
+    } else if (packet->ref) {
+        moloch_packet_unref(packet);
     }
     packet->pkt = 0;
-    MOLOCH_TYPE_FREE(MolochPacket_t, packet);
+    MOLOCH_POOL_FREE(MolochPacket_t, packet);
+}
+/******************************************************************************/
+// Make sure the packet owns its memory, needed before holding onto it past processing
+void moloch_packet_copy(MolochPacket_t *packet)
+{
+    if (packet->copied)
+        return;
+
+    uint8_t *pkt = moloch_pool_alloc(packet->pktlen, 0);
+    memcpy(pkt, packet->pkt, packet->pktlen);
+    packet->pkt = pkt;
+    packet->copied = 1;
+
+    if (packet->ref)
+        moloch_packet_unref(packet);
 }
 /******************************************************************************/
 void moloch_packet_process_data(MolochSession_t *session, const uint8_t *data, int len, int which)
 {
     int i;
 
-    for (i = 0; i < session->parserNum; i++) {
-        if (session->parserInfo[i].parserFunc) {
-            int consumed = session->parserInfo[i].parserFunc(session, session->parserInfo[i].uw, data, len, which);
+    for (i = 0; i < session->cold->parserNum; i++) {
+        if (session->cold->parserInfo[i].parserFunc) {
+            int consumed = session->cold->parserInfo[i].parserFunc(session, session->cold->parserInfo[i].uw, data, len, which);
             if (consumed) {
                 if (consumed == MOLOCH_PARSER_UNREGISTER) {
-                    if (session->parserInfo[i].parserFreeFunc) {
-                        session->parserInfo[i].parserFreeFunc(session, session->parserInfo[i].uw);
+                    if (session->cold->parserInfo[i].parserFreeFunc) {
+                        session->cold->parserInfo[i].parserFreeFunc(session, session->cold->parserInfo[i].uw);
                     }
-                    memset(&session->parserInfo[i], 0, sizeof(session->parserInfo[i]));
+                    memset(&session->cold->parserInfo[i], 0, sizeof(session->cold->parserInfo[i]));
                     continue;
                 }
                 session->consumed[which] += consumed;
@@ -161,6 +226,28 @@ void moloch_packet_process_data(MolochSession_t *session, const uint8_t *data, i
     }
 }
 /******************************************************************************/
+LOCAL uint32_t moloch_packet_ring_count(int thread)
+{
+    uint32_t count = 0;
+    const int producers = __atomic_load_n(&packetRingProducers, __ATOMIC_ACQUIRE);
+
+    for (int p = 0; p < producers; p++) {
+        MolochPacketRing_t *ring = __atomic_load_n(&packetRing[p][thread], __ATOMIC_ACQUIRE);
+        if (!ring)
+            continue;
+        count += __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+    return count;
+}
+/******************************************************************************/
+/* Number of packets waiting for a packet thread, no matter which queue mode */
+LOCAL uint32_t moloch_packet_queue_count(int thread)
+{
+    if (packetRings)
+        return moloch_packet_ring_count(thread);
+    return DLL_COUNT(packet_, &packetQ[thread]);
+}
+/******************************************************************************/
 void moloch_packet_thread_wake(int thread)
 {
     MOLOCH_LOCK(packetQ[thread].lock);
@@ -180,7 +267,7 @@ void moloch_packet_flush()
 
         for (t = 0; t < config.packetThreads; t++) {
             MOLOCH_LOCK(packetQ[t].lock);
-            if (DLL_COUNT(packet_, &packetQ[t]) > 0) {
+            if (DLL_COUNT(packet_, &packetQ[t]) > 0 || moloch_packet_ring_count(t) > 0 || inProgress[t]) {
                 flushed = 0;
             }
             MOLOCH_UNLOCK(packetQ[t].lock);
@@ -198,8 +285,6 @@ LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
 
     lastPacketSecs[thread] = packet->ts.tv_sec;
 
-    moloch_pq_run(thread, 10);
-
     MolochSession_t     *session;
     struct ip           *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
     struct ip6_hdr      *ip6 = (struct ip6_hdr*)(packet->pkt + packet->ipOffset);
@@ -422,12 +507,35 @@ LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
     }
 }
 /******************************************************************************/
+/* Run the per thread housekeeping that used to happen before every packet,
+ * pq is given the same budget it would have had for that many packets.
+ */
+LOCAL void moloch_packet_thread_service(int thread, uint32_t packets)
+{
+    moloch_session_process_commands(thread);
+    moloch_pq_run(thread, 10 * MAX(packets, 1));
+}
+/******************************************************************************/
 #ifndef FUZZLOCH
+LOCAL void moloch_packet_batch_hist_add(int thread, uint32_t count)
+{
+    int bucket = 31 - __builtin_clz(count);
+    if (bucket >= MOLOCH_PACKET_BATCH_HIST_MAX)
+        bucket = MOLOCH_PACKET_BATCH_HIST_MAX - 1;
+    packetBatchHist[thread][bucket]++;
+}
+/******************************************************************************/
+/* Splice everything waiting in packetQ[thread] into a local list with a single
+ * lock and then process the whole batch unlocked.
+ */
 LOCAL void *moloch_packet_thread(void *threadp)
 {
     int thread = (long)threadp;
     const uint32_t maxPackets75 = config.maxPackets*0.75;
     uint32_t skipCount = 0;
+    MolochPacketHead_t batch;
+
+    DLL_INIT(packet_, &batch);
 
     while (1) {
         MolochPacket_t  *packet;
@@ -435,6 +543,8 @@ LOCAL void *moloch_packet_thread(void *threadp)
         MOLOCH_LOCK(packetQ[thread].lock);
         inProgress[thread] = 0;
         if (DLL_COUNT(packet_, &packetQ[thread]) == 0) {
+            moloch_pool_flush();
+
             struct timespec ts;
             clock_gettime(CLOCK_REALTIME_COARSE, &ts);
             currentTime[thread] = ts.tv_sec;
@@ -449,19 +559,98 @@ LOCAL void *moloch_packet_thread(void *threadp)
                 lastPacketSecs[thread] = ts.tv_sec - 10;
             }
         }
-        inProgress[thread] = 1;
-        DLL_POP_HEAD(packet_, &packetQ[thread], packet);
+        inProgress[thread] = DLL_COUNT(packet_, &packetQ[thread]);
+        if (inProgress[thread] > 0)
+            DLL_PUSH_TAIL_DLL(packet_, &batch, &packetQ[thread]);
         MOLOCH_UNLOCK(packetQ[thread].lock);
 
-        // Only process commands if the packetQ is less then 75% full or every 8 packets
-        if (likely(DLL_COUNT(packet_, &packetQ[thread]) < maxPackets75) || (skipCount & 0x7) == 0) {
-            moloch_session_process_commands(thread);
-            if (!packet)
+        const uint32_t count = DLL_COUNT(packet_, &batch);
+        if (count == 0) {
+            moloch_packet_thread_service(thread, 0);
+            continue;
+        }
+        moloch_packet_batch_hist_add(thread, count);
+
+        uint32_t n = 0;
+        while (DLL_POP_HEAD(packet_, &batch, packet)) {
+            if (n % packetServiceEvery == 0) {
+                // Only process commands if the packetQ is less then 75% full or every 8 times
+                if (likely(DLL_COUNT(packet_, &batch) + DLL_COUNT(packet_, &packetQ[thread]) < maxPackets75) || (skipCount++ & 0x7) == 0) {
+                    moloch_packet_thread_service(thread, MIN(count - n, packetServiceEvery));
+                }
+            }
+            moloch_packet_process(packet, thread);
+            inProgress[thread] = DLL_COUNT(packet_, &batch);
+            n++;
+        }
+    }
+
+    return NULL;
+}
+/******************************************************************************/
+/* Packet thread used when packetRings is set.  Drain every producer ring in
+ * batches of at most a ring size, only parking on the condition variable when
+ * all of them are empty.
+ */
+LOCAL void *moloch_packet_ring_thread(void *threadp)
+{
+    int thread = (long)threadp;
+
+    while (1) {
+        uint32_t processed = 0;
+
+        inProgress[thread] = 1;
+        const int producers = __atomic_load_n(&packetRingProducers, __ATOMIC_ACQUIRE);
+        for (int p = 0; p < producers; p++) {
+            MolochPacketRing_t *ring = __atomic_load_n(&packetRing[p][thread], __ATOMIC_ACQUIRE);
+            if (!ring)
                 continue;
-        } else {
-            skipCount++;
+
+            uint32_t head = ring->head;
+            uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+            if (head == tail)
+                continue;
+
+            moloch_packet_batch_hist_add(thread, tail - head);
+            for (; head != tail; head++) {
+                moloch_packet_process(ring->slots[head & ring->mask], thread);
+                processed++;
+                if (processed % packetServiceEvery == 0)
+                    moloch_packet_thread_service(thread, packetServiceEvery);
+            }
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        }
+
+        moloch_packet_thread_service(thread, processed % packetServiceEvery);
+
+        if (processed)
+            continue;
+
+        moloch_pool_flush();
+
+        MOLOCH_LOCK(packetQ[thread].lock);
+        inProgress[thread] = 0;
+        __atomic_store_n(&packetThreadParked[thread], 1, __ATOMIC_SEQ_CST);
+
+        // Pairs with the fence in moloch_packet_ring_flush, either we see the
+        // new tail or the producer sees us parked and signals
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (moloch_packet_ring_count(thread) == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+            currentTime[thread] = ts.tv_sec;
+            ts.tv_sec++;
+            MOLOCH_COND_TIMEDWAIT(packetQ[thread].lock, ts);
+
+            // Same live capture idle handling as moloch_packet_thread
+            if (!config.pcapReadOffline && moloch_packet_ring_count(thread) == 0 && ts.tv_sec - 10 > lastPacketSecs[thread]) {
+                lastPacketSecs[thread] = ts.tv_sec - 10;
+            }
         }
-        moloch_packet_process(packet, thread);
+
+        __atomic_store_n(&packetThreadParked[thread], 0, __ATOMIC_SEQ_CST);
+        MOLOCH_UNLOCK(packetQ[thread].lock);
     }
 
     return NULL;
@@ -503,65 +692,98 @@ LOCAL void moloch_packet_save_unknown_packet(int type, MolochPacket_t * const pa
 }
 
 /******************************************************************************/
-void moloch_packet_frags_free(MolochFrags_t * const frags)
+void moloch_packet_frags_free(MolochFragsShard_t * const shard, MolochFrags_t * const frags)
 {
     MolochPacket_t *packet;
 
     while (DLL_POP_HEAD(packet_, &frags->packets, packet)) {
         moloch_packet_free(packet);
     }
-    HASH_REMOVE(fragh_, fragsHash, frags);
-    DLL_REMOVE(fragl_, &fragsList, frags);
+    HASH_REMOVE(fragh_, shard->hash, frags);
+    DLL_REMOVE(fragl_, &shard->list, frags);
     MOLOCH_TYPE_FREE(MolochFrags_t, frags);
+    MOLOCH_THREAD_DECRNEW(fragsCount);
+}
+/******************************************************************************/
+SUPPRESS_ALIGNMENT
+LOCAL void moloch_packet_frag_key(const MolochPacket_t * const packet, uint8_t *key)
+{
+    if (packet->v6) {
+        const struct ip6_hdr *ip6 = (struct ip6_hdr *)(packet->pkt + packet->ipOffset);
+        memcpy(key, &ip6->ip6_src, 16);
+        memcpy(key+16, &ip6->ip6_dst, 16);
+        memcpy(key+32, packet->pkt + packet->payloadOffset - 4, 4);
+        key[36] = 6;
+    } else {
+        const struct ip *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+        memset(key, 0, MOLOCH_FRAGS_KEY_LEN);
+        memcpy(key, &ip4->ip_src.s_addr, 4);
+        memcpy(key+4, &ip4->ip_dst.s_addr, 4);
+        memcpy(key+8, &ip4->ip_id, 2);
+        key[36] = 4;
+    }
+}
+/******************************************************************************/
+// Offset of fragment in 8 byte units, the ip6 fragment header is right before the payload
+SUPPRESS_ALIGNMENT
+LOCAL inline int moloch_packet_frag_off(const MolochPacket_t * const packet)
+{
+    if (packet->v6) {
+        const uint8_t *fraghdr = packet->pkt + packet->payloadOffset - 8;
+        return ((fraghdr[2] << 8) | fraghdr[3]) >> 3;
+    }
+    const struct ip *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+    return ntohs(ip4->ip_off) & IP_OFFMASK;
+}
+/******************************************************************************/
+SUPPRESS_ALIGNMENT
+LOCAL inline int moloch_packet_frag_last(const MolochPacket_t * const packet)
+{
+    if (packet->v6) {
+        return (packet->pkt[packet->payloadOffset - 5] & 0x01) == 0;
+    }
+    const struct ip *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+    return (ntohs(ip4->ip_off) & ~IP_OFFMASK) == 0;
 }
 /******************************************************************************/
 SUPPRESS_ALIGNMENT
-LOCAL gboolean moloch_packet_frags_process(MolochPacket_t * const packet)
+LOCAL gboolean moloch_packet_frags_process(MolochFragsShard_t * const shard, MolochPacket_t * const packet, const uint8_t *key)
 {
     MolochPacket_t * fpacket;
     MolochFrags_t   *frags;
-    char             key[10];
-
-    struct ip * const ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
-    memcpy(key, &ip4->ip_src.s_addr, 4);
-    memcpy(key+4, &ip4->ip_dst.s_addr, 4);
-    memcpy(key+8, &ip4->ip_id, 2);
 
-    HASH_FIND(fragh_, fragsHash, key, frags);
+    HASH_FIND(fragh_, shard->hash, key, frags);
 
     if (!frags) {
         frags = MOLOCH_TYPE_ALLOC0(MolochFrags_t);
-        memcpy(frags->key, key, 10);
+        memcpy(frags->key, key, MOLOCH_FRAGS_KEY_LEN);
         frags->secs = packet->ts.tv_sec;
-        HASH_ADD(fragh_, fragsHash, key, frags);
-        DLL_PUSH_TAIL(fragl_, &fragsList, frags);
+        HASH_ADD(fragh_, shard->hash, key, frags);
+        DLL_PUSH_TAIL(fragl_, &shard->list, frags);
         DLL_INIT(packet_, &frags->packets);
         DLL_PUSH_TAIL(packet_, &frags->packets, packet);
 
-        if (DLL_COUNT(fragl_, &fragsList) > config.maxFrags) {
-            droppedFrags++;
-            moloch_packet_frags_free(DLL_PEEK_HEAD(fragl_, &fragsList));
+        // Over this shard's part of maxFrags, drop its oldest
+        MOLOCH_THREAD_INCR(fragsCount);
+        if (DLL_COUNT(fragl_, &shard->list) > fragsShardMax) {
+            MOLOCH_THREAD_INCR(droppedFrags);
+            moloch_packet_frags_free(shard, DLL_PEEK_HEAD(fragl_, &shard->list));
         }
         return FALSE;
     } else {
-        DLL_MOVE_TAIL(fragl_, &fragsList, frags);
+        DLL_MOVE_TAIL(fragl_, &shard->list, frags);
     }
 
-    uint16_t          ip_off = ntohs(ip4->ip_off);
-    uint16_t          ip_flags = ip_off & ~IP_OFFMASK;
-    ip_off &= IP_OFFMASK;
-
+    const int frag_off = moloch_packet_frag_off(packet);
 
-    // we might be done once we receive the packets with no flags
-    if (ip_flags == 0) {
-        frags->haveNoFlags = 1;
+    // we might be done once we receive the last fragment
+    if (moloch_packet_frag_last(packet)) {
+        frags->haveLast = 1;
     }
 
     // Insert this packet in correct location sorted by offset
     DLL_FOREACH_REVERSE(packet_, &frags->packets, fpacket) {
-        struct ip *fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
-        if (ip_off >= fip_off) {
+        if (frag_off >= moloch_packet_frag_off(fpacket)) {
             DLL_ADD_AFTER(packet_, &frags->packets, fpacket, packet);
             break;
         }
@@ -571,23 +793,21 @@ LOCAL gboolean moloch_packet_frags_process(MolochPacket_t * const packet)
     }
 
     if (DLL_COUNT(packet_, &frags->packets) > 50) {
-        droppedFrags++;
-        moloch_packet_frags_free(frags);
+        MOLOCH_THREAD_INCR(droppedFrags);
+        moloch_packet_frags_free(shard, frags);
         return FALSE;
     }
 
-    // Don't bother checking until we get a packet with no flags
-    if (!frags->haveNoFlags) {
+    // Don't bother checking until we get the last fragment
+    if (!frags->haveLast) {
         return FALSE;
     }
 
     int off = 0;
-    struct ip *fip4;
 
     int payloadLen = 0;
     DLL_FOREACH(packet_, &frags->packets, fpacket) {
-        fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
+        int fip_off = moloch_packet_frag_off(fpacket);
         if (fip_off != off)
             break;
         off += fpacket->payloadLen/8;
@@ -598,69 +818,102 @@ LOCAL gboolean moloch_packet_frags_process(MolochPacket_t * const packet)
         return FALSE;
     }
 
+    // Everything before the payload is kept, except the ip6 fragment header
+    const int hdrLen = packet->v6 ? packet->payloadOffset - 8 : packet->payloadOffset;
+
     // Packet is too large, hacker
-    if (payloadLen + packet->payloadOffset >= MOLOCH_PACKET_MAX_LEN) {
-        droppedFrags++;
-        moloch_packet_frags_free(frags);
+    if (payloadLen + hdrLen >= MOLOCH_PACKET_MAX_LEN) {
+        MOLOCH_THREAD_INCR(droppedFrags);
+        moloch_packet_frags_free(shard, frags);
         return FALSE;
     }
 
     // Now alloc the full packet
-    packet->pktlen = packet->payloadOffset + payloadLen;
-    uint8_t *pkt = malloc(packet->pktlen);
+    packet->pktlen = hdrLen + payloadLen;
+    uint8_t *pkt = moloch_pool_alloc(packet->pktlen, 0);
 
     // Copy packet header
-    memcpy(pkt, packet->pkt, packet->payloadOffset);
+    memcpy(pkt, packet->pkt, hdrLen);
 
     // Fix header of new packet
-    fip4 = (struct ip*)(pkt + packet->ipOffset);
-    fip4->ip_len = htons(payloadLen + 4*ip4->ip_hl);
-    fip4->ip_off = 0;
+    if (packet->v6) {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)(pkt + packet->ipOffset);
+        ip6->ip6_plen = htons(hdrLen - packet->ipOffset - sizeof(struct ip6_hdr) + payloadLen);
+
+        // Whatever header pointed at the fragment header now points at what it carried
+        int nxtPos = packet->ipOffset + 6;
+        int pos = packet->ipOffset + sizeof(struct ip6_hdr);
+        while (pos < hdrLen) {
+            const int type = pkt[nxtPos];
+            nxtPos = pos;
+            // AH counts its length in 4 byte units minus 2, the others in 8 byte units minus 1
+            if (type == IPPROTO_AH)
+                pos += (pkt[pos+1] + 2) << 2;
+            else
+                pos += (pkt[pos+1] + 1) << 3;
+        }
+        pkt[nxtPos] = packet->pkt[packet->payloadOffset - 8];
+    } else {
+        struct ip *fip4 = (struct ip*)(pkt + packet->ipOffset);
+        fip4->ip_len = htons(payloadLen + 4*fip4->ip_hl);
+        fip4->ip_off = 0;
+    }
 
     // Copy payload
     DLL_FOREACH(packet_, &frags->packets, fpacket) {
-        fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
+        int fip_off = moloch_packet_frag_off(fpacket);
 
-        if (packet->payloadOffset+(fip_off*8) + fpacket->payloadLen <= packet->pktlen)
-            memcpy(pkt+packet->payloadOffset+(fip_off*8), fpacket->pkt+fpacket->payloadOffset, fpacket->payloadLen);
+        if (hdrLen+(fip_off*8) + fpacket->payloadLen <= packet->pktlen)
+            memcpy(pkt+hdrLen+(fip_off*8), fpacket->pkt+fpacket->payloadOffset, fpacket->payloadLen);
         else
-            LOG("WARNING - Not enough room for frag %d > %d", packet->payloadOffset+(fip_off*8) + fpacket->payloadLen, packet->pktlen);
+            LOG("WARNING - Not enough room for frag %d > %d", hdrLen+(fip_off*8) + fpacket->payloadLen, packet->pktlen);
     }
 
     // Set all the vars in the current packet to new defraged packet
     if (packet->copied)
-        free(packet->pkt);
+        moloch_pool_free(packet->pkt);
     packet->pkt = pkt;
     packet->copied = 1;
     packet->wasfrag = 1;
     packet->payloadLen = payloadLen;
     DLL_REMOVE(packet_, &frags->packets, packet); // Remove from list so we don't get freed in frags_free
-    moloch_packet_frags_free(frags);
+    moloch_packet_frags_free(shard, frags);
     return TRUE;
 }
 /******************************************************************************/
-LOCAL void moloch_packet_frags4(MolochPacketBatch_t *batch, MolochPacket_t * const packet)
+LOCAL void moloch_packet_frags_expire(MolochFragsShard_t * const shard, uint32_t now)
 {
     MolochFrags_t *frags;
 
-    // ALW - Should change frags_process to make the copy when needed
-    if (!packet->copied) {
-        uint8_t *pkt = malloc(packet->pktlen);
-        memcpy(pkt, packet->pkt, packet->pktlen);
-        packet->pkt = pkt;
-        packet->copied = 1;
+    while ((frags = DLL_PEEK_HEAD(fragl_, &shard->list)) && (frags->secs + config.fragsTimeout < now)) {
+        MOLOCH_THREAD_INCR(droppedFrags);
+        moloch_packet_frags_free(shard, frags);
     }
+}
+/******************************************************************************/
+LOCAL void moloch_packet_frags(MolochPacketBatch_t *batch, MolochPacket_t * const packet)
+{
+    uint8_t key[MOLOCH_FRAGS_KEY_LEN];
 
-    MOLOCH_LOCK(frags);
-    // Remove expired entries
-    while ((frags = DLL_PEEK_HEAD(fragl_, &fragsList)) && (frags->secs + config.fragsTimeout < packet->ts.tv_sec)) {
-        droppedFrags++;
-        moloch_packet_frags_free(frags);
-    }
+    // ALW - Should change frags_process to make the copy when needed
+    moloch_packet_copy(packet);
+
+    moloch_packet_frag_key(packet, key);
+    MolochFragsShard_t *shard = &fragsShards[(moloch_packet_frag_hash(key) >> 16) & (MOLOCH_FRAGS_SHARDS - 1)];
 
-    gboolean process = moloch_packet_frags_process(packet);
-    MOLOCH_UNLOCK(frags);
+    MOLOCH_LOCK(shard->lock);
+    moloch_packet_frags_expire(shard, packet->ts.tv_sec);
+    gboolean process = moloch_packet_frags_process(shard, packet, key);
+    MOLOCH_UNLOCK(shard->lock);
+
+    /* Sweep one other shard each time so idle shards still expire.
+     * Never wait on it, someone else is already working there.
+     */
+    MolochFragsShard_t *other = &fragsShards[__sync_fetch_and_add(&fragsSweep, 1) & (MOLOCH_FRAGS_SHARDS - 1)];
+    if (other != shard && MOLOCH_TRYLOCK(other->lock) == 0) {
+        moloch_packet_frags_expire(other, packet->ts.tv_sec);
+        MOLOCH_UNLOCK(other->lock);
+    }
 
     if (process)
         moloch_packet_batch(batch, packet);
@@ -668,7 +921,7 @@ LOCAL void moloch_packet_frags4(MolochPacketBatch_t *batch, MolochPacket_t * con
 /******************************************************************************/
 int moloch_packet_frags_size()
 {
-    return DLL_COUNT(fragl_, &fragsList);
+    return fragsCount;
 }
 /******************************************************************************/
 int moloch_packet_frags_outstanding()
@@ -782,7 +1035,7 @@ LOCAL MolochPacketRC moloch_packet_ip4(MolochPacketBatch_t *batch, MolochPacket_
 
 
     if ((ip_flags & IP_MF) || ip_off > 0) {
-        moloch_packet_frags4(batch, packet);
+        moloch_packet_frags(batch, packet);
         return MOLOCH_PACKET_DONT_PROCESS_OR_FREE;
     }
 
@@ -968,11 +1221,35 @@ LOCAL MolochPacketRC moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket
             }
 
             break;
-        case IPPROTO_FRAGMENT:
+        case IPPROTO_FRAGMENT: {
+            if (len < ip_hdr_len + 8) {
 #ifdef DEBUG_PACKET
-            LOG("ERROR - Don't support ip6 fragements yet!");
+                LOG("ERROR - %d < %d + 8", len, ip_hdr_len);
 #endif
-            return MOLOCH_PACKET_UNKNOWN;
+                return MOLOCH_PACKET_CORRUPT;
+            }
+            const uint8_t *fraghdr = data + ip_hdr_len;
+            nxt = fraghdr[0];
+            ip_hdr_len += 8;
+
+            packet->payloadOffset = packet->ipOffset + ip_hdr_len;
+
+            if (ip_len + (int)sizeof(struct ip6_hdr) < ip_hdr_len) {
+                return MOLOCH_PACKET_CORRUPT;
+            }
+            packet->payloadLen = ip_len + sizeof(struct ip6_hdr) - ip_hdr_len;
+
+            if (packet->pktlen < packet->payloadOffset + packet->payloadLen) {
+                return MOLOCH_PACKET_CORRUPT;
+            }
+
+            // Atomic fragment with offset 0 and no more fragments, just keep parsing
+            if ((((fraghdr[2] << 8) | fraghdr[3]) & 0xfff9) == 0)
+                break;
+
+            moloch_packet_frags(batch, packet);
+            return MOLOCH_PACKET_DONT_PROCESS_OR_FREE;
+        }
 
         case IPPROTO_TCP:
             if (len < ip_hdr_len + (int)sizeof(struct tcphdr)) {
@@ -1254,10 +1531,91 @@ void moloch_packet_batch_init(MolochPacketBatch_t *batch)
     batch->count = 0;
 }
 /******************************************************************************/
+LOCAL void moloch_packet_overload_drop(uint32_t thread, MolochPacket_t * const packet)
+{
+    MOLOCH_LOCK(packetQ[thread].lock);
+    overloadDrops[thread]++;
+    if ((overloadDrops[thread] % 10000) == 1 && (overloadDropTimes[thread] + 60) < packet->ts.tv_sec) {
+        overloadDropTimes[thread] = packet->ts.tv_sec;
+        LOG("WARNING - Packet Q %u is overflowing, total dropped so far %u.  See https://arkime.com/faq#why-am-i-dropping-packets and modify %s", thread, overloadDrops[thread], config.configFile);
+    }
+    MOLOCH_COND_SIGNAL(packetQ[thread].lock);
+    MOLOCH_UNLOCK(packetQ[thread].lock);
+    MOLOCH_THREAD_INCR(packetStats[MOLOCH_PACKET_DO_PROCESS]);
+    moloch_packet_free(packet);
+}
+/******************************************************************************/
+/* The first time a thread flushes in packetRings mode it gets its own set of
+ * rings, one per packet thread, so each ring only ever has a single producer.
+ */
+LOCAL int moloch_packet_ring_producer()
+{
+    if (likely(packetRingProducer != -1))
+        return packetRingProducer;
+
+    int p = __sync_fetch_and_add(&packetRingProducers, 1);
+    if (p >= MOLOCH_MAX_PACKET_PRODUCERS)
+        LOGEXIT("ERROR - Only %d threads can add packets with packetRings set", MOLOCH_MAX_PACKET_PRODUCERS);
+
+    for (int t = 0; t < config.packetThreads; t++) {
+        MolochPacketRing_t *ring;
+        if (posix_memalign((void **)&ring, 64, sizeof(MolochPacketRing_t)))
+            LOGEXIT("ERROR - Couldn't allocate packet ring");
+        memset(ring, 0, sizeof(MolochPacketRing_t));
+        ring->mask = packetRingSize - 1;
+        ring->slots = malloc(packetRingSize * sizeof(MolochPacket_t *));
+        __atomic_store_n(&packetRing[p][t], ring, __ATOMIC_RELEASE);
+    }
+
+    packetRingProducer = p;
+    return p;
+}
+/******************************************************************************/
+LOCAL void moloch_packet_ring_flush(MolochPacketBatch_t *batch)
+{
+    const int producer = moloch_packet_ring_producer();
+    MolochPacket_t *packet;
+
+    for (int t = 0; t < config.packetThreads; t++) {
+        if (DLL_COUNT(packet_, &batch->packetQ[t]) == 0)
+            continue;
+
+        MolochPacketRing_t *ring = packetRing[producer][t];
+        uint32_t tail = ring->tail;
+        uint32_t avail = packetRingSize - (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+
+        while (avail > 0 && DLL_POP_HEAD(packet_, &batch->packetQ[t], packet)) {
+            ring->slots[tail & ring->mask] = packet;
+            tail++;
+            avail--;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        // Ring is full, same accounting as the locked queue overflowing
+        while (DLL_POP_HEAD(packet_, &batch->packetQ[t], packet)) {
+            moloch_packet_overload_drop(t, packet);
+        }
+
+        // Pairs with the store in moloch_packet_ring_thread, only lock if it might be parked
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&packetThreadParked[t], __ATOMIC_SEQ_CST)) {
+            MOLOCH_LOCK(packetQ[t].lock);
+            MOLOCH_COND_SIGNAL(packetQ[t].lock);
+            MOLOCH_UNLOCK(packetQ[t].lock);
+        }
+    }
+    batch->count = 0;
+}
+/******************************************************************************/
 void moloch_packet_batch_flush(MolochPacketBatch_t *batch)
 {
     int t;
 
+    if (packetRings) {
+        moloch_packet_ring_flush(batch);
+        return;
+    }
+
     for (t = 0; t < config.packetThreads; t++) {
         if (DLL_COUNT(packet_, &batch->packetQ[t]) > 0) {
             MOLOCH_LOCK(packetQ[t].lock);
@@ -1379,29 +1737,18 @@ void moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const pac
 
     totalBytes[thread] += packet->pktlen;
 
+    // In packetRings mode the packetQ is always empty, overflow is handled when flushing
     if (DLL_COUNT(packet_, &packetQ[thread]) >= config.maxPacketsInQueue) {
-        MOLOCH_LOCK(packetQ[thread].lock);
-        overloadDrops[thread]++;
-        if ((overloadDrops[thread] % 10000) == 1 && (overloadDropTimes[thread] + 60) < packet->ts.tv_sec) {
-            overloadDropTimes[thread] = packet->ts.tv_sec;
-            LOG("WARNING - Packet Q %u is overflowing, total dropped so far %u.  See https://arkime.com/faq#why-am-i-dropping-packets and modify %s", thread, overloadDrops[thread], config.configFile);
-        }
-        MOLOCH_COND_SIGNAL(packetQ[thread].lock);
-        MOLOCH_UNLOCK(packetQ[thread].lock);
-        MOLOCH_THREAD_INCR(packetStats[rc]);
-        moloch_packet_free(packet);
+        moloch_packet_overload_drop(thread, packet);
         return;
     }
 
-    if (!packet->copied) {
-        uint8_t *pkt = malloc(packet->pktlen);
-        memcpy(pkt, packet->pkt, packet->pktlen);
-        packet->pkt = pkt;
-        packet->copied = 1;
-    }
+    // Zero copy readers keep the memory around until the last ref is dropped
+    if (!packet->ref)
+        moloch_packet_copy(packet);
 
 #ifdef FUZZLOCH
-    moloch_session_process_commands(thread);
+    moloch_packet_thread_service(thread, 1);
     moloch_packet_process(packet, thread);
 #else
     DLL_PUSH_TAIL(packet_, &batch->packetQ[thread], packet);
@@ -1415,7 +1762,7 @@ int moloch_packet_outstanding()
     int t;
 
     for (t = 0; t < config.packetThreads; t++) {
-        count += DLL_COUNT(packet_, &packetQ[t]);
+        count += moloch_packet_queue_count(t);
         count += inProgress[t];
     }
     return count;
@@ -1426,7 +1773,7 @@ LOCAL uint32_t moloch_packet_frag_hash(const void *key)
 {
     int i;
     uint32_t n = 0;
-    for (i = 0; i < 10; i++) {
+    for (i = 0; i < MOLOCH_FRAGS_KEY_LEN; i++) {
         n = (n << 5) - n + ((unsigned char*)key)[i];
     }
     return n;
@@ -1434,7 +1781,7 @@ LOCAL uint32_t moloch_packet_frag_hash(const void *key)
 /******************************************************************************/
 LOCAL int moloch_packet_frag_cmp(const void *keyv, const MolochFrags_t *element)
 {
-    return memcmp(keyv, element->key, 10) == 0;
+    return memcmp(keyv, element->key, MOLOCH_FRAGS_KEY_LEN) == 0;
 }
 /******************************************************************************/
 LOCAL gboolean moloch_packet_save_drophash(gpointer UNUSED(user_data))
@@ -1741,6 +2088,10 @@ void moloch_packet_init()
         "fieldECS", "network.community_id",
         (char *)NULL);
 
+    packetRings = moloch_config_boolean(NULL, "packetRings", FALSE);
+    packetRingSize = moloch_get_next_powerof2(moloch_config_int(NULL, "packetRingSize", 0x10000, 0x400, 0x400000));
+    packetServiceEvery = moloch_config_int(NULL, "packetThreadServiceEvery", 32, 1, 0x10000);
+
     int t;
     for (t = 0; t < config.packetThreads; t++) {
         char name[100];
@@ -1749,12 +2100,16 @@ void moloch_packet_init()
         MOLOCH_COND_INIT(packetQ[t].lock);
         snprintf(name, sizeof(name), "moloch-pkt%d", t);
 #ifndef FUZZLOCH
-        g_thread_unref(g_thread_new(name, &moloch_packet_thread, (gpointer)(long)t));
+        g_thread_unref(g_thread_new(name, packetRings ? &moloch_packet_ring_thread : &moloch_packet_thread, (gpointer)(long)t));
 #endif
     }
 
-    HASH_INIT(fragh_, fragsHash, moloch_packet_frag_hash, (HASH_CMP_FUNC)moloch_packet_frag_cmp);
-    DLL_INIT(fragl_, &fragsList);
+    fragsShardMax = (config.maxFrags + MOLOCH_FRAGS_SHARDS - 1) / MOLOCH_FRAGS_SHARDS;
+    for (t = 0; t < MOLOCH_FRAGS_SHARDS; t++) {
+        HASH_INIT(fragh_, fragsShards[t].hash, moloch_packet_frag_hash, (HASH_CMP_FUNC)moloch_packet_frag_cmp);
+        DLL_INIT(fragl_, &fragsShards[t].list);
+        MOLOCH_LOCK_INIT(fragsShards[t].lock);
+    }
 
     moloch_add_can_quit(moloch_packet_outstanding, "packet outstanding");
     moloch_add_can_quit(moloch_packet_frags_outstanding, "packet frags outstanding");
@@ -1793,6 +2148,18 @@ uint64_t moloch_packet_dropped_overload()
     return count;
 }
 /******************************************************************************/
+/* Cumulative count of packet thread batches by size, bucket i holds sizes [2^i, 2^(i+1)) */
+void moloch_packet_batch_hist(uint64_t *hist)
+{
+    memset(hist, 0, sizeof(uint64_t) * MOLOCH_PACKET_BATCH_HIST_MAX);
+
+    for (int t = 0; t < config.packetThreads; t++) {
+        for (int b = 0; b < MOLOCH_PACKET_BATCH_HIST_MAX; b++) {
+            hist[b] += packetBatchHist[t][b];
+        }
+    }
+}
+/******************************************************************************/
 uint64_t moloch_packet_total_bytes()
 {
     uint64_t count = 0;
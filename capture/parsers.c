@@ -37,6 +37,9 @@ enum MolochMagicMode { MOLOCH_MAGICMODE_LIBMAGIC, MOLOCH_MAGICMODE_BOTH, MOLOCH_
 
 LOCAL enum MolochMagicMode magicMode;
 
+LOCAL gboolean             classifierProfile;
+LOCAL void moloch_parsers_classifier_profile_log();
+
 /******************************************************************************/
 #define MAGIC_MATCH(offset, needle) memcmp(data+offset, needle, sizeof(needle)-1) == 0
 #define MAGIC_MATCH_LEN(offset, needle) ((len > (int)sizeof(needle)-1+offset) && (memcmp(data+offset, needle, sizeof(needle)-1) == 0))
@@ -601,6 +604,8 @@ LOCAL int cstring_cmp(const void *a, const void *b)
 /******************************************************************************/
 void moloch_parsers_init()
 {
+    classifierProfile = moloch_config_boolean(NULL, "classifierProfile", FALSE);
+
     if (config.nodeClass)
         snprintf(classTag, sizeof(classTag), "class:%s", config.nodeClass);
 
@@ -841,6 +846,9 @@ void moloch_parsers_init()
 }
 /******************************************************************************/
 void moloch_parsers_exit() {
+    if (classifierProfile)
+        moloch_parsers_classifier_profile_log();
+
     if (magicMode == MOLOCH_MAGICMODE_LIBMAGIC || magicMode == MOLOCH_MAGICMODE_BOTH) {
         int t;
         for (t = 0; t < config.packetThreads; t++) {
@@ -875,40 +883,40 @@ char *moloch_sprint_hex_string(char *buf, const unsigned char* data, unsigned in
 /******************************************************************************/
 void  moloch_parsers_register2(MolochSession_t *session, MolochParserFunc func, void *uw, MolochParserFreeFunc ffunc, MolochParserSaveFunc sfunc)
 {
-    if (session->parserNum > 30) {
+    if (session->cold->parserNum > 30) {
         char ipStr[200];
         moloch_session_pretty_string(session, ipStr, sizeof(ipStr));
-        LOG("WARNING - Too many parsers registered: %d %s", session->parserNum, ipStr);
+        LOG("WARNING - Too many parsers registered: %d %s", session->cold->parserNum, ipStr);
         return;
     }
 
-    if (session->parserNum >= session->parserLen) {
-        if (session->parserLen == 0) {
-            session->parserLen = 2;
+    if (session->cold->parserNum >= session->cold->parserLen) {
+        if (session->cold->parserLen == 0) {
+            session->cold->parserLen = 2;
         } else {
-            session->parserLen *= 1.67;
+            session->cold->parserLen *= 1.67;
         }
-        session->parserInfo = realloc(session->parserInfo, sizeof(MolochParserInfo_t) * session->parserLen);
+        session->cold->parserInfo = realloc(session->cold->parserInfo, sizeof(MolochParserInfo_t) * session->cold->parserLen);
     }
 
-    session->parserInfo[session->parserNum].parserFunc     = func;
-    session->parserInfo[session->parserNum].uw             = uw;
-    session->parserInfo[session->parserNum].parserFreeFunc = ffunc;
-    session->parserInfo[session->parserNum].parserSaveFunc = sfunc;
+    session->cold->parserInfo[session->cold->parserNum].parserFunc     = func;
+    session->cold->parserInfo[session->cold->parserNum].uw             = uw;
+    session->cold->parserInfo[session->cold->parserNum].parserFreeFunc = ffunc;
+    session->cold->parserInfo[session->cold->parserNum].parserSaveFunc = sfunc;
 
-    session->parserNum++;
+    session->cold->parserNum++;
 }
 /******************************************************************************/
 void  moloch_parsers_unregister(MolochSession_t *session, void *uw)
 {
     int i;
-    for (i = 0; i < session->parserNum; i++) {
-        if (session->parserInfo[i].uw == uw && session->parserInfo[i].parserFunc != 0) {
-            if (session->parserInfo[i].parserFreeFunc) {
-                session->parserInfo[i].parserFreeFunc(session, uw);
+    for (i = 0; i < session->cold->parserNum; i++) {
+        if (session->cold->parserInfo[i].uw == uw && session->cold->parserInfo[i].parserFunc != 0) {
+            if (session->cold->parserInfo[i].parserFreeFunc) {
+                session->cold->parserInfo[i].parserFreeFunc(session, uw);
             }
 
-            memset(&session->parserInfo[i], 0, sizeof(session->parserInfo[i]));
+            memset(&session->cold->parserInfo[i], 0, sizeof(session->cold->parserInfo[i]));
             break;
         }
     }
@@ -923,6 +931,9 @@ typedef struct moloch_classify_t
     int                  matchlen;
     int                  minlen;
     MolochClassifyFunc   func;
+    int                  pos;       // Registration order, matches are called in this order
+    uint64_t             hits;
+    uint64_t             nanos;
 } MolochClassify_t;
 
 typedef struct
@@ -932,23 +943,53 @@ typedef struct
     short               cnt;
 } MolochClassifyHead_t;
 
-LOCAL MolochClassifyHead_t classifersTcp0;
-LOCAL MolochClassifyHead_t classifersTcp1[256];
-LOCAL MolochClassifyHead_t classifersTcp2[256][256];
+/* The byte classifiers are compiled into one anchored automaton, each state is
+ * the set of classifiers still matching after that many bytes.  Bytes that
+ * no classifier at that depth looks at all go to def.
+ */
+typedef struct
+{
+    uint32_t            *table;     // All 256 next states, only for states with lots of bytes
+    uint8_t             *bytes;
+    uint32_t            *next;
+    uint32_t             def;
+    uint16_t             numBytes;
+    uint16_t             numOut;
+    MolochClassify_t   **out;       // Classifiers that fully match on reaching this state
+} MolochClassifyState_t;
+
+typedef struct
+{
+    MolochClassifyState_t *states;  // 0 is dead, 1 is the start
+    uint32_t               numStates;
+    int                    maxDepth;
+} MolochClassifyMatcher_t;
+
+#define MOLOCH_CLASSIFY_MAX_STATES 100000
+#define MOLOCH_CLASSIFY_TABLE_MIN  8
+#define MOLOCH_CLASSIFY_MAX_FOUND  256
+
+LOCAL MolochClassifyHead_t classifersTcp;
 LOCAL MolochClassifyHead_t classifersTcpPortSrc[0x10000];
 LOCAL MolochClassifyHead_t classifersTcpPortDst[0x10000];
+LOCAL MolochClassifyMatcher_t *classifersTcpMatcher;
+LOCAL int                  classifersTcpDirty;
 
-LOCAL MolochClassifyHead_t classifersUdp0;
-LOCAL MolochClassifyHead_t classifersUdp1[256];
-LOCAL MolochClassifyHead_t classifersUdp2[256][256];
+LOCAL MolochClassifyHead_t classifersUdp;
 LOCAL MolochClassifyHead_t classifersUdpPortSrc[0x10000];
 LOCAL MolochClassifyHead_t classifersUdpPortDst[0x10000];
+LOCAL MolochClassifyMatcher_t *classifersUdpMatcher;
+LOCAL int                  classifersUdpDirty;
+
+LOCAL MolochClassifyHead_t classifersAll;
+LOCAL MOLOCH_LOCK_DEFINE(classifers);
+LOCAL gboolean             classifersCompiled;
 
 /******************************************************************************/
-void moloch_parsers_classifier_add(MolochClassifyHead_t *ch, MolochClassify_t *c)
+LOCAL int moloch_parsers_classifier_push(MolochClassifyHead_t *ch, MolochClassify_t *c, int checkDup)
 {
     int i;
-    for (i = 0; i < ch->cnt; i++) {
+    for (i = 0; checkDup && i < ch->cnt; i++) {
         if (ch->arr[i]->offset == c->offset &&
             ch->arr[i]->func == c->func &&
             c->matchlen == ch->arr[i]->matchlen &&
@@ -958,8 +999,7 @@ void moloch_parsers_classifier_add(MolochClassifyHead_t *ch, MolochClassify_t *c
             if (config.debug > 1) {
                 LOG("Info, duplicate (could be normal) %s %s", c->name, c->match);
             }
-            MOLOCH_TYPE_FREE(MolochClassify_t, c);
-            return;
+            return 0;
         }
     }
     if (ch->cnt >= ch->size) {
@@ -973,6 +1013,216 @@ void moloch_parsers_classifier_add(MolochClassifyHead_t *ch, MolochClassify_t *c
 
     ch->arr[ch->cnt] = c;
     ch->cnt++;
+    return 1;
+}
+/******************************************************************************/
+// Returns 0 if it was a duplicate
+LOCAL int moloch_parsers_classifier_add(MolochClassifyHead_t *ch, MolochClassify_t *c)
+{
+    MOLOCH_LOCK(classifers);
+    const int added = moloch_parsers_classifier_push(ch, c, TRUE);
+
+    // First place this classifier was added, remember it for the profile
+    if (added && c->pos == 0) {
+        moloch_parsers_classifier_push(&classifersAll, c, FALSE);
+        c->pos = classifersAll.cnt;
+    }
+    MOLOCH_UNLOCK(classifers);
+    return added;
+}
+/******************************************************************************/
+LOCAL void moloch_parsers_classifier_matcher_free(void *mv)
+{
+    MolochClassifyMatcher_t *m = mv;
+
+    for (uint32_t s = 0; s < m->numStates; s++) {
+        g_free(m->states[s].table);
+        g_free(m->states[s].bytes);
+        g_free(m->states[s].next);
+        g_free(m->states[s].out);
+    }
+    g_free(m->states);
+    MOLOCH_TYPE_FREE(MolochClassifyMatcher_t, m);
+}
+/******************************************************************************/
+/* Find or create the state for depth with the classifiers still alive and the
+ * ones that just matched, both lists are indexes into the classifier head.
+ */
+LOCAL uint32_t moloch_parsers_classifier_state(MolochClassifyMatcher_t *m, GHashTable *seen, GQueue *todo, MolochClassifyHead_t *ch,
+                                               int depth, const uint32_t *alive, int numAlive, const uint32_t *out, int numOut)
+{
+    if (numAlive == 0 && numOut == 0)
+        return 0;
+
+    // Key is depth, alive count, alive list then the out list
+    const int keyLen = 2 + numAlive + numOut;
+    uint32_t *key = g_malloc(keyLen * sizeof(uint32_t));
+    key[0] = depth;
+    key[1] = numAlive;
+    memcpy(key + 2, alive, numAlive * sizeof(uint32_t));
+    memcpy(key + 2 + numAlive, out, numOut * sizeof(uint32_t));
+    GBytes *bkey = g_bytes_new_take(key, keyLen * sizeof(uint32_t));
+
+    gpointer value;
+    if (g_hash_table_lookup_extended(seen, bkey, NULL, &value)) {
+        g_bytes_unref(bkey);
+        return GPOINTER_TO_UINT(value);
+    }
+
+    if (m->numStates >= MOLOCH_CLASSIFY_MAX_STATES) {
+        g_bytes_unref(bkey);
+        return 0xffffffff;
+    }
+
+    if ((m->numStates & (m->numStates - 1)) == 0)
+        m->states = g_realloc(m->states, sizeof(MolochClassifyState_t) * m->numStates * 2);
+
+    const uint32_t s = m->numStates++;
+    memset(&m->states[s], 0, sizeof(MolochClassifyState_t));
+    m->states[s].numOut = numOut;
+    if (numOut) {
+        m->states[s].out = g_malloc(numOut * sizeof(MolochClassify_t *));
+        for (int i = 0; i < numOut; i++)
+            m->states[s].out[i] = ch->arr[out[i]];
+    }
+    if (depth > m->maxDepth)
+        m->maxDepth = depth;
+
+    g_hash_table_insert(seen, bkey, GUINT_TO_POINTER(s));
+    if (numAlive)
+        g_queue_push_tail(todo, bkey);
+    return s;
+}
+/******************************************************************************/
+/* Build the automaton, NULL if it would be too large and the classifiers are
+ * checked one at a time instead.
+ */
+LOCAL MolochClassifyMatcher_t *moloch_parsers_classifier_compile(MolochClassifyHead_t *ch)
+{
+    MolochClassifyMatcher_t *m = MOLOCH_TYPE_ALLOC0(MolochClassifyMatcher_t);
+    GHashTable *seen = g_hash_table_new_full(g_bytes_hash, g_bytes_equal, (GDestroyNotify)g_bytes_unref, NULL);
+    GQueue     *todo = g_queue_new();
+    uint32_t   *alive = g_malloc(ch->cnt * sizeof(uint32_t) + 1);
+    uint32_t   *out = g_malloc(ch->cnt * sizeof(uint32_t) + 1);
+    int         numAlive = 0, numOut = 0;
+
+    m->states = g_malloc(sizeof(MolochClassifyState_t));
+    memset(&m->states[0], 0, sizeof(MolochClassifyState_t));
+    m->numStates = 1;
+
+    for (int i = 0; i < ch->cnt; i++) {
+        if (ch->arr[i]->minlen == 0)
+            out[numOut++] = i;
+        else
+            alive[numAlive++] = i;
+    }
+    moloch_parsers_classifier_state(m, seen, todo, ch, 0, alive, numAlive, out, numOut);
+
+    GBytes *bkey;
+    while ((bkey = g_queue_pop_head(todo))) {
+        gsize           keyLen;
+        const uint32_t *key = g_bytes_get_data(bkey, &keyLen);
+        const int       depth = key[0];
+        const int       numFrom = key[1];
+        const uint32_t *from = key + 2;
+        const uint32_t  s = GPOINTER_TO_UINT(g_hash_table_lookup(seen, bkey));
+        uint8_t         bytes[256];
+        uint32_t        next[256];
+        int             numBytes = 0;
+        uint8_t         have[256];
+
+        memset(have, 0, sizeof(have));
+
+        // Every byte a classifier at this depth wants gets its own transition
+        for (int i = 0; i < numFrom; i++) {
+            const MolochClassify_t *c = ch->arr[from[i]];
+            if (depth >= c->offset && !have[c->match[depth - c->offset]]) {
+                have[c->match[depth - c->offset]] = 1;
+                bytes[numBytes++] = c->match[depth - c->offset];
+            }
+        }
+
+        for (int b = 0; b <= numBytes; b++) {
+            numAlive = numOut = 0;
+            for (int i = 0; i < numFrom; i++) {
+                const MolochClassify_t *c = ch->arr[from[i]];
+                if (depth < c->offset || (b < numBytes && c->match[depth - c->offset] == bytes[b])) {
+                    if (c->minlen == depth + 1)
+                        out[numOut++] = from[i];
+                    else
+                        alive[numAlive++] = from[i];
+                }
+            }
+            const uint32_t n = moloch_parsers_classifier_state(m, seen, todo, ch, depth + 1, alive, numAlive, out, numOut);
+            if (n == 0xffffffff)
+                goto tooBig;
+            if (b < numBytes)
+                next[b] = n;
+            else
+                m->states[s].def = n;
+        }
+
+        MolochClassifyState_t *state = &m->states[s];
+        if (numBytes >= MOLOCH_CLASSIFY_TABLE_MIN) {
+            state->table = g_malloc(256 * sizeof(uint32_t));
+            for (int i = 0; i < 256; i++)
+                state->table[i] = state->def;
+            for (int b = 0; b < numBytes; b++)
+                state->table[bytes[b]] = next[b];
+        } else if (numBytes > 0) {
+            state->numBytes = numBytes;
+            state->bytes = g_memdup(bytes, numBytes);
+            state->next = g_memdup(next, numBytes * sizeof(uint32_t));
+        }
+    }
+
+    g_queue_free(todo);
+    g_hash_table_destroy(seen);
+    g_free(alive);
+    g_free(out);
+    return m;
+
+tooBig:
+    LOG("WARNING - Classifiers need more than %d states, checking them one at a time", MOLOCH_CLASSIFY_MAX_STATES);
+    g_queue_free(todo);
+    g_hash_table_destroy(seen);
+    g_free(alive);
+    g_free(out);
+    moloch_parsers_classifier_matcher_free(m);
+    return NULL;
+}
+/******************************************************************************/
+// Rebuild the automaton if classifiers were added since it was built, main thread only
+LOCAL void moloch_parsers_classifier_matcher(MolochClassifyHead_t *ch, MolochClassifyMatcher_t **matcher, int *dirty)
+{
+    MOLOCH_LOCK(classifers);
+    if (*dirty) {
+        MolochClassifyMatcher_t *old = *matcher;
+        __atomic_store_n(matcher, moloch_parsers_classifier_compile(ch), __ATOMIC_RELEASE);
+        __atomic_store_n(dirty, 0, __ATOMIC_RELEASE);
+        if (old)
+            moloch_free_later(old, moloch_parsers_classifier_matcher_free);
+        if (config.debug && *matcher)
+            LOG("Compiled %d classifiers into %u states, max depth %d", ch->cnt, (*matcher)->numStates, (*matcher)->maxDepth);
+    }
+    MOLOCH_UNLOCK(classifers);
+}
+/******************************************************************************/
+LOCAL gboolean moloch_parsers_classifier_compile_gfunc(gpointer UNUSED(user_data))
+{
+    moloch_parsers_classifier_matcher(&classifersTcp, &classifersTcpMatcher, &classifersTcpDirty);
+    moloch_parsers_classifier_matcher(&classifersUdp, &classifersUdpMatcher, &classifersUdpDirty);
+    return G_SOURCE_REMOVE;
+}
+/******************************************************************************/
+/* Called on the main thread once the parsers and plugins have registered their
+ * classifiers.  Anything registered later, like from lua on a packet thread,
+ * is checked one at a time until the main thread rebuilds the automaton.
+ */
+void moloch_parsers_classify_init()
+{
+    moloch_parsers_classifier_compile_gfunc(NULL);
+    classifersCompiled = TRUE;
 }
 /******************************************************************************/
 void moloch_parsers_classifier_register_port_internal(const char *name, void *uw, uint16_t port, uint32_t type, MolochClassifyFunc func, size_t sessionsize, int apiversion)
@@ -997,15 +1247,19 @@ void moloch_parsers_classifier_register_port_internal(const char *name, void *uw
     if (config.debug)
         LOG("adding %s port:%u type:%02x uw:%p", name, port, type, uw);
 
+    int added = 0;
     if (type & MOLOCH_PARSERS_PORT_TCP_SRC)
-        moloch_parsers_classifier_add(&classifersTcpPortSrc[port], c);
+        added += moloch_parsers_classifier_add(&classifersTcpPortSrc[port], c);
     if (type & MOLOCH_PARSERS_PORT_TCP_DST)
-        moloch_parsers_classifier_add(&classifersTcpPortDst[port], c);
+        added += moloch_parsers_classifier_add(&classifersTcpPortDst[port], c);
 
     if (type & MOLOCH_PARSERS_PORT_UDP_SRC)
-        moloch_parsers_classifier_add(&classifersUdpPortSrc[port], c);
+        added += moloch_parsers_classifier_add(&classifersUdpPortSrc[port], c);
     if (type & MOLOCH_PARSERS_PORT_UDP_DST)
-        moloch_parsers_classifier_add(&classifersUdpPortDst[port], c);
+        added += moloch_parsers_classifier_add(&classifersUdpPortDst[port], c);
+
+    if (!added)
+        MOLOCH_TYPE_FREE(MolochClassify_t, c);
 }
 /******************************************************************************/
 void moloch_parsers_classifier_register_tcp_internal(const char *name, void *uw, int offset, const unsigned char *match, int matchlen, MolochClassifyFunc func, size_t sessionsize, int apiversion)
@@ -1035,15 +1289,13 @@ void moloch_parsers_classifier_register_tcp_internal(const char *name, void *uw,
         moloch_sprint_hex_string(hex, match, matchlen);
         LOG("adding %s matchlen:%d offset:%d match %s (0x%s)", name, matchlen, offset, match, hex);
     }
-    if (matchlen == 0 || offset != 0) {
-        moloch_parsers_classifier_add(&classifersTcp0, c);
-    } else if (matchlen == 1) {
-        moloch_parsers_classifier_add(&classifersTcp1[(uint8_t)match[0]], c);
-    } else  {
-        c->match += 2;
-        c->matchlen -= 2;
-        moloch_parsers_classifier_add(&classifersTcp2[(uint8_t)match[0]][(uint8_t)match[1]], c);
-    }
+
+    if (moloch_parsers_classifier_add(&classifersTcp, c)) {
+        __atomic_store_n(&classifersTcpDirty, 1, __ATOMIC_RELEASE);
+        if (classifersCompiled)
+            g_idle_add(moloch_parsers_classifier_compile_gfunc, NULL);
+    } else
+        MOLOCH_TYPE_FREE(MolochClassify_t, c);
 }
 /******************************************************************************/
 void moloch_parsers_classifier_register_udp_internal(const char *name, void *uw, int offset, const unsigned char *match, int matchlen, MolochClassifyFunc func, size_t sessionsize, int apiversion)
@@ -1067,15 +1319,108 @@ void moloch_parsers_classifier_register_udp_internal(const char *name, void *uw,
 
     if (config.debug)
         LOG("adding %s matchlen:%d offset:%d match %s ", name, matchlen, offset, match);
-    if (matchlen == 0 || offset != 0) {
-        moloch_parsers_classifier_add(&classifersUdp0, c);
-    } else if (matchlen == 1) {
-        moloch_parsers_classifier_add(&classifersUdp1[(uint8_t)match[0]], c);
-    } else  {
-        c->match += 2;
-        c->matchlen -= 2;
-        moloch_parsers_classifier_add(&classifersUdp2[(uint8_t)match[0]][(uint8_t)match[1]], c);
+
+    if (moloch_parsers_classifier_add(&classifersUdp, c)) {
+        __atomic_store_n(&classifersUdpDirty, 1, __ATOMIC_RELEASE);
+        if (classifersCompiled)
+            g_idle_add(moloch_parsers_classifier_compile_gfunc, NULL);
+    } else
+        MOLOCH_TYPE_FREE(MolochClassify_t, c);
+}
+/******************************************************************************/
+LOCAL inline void moloch_parsers_classifier_call(MolochClassify_t *c, MolochSession_t *session, const unsigned char *data, int remaining, int which)
+{
+    if (unlikely(classifierProfile)) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        c->func(session, data, remaining, which, c->uw);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        MOLOCH_THREAD_INCR(c->hits);
+        MOLOCH_THREAD_INCR_NUM(c->nanos, (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+    } else {
+        c->func(session, data, remaining, which, c->uw);
+    }
+}
+/******************************************************************************/
+LOCAL void moloch_parsers_classifier_profile_log()
+{
+    for (int i = 0; i < classifersAll.cnt; i++) {
+        const MolochClassify_t *c = classifersAll.arr[i];
+        if (c->hits)
+            LOG("Classifier %s offset:%d matchlen:%d hits:%" PRIu64 " avgns:%" PRIu64, c->name, c->offset, c->matchlen, c->hits, c->nanos / c->hits);
+    }
+}
+/******************************************************************************/
+/* Walk the automaton over the start of data and call every classifier that
+ * matched, in the order they were registered.
+ */
+LOCAL void moloch_parsers_classifier_run(MolochClassifyHead_t *ch, MolochClassifyMatcher_t **matcher, int *dirty,
+                                         MolochSession_t *session, const unsigned char *data, int remaining, int which)
+{
+    // Out of date until the main thread rebuilds it, check one at a time
+    MolochClassifyMatcher_t *m = NULL;
+    if (likely(!__atomic_load_n(dirty, __ATOMIC_ACQUIRE)))
+        m = __atomic_load_n(matcher, __ATOMIC_ACQUIRE);
+
+    int i;
+    if (unlikely(!m)) {
+        for (i = 0; i < ch->cnt; i++) {
+            MolochClassify_t *c = ch->arr[i];
+            if (remaining >= c->minlen && memcmp(data + c->offset, c->match, c->matchlen) == 0) {
+                moloch_parsers_classifier_call(c, session, data, remaining, which);
+            }
+        }
+        return;
+    }
+
+    if (m->numStates < 2)
+        return;
+
+    MolochClassify_t *found[MOLOCH_CLASSIFY_MAX_FOUND];
+    int               numFound = 0;
+    uint32_t          s = 1;
+    const int         len = MIN(remaining, m->maxDepth);
+
+    for (i = 0; ; i++) {
+        const MolochClassifyState_t *state = &m->states[s];
+
+        for (int o = 0; o < state->numOut; o++) {
+            if (likely(numFound < MOLOCH_CLASSIFY_MAX_FOUND))
+                found[numFound++] = state->out[o];
+            else
+                moloch_parsers_classifier_call(state->out[o], session, data, remaining, which);
+        }
+
+        if (i >= len)
+            break;
+
+        if (state->table) {
+            s = state->table[data[i]];
+        } else {
+            s = state->def;
+            for (int b = 0; b < state->numBytes; b++) {
+                if (state->bytes[b] == data[i]) {
+                    s = state->next[b];
+                    break;
+                }
+            }
+        }
+
+        if (s == 0)
+            break;
+    }
+
+    // Usually only a couple matched
+    for (i = 1; i < numFound; i++) {
+        MolochClassify_t *c = found[i];
+        int j;
+        for (j = i; j > 0 && found[j-1]->pos > c->pos; j--)
+            found[j] = found[j-1];
+        found[j] = c;
     }
+
+    for (i = 0; i < numFound; i++)
+        moloch_parsers_classifier_call(found[i], session, data, remaining, which);
 }
 /******************************************************************************/
 void moloch_parsers_classify_udp(MolochSession_t *session, const unsigned char *data, int remaining, int which)
@@ -1091,29 +1436,14 @@ void moloch_parsers_classify_udp(MolochSession_t *session, const unsigned char *
 #endif
 
     for (i = 0; i < classifersUdpPortSrc[session->port1].cnt; i++) {
-        classifersUdpPortSrc[session->port1].arr[i]->func(session, data, remaining, which, classifersUdpPortSrc[session->port1].arr[i]->uw);
+        moloch_parsers_classifier_call(classifersUdpPortSrc[session->port1].arr[i], session, data, remaining, which);
     }
 
     for (i = 0; i < classifersUdpPortDst[session->port2].cnt; i++) {
-        classifersUdpPortDst[session->port2].arr[i]->func(session, data, remaining, which, classifersUdpPortDst[session->port2].arr[i]->uw);
-    }
-
-    for (i = 0; i < classifersUdp0.cnt; i++) {
-        MolochClassify_t *c = classifersUdp0.arr[i];
-        if (remaining >= c->minlen && memcmp(data + c->offset, c->match, c->matchlen) == 0) {
-            c->func(session, data, remaining, which, c->uw);
-        }
+        moloch_parsers_classifier_call(classifersUdpPortDst[session->port2].arr[i], session, data, remaining, which);
     }
 
-    for (i = 0; i < classifersUdp1[data[0]].cnt; i++)
-        classifersUdp1[data[0]].arr[i]->func(session, data, remaining, which, classifersUdp1[data[0]].arr[i]->uw);
-
-    for (i = 0; i < classifersUdp2[data[0]][data[1]].cnt; i++) {
-        MolochClassify_t *c = classifersUdp2[data[0]][data[1]].arr[i];
-        if (remaining >= c->minlen && memcmp(data+2, c->match, c->matchlen) == 0) {
-            c->func(session, data, remaining, which, c->uw);
-        }
-    }
+    moloch_parsers_classifier_run(&classifersUdp, &classifersUdpMatcher, &classifersUdpDirty, session, data, remaining, which);
 
     moloch_rules_run_after_classify(session);
     if (config.yara && !config.yaraEveryPacket && !session->stopYara)
@@ -1133,30 +1463,14 @@ void moloch_parsers_classify_tcp(MolochSession_t *session, const unsigned char *
         return;
 
     for (i = 0; i < classifersTcpPortSrc[session->port1].cnt; i++) {
-        classifersTcpPortSrc[session->port1].arr[i]->func(session, data, remaining, which, classifersTcpPortSrc[session->port1].arr[i]->uw);
+        moloch_parsers_classifier_call(classifersTcpPortSrc[session->port1].arr[i], session, data, remaining, which);
     }
 
     for (i = 0; i < classifersTcpPortDst[session->port2].cnt; i++) {
-        classifersTcpPortDst[session->port2].arr[i]->func(session, data, remaining, which, classifersTcpPortDst[session->port2].arr[i]->uw);
+        moloch_parsers_classifier_call(classifersTcpPortDst[session->port2].arr[i], session, data, remaining, which);
     }
 
-    for (i = 0; i < classifersTcp0.cnt; i++) {
-        MolochClassify_t *c = classifersTcp0.arr[i];
-        if (remaining >= c->minlen && memcmp(data + c->offset, c->match, c->matchlen) == 0) {
-            c->func(session, data, remaining, which, c->uw);
-        }
-    }
-
-    for (i = 0; i < classifersTcp1[data[0]].cnt; i++) {
-        classifersTcp1[data[0]].arr[i]->func(session, data, remaining, which, classifersTcp1[data[0]].arr[i]);
-    }
-
-    for (i = 0; i < classifersTcp2[data[0]][data[1]].cnt; i++) {
-        MolochClassify_t *c = classifersTcp2[data[0]][data[1]].arr[i];
-        if (remaining >= c->minlen && memcmp(data+2, c->match, c->matchlen) == 0) {
-            c->func(session, data, remaining, which, c->uw);
-        }
-    }
+    moloch_parsers_classifier_run(&classifersTcp, &classifersTcpMatcher, &classifersTcpDirty, session, data, remaining, which);
 
     moloch_rules_run_after_classify(session);
     if (config.yara && !config.yaraEveryPacket && !session->stopYara)
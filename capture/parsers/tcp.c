@@ -33,12 +33,10 @@ extern MolochSessionHead_t   tcpWriteQ[MOLOCH_MAX_PACKET_THREADS];
 LOCAL int                    maxTcpOutOfOrderPackets;
 extern uint32_t              pluginsCbs;
 
-void moloch_packet_free(MolochPacket_t *packet);
-
 /******************************************************************************/
 void tcp_session_free(MolochSession_t *session)
 {
-    if (session->tcpData.td_count == 1 && session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH] == 1) {
+    if (session->tcpData.td_count == 1 && session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_PSH] == 1) {
         MolochTcpData_t *ftd = DLL_PEEK_HEAD(td_, &session->tcpData);
         const int which = ftd->packet->direction;
         const uint8_t *data = ftd->packet->pkt + ftd->dataOffset;
@@ -51,7 +49,7 @@ void tcp_session_free(MolochSession_t *session)
     MolochTcpData_t *td;
     while (DLL_POP_HEAD(td_, &session->tcpData, td)) {
         moloch_packet_free(td->packet);
-        MOLOCH_TYPE_FREE(MolochTcpData_t, td);
+        MOLOCH_POOL_FREE(MolochTcpData_t, td);
     }
 }
 
@@ -93,7 +91,7 @@ void tcp_packet_finish(MolochSession_t *session)
             if (tcpSeq >= ftd->seq + ftd->len) {
                 DLL_REMOVE(td_, tcpData, ftd);
                 moloch_packet_free(ftd->packet);
-                MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
+                MOLOCH_POOL_FREE(MolochTcpData_t, ftd);
                 continue;
             }
 
@@ -102,10 +100,10 @@ void tcp_packet_finish(MolochSession_t *session)
             const uint8_t *data = ftd->packet->pkt + ftd->dataOffset + offset;
             const int len = ftd->len - offset;
 
-            if (session->firstBytesLen[which] < 8) {
-                int copy = MIN(8 - session->firstBytesLen[which], len);
-                memcpy(session->firstBytes[which] + session->firstBytesLen[which], data, copy);
-                session->firstBytesLen[which] += copy;
+            if (session->cold->firstBytesLen[which] < 8) {
+                int copy = MIN(8 - session->cold->firstBytesLen[which], len);
+                memcpy(session->cold->firstBytes[which] + session->cold->firstBytesLen[which], data, copy);
+                session->cold->firstBytesLen[which] += copy;
             }
 
             if (session->totalDatabytes[which] == session->consumed[which]) {
@@ -126,7 +124,7 @@ void tcp_packet_finish(MolochSession_t *session)
 
             DLL_REMOVE(td_, tcpData, ftd);
             moloch_packet_free(ftd->packet);
-            MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
+            MOLOCH_POOL_FREE(MolochTcpData_t, ftd);
         } else {
             return;
         }
@@ -148,14 +146,14 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
 #endif
 
     if (tcphdr->th_win == 0 && (tcphdr->th_flags & TH_RST) == 0) {
-        session->tcpFlagCnt[MOLOCH_TCPFLAG_SRC_ZERO + packet->direction]++;
+        session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_SRC_ZERO + packet->direction]++;
     }
 
     if (len < 0)
         return 1;
 
     if (tcphdr->th_flags & TH_URG) {
-        session->tcpFlagCnt[MOLOCH_TCPFLAG_URG]++;
+        session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_URG]++;
     }
 
     // add to the long open
@@ -165,7 +163,7 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
 
     if (tcphdr->th_flags & TH_SYN) {
         if (tcphdr->th_flags & TH_ACK) {
-            session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK]++;
+            session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK]++;
 
             if (!session->haveTcpSession && config.antiSynDrop) {
 #ifdef DEBUG_TCP
@@ -174,11 +172,11 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
                 session->tcpSeq[(packet->direction+1)%2] = ntohl(tcphdr->th_ack);
             }
         } else {
-            session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN]++;
-            if (session->synTime == 0) {
-                session->synTime = (packet->ts.tv_sec - session->firstPacket.tv_sec) * 1000000 +
+            session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_SYN]++;
+            if (session->cold->synTime == 0) {
+                session->cold->synTime = (packet->ts.tv_sec - session->firstPacket.tv_sec) * 1000000 +
                                    (packet->ts.tv_usec - session->firstPacket.tv_usec) + 1;
-                session->ackTime = 0;
+                session->cold->ackTime = 0;
             }
         }
 
@@ -193,7 +191,7 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
     }
 
     if (tcphdr->th_flags & TH_RST) {
-        session->tcpFlagCnt[MOLOCH_TCPFLAG_RST]++;
+        session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_RST]++;
         int64_t diff = tcp_sequence_diff(seq, session->tcpSeq[packet->direction]);
         if (diff  <= 0) {
             if (diff == 0 && !session->closingQ) {
@@ -206,27 +204,27 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
     }
 
     if (tcphdr->th_flags & TH_FIN) {
-        session->tcpFlagCnt[MOLOCH_TCPFLAG_FIN]++;
+        session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_FIN]++;
         session->tcpState[packet->direction] = MOLOCH_TCP_STATE_FIN;
     }
 
     if ((tcphdr->th_flags & (TH_FIN | TH_RST | TH_PUSH | TH_SYN | TH_ACK)) == TH_ACK) {
-        session->tcpFlagCnt[MOLOCH_TCPFLAG_ACK]++;
-        if (session->ackTime == 0) {
-            session->ackTime = (packet->ts.tv_sec - session->firstPacket.tv_sec) * 1000000 +
+        session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_ACK]++;
+        if (session->cold->ackTime == 0) {
+            session->cold->ackTime = (packet->ts.tv_sec - session->firstPacket.tv_sec) * 1000000 +
                                (packet->ts.tv_usec - session->firstPacket.tv_usec) + 1;
         }
     }
 
     if (tcphdr->th_flags & TH_PUSH) {
-        session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH]++;
+        session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_PSH]++;
     }
 
     if (session->stopTCP)
         return 1;
 
     // If we've seen SYN but no SYN_ACK and no tcpSeq set, then just assume we've missed the syn-ack
-    if (session->haveTcpSession && session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK] == 0 && session->tcpSeq[packet->direction] == 0) {
+    if (session->haveTcpSession && session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK] == 0 && session->tcpSeq[packet->direction] == 0) {
         moloch_session_add_tag(session, "no-syn-ack");
         session->tcpSeq[packet->direction] = seq;
     }
@@ -275,7 +273,7 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
     if (session->haveTcpSession && diff <= 0)
         return 1;
 
-    MolochTcpData_t *ftd, *td = MOLOCH_TYPE_ALLOC(MolochTcpData_t);
+    MolochTcpData_t *ftd, *td = MOLOCH_POOL_ALLOC(MolochTcpData_t);
     const uint32_t ack = ntohl(tcphdr->th_ack);
 
     td->packet = packet;
@@ -309,10 +307,10 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
 
                         DLL_REMOVE(td_, tcpData, ftd);
                         moloch_packet_free(ftd->packet);
-                        MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
+                        MOLOCH_POOL_FREE(MolochTcpData_t, ftd);
                         ftd = td;
                     } else {
-                        MOLOCH_TYPE_FREE(MolochTcpData_t, td);
+                        MOLOCH_POOL_FREE(MolochTcpData_t, td);
                         return 1;
                     }
                     break;
@@ -365,7 +363,7 @@ int tcp_pre_process(MolochSession_t *session, MolochPacket_t * const packet, int
     struct tcphdr       *tcphdr = (struct tcphdr *)(packet->pkt + packet->payloadOffset);
 
     // If this is an old session that hash RSTs and we get a syn, probably a port reuse, close old session
-    if (!isNewSession && (tcphdr->th_flags & TH_SYN) && ((tcphdr->th_flags & TH_ACK) == 0) && session->tcpFlagCnt[MOLOCH_TCPFLAG_RST]) {
+    if (!isNewSession && (tcphdr->th_flags & TH_SYN) && ((tcphdr->th_flags & TH_ACK) == 0) && session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_RST]) {
         return 1;
     }
 
@@ -414,6 +412,14 @@ int tcp_process(MolochSession_t *session, MolochPacket_t * const packet)
 {
     int freePacket = tcp_packet_process(session, packet);
     tcp_packet_finish(session);
+
+    // Anything still waiting on reassembly can't pin zero copy reader memory
+    if (!freePacket) {
+        MolochTcpData_t *ftd;
+        DLL_FOREACH(td_, &session->tcpData, ftd) {
+            moloch_packet_copy(ftd->packet);
+        }
+    }
     return freePacket;
 }
 /******************************************************************************/
@@ -83,9 +83,9 @@ int udp_process(MolochSession_t *session, MolochPacket_t * const packet)
     if (len <= 0)
         return 1;
 
-    if (session->firstBytesLen[packet->direction] == 0) {
-        session->firstBytesLen[packet->direction] = MIN(8, len);
-        memcpy(session->firstBytes[packet->direction], data, session->firstBytesLen[packet->direction]);
+    if (session->cold->firstBytesLen[packet->direction] == 0) {
+        session->cold->firstBytesLen[packet->direction] = MIN(8, len);
+        memcpy(session->cold->firstBytes[packet->direction], data, session->cold->firstBytesLen[packet->direction]);
 
         moloch_parsers_classify_udp(session, data, len, packet->direction);
 
@@ -95,14 +95,14 @@ int udp_process(MolochSession_t *session, MolochPacket_t * const packet)
     }
 
     int i;
-    for (i = 0; i < session->parserNum; i++) {
-        if (session->parserInfo[i].parserFunc) {
-            int consumed = session->parserInfo[i].parserFunc(session, session->parserInfo[i].uw, data, len, packet->direction);
+    for (i = 0; i < session->cold->parserNum; i++) {
+        if (session->cold->parserInfo[i].parserFunc) {
+            int consumed = session->cold->parserInfo[i].parserFunc(session, session->cold->parserInfo[i].uw, data, len, packet->direction);
             if (consumed == MOLOCH_PARSER_UNREGISTER) {
-                if (session->parserInfo[i].parserFreeFunc) {
-                    session->parserInfo[i].parserFreeFunc(session, session->parserInfo[i].uw);
+                if (session->cold->parserInfo[i].parserFreeFunc) {
+                    session->cold->parserInfo[i].parserFreeFunc(session, session->cold->parserInfo[i].uw);
                 }
-                memset(&session->parserInfo[i], 0, sizeof(session->parserInfo[i]));
+                memset(&session->cold->parserInfo[i], 0, sizeof(session->cold->parserInfo[i]));
                 continue;
             }
         }
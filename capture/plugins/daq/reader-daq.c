@@ -53,7 +53,7 @@ DAQ_Verdict reader_daq_packet_cb(void *batch, const DAQ_PktHdr_t *h, const uint8
         LOGEXIT("ERROR - Arkime requires full packet captures caplen: %d pktlen: %d", h->caplen, h->pktlen);
     }
 
-    MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+    MolochPacket_t *packet = MOLOCH_POOL_ALLOC0(MolochPacket_t);
 
     packet->pkt           = (u_char *)data;
     packet->ts            = h->ts;
@@ -51,7 +51,7 @@ void reader_pfring_packet_cb(const struct pfring_pkthdr *h, const u_char *p, con
         LOGEXIT("ERROR - Arkime requires full packet captures caplen: %d pktlen: %d", h->caplen, h->len);
     }
 
-    MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+    MolochPacket_t *packet = MOLOCH_POOL_ALLOC0(MolochPacket_t);
 
     packet->pkt           = (u_char *)p;
     packet->ts            = h->ts;
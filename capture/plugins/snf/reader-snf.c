@@ -99,7 +99,7 @@ LOCAL void *reader_snf_thread(gpointer posv)
             break;
         }
 
-        MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+        MolochPacket_t *packet = MOLOCH_POOL_ALLOC0(MolochPacket_t);
 
         packet->pkt           = (u_char *)req.pkt_addr;
         packet->ts.tv_sec     = req.timestamp / 1000000000;
@@ -2,7 +2,8 @@
  *              lists fetched from the ES database.  taggerUpdate.pl is
  *              used to upload files to the database.  tagger checks
  *              once a minute to see if the files in the database have
- *              changed.
+ *              changed, and rebuilds its index with just the changed
+ *              files.
  *
  * Copyright 2012-2017 AOL Inc. All rights reserved.
  *
@@ -27,7 +28,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
-#include "patricia.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "moloch.h"
 
 
@@ -48,122 +54,234 @@ LOCAL  int                   emailDstField;
 LOCAL  int                   dnsHostField;
 LOCAL  int                   dnsMailServerField;
 
+LOCAL  char                 *indexFile;
+
 /******************************************************************************/
+/* All the tagger data is kept in one read only index built from the files in
+ * the database.  Everything in it is an offset from the start, so once built
+ * it is written to disk and mmapped, letting a restart, or other capture
+ * nodes on the same host, use it without downloading all the files again.
+ *
+ * Strings are kept in open addressed tables.  Ips are kept in one table keyed
+ * by prefix length and masked address, a lookup tries each prefix length
+ * present so every matching prefix is found, not just the longest.
+ */
+#define TAGGER_INDEX_MAGIC   "ARKTAG01"
+
+#define TAGGER_TABLE_DOMAIN  0
+#define TAGGER_TABLE_MD5     1
+#define TAGGER_TABLE_EMAIL   2
+#define TAGGER_TABLE_URI     3
+#define TAGGER_TABLE_IP      4
+#define TAGGER_TABLES        5
+
+#define TAGGER_IP_KEY_LEN    17
 
-typedef struct tagger_string {
-    struct tagger_string *s_next, *s_prev;
-    char                 *str;
-    GPtrArray            *infos;
-    uint32_t              s_hash;
-    uint16_t              s_bucket;
-} TaggerString_t;
+typedef struct {
+    uint32_t              hash;
+    uint32_t              key;       // 0 if empty
+    uint32_t              keyLen;
+    uint32_t              infos;     // uint32_t array of info numbers
+    uint32_t              numInfos;
+} TaggerIndexSlot_t;
+
+typedef struct {
+    uint32_t              slots;
+    uint32_t              mask;
+} TaggerIndexTable_t;
+
+typedef struct {
+    uint32_t              id;
+    uint32_t              md5;
+    uint32_t              type;
+    uint32_t              tags;
+    uint32_t              fields;    // 0 if none
+} TaggerIndexFile_t;
 
 typedef struct {
-    struct tagger_string *s_next, *s_prev;
-    int                   s_count;
-} TaggerStringHead_t;
+    uint32_t              file;
+    uint32_t              ops;       // 0 if just the file tags
+} TaggerIndexInfo_t;
+
+typedef struct {
+    char                  magic[8];
+    uint64_t              size;
+    uint64_t              ipLens[3]; // Bit for each prefix length in the ip table
+    uint32_t              numFiles;
+    uint32_t              files;
+    uint32_t              numInfos;
+    uint32_t              infos;
+    TaggerIndexTable_t    tables[TAGGER_TABLES];
+} TaggerIndexHdr_t;
 
 /******************************************************************************/
 
-typedef struct tagger_ip {
-    GPtrArray            *infos;
-} TaggerIP_t;
+typedef struct {
+    MolochFieldOps_t      ops;
+    char                **tags;
+} TaggerInfo_t;
+
+typedef struct {
+    uint8_t              *data;      // Starts with TaggerIndexHdr_t
+    size_t                len;
+    int                   mapped;
+    TaggerInfo_t         *infos;
+    char               ***tags;      // Per file
+} TaggerIndex_t;
 
 /******************************************************************************/
 
-typedef struct tagger_file {
-    struct tagger_file   *s_next, *s_prev;
-    char                 *str;
+// A file downloaded from the database, or removed if md5 is NULL
+typedef struct {
+    char                 *id;
     char                 *md5;
     char                 *type;
-    char                **tags;
-    char                **elements;
-    uint32_t              s_hash;
-    uint16_t              s_bucket;
-} TaggerFile_t;
+    char                 *tags;
+    char                 *fields;
+    char                 *data;
+} TaggerLoad_t;
 
+// Points into the old index or the loads while building
 typedef struct {
-    struct tagger_file   *s_next, *s_prev;
-    int                   s_count;
-} TaggerFileHead_t;
+    const char           *id;
+    const char           *md5;
+    const char           *type;
+    const char           *tags;
+    const char           *fields;
+} TaggerBuildFile_t;
 
-/******************************************************************************/
+typedef struct {
+    uint32_t              file;
+    const char           *ops;
+} TaggerBuildInfo_t;
 
-typedef struct tagger_info {
-    MolochFieldOps_t  ops;
-    TaggerFile_t     *file;
-} TaggerInfo_t;
+typedef struct {
+    TaggerIndex_t        *old;
+    GPtrArray            *loads;
+    TaggerIndex_t        *index;
+} TaggerBuild_t;
+
+LOCAL  TaggerIndex_t        *tagger;
+LOCAL  GHashTable           *knownFiles;   // id -> md5 of the files asked for
+LOCAL  GPtrArray            *loads;
+LOCAL  int                   loadsPending;
+LOCAL  int                   building;
 
 /******************************************************************************/
-typedef HASH_VAR(s_, TaggerStringHash_t, TaggerStringHead_t, 37277);
+// Not moloch_string_hash, it is salted per process and the index is shared
+LOCAL inline uint32_t tagger_hash(const void *key, int len)
+{
+    const uint8_t *p = key;
+    uint32_t       n = 2166136261U;
 
-TaggerStringHash_t allDomains;
-TaggerStringHash_t allMD5s;
-TaggerStringHash_t allEmails;
-TaggerStringHash_t allURIs;
+    while (len--) {
+        n ^= *p++;
+        n *= 16777619;
+    }
+    return n;
+}
+/******************************************************************************/
+LOCAL const TaggerIndexSlot_t *tagger_index_find(const TaggerIndex_t *index, int table, const void *key, int keyLen)
+{
+    const TaggerIndexHdr_t   *hdr = (TaggerIndexHdr_t *)index->data;
+    const TaggerIndexTable_t *t = &hdr->tables[table];
 
-HASH_VAR(s_, allFiles, TaggerFileHead_t, 101);
+    if (!t->slots)
+        return NULL;
 
-LOCAL  patricia_tree_t *allIps;
+    const TaggerIndexSlot_t *slots = (TaggerIndexSlot_t *)(index->data + t->slots);
+    const uint32_t           h = tagger_hash(key, keyLen);
 
+    for (uint32_t i = h & t->mask; slots[i].key; i = (i + 1) & t->mask) {
+        if (slots[i].hash == h && slots[i].keyLen == (uint32_t)keyLen && memcmp(index->data + slots[i].key, key, keyLen) == 0)
+            return &slots[i];
+    }
+    return NULL;
+}
 /******************************************************************************/
-LOCAL void tagger_process_match(MolochSession_t *session, GPtrArray *infos)
+LOCAL inline void tagger_ip_key(uint8_t *key, const uint8_t *addr, int bits)
 {
-    uint32_t f, t;
-    for (f = 0; f < infos->len; f++) {
-        TaggerInfo_t *info = g_ptr_array_index(infos, f);
-        TaggerFile_t *file = info->file;
-        for (t = 0; file->tags[t]; t++) {
-            moloch_session_add_tag(session, file->tags[t]);
+    key[0] = bits;
+    for (int i = 0; i < 16; i++) {
+        if (bits >= 8) {
+            key[i + 1] = addr[i];
+            bits -= 8;
+        } else {
+            key[i + 1] = addr[i] & (0xff << (8 - bits));
+            bits = 0;
+        }
+    }
+}
+/******************************************************************************/
+LOCAL void tagger_process_match(MolochSession_t *session, const TaggerIndex_t *index, const TaggerIndexSlot_t *slot)
+{
+    const uint32_t *infos = (uint32_t *)(index->data + slot->infos);
+
+    for (uint32_t f = 0; f < slot->numInfos; f++) {
+        TaggerInfo_t *info = &index->infos[infos[f]];
+        for (int t = 0; info->tags[t]; t++) {
+            moloch_session_add_tag(session, info->tags[t]);
         }
         moloch_field_ops_run(session, &info->ops);
     }
 }
 /******************************************************************************/
+LOCAL void tagger_check_ip(MolochSession_t *session, const TaggerIndex_t *index, const struct in6_addr *addr)
+{
+    const TaggerIndexHdr_t *hdr = (TaggerIndexHdr_t *)index->data;
+    uint8_t                 key[TAGGER_IP_KEY_LEN];
+
+    for (int w = 0; w < 3; w++) {
+        uint64_t lens = hdr->ipLens[w];
+        while (lens) {
+            const int bits = w * 64 + __builtin_ctzll(lens);
+            lens &= lens - 1;
+
+            tagger_ip_key(key, addr->s6_addr, bits);
+            const TaggerIndexSlot_t *slot = tagger_index_find(index, TAGGER_TABLE_IP, key, TAGGER_IP_KEY_LEN);
+            if (slot)
+                tagger_process_match(session, index, slot);
+        }
+    }
+}
+/******************************************************************************/
+LOCAL void tagger_check_strings(MolochSession_t *session, const TaggerIndex_t *index, int pos, int table, int parent)
+{
+    if (pos == -1 || !session->fields[pos])
+        return;
+
+    MolochString_t        *hstring;
+    MolochStringHashStd_t *shash = session->fields[pos]->shash;
+    HASH_FORALL(s_, *shash, hstring,
+        const int len = strlen(hstring->str);
+        const TaggerIndexSlot_t *slot = tagger_index_find(index, table, hstring->str, len);
+        if (slot)
+            tagger_process_match(session, index, slot);
+
+        // Also check the parent domain
+        if (parent) {
+            char *dot = strchr(hstring->str, '.');
+            if (dot && *(dot+1)) {
+                slot = tagger_index_find(index, table, dot + 1, len - (dot + 1 - hstring->str));
+                if (slot)
+                    tagger_process_match(session, index, slot);
+            }
+        }
+    );
+}
+/******************************************************************************/
 /*
  * Called by arkime when a session is about to be saved
  */
 LOCAL void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
 {
-    TaggerString_t *tstring;
+    const TaggerIndex_t *index = __atomic_load_n(&tagger, __ATOMIC_ACQUIRE);
 
-    patricia_node_t *nodes[PATRICIA_MAXBITS+1];
-    int cnt;
-    prefix_t prefix;
-
-    int i;
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-    if (IN6_IS_ADDR_V4MAPPED(&session->addr1)) {
-        prefix.family = AF_INET;
-        prefix.bitlen = 32;
-        prefix.add.sin.s_addr = MOLOCH_V6_TO_V4(session->addr1);
-    } else {
-        prefix.family = AF_INET;
-        prefix.bitlen = 128;
-        memcpy(&prefix.add.sin6.s6_addr, &session->addr1, 16);
-    }
-
-    cnt = patricia_search_all(allIps, &prefix, 1, nodes);
-    for (i = 0; i < cnt; i++) {
-        tagger_process_match(session, ((TaggerIP_t *)(nodes[i]->data))->infos);
-    }
-
-    if (IN6_IS_ADDR_V4MAPPED(&session->addr2)) {
-        prefix.family = AF_INET;
-        prefix.bitlen = 32;
-        prefix.add.sin.s_addr = MOLOCH_V6_TO_V4(session->addr2);
-    } else {
-        prefix.family = AF_INET;
-        prefix.bitlen = 128;
-        memcpy(&prefix.add.sin6.s6_addr, &session->addr2, 16);
-    }
+    if (!index)
+        return;
 
-    cnt = patricia_search_all(allIps, &prefix, 1, nodes);
-    for (i = 0; i < cnt; i++) {
-        tagger_process_match(session, ((TaggerIP_t *)(nodes[i]->data))->infos);
-    }
+    tagger_check_ip(session, index, &session->addr1);
+    tagger_check_ip(session, index, &session->addr2);
 
     if (httpXffField != -1 && session->fields[httpXffField]) {
         GHashTable            *ghash;
@@ -173,412 +291,734 @@ LOCAL void tagger_plugin_save(MolochSession_t *session, int UNUSED(final))
         ghash = session->fields[httpXffField]->ghash;
         g_hash_table_iter_init (&iter, ghash);
         while (g_hash_table_iter_next (&iter, &ikey, NULL)) {
-            if (IN6_IS_ADDR_V4MAPPED((struct in6_addr*)ikey)) {
-                prefix.family = AF_INET;
-                prefix.bitlen = 32;
-                prefix.add.sin.s_addr = MOLOCH_V6_TO_V4(*(struct in6_addr*)ikey);
-            } else {
-                prefix.family = AF_INET6;
-                prefix.bitlen = 128;
-                memcpy(&prefix.add.sin6.s6_addr, ikey, 16);
-            }
-
-            cnt = patricia_search_all(allIps, &prefix, 1, nodes);
-            for (i = 0; i < cnt; i++) {
-                tagger_process_match(session, ((TaggerIP_t *)(nodes[i]->data))->infos);
-            }
+            tagger_check_ip(session, index, ikey);
         }
     }
-#pragma GCC diagnostic pop
 
-    MolochString_t *hstring;
-    if (httpHostField != -1 && session->fields[httpHostField]) {
-        MolochStringHashStd_t *shash = session->fields[httpHostField]->shash;
-        HASH_FORALL(s_, *shash, hstring,
-            HASH_FIND_HASH(s_, allDomains, hstring->s_hash, hstring->str, tstring);
-            if (tstring)
-                tagger_process_match(session, tstring->infos);
-            char *dot = strchr(hstring->str, '.');
-            if (dot && *(dot+1)) {
-                HASH_FIND(s_, allDomains, dot+1, tstring);
-                if (tstring)
-                    tagger_process_match(session, tstring->infos);
-            }
-        );
-    }
+    tagger_check_strings(session, index, httpHostField, TAGGER_TABLE_DOMAIN, TRUE);
+    tagger_check_strings(session, index, dnsHostField, TAGGER_TABLE_DOMAIN, TRUE);
+    tagger_check_strings(session, index, dnsMailServerField, TAGGER_TABLE_DOMAIN, TRUE);
+    tagger_check_strings(session, index, httpMd5Field, TAGGER_TABLE_MD5, FALSE);
+    tagger_check_strings(session, index, httpPathField, TAGGER_TABLE_URI, FALSE);
+    tagger_check_strings(session, index, emailMd5Field, TAGGER_TABLE_MD5, FALSE);
+    tagger_check_strings(session, index, emailSrcField, TAGGER_TABLE_EMAIL, FALSE);
+    tagger_check_strings(session, index, emailDstField, TAGGER_TABLE_EMAIL, FALSE);
+}
+/******************************************************************************/
+LOCAL void tagger_index_free(TaggerIndex_t *index)
+{
+    const TaggerIndexHdr_t *hdr = (TaggerIndexHdr_t *)index->data;
 
-    if (dnsHostField != -1 && session->fields[dnsHostField]) {
-        MolochStringHashStd_t *shash = session->fields[dnsHostField]->shash;
-        HASH_FORALL(s_, *shash, hstring,
-            HASH_FIND_HASH(s_, allDomains, hstring->s_hash, hstring->str, tstring);
-            if (tstring)
-                tagger_process_match(session, tstring->infos);
-            char *dot = strchr(hstring->str, '.');
-            if (dot && *(dot+1)) {
-                HASH_FIND(s_, allDomains, dot+1, tstring);
-                if (tstring)
-                    tagger_process_match(session, tstring->infos);
-            }
-        );
+    if (index->infos) {
+        for (uint32_t i = 0; i < hdr->numInfos; i++) {
+            moloch_field_ops_free(&index->infos[i].ops);
+        }
+        g_free(index->infos);
     }
-
-    if (dnsMailServerField != -1 && session->fields[dnsMailServerField]) {
-        MolochStringHashStd_t *shash = session->fields[dnsMailServerField]->shash;
-        HASH_FORALL(s_, *shash, hstring,
-            HASH_FIND_HASH(s_, allDomains, hstring->s_hash, hstring->str, tstring);
-            if (tstring)
-                tagger_process_match(session, tstring->infos);
-            char *dot = strchr(hstring->str, '.');
-            if (dot && *(dot+1)) {
-                HASH_FIND(s_, allDomains, dot+1, tstring);
-                if (tstring)
-                    tagger_process_match(session, tstring->infos);
-            }
-        );
+    if (index->tags) {
+        for (uint32_t f = 0; f < hdr->numFiles; f++) {
+            g_strfreev(index->tags[f]);
+        }
+        g_free(index->tags);
     }
 
-    if (httpMd5Field != -1 && session->fields[httpMd5Field]) {
-        MolochStringHashStd_t *shash = session->fields[httpMd5Field]->shash;
-        HASH_FORALL(s_, *shash, hstring,
-            HASH_FIND_HASH(s_, allMD5s, hstring->s_hash, hstring->str, tstring);
-            if (tstring)
-                tagger_process_match(session, tstring->infos);
-        );
-    }
+    if (index->mapped)
+        munmap(index->data, index->len);
+    else
+        g_free(index->data);
+    MOLOCH_TYPE_FREE(TaggerIndex_t, index);
+}
+/******************************************************************************/
+LOCAL void tagger_load_free(TaggerLoad_t *load)
+{
+    g_free(load->id);
+    g_free(load->md5);
+    g_free(load->type);
+    g_free(load->tags);
+    g_free(load->fields);
+    g_free(load->data);
+    MOLOCH_TYPE_FREE(TaggerLoad_t, load);
+}
+/******************************************************************************/
+/*
+ * Called by arkime when arkime is quiting
+ */
+LOCAL void tagger_plugin_exit()
+{
+    if (tagger)
+        tagger_index_free(tagger);
+    tagger = NULL;
 
-    if (httpPathField != -1 && session->fields[httpPathField]) {
-        MolochStringHashStd_t *shash = session->fields[httpPathField]->shash;
-        HASH_FORALL(s_, *shash, hstring,
-            HASH_FIND_HASH(s_, allURIs, hstring->s_hash, hstring->str, tstring);
-            if (tstring) {
-                tagger_process_match(session, tstring->infos);
-            }
-        );
+    g_hash_table_destroy(knownFiles);
+    g_ptr_array_free(loads, TRUE);
+}
+
+/******************************************************************************/
+/*
+ * Builds the ops for an info from "field=value;field=value", fields can
+ * also be the number of a shortcut from the file's fields
+ */
+LOCAL void tagger_info_ops(TaggerInfo_t *info, const char *opsStr, const unsigned int *fieldShortHand)
+{
+    char *str = g_strdup(opsStr);
+    char *parts[100];
+    int   p = 0;
+
+    parts[p++] = str;
+    for (char *s = str; *s && p < 100; s++) {
+        if (*s == ';' || *s == '=') {
+            if (!s[1])
+                break;
+            *s = 0;
+            parts[p++] = s + 1;
+        }
     }
 
-    if (emailMd5Field != -1 && session->fields[emailMd5Field]) {
-        MolochStringHashStd_t *shash = session->fields[emailMd5Field]->shash;
-        HASH_FORALL(s_, *shash, hstring,
-            HASH_FIND_HASH(s_, allMD5s, hstring->s_hash, hstring->str, tstring);
-            if (tstring)
-                tagger_process_match(session, tstring->infos);
-        );
+    moloch_field_ops_init(&info->ops, p / 2, MOLOCH_FIELD_OPS_FLAGS_COPY);
+
+    for (int j = 0; j + 1 < p; j += 2) {
+        int pos = -1;
+        if (isdigit(parts[j][0])) {
+            unsigned int f = atoi(parts[j]);
+            if (f < 20 && fieldShortHand[f] != 0xffffffff)
+                pos = fieldShortHand[f];
+        } else {
+            pos = moloch_field_by_exp(parts[j]);
+        }
+        if (pos == -1) {
+            LOG("WARNING - Unknown expression field %s", parts[j]);
+            continue;
+        }
+
+        moloch_field_ops_add(&info->ops, pos, parts[j+1], strlen(parts[j+1]));
     }
+    g_free(str);
+}
+/******************************************************************************/
+/*
+ * Create the per process parts of an index, the field ops and tags.  Done on
+ * the main thread since it can define fields.
+ */
+LOCAL void tagger_index_open(TaggerIndex_t *index)
+{
+    const TaggerIndexHdr_t  *hdr = (TaggerIndexHdr_t *)index->data;
+    const TaggerIndexFile_t *files = (TaggerIndexFile_t *)(index->data + hdr->files);
+    const TaggerIndexInfo_t *infos = (TaggerIndexInfo_t *)(index->data + hdr->infos);
+
+    unsigned int (*fieldShortHand)[20] = g_malloc(MAX(hdr->numFiles, 1) * sizeof(*fieldShortHand));
+    memset(fieldShortHand, 0xff, MAX(hdr->numFiles, 1) * sizeof(*fieldShortHand));
+
+    index->tags = g_malloc0(MAX(hdr->numFiles, 1) * sizeof(char **));
+    for (uint32_t f = 0; f < hdr->numFiles; f++) {
+        index->tags[f] = g_strsplit((char *)index->data + files[f].tags, ",", 0);
+
+        if (!files[f].fields)
+            continue;
 
-    if (emailSrcField != -1 && session->fields[emailSrcField]) {
-        MolochStringHashStd_t *shash = session->fields[emailSrcField]->shash;
-        HASH_FORALL(s_, *shash, hstring,
-            HASH_FIND_HASH(s_, allEmails, hstring->s_hash, hstring->str, tstring);
-            if (tstring)
-                tagger_process_match(session, tstring->infos);
-        );
+        char **fields = g_strsplit((char *)index->data + files[f].fields, ",", 0);
+        for (int i = 0; i < 100 && fields[i]; i++) {
+            int shortcut = -1;
+            int pos = moloch_field_define_text(fields[i], &shortcut);
+            if (shortcut >= 0 && shortcut < 20)
+                fieldShortHand[f][shortcut] = pos;
+        }
+        g_strfreev(fields);
     }
 
-    if (emailDstField != -1 && session->fields[emailDstField]) {
-        MolochStringHashStd_t *shash = session->fields[emailDstField]->shash;
-        HASH_FORALL(s_, *shash, hstring,
-            HASH_FIND_HASH(s_, allEmails, hstring->s_hash, hstring->str, tstring);
-            if (tstring)
-                tagger_process_match(session, tstring->infos);
-        );
+    index->infos = g_malloc0(MAX(hdr->numInfos, 1) * sizeof(TaggerInfo_t));
+    for (uint32_t i = 0; i < hdr->numInfos; i++) {
+        TaggerInfo_t *info = &index->infos[i];
+        info->tags = index->tags[infos[i].file];
+        if (infos[i].ops)
+            tagger_info_ops(info, (char *)index->data + infos[i].ops, fieldShortHand[infos[i].file]);
+        else
+            moloch_field_ops_init(&info->ops, 0, 0);
     }
+    g_free(fieldShortHand);
 }
-
 /******************************************************************************/
-LOCAL void tagger_free_ip (TaggerIP_t *tip) 
+// A NUL terminated string that starts after the header and ends inside the index
+LOCAL inline gboolean tagger_index_str_valid(const uint8_t *data, size_t len, uint32_t off)
 {
-    g_ptr_array_free(tip->infos, TRUE);
-    MOLOCH_TYPE_FREE(TaggerIP_t, tip);
+    return off >= sizeof(TaggerIndexHdr_t) && off < len && memchr(data + off, 0, len - off) != NULL;
+}
+/******************************************************************************/
+// An array of num items of size that is aligned and ends inside the index
+LOCAL inline gboolean tagger_index_array_valid(size_t len, uint32_t off, uint64_t num, size_t size)
+{
+    return off >= sizeof(TaggerIndexHdr_t) && off % 4 == 0 && off + num * size <= len;
 }
 /******************************************************************************/
 /*
- * Called by arkime when arkime is quiting
+ * The index can come from disk, so check every offset, length and number in
+ * it before anything uses it.  Lookups never check again.
  */
-LOCAL void tagger_plugin_exit()
+LOCAL gboolean tagger_index_valid(const uint8_t *data, size_t len)
 {
-    TaggerString_t *tstring;
-    HASH_FORALL_POP_HEAD(s_, allDomains, tstring,
-        free(tstring->str);
-        g_ptr_array_free(tstring->infos, TRUE);
-        MOLOCH_TYPE_FREE(TaggerString_t, tstring);
-    );
+    const TaggerIndexHdr_t *hdr = (TaggerIndexHdr_t *)data;
+
+    if (len < sizeof(TaggerIndexHdr_t) || len > 0xffffffff || memcmp(hdr->magic, TAGGER_INDEX_MAGIC, 8) != 0 || hdr->size != len)
+        return FALSE;
+
+    if ((hdr->numFiles && !tagger_index_array_valid(len, hdr->files, hdr->numFiles, sizeof(TaggerIndexFile_t))) ||
+        (hdr->numInfos && !tagger_index_array_valid(len, hdr->infos, hdr->numInfos, sizeof(TaggerIndexInfo_t))))
+        return FALSE;
+
+    const TaggerIndexFile_t *files = (TaggerIndexFile_t *)(data + hdr->files);
+    for (uint32_t f = 0; f < hdr->numFiles; f++) {
+        if (!tagger_index_str_valid(data, len, files[f].id) ||
+            !tagger_index_str_valid(data, len, files[f].md5) ||
+            !tagger_index_str_valid(data, len, files[f].type) ||
+            !tagger_index_str_valid(data, len, files[f].tags) ||
+            (files[f].fields && !tagger_index_str_valid(data, len, files[f].fields)))
+            return FALSE;
+    }
 
-    HASH_FORALL_POP_HEAD(s_, allMD5s, tstring,
-        free(tstring->str);
-        g_ptr_array_free(tstring->infos, TRUE);
-        MOLOCH_TYPE_FREE(TaggerString_t, tstring);
-    );
+    const TaggerIndexInfo_t *infos = (TaggerIndexInfo_t *)(data + hdr->infos);
+    for (uint32_t i = 0; i < hdr->numInfos; i++) {
+        if (infos[i].file >= hdr->numFiles ||
+            (infos[i].ops && !tagger_index_str_valid(data, len, infos[i].ops)))
+            return FALSE;
+    }
 
-    HASH_FORALL_POP_HEAD(s_, allEmails, tstring,
-        free(tstring->str);
-        g_ptr_array_free(tstring->infos, TRUE);
-        MOLOCH_TYPE_FREE(TaggerString_t, tstring);
-    );
+    for (int t = 0; t < TAGGER_TABLES; t++) {
+        const TaggerIndexTable_t *table = &hdr->tables[t];
+        if (!table->slots)
+            continue;
 
-    HASH_FORALL_POP_HEAD(s_, allURIs, tstring,
-        free(tstring->str);
-        g_ptr_array_free(tstring->infos, TRUE);
-        MOLOCH_TYPE_FREE(TaggerString_t, tstring);
-    );
+        // Power of 2 sized, and lookups stop at an empty slot so there must be one
+        const uint64_t size = (uint64_t)table->mask + 1;
+        if ((size & table->mask) != 0 || !tagger_index_array_valid(len, table->slots, size, sizeof(TaggerIndexSlot_t)))
+            return FALSE;
 
-    TaggerFile_t *file;
-    HASH_FORALL_POP_HEAD(s_, allFiles, file,
-        free(file->str);
-        g_free(file->md5);
-        g_free(file->type);
-        g_strfreev(file->tags);
-        g_strfreev(file->elements);
-        MOLOCH_TYPE_FREE(TaggerFile_t, file);
-    );
+        const TaggerIndexSlot_t *slots = (TaggerIndexSlot_t *)(data + table->slots);
+        uint64_t empty = 0;
+        for (uint64_t s = 0; s < size; s++) {
+            if (!slots[s].key) {
+                empty++;
+                continue;
+            }
 
-    Destroy_Patricia(allIps, tagger_free_ip);
-}
+            if (slots[s].key < sizeof(TaggerIndexHdr_t) || (uint64_t)slots[s].key + slots[s].keyLen > len ||
+                (t == TAGGER_TABLE_IP && (slots[s].keyLen != TAGGER_IP_KEY_LEN || data[slots[s].key] > 128)))
+                return FALSE;
 
+            if (slots[s].numInfos && !tagger_index_array_valid(len, slots[s].infos, slots[s].numInfos, sizeof(uint32_t)))
+                return FALSE;
+
+            const uint32_t *sinfos = (uint32_t *)(data + slots[s].infos);
+            for (uint32_t i = 0; i < slots[s].numInfos; i++) {
+                if (sinfos[i] >= hdr->numInfos)
+                    return FALSE;
+            }
+        }
+        if (!empty)
+            return FALSE;
+    }
+    return TRUE;
+}
 /******************************************************************************/
-LOCAL void tagger_remove_file(GPtrArray *infos, const TaggerFile_t *file)
+LOCAL TaggerIndex_t *tagger_index_map(const char *filename)
 {
-    int f;
-    for (f = 0; f < (int)infos->len; f++) {
-        if (file == ((TaggerInfo_t *)g_ptr_array_index(infos, f))->file) {
-            g_ptr_array_remove_index_fast(infos, f);
-            return;
-        }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || sb.st_size < (off_t)sizeof(TaggerIndexHdr_t)) {
+        close(fd);
+        return NULL;
     }
+
+    uint8_t *data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    if (!tagger_index_valid(data, sb.st_size)) {
+        LOG("WARNING - Ignoring bad tagger index %s", filename);
+        munmap(data, sb.st_size);
+        return NULL;
+    }
+
+    TaggerIndex_t *index = MOLOCH_TYPE_ALLOC0(TaggerIndex_t);
+    index->data = data;
+    index->len = sb.st_size;
+    index->mapped = 1;
+    return index;
 }
 /******************************************************************************/
 /*
- * Free most of the memory used by a file
+ * Write the index to disk and switch it over to the mmapped copy, so the
+ * memory is shared with any other capture on the host that maps it.  The
+ * rename is atomic so anyone already using the old file is fine.
  */
-LOCAL void tagger_unload_file(TaggerFile_t *file) {
-    int i;
-    if (file->type[0] == 'i') {
-        prefix_t prefix;
+LOCAL void tagger_index_write(TaggerIndex_t *index)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", indexFile);
 
-        for (i = 0; file->elements[i]; i++) {
-            if (!ascii2prefix2(AF_INET, file->elements[i], &prefix)) {
-                LOG("Couldn't unload %s", file->elements[i]);
-                continue;
-            }
+    // mkstemp opens with O_EXCL, so nothing already at that name gets written through
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        LOG("WARNING - Couldn't write tagger index %s: %s", tmp, strerror(errno));
+        return;
+    }
+    fchmod(fd, 0644);
+
+    size_t pos = 0;
+    while (pos < index->len) {
+        ssize_t len = write(fd, index->data + pos, index->len - pos);
+        if (len <= 0) {
+            LOG("WARNING - Couldn't write tagger index %s: %s", tmp, strerror(errno));
+            close(fd);
+            unlink(tmp);
+            return;
+        }
+        pos += len;
+    }
 
-            patricia_node_t *node = patricia_search_exact(allIps, &prefix);
-            if (!node || !(node->data)) {
-                LOG("Couldn't unload %s", file->elements[i]);
-                continue;
-            }
+    uint8_t *data = mmap(NULL, index->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
 
-            tagger_remove_file(((TaggerIP_t *)(node->data))->infos, file);
-        }
-        return;
+    if (rename(tmp, indexFile) != 0) {
+        LOG("WARNING - Couldn't rename tagger index %s: %s", tmp, strerror(errno));
+        unlink(tmp);
     }
 
-    TaggerStringHash_t *hash = 0;
-    switch (file->type[0]) {
+    if (data != MAP_FAILED) {
+        g_free(index->data);
+        index->data = data;
+        index->mapped = 1;
+    }
+}
+/******************************************************************************/
+LOCAL uint32_t tagger_build_append(GByteArray *buf, const void *data, uint32_t len, int align)
+{
+    static const uint8_t zero[8];
+
+    if (buf->len % align)
+        g_byte_array_append(buf, zero, align - buf->len % align);
+
+    uint32_t off = buf->len;
+    g_byte_array_append(buf, data, len);
+    return off;
+}
+/******************************************************************************/
+LOCAL uint32_t tagger_build_str(GByteArray *buf, const char *str)
+{
+    if (!str)
+        return 0;
+    return tagger_build_append(buf, str, strlen(str) + 1, 1);
+}
+/******************************************************************************/
+LOCAL void tagger_array_free(gpointer array)
+{
+    g_array_free(array, TRUE);
+}
+/******************************************************************************/
+LOCAL void tagger_build_add(GHashTable *table, const void *key, int keyLen, uint32_t info)
+{
+    GBytes *bkey = g_bytes_new_static(key, keyLen);
+    GArray *infos = g_hash_table_lookup(table, bkey);
+    g_bytes_unref(bkey);
+
+    if (!infos) {
+        infos = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+        g_hash_table_insert(table, g_bytes_new(key, keyLen), infos);
+    } else if (g_array_index(infos, uint32_t, infos->len - 1) == info) {
+        return;
+    }
+    g_array_append_val(infos, info);
+}
+/******************************************************************************/
+LOCAL int tagger_type_table(const char *type)
+{
+    switch (type[0]) {
+    case 'i':
+        return TAGGER_TABLE_IP;
     case 'h':
-        hash = (TaggerStringHash_t *)&allDomains;
-        break;
+        return TAGGER_TABLE_DOMAIN;
     case 'm':
-        hash = (TaggerStringHash_t *)&allMD5s;
-        break;
+        return TAGGER_TABLE_MD5;
     case 'e':
-        hash = (TaggerStringHash_t *)&allEmails;
-        break;
+        return TAGGER_TABLE_EMAIL;
     case 'u':
-        hash = (TaggerStringHash_t *)&allURIs;
-        break;
-    default:
-        LOG("ERROR - Unknown tagger type %s for %s", file->type, file->str);
-    }
-
-    TaggerString_t *tstring;
-    if (hash) {
-        for (i = 0; file->elements[i]; i++) {
-            HASH_FIND(s_, *hash, file->elements[i], tstring);
-            if (tstring) {
-                tagger_remove_file(tstring->infos, file);
-                // We could check if files is now empty and remove the node, but the
-                // theory is most of the time it will be just readded in the load_file
-            }
-        }
+        return TAGGER_TABLE_URI;
     }
-
-    g_free(file->md5);
-    g_free(file->type);
-    g_strfreev(file->tags);
-    g_strfreev(file->elements);
-    file->md5 = NULL;
+    return -1;
 }
 /******************************************************************************/
-LOCAL void tagger_info_free(gpointer data)
+// Parse ip or ip/bits into a key, v4 is stored mapped like the session addresses
+LOCAL gboolean tagger_parse_ip(const char *str, uint8_t *key)
 {
-    TaggerInfo_t *info = data;
+    char            buf[INET6_ADDRSTRLEN + 5];
+    struct in6_addr addr;
+    struct in_addr  addr4;
+    int             bits;
+
+    g_strlcpy(buf, str, sizeof(buf));
+    char *slash = strchr(buf, '/');
+    if (slash)
+        *slash = 0;
+
+    if (inet_pton(AF_INET, buf, &addr4) == 1) {
+        memset(&addr, 0, sizeof(addr));
+        addr.s6_addr[10] = addr.s6_addr[11] = 0xff;
+        memcpy(addr.s6_addr + 12, &addr4, 4);
+        bits = slash ? atoi(slash + 1) : 32;
+        if (bits < 0 || bits > 32)
+            return FALSE;
+        bits += 96;
+    } else if (inet_pton(AF_INET6, buf, &addr) == 1) {
+        bits = slash ? atoi(slash + 1) : 128;
+        if (bits < 0 || bits > 128)
+            return FALSE;
+    } else {
+        return FALSE;
+    }
 
-    moloch_field_ops_free(&info->ops);
-    MOLOCH_TYPE_FREE(TaggerInfo_t, info);
+    tagger_ip_key(key, addr.s6_addr, bits);
+    return TRUE;
 }
 /******************************************************************************/
+LOCAL gboolean tagger_build_done(gpointer uw);
+LOCAL void tagger_build_start();
+/******************************************************************************/
 /*
- * File data from ES
+ * Build a new index from the old one plus the files that changed.  Only the
+ * changed files are parsed, everything else is copied over from the old
+ * index.  Runs on its own thread, only reading the old index.
  */
-LOCAL void tagger_load_file_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer uw)
+LOCAL gpointer tagger_build_thread(gpointer uw)
 {
-    TaggerFile_t *file = uw;
-    uint32_t out[4*100];
-
-    if (file->md5)
-        tagger_unload_file(file);
-
-    memset(out, 0, sizeof(out));
-    if (!data_len || !data) {
-        HASH_REMOVE(s_, allFiles, file);
-        free(file->str);
-        MOLOCH_TYPE_FREE(TaggerFile_t, file);
-        return;
+    TaggerBuild_t           *build = uw;
+    const TaggerIndex_t     *old = build->old;
+    GHashTable              *changed = g_hash_table_new(g_str_hash, g_str_equal);
+    GArray                  *files = g_array_new(FALSE, FALSE, sizeof(TaggerBuildFile_t));
+    GArray                  *infos = g_array_new(FALSE, FALSE, sizeof(TaggerBuildInfo_t));
+    GHashTable              *tables[TAGGER_TABLES];
+    GPtrArray               *freeLater = g_ptr_array_new_with_free_func((GDestroyNotify)g_strfreev);
+    uint32_t                 i, f, t;
+
+    for (t = 0; t < TAGGER_TABLES; t++) {
+        tables[t] = g_hash_table_new_full(g_bytes_hash, g_bytes_equal, (GDestroyNotify)g_bytes_unref, tagger_array_free);
     }
 
-    int rc;
-    if ((rc = js0n(data, data_len, out, sizeof(out))) != 0) {
-        LOG("ERROR: Parse error %d in >%.*s<\n", rc, data_len, data);
-        HASH_REMOVE(s_, allFiles, file);
-        free(file->str);
-        MOLOCH_TYPE_FREE(TaggerFile_t, file);
-        return;
+    // Last one wins if a file changed more than once
+    for (i = 0; i < build->loads->len; i++) {
+        TaggerLoad_t *load = g_ptr_array_index(build->loads, i);
+        g_hash_table_insert(changed, load->id, load);
     }
 
-    unsigned int fieldShortHand[20];
-    memset(fieldShortHand, 0xff, sizeof(fieldShortHand));
-
-    int i;
-    for (i = 0; out[i]; i+= 4) {
-        if (out[i+1] == 3 && memcmp("md5", data + out[i], sizeof("md5")-1) == 0) {
-            file->md5 = g_strndup((char*)data + out[i+2], out[i+3]);
-        } else if (out[i+1] == 4 && memcmp("tags", data + out[i], sizeof("tags")-1) == 0) {
-            data[out[i+2] + out[i+3]] = 0;
-            file->tags = g_strsplit((char*)data + out[i+2], ",", 0);
-        } else if (out[i+1] == sizeof("type")-1 && memcmp("type", data + out[i], sizeof("type")-1) == 0) {
-            file->type = g_strndup((char*)data + out[i+2], out[i+3]);
-        } else if (out[i+1] == sizeof("data")-1 && memcmp("data", data + out[i], sizeof("data")-1) == 0) {
-            data[out[i+2] + out[i+3]] = 0;
-            file->elements = g_strsplit((char*)data + out[i+2], ",", 0);
-        } else if (out[i+1] == sizeof("fields") - 1 && memcmp("fields", data + out[i], sizeof("fields")-1) == 0) {
-            data[out[i+2] + out[i+3]] = 0;
-            char **fields = g_strsplit((char*)data + out[i+2], ",", 0);
-            int f;
-            for (f = 0; f < 100 && fields[f]; f++) {
-                int shortcut = -1;
-                int pos = moloch_field_define_text(fields[f], &shortcut);
-                if (shortcut >= 0 && shortcut < 20)
-                    fieldShortHand[shortcut] = pos;
+    // Copy over everything from the files that didn't change
+    if (old) {
+        const uint8_t           *data = old->data;
+        const TaggerIndexHdr_t  *hdr = (TaggerIndexHdr_t *)data;
+        const TaggerIndexFile_t *ofiles = (TaggerIndexFile_t *)(data + hdr->files);
+        const TaggerIndexInfo_t *oinfos = (TaggerIndexInfo_t *)(data + hdr->infos);
+        int32_t                 *fileMap = g_malloc(MAX(hdr->numFiles, 1) * sizeof(int32_t));
+        int32_t                 *infoMap = g_malloc(MAX(hdr->numInfos, 1) * sizeof(int32_t));
+
+        for (f = 0; f < hdr->numFiles; f++) {
+            if (g_hash_table_contains(changed, data + ofiles[f].id)) {
+                fileMap[f] = -1;
+                continue;
             }
-            g_strfreev(fields);
+            TaggerBuildFile_t file = {(char *)data + ofiles[f].id, (char *)data + ofiles[f].md5, (char *)data + ofiles[f].type,
+                                (char *)data + ofiles[f].tags, ofiles[f].fields ? (char *)data + ofiles[f].fields : NULL};
+            fileMap[f] = files->len;
+            g_array_append_val(files, file);
         }
-    }
 
-    patricia_node_t *node;
-    TaggerIP_t *tip;
+        for (i = 0; i < hdr->numInfos; i++) {
+            if (fileMap[oinfos[i].file] == -1) {
+                infoMap[i] = -1;
+                continue;
+            }
+            TaggerBuildInfo_t info = {fileMap[oinfos[i].file], oinfos[i].ops ? (char *)data + oinfos[i].ops : NULL};
+            infoMap[i] = infos->len;
+            g_array_append_val(infos, info);
+        }
 
-    for (i = 0; file->elements[i]; i++) {
+        for (t = 0; t < TAGGER_TABLES; t++) {
+            if (!hdr->tables[t].slots)
+                continue;
 
-        int p = 2;
-        char *parts[100];
-        char *str = file->elements[i];
+            const TaggerIndexSlot_t *slots = (TaggerIndexSlot_t *)(data + hdr->tables[t].slots);
+            for (uint32_t s = 0; s <= hdr->tables[t].mask; s++) {
+                if (!slots[s].key)
+                    continue;
 
-        parts[0] = file->elements[i];
-        parts[1] = 0;
-        while (*str && p < 100) {
-            if (*str == ';' || *str == '=') {
-                if (!str[1])
-                    break;
-                parts[p] = str+1;
-                p++;
-                *str = 0;
+                const uint32_t *sinfos = (uint32_t *)(data + slots[s].infos);
+                for (i = 0; i < slots[s].numInfos; i++) {
+                    if (infoMap[sinfos[i]] != -1)
+                        tagger_build_add(tables[t], data + slots[s].key, slots[s].keyLen, infoMap[sinfos[i]]);
+                }
             }
-            str++;
         }
+        g_free(fileMap);
+        g_free(infoMap);
+    }
 
-        TaggerInfo_t *info = MOLOCH_TYPE_ALLOC(TaggerInfo_t);
-        info->file = file;
-        moloch_field_ops_init(&info->ops, p-2, 0);
-
-        int j;
-        for(j = 2; j < p; j+=2) {
-            int pos = -1;
-            if (isdigit(parts[j][0])) {
-                unsigned int f = atoi(parts[j]);
-                if (f < 20 && fieldShortHand[f] != 0xffffffff)
-                    pos = fieldShortHand[f];
-            } else {
-                pos = moloch_field_by_exp(parts[j]);
-            }
-            if (pos == -1) {
-                LOG("WARNING - Unknown expression field %s", parts[j]);
-                continue;
-            }
+    // Parse the files that changed
+    GHashTableIter iter;
+    TaggerLoad_t  *load;
+    g_hash_table_iter_init (&iter, changed);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&load)) {
+        if (!load->md5)
+            continue;
 
-            moloch_field_ops_add(&info->ops, pos, parts[j+1], strlen(parts[j+1]));
+        TaggerBuildFile_t file = {load->id, load->md5, load->type, load->tags, load->fields};
+        const uint32_t fileNum = files->len;
+        g_array_append_val(files, file);
+
+        const int table = tagger_type_table(load->type);
+        if (table == -1) {
+            LOG("ERROR - Unknown tagger type %s for %s", load->type, load->id);
+            continue;
         }
 
-        TaggerStringHash_t *hash = 0;
-        switch (file->type[0]) {
-        case 'i':
-            node = make_and_lookup(allIps, parts[0]);
-            if (!node) {
-                LOG("Couldn't create node for %s", parts[0]);
-                continue;
+        char **elements = g_strsplit(load->data, ",", 0);
+        g_ptr_array_add(freeLater, elements);
+
+        // Elements without ops all share one info for the file
+        uint32_t fileInfo = 0xffffffff;
+        for (i = 0; elements[i]; i++) {
+            char *ops = strpbrk(elements[i], ";=");
+            if (ops) {
+                *ops = 0;
+                ops++;
             }
-            if (!node->data) {
-                tip = MOLOCH_TYPE_ALLOC(TaggerIP_t);
-                tip->infos = g_ptr_array_new_with_free_func(tagger_info_free);
-                node->data = tip;
+
+            uint32_t infoNum;
+            if (ops && *ops) {
+                TaggerBuildInfo_t info = {fileNum, ops};
+                infoNum = infos->len;
+                g_array_append_val(infos, info);
             } else {
-                tip = node->data;
+                if (fileInfo == 0xffffffff) {
+                    TaggerBuildInfo_t info = {fileNum, NULL};
+                    fileInfo = infos->len;
+                    g_array_append_val(infos, info);
+                }
+                infoNum = fileInfo;
             }
-            g_ptr_array_add(tip->infos, info);
-            continue;
-        case 'h':
-            hash = (TaggerStringHash_t *)&allDomains;
-            break;
-        case 'm':
-            hash = (TaggerStringHash_t *)&allMD5s;
-            break;
-        case 'e':
-            hash = (TaggerStringHash_t *)&allEmails;
-            break;
-        case 'u':
-            hash = (TaggerStringHash_t *)&allURIs;
-            break;
-        default:
-            LOG("ERROR - Unknown tagger type %s for %s", file->type, file->str);
+
+            if (table == TAGGER_TABLE_IP) {
+                uint8_t key[TAGGER_IP_KEY_LEN];
+                if (!tagger_parse_ip(elements[i], key)) {
+                    LOG("Couldn't create node for %s", elements[i]);
+                    continue;
+                }
+                tagger_build_add(tables[table], key, TAGGER_IP_KEY_LEN, infoNum);
+            } else {
+                tagger_build_add(tables[table], elements[i], strlen(elements[i]), infoNum);
+            }
+        }
+    }
+
+    // Lay it all out
+    GByteArray       *buf = g_byte_array_sized_new(sizeof(TaggerIndexHdr_t) + 1024);
+    TaggerIndexHdr_t  hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TAGGER_INDEX_MAGIC, 8);
+    g_byte_array_append(buf, (uint8_t *)&hdr, sizeof(hdr));
+
+    TaggerIndexFile_t *ifiles = g_malloc0(MAX(files->len, 1) * sizeof(TaggerIndexFile_t));
+    for (f = 0; f < files->len; f++) {
+        TaggerBuildFile_t *file = &g_array_index(files, TaggerBuildFile_t, f);
+        ifiles[f].id = tagger_build_str(buf, file->id);
+        ifiles[f].md5 = tagger_build_str(buf, file->md5);
+        ifiles[f].type = tagger_build_str(buf, file->type);
+        ifiles[f].tags = tagger_build_str(buf, file->tags ? file->tags : "");
+        ifiles[f].fields = tagger_build_str(buf, file->fields);
+    }
+    hdr.numFiles = files->len;
+    hdr.files = tagger_build_append(buf, ifiles, files->len * sizeof(TaggerIndexFile_t), 4);
+    g_free(ifiles);
+
+    TaggerIndexInfo_t *iinfos = g_malloc0(MAX(infos->len, 1) * sizeof(TaggerIndexInfo_t));
+    for (i = 0; i < infos->len; i++) {
+        TaggerBuildInfo_t *info = &g_array_index(infos, TaggerBuildInfo_t, i);
+        iinfos[i].file = info->file;
+        iinfos[i].ops = tagger_build_str(buf, info->ops);
+    }
+    hdr.numInfos = infos->len;
+    hdr.infos = tagger_build_append(buf, iinfos, infos->len * sizeof(TaggerIndexInfo_t), 4);
+    g_free(iinfos);
+
+    for (t = 0; t < TAGGER_TABLES; t++) {
+        const uint32_t num = g_hash_table_size(tables[t]);
+        if (num == 0)
             continue;
-        } 
 
-        TaggerString_t *tstring;
+        // At most half full
+        uint32_t size = 16;
+        while (size < num * 2)
+            size <<= 1;
+
+        TaggerIndexSlot_t *slots = g_malloc0(size * sizeof(TaggerIndexSlot_t));
+        GBytes            *bkey;
+        GArray            *sinfos;
+
+        g_hash_table_iter_init (&iter, tables[t]);
+        while (g_hash_table_iter_next (&iter, (gpointer *)&bkey, (gpointer *)&sinfos)) {
+            gsize          keyLen;
+            const uint8_t *key = g_bytes_get_data(bkey, &keyLen);
+            const uint32_t h = tagger_hash(key, keyLen);
+
+            uint32_t s = h & (size - 1);
+            while (slots[s].key)
+                s = (s + 1) & (size - 1);
+
+            slots[s].hash = h;
+            slots[s].keyLen = keyLen;
+            slots[s].key = tagger_build_append(buf, key, keyLen, 1);
+            slots[s].infos = tagger_build_append(buf, sinfos->data, sinfos->len * sizeof(uint32_t), 4);
+            slots[s].numInfos = sinfos->len;
+
+            if (t == TAGGER_TABLE_IP)
+                hdr.ipLens[key[0] / 64] |= 1ULL << (key[0] % 64);
+        }
+
+        hdr.tables[t].mask = size - 1;
+        hdr.tables[t].slots = tagger_build_append(buf, slots, size * sizeof(TaggerIndexSlot_t), 4);
+        g_free(slots);
+        g_hash_table_destroy(tables[t]);
+    }
+
+    hdr.size = buf->len;
+    memcpy(buf->data, &hdr, sizeof(hdr));
+
+    TaggerIndex_t *index = MOLOCH_TYPE_ALLOC0(TaggerIndex_t);
+    index->len = buf->len;
+    index->data = g_byte_array_free(buf, FALSE);
+
+    if (config.debug)
+        LOG("Built tagger index with %u files, %u infos, %zu bytes", hdr.numFiles, hdr.numInfos, index->len);
+
+    if (indexFile)
+        tagger_index_write(index);
+
+    g_ptr_array_free(freeLater, TRUE);
+    g_array_free(files, TRUE);
+    g_array_free(infos, TRUE);
+    g_hash_table_destroy(changed);
+
+    build->index = index;
+    g_idle_add(tagger_build_done, build);
+    return NULL;
+}
+/******************************************************************************/
+/*
+ * Back on the main thread, finish and switch to the new index
+ */
+LOCAL gboolean tagger_build_done(gpointer uw)
+{
+    TaggerBuild_t *build = uw;
+
+    tagger_index_open(build->index);
+
+    TaggerIndex_t *old = tagger;
+    __atomic_store_n(&tagger, build->index, __ATOMIC_RELEASE);
+    if (old)
+        moloch_free_later(old, (GDestroyNotify)tagger_index_free);
+
+    g_ptr_array_free(build->loads, TRUE);
+    MOLOCH_TYPE_FREE(TaggerBuild_t, build);
+    building = 0;
+
+    // More changes showed up while building
+    if (loads->len && loadsPending == 0)
+        tagger_build_start();
+
+    return G_SOURCE_REMOVE;
+}
+/******************************************************************************/
+/*
+ * Once all the files that changed have been downloaded build a new index
+ */
+LOCAL void tagger_build_start()
+{
+    if (building)
+        return;
+
+    building = 1;
+
+    TaggerBuild_t *build = MOLOCH_TYPE_ALLOC0(TaggerBuild_t);
+    build->old = tagger;
+    build->loads = loads;
+    loads = g_ptr_array_new_with_free_func((GDestroyNotify)tagger_load_free);
+
+    g_thread_unref(g_thread_new("moloch-tagger", &tagger_build_thread, build));
+}
+/******************************************************************************/
+/*
+ * File data from ES
+ */
+LOCAL void tagger_load_file_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer uw)
+{
+    TaggerLoad_t *load = uw;
+    uint32_t out[4*100];
+
+    loadsPending--;
+    g_ptr_array_add(loads, load);
 
-        HASH_FIND(s_, *hash, parts[0], tstring);
-        if (!tstring) {
-            tstring = MOLOCH_TYPE_ALLOC(TaggerString_t);
-            tstring->str = strdup(parts[0]); // Need to strdup since file might be unloaded
-            tstring->infos = g_ptr_array_new_with_free_func(tagger_info_free);
-            HASH_ADD(s_, *hash, tstring->str, tstring);
+    memset(out, 0, sizeof(out));
+    int rc;
+    if (!data_len || !data) {
+        // Treat like it was removed
+    } else if ((rc = js0n(data, data_len, out, sizeof(out))) != 0) {
+        LOG("ERROR: Parse error %d in >%.*s<\n", rc, data_len, data);
+    } else {
+        int i;
+        for (i = 0; out[i]; i+= 4) {
+            if (out[i+1] == 3 && memcmp("md5", data + out[i], sizeof("md5")-1) == 0) {
+                load->md5 = g_strndup((char*)data + out[i+2], out[i+3]);
+            } else if (out[i+1] == 4 && memcmp("tags", data + out[i], sizeof("tags")-1) == 0) {
+                load->tags = g_strndup((char*)data + out[i+2], out[i+3]);
+            } else if (out[i+1] == sizeof("type")-1 && memcmp("type", data + out[i], sizeof("type")-1) == 0) {
+                load->type = g_strndup((char*)data + out[i+2], out[i+3]);
+            } else if (out[i+1] == sizeof("data")-1 && memcmp("data", data + out[i], sizeof("data")-1) == 0) {
+                load->data = g_strndup((char*)data + out[i+2], out[i+3]);
+            } else if (out[i+1] == sizeof("fields") - 1 && memcmp("fields", data + out[i], sizeof("fields")-1) == 0) {
+                load->fields = g_strndup((char*)data + out[i+2], out[i+3]);
+            }
         }
-        g_ptr_array_add(tstring->infos, info);
-    } /* for elements */
+    }
+
+    if (!load->md5 || !load->type || !load->data) {
+        g_free(load->md5);
+        load->md5 = NULL;
+        g_hash_table_remove(knownFiles, load->id);
+    }
+
+    if (loadsPending == 0)
+        tagger_build_start();
 }
 /******************************************************************************/
 /*
  * Start loading a file from database
  */
-LOCAL void tagger_load_file(TaggerFile_t *file)
+LOCAL void tagger_load_file(const char *id)
 {
     char                key[500];
     int                 key_len;
 
-    key_len = snprintf(key, sizeof(key), "/tagger/_source/%s", file->str);
+    TaggerLoad_t *load = MOLOCH_TYPE_ALLOC0(TaggerLoad_t);
+    load->id = g_strdup(id);
+    loadsPending++;
+
+    key_len = snprintf(key, sizeof(key), "/tagger/_source/%s", id);
 
-    moloch_http_send(esServer, "GET", key, key_len, NULL, 0, NULL, FALSE, tagger_load_file_cb, file);
+    moloch_http_send(esServer, "GET", key, key_len, NULL, 0, NULL, FALSE, tagger_load_file_cb, load);
 }
 /******************************************************************************/
 /*
- * Process the list of files from ES
+ * Process the list of files from ES, only files that are new or have a
+ * different md5 are downloaded, and files no longer there are removed.
  */
 LOCAL void tagger_fetch_files_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer UNUSED(uw))
 {
@@ -599,6 +1039,8 @@ LOCAL void tagger_fetch_files_cb(int UNUSED(code), unsigned char *data, int data
         LOG("ERROR: Parse error %d in >%.*s<\n", rc, hits_len, hits);
         return;
     }
+
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
     int i;
     for (i = 0; out[i]; i+= 2) {
         uint32_t           source_len;
@@ -614,26 +1056,41 @@ LOCAL void tagger_fetch_files_cb(int UNUSED(code), unsigned char *data, int data
         unsigned char     *md5 = 0;
         md5 = moloch_js0n_get(source, source_len, "md5", &md5_len);
 
+        if (!id || !md5) {
+            g_free(id);
+            continue;
+        }
+
         if (*md5 == '[') {
             md5+=2;
             md5_len -= 4;
         }
 
+        g_hash_table_add(seen, id);
 
-        TaggerFile_t *file;
-        HASH_FIND(s_, allFiles, id, file);
-        if (!file) {
-            file = MOLOCH_TYPE_ALLOC0(TaggerFile_t);
-            file->str = id;
-            HASH_ADD(s_, allFiles, file->str, file);
-            tagger_load_file(file);
-            continue;
-        }
-        g_free(id);
-        if (!file->md5 || strncmp(file->md5, (char*)md5, md5_len) != 0) {
-            tagger_load_file(file);
+        char *known = g_hash_table_lookup(knownFiles, id);
+        if (!known || strlen(known) != md5_len || strncmp(known, (char*)md5, md5_len) != 0) {
+            g_hash_table_insert(knownFiles, g_strdup(id), g_strndup((char *)md5, md5_len));
+            tagger_load_file(id);
         }
     }
+
+    GHashTableIter  iter;
+    char           *id;
+    g_hash_table_iter_init (&iter, knownFiles);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&id, NULL)) {
+        if (g_hash_table_contains(seen, id))
+            continue;
+
+        TaggerLoad_t *load = MOLOCH_TYPE_ALLOC0(TaggerLoad_t);
+        load->id = g_strdup(id);
+        g_ptr_array_add(loads, load);
+        g_hash_table_iter_remove(&iter);
+    }
+    g_hash_table_destroy(seen);
+
+    if (loads->len && loadsPending == 0)
+        tagger_build_start();
 }
 
 /******************************************************************************/
@@ -660,6 +1117,29 @@ LOCAL gboolean tagger_fetch_files (gpointer sync)
     return G_SOURCE_CONTINUE;
 }
 /******************************************************************************/
+/*
+ * Start with the index from disk if there is one, only the files that
+ * changed since it was built are downloaded
+ */
+LOCAL void tagger_load_index()
+{
+    TaggerIndex_t *index = tagger_index_map(indexFile);
+    if (!index)
+        return;
+
+    tagger_index_open(index);
+    tagger = index;
+
+    const TaggerIndexHdr_t  *hdr = (TaggerIndexHdr_t *)index->data;
+    const TaggerIndexFile_t *files = (TaggerIndexFile_t *)(index->data + hdr->files);
+    for (uint32_t f = 0; f < hdr->numFiles; f++) {
+        g_hash_table_insert(knownFiles, g_strdup((char *)index->data + files[f].id), g_strdup((char *)index->data + files[f].md5));
+    }
+
+    if (config.debug)
+        LOG("Loaded tagger index %s with %u files", indexFile, hdr->numFiles);
+}
+/******************************************************************************/
 /*
  * Called by arkime when the plugin is loaded
  */
@@ -670,12 +1150,8 @@ void moloch_plugin_init()
         return;
     }
 
-    HASH_INIT(s_, allFiles, moloch_string_hash, moloch_string_cmp);
-    HASH_INIT(s_, allDomains, moloch_string_hash, moloch_string_cmp);
-    HASH_INIT(s_, allMD5s, moloch_string_hash, moloch_string_cmp);
-    HASH_INIT(s_, allEmails, moloch_string_hash, moloch_string_cmp);
-    HASH_INIT(s_, allURIs, moloch_string_hash, moloch_string_cmp);
-    allIps = New_Patricia(128);
+    knownFiles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    loads = g_ptr_array_new_with_free_func((GDestroyNotify)tagger_load_free);
 
     moloch_plugins_register("tagger", FALSE);
 
@@ -699,11 +1175,25 @@ void moloch_plugin_init()
     emailSrcField  = moloch_field_by_db("email.src");
     emailDstField  = moloch_field_by_db("email.dst");
     dnsHostField   = moloch_field_by_db("dns.host");
+    dnsMailServerField = -1;
 
     if (config.parseDNSRecordAll) {
         dnsMailServerField = moloch_field_by_db("dns.mailserverHost");
     }
 
+    // Default to the first pcapDir, capture already owns it and can write there
+    char defaultIndexFile[PATH_MAX];
+    defaultIndexFile[0] = 0;
+    if (config.pcapDir && config.pcapDir[0])
+        snprintf(defaultIndexFile, sizeof(defaultIndexFile), "%s/%stagger.index", config.pcapDir[0], config.prefix);
+    indexFile = moloch_config_str(NULL, "taggerIndexFile", defaultIndexFile);
+    if (!indexFile[0]) {
+        g_free(indexFile);
+        indexFile = NULL;
+    } else {
+        tagger_load_index();
+    }
+
     /* Call right away sync, and schedule every 60 seconds async */
     tagger_fetch_files((gpointer)1);
     g_timeout_add_seconds(60, tagger_fetch_files, 0);
@@ -22,6 +22,16 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 extern MolochConfig_t        config;
 
@@ -83,7 +93,8 @@ LOCAL const int validDNS[256] = {
 #define INTEL_STAT_REQUEST    2
 #define INTEL_STAT_INPROGRESS 3
 #define INTEL_STAT_FAIL       4
-#define INTEL_STAT_SIZE       5
+#define INTEL_STAT_DISK       5
+#define INTEL_STAT_SIZE       6
 
 LOCAL uint32_t stats[INTEL_TYPE_SIZE][INTEL_STAT_SIZE];
 /******************************************************************************/
@@ -150,10 +161,11 @@ LOCAL int wise_item_cmp(const void *keyv, const void *elementv)
 LOCAL void wise_print_stats()
 {
     for (int i = 0; i < numTypes; i++) {
-        LOG("%8s lookups:%7d cache:%7d requests:%7d inprogress:%7d fail:%7d hash:%7d list:%7u",
+        LOG("%8s lookups:%7d cache:%7d disk:%7d requests:%7d inprogress:%7d fail:%7d hash:%7d list:%7u",
             types[i].name,
             stats[i][0],
             stats[i][1],
+            stats[i][5],
             stats[i][2],
             stats[i][3],
             stats[i][4],
@@ -162,12 +174,15 @@ LOCAL void wise_print_stats()
     }
 }
 /******************************************************************************/
+LOCAL void wise_disk_fields_publish(const int *map, int cnt);
 LOCAL void wise_load_fields()
 {
     char                key[500];
     int                 key_len;
+    int                 map[MOLOCH_FIELDS_DB_MAX];
+    uint32_t            ts = 0;
 
-    memset(fieldsMap[0], -1, sizeof(fieldsMap[0]));
+    memset(map, -1, sizeof(map));
 
     key_len = snprintf(key, sizeof(key), "/fields?ver=1");
     size_t         data_len;
@@ -177,7 +192,7 @@ LOCAL void wise_load_fields()
     BSB_INIT(bsb, data, data_len);
 
     int ver = -1, cnt = 0;
-    BSB_IMPORT_u32(bsb, fieldsTS);
+    BSB_IMPORT_u32(bsb, ts);
     BSB_IMPORT_u32(bsb, ver);
 
     if (ver < 0 || ver > 1) {
@@ -205,15 +220,23 @@ LOCAL void wise_load_fields()
     for (int i = 0; i < cnt; i++) {
         int len = 0;
         BSB_IMPORT_u16(bsb, len); // len includes NULL terminated
-        fieldsMap[0][i] = moloch_field_define_text((char*)BSB_WORK_PTR(bsb), NULL);
-        if (fieldsMap[0][i] == -1) {
-            fieldsTS = 0;
+        map[i] = moloch_field_define_text((char*)BSB_WORK_PTR(bsb), NULL);
+        if (map[i] == -1) {
+            ts = 0;
             if (config.debug)
-                LOG("Couldn't define field - %d %d %s", i, fieldsMap[0][i], BSB_WORK_PTR(bsb));
+                LOG("Couldn't define field - %d %d %s", i, map[i], BSB_WORK_PTR(bsb));
         }
         BSB_IMPORT_skip(bsb, len);
     }
     free(data);
+
+    // The stream thread reads the map under the item lock
+    MOLOCH_LOCK(item);
+    memcpy(fieldsMap[0], map, sizeof(map));
+    fieldsTS = ts;
+    MOLOCH_UNLOCK(item);
+
+    wise_disk_fields_publish(map, cnt);
 }
 /******************************************************************************/
 LOCAL void wise_session_cmd_cb(MolochSession_t *session, gpointer uw1, gpointer UNUSED(uw2))
@@ -246,15 +269,362 @@ LOCAL void wise_remove_item_locked(WiseItem_t *wi)
     moloch_free_later(wi, (GDestroyNotify) wise_free_item);
 }
 /******************************************************************************/
-LOCAL void wise_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer uw)
+LOCAL void wise_item_cached_locked(WiseItem_t *wi)
+{
+    DLL_PUSH_HEAD(wil_, &types[(int)wi->type].itemList, wi);
+    // Cache needs to be reduced
+    if (types[(int)wi->type].itemList.wil_count > maxCache) {
+        DLL_POP_TAIL(wil_, &types[(int)wi->type].itemList, wi);
+        wise_remove_item_locked(wi);
+    }
+}
+/******************************************************************************/
+/*
+ * Optional disk cache of results that survives restarts and is shared by all
+ * the captures on a host.  The file is a header, a CLOCK hand per set and then
+ * sets of WISE_CACHE_WAYS fixed size slots.  Each slot has a seqlock, readers
+ * never wait and treat a torn read as a miss, writers claim a slot by making
+ * its seq odd.  Field positions differ between processes, so ops are stored
+ * with the field expression.
+ */
+#define WISE_CACHE_MAGIC    "ARKWISE1"
+#define WISE_CACHE_WAYS     8
+#define WISE_CACHE_HDR_SIZE 4096
+#define WISE_CACHE_SLOT_MAX 8192
+
+typedef struct {
+    char                  magic[8];
+    uint32_t              slotSize;
+    uint32_t              numSets;
+} WiseCacheHdr_t;
+
+typedef struct {
+    uint32_t              seq;      // odd while being written
+    uint32_t              hash;
+    uint32_t              loadTime;
+    uint16_t              keyLen;   // type name, NULL, key
+    uint16_t              dataLen;
+    uint8_t               ref;      // CLOCK bit, set on every hit
+    uint8_t               pad[3];
+    uint8_t               data[];
+} WiseCacheSlot_t;
+
+/* The disk cache stores field expressions since positions differ between
+ * captures.  Expression to pos+1 for every field WISE defined, only the main
+ * thread defines fields so it builds a new table each time and swaps it in,
+ * packet threads just read whatever table is current.
+ */
+LOCAL GHashTable           *diskFieldsByExp;
+
+LOCAL uint8_t              *diskCache;
+LOCAL size_t                diskCacheLen;
+LOCAL size_t                diskCacheSlots;
+LOCAL uint32_t              diskCacheSlotSize;
+LOCAL uint32_t              diskCacheNumSets;
+
+/******************************************************************************/
+LOCAL inline uint32_t wise_disk_hash(const uint8_t *key, int len)
+{
+    uint32_t n = 2166136261U;
+
+    while (len--) {
+        n ^= *key++;
+        n *= 16777619;
+    }
+    return n;
+}
+/******************************************************************************/
+LOCAL inline WiseCacheSlot_t *wise_disk_slot(uint32_t set, int way)
+{
+    return (WiseCacheSlot_t *)(diskCache + diskCacheSlots + ((size_t)set * WISE_CACHE_WAYS + way) * diskCacheSlotSize);
+}
+/******************************************************************************/
+LOCAL int wise_disk_key(const WiseItem_t *wi, uint8_t *key, int size)
+{
+    const int nameLen = types[(int)wi->type].nameLen;
+    const int valueLen = strlen(wi->key);
+
+    if (nameLen + 1 + valueLen > size)
+        return -1;
+
+    memcpy(key, types[(int)wi->type].name, nameLen);
+    key[nameLen] = 0;
+    memcpy(key + nameLen + 1, wi->key, valueLen);
+    return nameLen + 1 + valueLen;
+}
+/******************************************************************************/
+// Main thread only, add the fields just defined to a new copy of diskFieldsByExp
+LOCAL void wise_disk_fields_publish(const int *map, int cnt)
+{
+    GHashTable *old = diskFieldsByExp;
+    GHashTable *fieldsByExp = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (old) {
+        g_hash_table_iter_init(&iter, old);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            g_hash_table_insert(fieldsByExp, g_strdup(key), value);
+    }
+
+    for (int i = 0; i < cnt; i++) {
+        if (map[i] >= 0 && map[i] < MOLOCH_FIELDS_CNT_MAX && config.fields[map[i]])
+            g_hash_table_replace(fieldsByExp, g_strdup(config.fields[map[i]]->expression), GINT_TO_POINTER(map[i] + 1));
+    }
+
+    __atomic_store_n(&diskFieldsByExp, fieldsByExp, __ATOMIC_RELEASE);
+    if (old)
+        moloch_free_later(old, (GDestroyNotify)g_hash_table_destroy);
+}
+/******************************************************************************/
+LOCAL void wise_disk_export_op(BSB *bsb, int fieldPos, const char *str, int len)
+{
+    if (len < 1) {
+        BSB_SET_ERROR(*bsb);
+        return;
+    }
+
+    if (fieldPos >= 0 && fieldPos < MOLOCH_FIELDS_CNT_MAX) {
+        const char *exp = config.fields[fieldPos] ? config.fields[fieldPos]->expression : NULL;
+        const int   expLen = exp ? (int)strlen(exp) + 1 : 0;
+        if (expLen < 2 || expLen > 0xff) {
+            BSB_SET_ERROR(*bsb);
+            return;
+        }
+        BSB_EXPORT_u08(*bsb, expLen);
+        BSB_EXPORT_ptr(*bsb, exp, expLen);
+    } else {
+        BSB_EXPORT_u08(*bsb, 0);
+        BSB_EXPORT_u16(*bsb, fieldPos);
+    }
+
+    BSB_EXPORT_u08(*bsb, len);
+    BSB_EXPORT_ptr(*bsb, str, len - 1);
+    BSB_EXPORT_u08(*bsb, 0);
+}
+/******************************************************************************/
+LOCAL int wise_disk_import_ops(WiseItem_t *wi, uint8_t *data, int dataLen)
+{
+    BSB bsb;
+    BSB_INIT(bsb, data, dataLen);
+
+    int numOps = 0;
+    BSB_IMPORT_u08(bsb, numOps);
+
+    moloch_field_ops_init(&wi->ops, numOps, MOLOCH_FIELD_OPS_FLAGS_COPY);
+    for (int o = 0; o < numOps && !BSB_IS_ERROR(bsb); o++) {
+        int fieldPos = -1;
+        int len = 0;
+
+        BSB_IMPORT_u08(bsb, len);
+        if (len == 0) {
+            BSB_IMPORT_u16(bsb, fieldPos);
+            fieldPos = (int16_t)fieldPos;
+        } else {
+            char *exp = (char*)BSB_WORK_PTR(bsb);
+            BSB_IMPORT_skip(bsb, len);
+            if (BSB_NOT_ERROR(bsb) && exp[len - 1] == 0) {
+                GHashTable *fieldsByExp = __atomic_load_n(&diskFieldsByExp, __ATOMIC_ACQUIRE);
+                fieldPos = fieldsByExp ? GPOINTER_TO_INT(g_hash_table_lookup(fieldsByExp, exp)) - 1 : -1;
+            }
+        }
+
+        len = 0;
+        BSB_IMPORT_u08(bsb, len);
+        char *str = (char*)BSB_WORK_PTR(bsb);
+        BSB_IMPORT_skip(bsb, len);
+
+        // Fields this process doesn't know yet have to come from WISE
+        if (BSB_IS_ERROR(bsb) || fieldPos == -1 || len == 0 || str[len - 1] != 0) {
+            BSB_SET_ERROR(bsb);
+            break;
+        }
+
+        moloch_field_ops_add(&wi->ops, fieldPos, str, len - 1);
+    }
+
+    if (BSB_IS_ERROR(bsb)) {
+        moloch_field_ops_free(&wi->ops);
+        return 0;
+    }
+    return 1;
+}
+/******************************************************************************/
+// Fill in wi from the disk cache, doesn't lock so torn or changing slots are just a miss
+LOCAL int wise_disk_get(WiseItem_t *wi, uint32_t now)
 {
+    uint8_t   key[WISE_CACHE_SLOT_MAX];
+    uint8_t   buf[WISE_CACHE_SLOT_MAX];
+    const int maxData = diskCacheSlotSize - sizeof(WiseCacheSlot_t);
+    const int keyLen = wise_disk_key(wi, key, maxData);
+
+    if (keyLen < 0)
+        return 0;
+
+    const uint32_t h = wise_disk_hash(key, keyLen);
+    const uint32_t set = h % diskCacheNumSets;
+
+    for (int w = 0; w < WISE_CACHE_WAYS; w++) {
+        WiseCacheSlot_t *slot = wise_disk_slot(set, w);
+        const uint32_t   seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if ((seq & 1) || slot->hash != h || slot->keyLen != keyLen)
+            continue;
+
+        const uint32_t loadTime = slot->loadTime;
+        const int      dataLen = slot->dataLen;
+        if (keyLen + dataLen > maxData)
+            continue;
+
+        memcpy(buf, slot->data, keyLen + dataLen);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq || memcmp(buf, key, keyLen) != 0)
+            continue;
+
+        if (loadTime + cacheSecs <= now || !wise_disk_import_ops(wi, buf + keyLen, dataLen))
+            return 0;
+
+        if (!slot->ref)
+            slot->ref = 1;
+        wi->loadTime = loadTime;
+        return 1;
+    }
+    return 0;
+}
+/******************************************************************************/
+LOCAL void wise_disk_put(const WiseItem_t *wi, const uint8_t *data, int dataLen)
+{
+    uint8_t          key[WISE_CACHE_SLOT_MAX];
+    const int        maxData = diskCacheSlotSize - sizeof(WiseCacheSlot_t);
+    const int        keyLen = wise_disk_key(wi, key, maxData);
+    WiseCacheSlot_t *slot = NULL;
+    WiseCacheSlot_t *s;
+
+    if (keyLen < 0 || keyLen + dataLen > maxData)
+        return;
 
+    const uint32_t h = wise_disk_hash(key, keyLen);
+    const uint32_t set = h % diskCacheNumSets;
+    uint8_t       *hands = diskCache + WISE_CACHE_HDR_SIZE;
+
+    // Replace an older copy of the same key
+    for (int w = 0; w < WISE_CACHE_WAYS; w++) {
+        s = wise_disk_slot(set, w);
+        if (s->hash == h && s->keyLen == keyLen && memcmp(s->data, key, keyLen) == 0) {
+            slot = s;
+            break;
+        }
+    }
+
+    // CLOCK, take an empty or expired slot or the first one not referenced since the last pass
+    if (!slot) {
+        int hand = hands[set] % WISE_CACHE_WAYS;
+        for (int i = 0; i < WISE_CACHE_WAYS * 2 && !slot; i++, hand = (hand + 1) % WISE_CACHE_WAYS) {
+            s = wise_disk_slot(set, hand);
+            if (s->seq & 1)
+                continue;
+            if (!s->ref || s->loadTime + cacheSecs <= wi->loadTime)
+                slot = s;
+            else
+                s->ref = 0;
+        }
+        hands[set] = hand;
+    }
+
+    if (!slot)
+        return;
+
+    // Someone else, maybe another capture, is writing it
+    const uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+        return;
+
+    slot->hash     = h;
+    slot->loadTime = wi->loadTime;
+    slot->keyLen   = keyLen;
+    slot->dataLen  = dataLen;
+    slot->ref      = 1;
+    memcpy(slot->data, key, keyLen);
+    memcpy(slot->data + keyLen, data, dataLen);
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+/******************************************************************************/
+LOCAL void wise_disk_init()
+{
+    char *filename = moloch_config_str(NULL, "wiseCacheFile", NULL);
+    if (!filename || !*filename) {
+        g_free(filename);
+        return;
+    }
+
+    const uint32_t entries = moloch_config_int(NULL, "wiseCacheFileEntries", 500000, WISE_CACHE_WAYS, 100000000);
+    diskCacheSlotSize = moloch_config_int(NULL, "wiseCacheFileSlotSize", 512, 128, WISE_CACHE_SLOT_MAX);
+    diskCacheSlotSize &= ~63U; // Keep slots on cache lines
+    diskCacheNumSets = entries / WISE_CACHE_WAYS;
+    diskCacheSlots = WISE_CACHE_HDR_SIZE + ((diskCacheNumSets + 4095) & ~4095U);
+    diskCacheLen = diskCacheSlots + (size_t)diskCacheNumSets * WISE_CACHE_WAYS * diskCacheSlotSize;
+
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        LOG("WARNING - Couldn't open wiseCacheFile %s: %s", filename, strerror(errno));
+        g_free(filename);
+        return;
+    }
+
+    // Only one capture sets up a new file
+    flock(fd, LOCK_EX);
+
+    struct stat sb;
+    int created = 0;
+    if (fstat(fd, &sb) == 0 && sb.st_size == 0) {
+        if (ftruncate(fd, diskCacheLen) == 0)
+            created = 1;
+    } else if (sb.st_size != (off_t)diskCacheLen) {
+        LOG("WARNING - wiseCacheFile %s is %lld bytes, expected %lld, check wiseCacheFileEntries/wiseCacheFileSlotSize match the other captures or remove it",
+            filename, (long long)sb.st_size, (long long)diskCacheLen);
+        goto cleanup;
+    }
+
+    uint8_t *data = mmap(NULL, diskCacheLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        LOG("WARNING - Couldn't mmap wiseCacheFile %s: %s", filename, strerror(errno));
+        goto cleanup;
+    }
+
+    WiseCacheHdr_t *hdr = (WiseCacheHdr_t *)data;
+    if (created) {
+        hdr->slotSize = diskCacheSlotSize;
+        hdr->numSets = diskCacheNumSets;
+        memcpy(hdr->magic, WISE_CACHE_MAGIC, sizeof(hdr->magic));
+    } else if (memcmp(hdr->magic, WISE_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+               hdr->slotSize != diskCacheSlotSize ||
+               hdr->numSets != diskCacheNumSets) {
+        LOG("WARNING - wiseCacheFile %s doesn't match this config, not using it", filename);
+        munmap(data, diskCacheLen);
+        goto cleanup;
+    }
+
+    diskCache = data;
+    if (config.debug)
+        LOG("Using wiseCacheFile %s with %u entries", filename, diskCacheNumSets * WISE_CACHE_WAYS);
+
+cleanup:
+    flock(fd, LOCK_UN);
+    close(fd);
+    g_free(filename);
+}
+/******************************************************************************/
+/*
+ * Fields can only be defined on the main thread.  When canDefine isn't set
+ * and the response has fields that haven't been defined yet, returns FALSE
+ * without touching anything so the caller can hand it to the main thread.
+ */
+LOCAL gboolean wise_process(unsigned char *data, int data_len, WiseRequest_t *request, gboolean canDefine)
+{
     BSB             bsb;
-    WiseRequest_t *request = uw;
     int             i;
 
-    inflight -= request->numItems;
-
     BSB_INIT(bsb, data, data_len);
 
     uint32_t fts = 0, ver = 0xffffffff;
@@ -262,17 +632,21 @@ LOCAL void wise_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer
     BSB_IMPORT_u32(bsb, ver);
 
     if (BSB_IS_ERROR(bsb) || (ver != 0 && ver != 2)) {
+        __sync_sub_and_fetch(&inflight, request->numItems);
         MOLOCH_LOCK(item);
         for (i = 0; i < request->numItems; i++) {
             wise_remove_item_locked(request->items[i]);
         }
         MOLOCH_UNLOCK(item);
         MOLOCH_TYPE_FREE(WiseRequest_t, request);
-        return;
+        return TRUE;
     }
 
-    if (ver == 0 && fts != fieldsTS)
+    if (ver == 0 && fts != fieldsTS) {
+        if (!canDefine)
+            return FALSE;
         wise_load_fields();
+    }
 
     int hashPos = 0;
     if (ver == 2) {
@@ -291,10 +665,37 @@ LOCAL void wise_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer
         if (config.debug)
             LOG("WISE Response %32.32s cnt %d pos %d", hash, cnt, hashPos);
 
-        if (hashPos == FIELDS_MAP_MAX)
-            LOGEXIT("ERROR - Too many unique wise hashs");
+        if (hashPos < fieldsMapCnt) {
+            // Already defined, the hash covers the field block so just skip it
+            for (i = 0; i < cnt; i++) {
+                int len = 0;
+                BSB_IMPORT_u16(bsb, len);
+                BSB_IMPORT_skip(bsb, len);
+            }
+        } else {
+            if (!canDefine) {
+                MOLOCH_UNLOCK(item);
+                return FALSE;
+            }
+
+            if (hashPos == FIELDS_MAP_MAX)
+                LOGEXIT("ERROR - Too many unique wise hashs");
+
+            memset(fieldsMap[hashPos], -1, sizeof(fieldsMap[hashPos]));
+
+            for (i = 0; i < cnt; i++) {
+                int len = 0;
+                BSB_IMPORT_u16(bsb, len); // len includes NULL terminated
+                fieldsMap[hashPos][i] = moloch_field_define_text((char*)BSB_WORK_PTR(bsb), NULL);
+                if (fieldsMap[hashPos][i] == -1) {
+                    fieldsTS = 0;
+                    if (config.debug)
+                        LOG("Couldn't define field - %d %d %s", i, fieldsMap[hashPos][i], BSB_WORK_PTR(bsb));
+                }
+                BSB_IMPORT_skip(bsb, len);
+            }
+            wise_disk_fields_publish(fieldsMap[hashPos], cnt);
 
-        if (hashPos == fieldsMapCnt) {
             fieldsMapHash[hashPos] = g_strndup((gchar*)hash, 32);
             fieldsMapCnt++;
             g_strlcpy(wiseGetURI, "/get?ver=2", sizeof(wiseGetURI));
@@ -307,24 +708,11 @@ LOCAL void wise_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer
                 }
             }
         }
-
-        if (cnt)
-            memset(fieldsMap[hashPos], -1, sizeof(fieldsMap[hashPos]));
-
-        for (i = 0; i < cnt; i++) {
-            int len = 0;
-            BSB_IMPORT_u16(bsb, len); // len includes NULL terminated
-            fieldsMap[0][i] = moloch_field_define_text((char*)BSB_WORK_PTR(bsb), NULL);
-            if (fieldsMap[0][i] == -1) {
-                fieldsTS = 0;
-                if (config.debug)
-                    LOG("Couldn't define field - %d %d %s", i, fieldsMap[0][i], BSB_WORK_PTR(bsb));
-            }
-            BSB_IMPORT_skip(bsb, len);
-        }
         MOLOCH_UNLOCK(item);
     }
 
+    __sync_sub_and_fetch(&inflight, request->numItems);
+
     struct timeval currentTime;
     gettimeofday(&currentTime, NULL);
 
@@ -334,6 +722,13 @@ LOCAL void wise_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer
         int numOps = 0;
         BSB_IMPORT_u08(bsb, numOps);
 
+        uint8_t   disk[WISE_CACHE_SLOT_MAX];
+        const int diskSize = diskCache ? diskCacheSlotSize - sizeof(WiseCacheSlot_t) : 0;
+        int       diskOps = 0;
+        BSB       dbsb;
+        BSB_INIT(dbsb, disk, diskSize);
+        BSB_EXPORT_u08(dbsb, 0);
+
         moloch_field_ops_init(&wi->ops, numOps, MOLOCH_FIELD_OPS_FLAGS_COPY);
         for (int o = 0; o < numOps && !BSB_IS_ERROR(bsb); o++) {
 
@@ -357,10 +752,19 @@ LOCAL void wise_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer
             }
 
             moloch_field_ops_add(&wi->ops, fieldPos, str, len - 1);
+            if (diskCache) {
+                wise_disk_export_op(&dbsb, fieldPos, str, len);
+                diskOps++;
+            }
         }
 
         wi->loadTime = currentTime.tv_sec;
 
+        if (diskCache && BSB_NOT_ERROR(bsb) && BSB_NOT_ERROR(dbsb)) {
+            disk[0] = diskOps;
+            wise_disk_put(wi, disk, BSB_LENGTH(dbsb));
+        }
+
         // Schedule updates on waiting sessions
         int s;
         for (s = 0; s < wi->numSessions; s++) {
@@ -370,15 +774,395 @@ LOCAL void wise_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer
         wi->sessions = 0;
         wi->numSessions = 0;
 
-        DLL_PUSH_HEAD(wil_, &types[(int)wi->type].itemList, wi);
-        // Cache needs to be reduced
-        if (types[(int)wi->type].itemList.wil_count > maxCache) {
-            DLL_POP_TAIL(wil_, &types[(int)wi->type].itemList, wi);
-            wise_remove_item_locked(wi);
-        }
+        wise_item_cached_locked(wi);
         MOLOCH_UNLOCK(item);
     }
     MOLOCH_TYPE_FREE(WiseRequest_t, request);
+    return TRUE;
+}
+/******************************************************************************/
+LOCAL void wise_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer uw)
+{
+    wise_process(data, data_len, uw, TRUE);
+}
+/******************************************************************************/
+/*
+ * Streaming mode sends requests as length prefixed frames over one persistent
+ * unix or tcp connection with many batches outstanding.  A dedicated thread
+ * does all the socket work and decodes the responses, which go straight to the
+ * packet threads command queues.  A response with fields that haven't been
+ * defined yet is handed to the main thread instead, since only it can define
+ * fields.  Falls back to http while not connected.  Batches without a reply
+ * after WISE_STREAM_TIMEOUT seconds fail the same as an http timeout.
+ *
+ * Request:  u32 len, u32 id, u16 query len, query (ver=2&hashes=...), items as /get
+ * Response: u32 len, u32 id, same body as a /get?ver=2 reply
+ * All numbers are network order and len doesn't include itself.
+ */
+#define WISE_STREAM_MAX_OUTSTANDING 1024
+#define WISE_STREAM_MAX_FRAME       (64*1024*1024)
+#define WISE_STREAM_TIMEOUT         120
+
+typedef struct wisestreamframe {
+    struct wisestreamframe *next;
+    uint8_t                *data;
+    uint32_t                len;
+    uint32_t                pos;
+} WiseStreamFrame_t;
+
+typedef struct {
+    WiseRequest_t          *request;
+    int                     len;
+    unsigned char           data[];
+} WiseStreamFields_t;
+
+LOCAL char                 *streamSocket;
+LOCAL int                   streamPort;
+LOCAL int                   streamFd = -1;
+LOCAL int                   streamWake[2];
+LOCAL int                   streamQuit;
+LOCAL GThread              *streamThread;
+LOCAL uint32_t              streamId;
+LOCAL WiseRequest_t        *streamRequests[WISE_STREAM_MAX_OUTSTANDING];
+LOCAL uint32_t              streamIds[WISE_STREAM_MAX_OUTSTANDING];
+LOCAL time_t                streamSent[WISE_STREAM_MAX_OUTSTANDING];
+LOCAL WiseStreamFrame_t    *streamHead;
+LOCAL WiseStreamFrame_t    *streamTail;
+LOCAL MOLOCH_LOCK_DEFINE(stream);
+
+/******************************************************************************/
+// Queue a request for the stream thread, returns -1 if it should go over http instead
+LOCAL int wise_stream_send(WiseRequest_t *request, char *buf, int len)
+{
+    const char *query = strchr(wiseGetURI, '?');
+    query = query ? query + 1 : "";
+    const int queryLen = strlen(query);
+
+    MOLOCH_LOCK(stream);
+    if (streamFd == -1 || streamRequests[streamId % WISE_STREAM_MAX_OUTSTANDING]) {
+        MOLOCH_UNLOCK(stream);
+        return -1;
+    }
+
+    const uint32_t id = streamId++;
+    streamRequests[id % WISE_STREAM_MAX_OUTSTANDING] = request;
+    streamIds[id % WISE_STREAM_MAX_OUTSTANDING] = id;
+    streamSent[id % WISE_STREAM_MAX_OUTSTANDING] = time(NULL);
+
+    WiseStreamFrame_t *frame = MOLOCH_TYPE_ALLOC0(WiseStreamFrame_t);
+    frame->len = 10 + queryLen + len;
+    frame->data = malloc(frame->len);
+
+    BSB bsb;
+    BSB_INIT(bsb, frame->data, frame->len);
+    BSB_EXPORT_u32(bsb, frame->len - 4);
+    BSB_EXPORT_u32(bsb, id);
+    BSB_EXPORT_u16(bsb, queryLen);
+    BSB_EXPORT_ptr(bsb, query, queryLen);
+    BSB_EXPORT_ptr(bsb, buf, len);
+
+    if (streamTail)
+        streamTail->next = frame;
+    else
+        streamHead = frame;
+    streamTail = frame;
+    MOLOCH_UNLOCK(stream);
+
+    if (write(streamWake[1], "", 1) < 0 && errno != EAGAIN) {
+        LOG("WARNING - Couldn't wake wise stream thread: %s", strerror(errno));
+    }
+    return 0;
+}
+/******************************************************************************/
+LOCAL int wise_stream_connect()
+{
+    int fd = -1;
+
+    if (streamSocket) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        g_strlcpy(addr.sun_path, streamSocket, sizeof(addr.sun_path));
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        struct addrinfo hints, *res, *ai;
+        char            port[10];
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(port, sizeof(port), "%d", streamPort);
+
+        if (getaddrinfo(wiseHost, port, &hints, &res) != 0)
+            return -1;
+
+        for (ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+
+        if (fd >= 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+/******************************************************************************/
+// Drop the connection and fail everything outstanding or queued on it
+LOCAL void wise_stream_close()
+{
+    WiseRequest_t     *failed[WISE_STREAM_MAX_OUTSTANDING];
+    int                numFailed = 0;
+    WiseStreamFrame_t *frame, *next;
+
+    MOLOCH_LOCK(stream);
+    if (streamFd != -1)
+        close(streamFd);
+    streamFd = -1;
+    for (int i = 0; i < WISE_STREAM_MAX_OUTSTANDING; i++) {
+        if (streamRequests[i]) {
+            failed[numFailed++] = streamRequests[i];
+            streamRequests[i] = NULL;
+        }
+    }
+    frame = streamHead;
+    streamHead = streamTail = NULL;
+    MOLOCH_UNLOCK(stream);
+
+    for (; frame; frame = next) {
+        next = frame->next;
+        free(frame->data);
+        MOLOCH_TYPE_FREE(WiseStreamFrame_t, frame);
+    }
+
+    for (int i = 0; i < numFailed; i++) {
+        wise_cb(500, NULL, 0, failed[i]);
+    }
+}
+/******************************************************************************/
+// Fail the batches that have waited too long for a reply, a late reply is ignored
+LOCAL void wise_stream_expire()
+{
+    WiseRequest_t     *failed[WISE_STREAM_MAX_OUTSTANDING];
+    int                numFailed = 0;
+    const time_t       expire = time(NULL) - WISE_STREAM_TIMEOUT;
+
+    MOLOCH_LOCK(stream);
+    for (int i = 0; i < WISE_STREAM_MAX_OUTSTANDING; i++) {
+        if (streamRequests[i] && streamSent[i] < expire) {
+            failed[numFailed++] = streamRequests[i];
+            streamRequests[i] = NULL;
+        }
+    }
+    MOLOCH_UNLOCK(stream);
+
+    if (numFailed)
+        LOG("WARNING - %d wise stream requests timed out", numFailed);
+
+    for (int i = 0; i < numFailed; i++) {
+        wise_cb(500, NULL, 0, failed[i]);
+    }
+}
+/******************************************************************************/
+// Write as much as the socket will take, returns 0 if the connection failed
+LOCAL int wise_stream_write()
+{
+    MOLOCH_LOCK(stream);
+    while (streamHead) {
+        WiseStreamFrame_t *frame = streamHead;
+        ssize_t len = send(streamFd, frame->data + frame->pos, frame->len - frame->pos, MSG_NOSIGNAL);
+        if (len < 0) {
+            MOLOCH_UNLOCK(stream);
+            return errno == EAGAIN || errno == EINTR;
+        }
+
+        frame->pos += len;
+        if (frame->pos < frame->len)
+            break;
+
+        streamHead = frame->next;
+        if (!streamHead)
+            streamTail = NULL;
+        free(frame->data);
+        MOLOCH_TYPE_FREE(WiseStreamFrame_t, frame);
+    }
+    MOLOCH_UNLOCK(stream);
+    return 1;
+}
+/******************************************************************************/
+// Back on the main thread, define the new fields and then apply the results
+LOCAL gboolean wise_stream_fields(gpointer uw)
+{
+    WiseStreamFields_t *fields = uw;
+
+    wise_process(fields->data, fields->len, fields->request, TRUE);
+    g_free(fields);
+    return FALSE;
+}
+/******************************************************************************/
+// Decode all the complete frames at the start of buf, returns how much was used or -1 on a bad frame
+LOCAL int wise_stream_decode(uint8_t *buf, uint32_t len, uint32_t *need)
+{
+    uint32_t pos = 0;
+
+    while (len - pos >= 8) {
+        BSB bsb;
+        BSB_INIT(bsb, buf + pos, len - pos);
+
+        uint32_t flen = 0, id = 0;
+        BSB_IMPORT_u32(bsb, flen);
+        BSB_IMPORT_u32(bsb, id);
+
+        if (flen < 4 || flen > WISE_STREAM_MAX_FRAME)
+            return -1;
+
+        if (len - pos < 4 + flen) {
+            *need = 4 + flen;
+            break;
+        }
+
+        // The slot may have timed out and been reused by a newer batch
+        MOLOCH_LOCK(stream);
+        WiseRequest_t *request = NULL;
+        if (streamIds[id % WISE_STREAM_MAX_OUTSTANDING] == id) {
+            request = streamRequests[id % WISE_STREAM_MAX_OUTSTANDING];
+            streamRequests[id % WISE_STREAM_MAX_OUTSTANDING] = NULL;
+        }
+        MOLOCH_UNLOCK(stream);
+
+        if (!request) {
+            if (config.debug)
+                LOG("Unknown or timed out wise stream response %u", id);
+        } else if (!wise_process(buf + pos + 8, flen - 4, request, FALSE)) {
+            WiseStreamFields_t *fields = g_malloc(sizeof(WiseStreamFields_t) + flen - 4);
+            fields->request = request;
+            fields->len = flen - 4;
+            memcpy(fields->data, buf + pos + 8, flen - 4);
+            g_idle_add(wise_stream_fields, fields);
+        }
+
+        pos += 4 + flen;
+    }
+    return pos;
+}
+/******************************************************************************/
+LOCAL void *wise_stream_thread(void *UNUSED(arg))
+{
+    uint32_t  bufSize = 1024 * 1024;
+    uint8_t  *buf = malloc(bufSize);
+    uint32_t  bufLen = 0;
+    char      junk[64];
+    time_t    lastExpire = 0;
+
+    while (!streamQuit) {
+        if (lastExpire != time(NULL)) {
+            lastExpire = time(NULL);
+            wise_stream_expire();
+        }
+
+        struct pollfd fds[2];
+        fds[1].fd = streamWake[0];
+        fds[1].events = POLLIN;
+
+        if (streamFd == -1) {
+            int fd = wise_stream_connect();
+            if (fd < 0) {
+                // Try again in a second, requests use http until then
+                poll(fds + 1, 1, 1000);
+                while (read(streamWake[0], junk, sizeof(junk)) > 0);
+                continue;
+            }
+
+            MOLOCH_LOCK(stream);
+            streamFd = fd;
+            MOLOCH_UNLOCK(stream);
+            bufLen = 0;
+            if (streamSocket)
+                LOG("Connected to wise stream %s", streamSocket);
+            else
+                LOG("Connected to wise stream %s:%d", wiseHost, streamPort);
+        }
+
+        fds[0].fd = streamFd;
+        fds[0].events = POLLIN | (streamHead ? POLLOUT : 0);
+
+        if (poll(fds, 2, 1000) < 0 && errno != EINTR)
+            LOGEXIT("ERROR - wise stream poll failed: %s", strerror(errno));
+
+        if (fds[1].revents) {
+            while (read(streamWake[0], junk, sizeof(junk)) > 0);
+        }
+
+        if (!wise_stream_write()) {
+            LOG("WARNING - wise stream write failed: %s", strerror(errno));
+            wise_stream_close();
+            continue;
+        }
+
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        ssize_t len = read(streamFd, buf + bufLen, bufSize - bufLen);
+        if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+            LOG("WARNING - wise stream closed: %s", len == 0 ? "EOF" : strerror(errno));
+            wise_stream_close();
+            continue;
+        }
+        if (len < 0)
+            continue;
+        bufLen += len;
+
+        uint32_t need = 0;
+        int used = wise_stream_decode(buf, bufLen, &need);
+        if (used < 0) {
+            LOG("WARNING - wise stream sent a corrupt frame");
+            wise_stream_close();
+            continue;
+        }
+
+        bufLen -= used;
+        memmove(buf, buf + used, bufLen);
+        if (need > bufSize) {
+            bufSize = need;
+            buf = realloc(buf, bufSize);
+        }
+    }
+
+    // Quitting, fail whatever is still queued or waiting for a reply
+    wise_stream_close();
+    free(buf);
+    return NULL;
+}
+/******************************************************************************/
+LOCAL void wise_stream_init()
+{
+    streamSocket = moloch_config_str(NULL, "wiseStreamSocket", NULL);
+    streamPort = moloch_config_int(NULL, "wiseStreamPort", 0, 0, 0xffff);
+
+    if (!streamSocket && !streamPort)
+        return;
+
+    if (pipe(streamWake) != 0)
+        LOGEXIT("ERROR - Couldn't create wise stream pipe: %s", strerror(errno));
+    fcntl(streamWake[0], F_SETFL, fcntl(streamWake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(streamWake[1], F_SETFL, fcntl(streamWake[1], F_GETFL) | O_NONBLOCK);
+
+    streamThread = g_thread_new("moloch-wise-stream", &wise_stream_thread, NULL);
 }
 /******************************************************************************/
 LOCAL void wise_lookup(MolochSession_t *session, WiseRequest_t *request, char *value, int type)
@@ -441,6 +1225,14 @@ LOCAL void wise_lookup(MolochSession_t *session, WiseRequest_t *request, char *v
         HASH_ADD(wih_, types[type].itemHash, wi->key, wi);
     }
 
+    // Another capture, or this one before a restart, may have already looked it up
+    if (diskCache && wise_disk_get(wi, currentTime.tv_sec)) {
+        wise_item_cached_locked(wi);
+        moloch_field_ops_run(session, &wi->ops);
+        stats[type][INTEL_STAT_DISK]++;
+        goto cleanup;
+    }
+
     wi->sessions = malloc(sizeof(MolochSession_t *) * wi->sessionsSize);
     wi->sessions[wi->numSessions++] = session;
     moloch_session_incr_outstanding(session);
@@ -617,8 +1409,10 @@ LOCAL void wise_flush_locked()
     if (!iRequest || iRequest->numItems == 0)
         return;
 
-    inflight += iRequest->numItems;
-    if (moloch_http_send(wiseService, "POST", wiseGetURI, -1, iBuf, BSB_LENGTH(iRequest->bsb), NULL, TRUE, wise_cb, iRequest) != 0) {
+    MOLOCH_THREAD_INCR_NUM(inflight, iRequest->numItems);
+    if ((streamSocket || streamPort) && wise_stream_send(iRequest, iBuf, BSB_LENGTH(iRequest->bsb)) == 0) {
+        moloch_http_free_buffer(iBuf);
+    } else if (moloch_http_send(wiseService, "POST", wiseGetURI, -1, iBuf, BSB_LENGTH(iRequest->bsb), NULL, TRUE, wise_cb, iRequest) != 0) {
         LOG("Wise - request failed %p for %d items", iRequest, iRequest->numItems);
         wise_cb(500, NULL, 0, iRequest);
     }
@@ -817,6 +1611,18 @@ void wise_plugin_pre_save(MolochSession_t *session, int UNUSED(final))
 /******************************************************************************/
 LOCAL void wise_plugin_exit()
 {
+    // Failing the stream requests takes the item lock, so stop it first
+    if (streamThread) {
+        streamQuit = 1;
+        if (write(streamWake[1], "", 1) < 0) {
+            LOG("WARNING - Couldn't wake wise stream thread: %s", strerror(errno));
+        }
+        g_thread_join(streamThread);
+        streamThread = NULL;
+        close(streamWake[0]);
+        close(streamWake[1]);
+    }
+
     MOLOCH_LOCK(item);
     for (int type = 0; type < INTEL_TYPE_SIZE; type++) {
         WiseItem_t *wi;
@@ -832,6 +1638,12 @@ LOCAL void wise_plugin_exit()
         g_free(wiseURL);
 
     moloch_http_free_server(wiseService);
+
+    if (diskCache) {
+        munmap(diskCache, diskCacheLen);
+        diskCache = NULL;
+    }
+
     MOLOCH_UNLOCK(item);
 }
 /******************************************************************************/
@@ -973,6 +1785,8 @@ void moloch_plugin_init()
 
     protocolField    = moloch_field_by_db("protocol");
 
+    wise_disk_init();
+
     wise_load_config();
 
     wiseExcludeDomains = moloch_config_str_list(NULL, "wiseExcludeDomains", ".in-addr.arpa;.ip6.arpa");
@@ -996,6 +1810,8 @@ void moloch_plugin_init()
     moloch_http_set_headers(wiseService, headers);
     moloch_http_set_retries(wiseService, 1);
 
+    wise_stream_init();
+
     moloch_plugins_register("wise", FALSE);
 
     moloch_plugins_set_cb("wise",
@@ -0,0 +1,263 @@
+/******************************************************************************/
+/* pool.c  -- Per thread pools for packets and packet buffers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Packets are allocated on the reader threads and freed on the packet threads.
+ * Each allocating thread owns a pool of size classes, memory freed by another
+ * thread is collected in a per thread magazine and handed back to the owning
+ * pool in batches, where the owner picks it up the next time it runs dry.
+ */
+
+#include "moloch.h"
+
+/******************************************************************************/
+extern MolochConfig_t        config;
+
+#ifdef MOLOCH_USE_MALLOC
+/******************************************************************************/
+void *moloch_pool_alloc(int size, int zero)
+{
+    return zero ? calloc(1, size) : malloc(size);
+}
+/******************************************************************************/
+void moloch_pool_free(void *mem)
+{
+    free(mem);
+}
+/******************************************************************************/
+void moloch_pool_flush()
+{
+}
+/******************************************************************************/
+void moloch_pool_stats(uint64_t *inUse, uint64_t *freeCnt, uint64_t *remoteReturns)
+{
+    *inUse = *freeCnt = *remoteReturns = 0;
+}
+#else
+
+#define MOLOCH_POOL_MAX          128
+#define MOLOCH_POOL_MAG_SIZE     32
+#define MOLOCH_POOL_SLAB_SIZE    0x10000
+#define MOLOCH_POOL_NONE         0xff
+
+LOCAL const uint32_t poolSizes[] = {64, 128, 256, 512, 1024, 1600, 2048, 4096, 9216, 16384, 32768, MOLOCH_PACKET_MAX_LEN};
+#define MOLOCH_POOL_CLASSES      (int)(sizeof(poolSizes)/sizeof(poolSizes[0]))
+
+// Sits in front of every allocation, while free the item overlays the memory after it
+typedef struct {
+    uint16_t                 pool;
+    uint8_t                  cls;
+    uint8_t                  pad[5];
+} MolochPoolHdr_t;
+
+typedef struct molochpoolitem_t {
+    struct molochpoolitem_t *next;
+} MolochPoolItem_t;
+
+typedef struct {
+    MolochPoolItem_t        *free;
+    MolochPoolItem_t        *remote;   // pushed by other threads, only ever emptied by owner
+    uint64_t                 allocs;
+    uint64_t                 frees;
+    uint64_t                 carved;
+} MolochPoolClass_t;
+
+typedef struct {
+    MolochPoolClass_t        classes[MOLOCH_POOL_CLASSES];
+    uint64_t                 remoteReturns;
+    uint16_t                 id;
+} MolochPool_t;
+
+typedef struct {
+    MolochPoolItem_t        *head, *tail;
+    int                      count;
+} MolochPoolMag_t;
+
+LOCAL MolochPool_t          *pools[MOLOCH_POOL_MAX];
+LOCAL int                    numPools;
+
+LOCAL __thread MolochPool_t    *pool;
+LOCAL __thread MolochPoolMag_t *mags;
+LOCAL __thread int              magsMax;
+
+/******************************************************************************/
+LOCAL inline int moloch_pool_class(uint32_t size)
+{
+    for (int cls = 0; cls < MOLOCH_POOL_CLASSES; cls++) {
+        if (size <= poolSizes[cls])
+            return cls;
+    }
+    return -1;
+}
+/******************************************************************************/
+LOCAL MolochPool_t *moloch_pool_create()
+{
+    int id = MOLOCH_THREAD_INCROLD(numPools);
+    if (id >= MOLOCH_POOL_MAX) {
+        if (id == MOLOCH_POOL_MAX)
+            LOG("WARNING - More than %d threads allocating packets, falling back to malloc", MOLOCH_POOL_MAX);
+        return NULL;
+    }
+
+    MolochPool_t *p = MOLOCH_TYPE_ALLOC0(MolochPool_t);
+    p->id = id;
+    pools[id] = p;
+    return p;
+}
+/******************************************************************************/
+LOCAL void moloch_pool_carve(MolochPoolClass_t *c, int cls)
+{
+    const uint32_t itemSize = poolSizes[cls] + sizeof(MolochPoolHdr_t);
+    const uint32_t num = MAX(MOLOCH_POOL_SLAB_SIZE / itemSize, 16);
+    uint8_t *slab = malloc(itemSize * num);
+
+    if (!slab)
+        LOGEXIT("ERROR - Couldn't allocate pool slab of %u bytes", itemSize * num);
+
+    for (uint32_t i = 0; i < num; i++) {
+        MolochPoolHdr_t *hdr = (MolochPoolHdr_t *)(slab + i * itemSize);
+        hdr->pool = pool->id;
+        hdr->cls = cls;
+
+        MolochPoolItem_t *item = (MolochPoolItem_t *)(hdr + 1);
+        item->next = c->free;
+        c->free = item;
+    }
+    c->carved += num;
+}
+/******************************************************************************/
+void *moloch_pool_alloc(int size, int zero)
+{
+    if (unlikely(!pool))
+        pool = moloch_pool_create();
+
+    const int cls = moloch_pool_class(size);
+    if (unlikely(!pool || cls < 0)) {
+        MolochPoolHdr_t *hdr = malloc(size + sizeof(MolochPoolHdr_t));
+        hdr->cls = MOLOCH_POOL_NONE;
+        if (zero)
+            memset(hdr + 1, 0, size);
+        return hdr + 1;
+    }
+
+    MolochPoolClass_t *c = &pool->classes[cls];
+    if (!c->free) {
+        if (c->remote)
+            c->free = __sync_lock_test_and_set(&c->remote, NULL);
+        else
+            moloch_pool_carve(c, cls);
+    }
+
+    MolochPoolItem_t *item = c->free;
+    c->free = item->next;
+    c->allocs++;
+
+    if (zero)
+        memset(item, 0, size);
+    return item;
+}
+/******************************************************************************/
+LOCAL void moloch_pool_mag_flush(MolochPoolMag_t *mag, int id, int cls)
+{
+    MolochPoolClass_t *c = &pools[id]->classes[cls];
+    MolochPoolItem_t *old;
+
+    do {
+        old = c->remote;
+        mag->tail->next = old;
+    } while (!__sync_bool_compare_and_swap(&c->remote, old, mag->head));
+
+    MOLOCH_THREAD_INCR_NUM(pools[id]->remoteReturns, mag->count);
+    mag->head = mag->tail = NULL;
+    mag->count = 0;
+}
+/******************************************************************************/
+void moloch_pool_free(void *mem)
+{
+    MolochPoolHdr_t *hdr = (MolochPoolHdr_t *)mem - 1;
+    MolochPoolItem_t *item = mem;
+
+    if (unlikely(hdr->cls == MOLOCH_POOL_NONE)) {
+        free(hdr);
+        return;
+    }
+
+    const int id = hdr->pool;
+    const int cls = hdr->cls;
+
+    if (pool && pool->id == id) {
+        MolochPoolClass_t *c = &pool->classes[cls];
+        item->next = c->free;
+        c->free = item;
+        c->frees++;
+        return;
+    }
+
+    if (unlikely(!mags)) {
+        mags = calloc(MOLOCH_POOL_MAX * MOLOCH_POOL_CLASSES, sizeof(MolochPoolMag_t));
+    }
+
+    MolochPoolMag_t *mag = &mags[id * MOLOCH_POOL_CLASSES + cls];
+    item->next = mag->head;
+    mag->head = item;
+    if (!mag->tail)
+        mag->tail = item;
+    if (id >= magsMax)
+        magsMax = id + 1;
+
+    if (++mag->count >= MOLOCH_POOL_MAG_SIZE)
+        moloch_pool_mag_flush(mag, id, cls);
+}
+/******************************************************************************/
+// Hand back anything this thread is holding for other pools, call before going idle
+void moloch_pool_flush()
+{
+    if (!mags)
+        return;
+
+    for (int id = 0; id < magsMax; id++) {
+        for (int cls = 0; cls < MOLOCH_POOL_CLASSES; cls++) {
+            MolochPoolMag_t *mag = &mags[id * MOLOCH_POOL_CLASSES + cls];
+            if (mag->count)
+                moloch_pool_mag_flush(mag, id, cls);
+        }
+    }
+}
+/******************************************************************************/
+void moloch_pool_stats(uint64_t *inUse, uint64_t *freeCnt, uint64_t *remoteReturns)
+{
+    *inUse = *freeCnt = *remoteReturns = 0;
+
+    const int num = MIN(numPools, MOLOCH_POOL_MAX);
+    for (int id = 0; id < num; id++) {
+        MolochPool_t *p = pools[id];
+        if (!p)
+            continue;
+
+        uint64_t allocs = 0, frees = 0, carved = 0;
+        for (int cls = 0; cls < MOLOCH_POOL_CLASSES; cls++) {
+            allocs += p->classes[cls].allocs;
+            frees  += p->classes[cls].frees;
+            carved += p->classes[cls].carved;
+        }
+        frees += p->remoteReturns;
+
+        // Counters are read without locks, so clamp instead of going negative
+        uint64_t used = allocs > frees ? allocs - frees : 0;
+        *inUse += used;
+        *freeCnt += carved > used ? carved - used : 0;
+        *remoteReturns += p->remoteReturns;
+    }
+}
+#endif
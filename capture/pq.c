@@ -1,4 +1,4 @@
-/* pq.c  -- Priority Q
+/* pq.c  -- Priority Q and timing wheel
  *
  * Copyright 2012-2017 AOL Inc. All rights reserved.
  *
@@ -211,6 +211,137 @@ void moloch_pq_flush(int thread)
     }
 }
 /******************************************************************************/
+/* Hierarchical timing wheel with 1 second ticks. Each level has
+ * MOLOCH_TIMEWHEEL_SIZE slots, level n covers MOLOCH_TIMEWHEEL_SIZE^(n+1) seconds
+ * ahead. Timers are placed by absolute expire time and cascade down a level
+ * when the lower level wraps, timers that are due end up on the expired list.
+ */
+#define MOLOCH_TIMEWHEEL_MASK    (MOLOCH_TIMEWHEEL_SIZE - 1)
+#define MOLOCH_TIMEWHEEL_EXPIRED (MOLOCH_TIMEWHEEL_LEVELS * MOLOCH_TIMEWHEEL_SIZE)
+#define MOLOCH_TIMEWHEEL_NONE    0xffff
+
+void moloch_timewheel_init(MolochTimeWheel_t *tw, uint32_t now)
+{
+    for (int i = 0; i < MOLOCH_TIMEWHEEL_EXPIRED; i++) {
+        DLL_INIT(tw_, &tw->slots[i]);
+    }
+    DLL_INIT(tw_, &tw->expired);
+    memset(tw->levelCount, 0, sizeof(tw->levelCount));
+    tw->now = now;
+}
+/******************************************************************************/
+LOCAL void moloch_timewheel_place(MolochTimeWheel_t *tw, MolochTimer_t *timer)
+{
+    if (timer->expire < tw->now) {
+        timer->slot = MOLOCH_TIMEWHEEL_EXPIRED;
+        DLL_PUSH_TAIL(tw_, &tw->expired, timer);
+        return;
+    }
+
+    const uint32_t delta = timer->expire - tw->now;
+    int level = 0;
+    while (level < MOLOCH_TIMEWHEEL_LEVELS - 1 && delta >= (1U << (MOLOCH_TIMEWHEEL_BITS * (level + 1))))
+        level++;
+
+    timer->slot = level * MOLOCH_TIMEWHEEL_SIZE + ((timer->expire >> (MOLOCH_TIMEWHEEL_BITS * level)) & MOLOCH_TIMEWHEEL_MASK);
+    DLL_PUSH_TAIL(tw_, &tw->slots[timer->slot], timer);
+    tw->levelCount[level]++;
+}
+/******************************************************************************/
+void moloch_timewheel_del(MolochTimeWheel_t *tw, MolochTimer_t *timer)
+{
+    if (!timer->tw_next)
+        return;
+
+    if (timer->slot == MOLOCH_TIMEWHEEL_EXPIRED) {
+        DLL_REMOVE(tw_, &tw->expired, timer);
+    } else {
+        DLL_REMOVE(tw_, &tw->slots[timer->slot], timer);
+        tw->levelCount[timer->slot / MOLOCH_TIMEWHEEL_SIZE]--;
+    }
+    timer->slot = MOLOCH_TIMEWHEEL_NONE;
+}
+/******************************************************************************/
+void moloch_timewheel_add(MolochTimeWheel_t *tw, MolochTimer_t *timer, uint32_t expire)
+{
+    moloch_timewheel_del(tw, timer);
+    timer->expire = expire;
+    moloch_timewheel_place(tw, timer);
+}
+/******************************************************************************/
+LOCAL void moloch_timewheel_cascade(MolochTimeWheel_t *tw, int level, int idx)
+{
+    MolochTimerHead_t *head = &tw->slots[level * MOLOCH_TIMEWHEEL_SIZE + idx];
+    MolochTimerHead_t  list;
+    MolochTimer_t     *timer;
+
+    if (DLL_COUNT(tw_, head) == 0)
+        return;
+
+    // A timer a full rotation out lands back in this same slot, so work off a copy
+    DLL_INIT(tw_, &list);
+    DLL_PUSH_TAIL_DLL(tw_, &list, head);
+    tw->levelCount[level] -= DLL_COUNT(tw_, &list);
+    while (DLL_POP_HEAD(tw_, &list, timer)) {
+        moloch_timewheel_place(tw, timer);
+    }
+}
+/******************************************************************************/
+/* Move everything with expire <= now to the expired list. Ticks are walked one
+ * at a time while the bottom level has timers, otherwise whole empty levels are
+ * skipped so large jumps in packet time stay cheap.
+ */
+void moloch_timewheel_advance(MolochTimeWheel_t *tw, uint32_t now)
+{
+    while (tw->now <= now) {
+        const uint32_t t = tw->now;
+
+        for (int level = MOLOCH_TIMEWHEEL_LEVELS - 1; level > 0; level--) {
+            if ((t & ((1U << (MOLOCH_TIMEWHEEL_BITS * level)) - 1)) == 0)
+                moloch_timewheel_cascade(tw, level, (t >> (MOLOCH_TIMEWHEEL_BITS * level)) & MOLOCH_TIMEWHEEL_MASK);
+        }
+
+        MolochTimerHead_t *head = &tw->slots[t & MOLOCH_TIMEWHEEL_MASK];
+        if (DLL_COUNT(tw_, head)) {
+            MolochTimer_t *timer;
+            DLL_FOREACH(tw_, head, timer) {
+                timer->slot = MOLOCH_TIMEWHEEL_EXPIRED;
+            }
+            tw->levelCount[0] -= DLL_COUNT(tw_, head);
+            DLL_PUSH_TAIL_DLL(tw_, &tw->expired, head);
+        }
+
+        // Jump to the next boundary of the lowest level that has anything on it
+        int level = 0;
+        while (level < MOLOCH_TIMEWHEEL_LEVELS - 1 && tw->levelCount[level] == 0)
+            level++;
+
+        uint64_t next = t + 1;
+        if (tw->levelCount[level] == 0) {
+            next = (uint64_t)now + 1;
+        } else if (level > 0) {
+            const uint64_t span = 1ULL << (MOLOCH_TIMEWHEEL_BITS * level);
+            next = ((uint64_t)t + span) & ~(span - 1);
+            if (next > (uint64_t)now + 1)
+                next = (uint64_t)now + 1;
+        }
+        if (next > 0xffffffff) {
+            tw->now = 0xffffffff;
+            break;
+        }
+        tw->now = next;
+    }
+}
+/******************************************************************************/
+MolochTimer_t *moloch_timewheel_pop(MolochTimeWheel_t *tw)
+{
+    MolochTimer_t *timer;
+    if (!DLL_POP_HEAD(tw_, &tw->expired, timer))
+        return NULL;
+    timer->slot = MOLOCH_TIMEWHEEL_NONE;
+    return timer;
+}
+/******************************************************************************/
 
 #ifdef TESTPQ
 #include <assert.h>
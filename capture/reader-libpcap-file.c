@@ -24,29 +24,88 @@
 #include <pwd.h>
 #include <grp.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 extern MolochPcapFileHdr_t   pcapFileHeader;
 
 extern MolochConfig_t        config;
 
-LOCAL  pcap_t               *pcap;
-LOCAL  FILE                 *offlineFile = 0;
+#define MOLOCH_PCAPFILE_MAX_THREADS 32
+#define MOLOCH_PCAPFILE_MAX_IFS     64
+#define MOLOCH_PCAPFILE_MAX_SNAPLEN 262144
+
+#define MOLOCH_PCAPFILE_PCAP        1
+#define MOLOCH_PCAPFILE_PCAPNG      2
+
+/* A file we mapped ourselves, packets point straight into the mapping and each
+ * one holds a ref, plus one for the reader until it is done with the file.
+ */
+typedef struct {
+    MolochPacketRef_t     ref;
+    uint8_t              *data;
+    uint64_t              len;
+} MolochPcapFileMap_t;
+
+typedef struct {
+    uint32_t              linktype;
+    uint32_t              snaplen;
+    uint64_t              tsUnits;    // timestamp units per second
+    int64_t               tsOffset;   // seconds
+} MolochPcapFileIf_t;
+
+/* Per file state, with pcapReadThreads of 1 only readers[0] is used and it is
+ * driven from the main thread, otherwise each reader has its own thread.
+ */
+typedef struct {
+    pcap_t               *pcap;       // With a mapped file only used to compile the bpf
+    FILE                 *offlineFile;
+    char                  offlinePcapFilename[PATH_MAX+1];
+    int                   dlt;
+    int                   snaplen;
+
+    MolochPcapFileMap_t  *map;
+    uint64_t              mapPos;
+    int                   mapFd;
+    uint8_t               mapFormat;
+    uint8_t               mapSwapped;
+    uint8_t               mapNsec;
+    uint8_t               hasBpf;
+    struct bpf_program    bpf;
+    int                   numIfs;
+    MolochPcapFileIf_t    ifs[MOLOCH_PCAPFILE_MAX_IFS];
+
+    MolochPacketBatch_t   batch;
+    MolochStringHead_t    pendingQ;   // Files assigned to this reader by pcapReadThreadRegex
+    int                   pktsToRead;
+    int                   num;
+    uint8_t               readerPos;
+} MolochPcapFileReader_t;
+
+LOCAL  MolochPcapFileReader_t readers[MOLOCH_PCAPFILE_MAX_THREADS];
+LOCAL  int                   numReaderThreads;
+LOCAL  int                   runningReaderThreads;
+LOCAL  GRegex               *threadRegex;
+
+// Protects the file iterators, monitorQ, pendingQs, readerPos and the link type
+LOCAL  MOLOCH_LOCK_DEFINE(files);
+LOCAL  MOLOCH_COND_DEFINE(files);
+LOCAL  int                   activeReaders;
+LOCAL  int                   dltWaiters;
+LOCAL  MOLOCH_LOCK_DEFINE(bpf);
 
 extern void                 *esServer;
 LOCAL  MolochStringHead_t    monitorQ;
 
-LOCAL  char                  offlinePcapFilename[PATH_MAX+1];
-LOCAL  int                   pktsToRead;
-
-LOCAL void reader_libpcapfile_opened();
+LOCAL void reader_libpcapfile_opened(MolochPcapFileReader_t *reader);
 
-LOCAL MolochPacketBatch_t   batch;
 LOCAL uint8_t               readerPos;
 extern char                *readerFileName[256];
 extern MolochFieldOps_t     readerFieldOps[256];
 extern uint32_t             readerOutputIds[256];
 
 LOCAL  int                  offlineDispatchAfter;
+LOCAL  gboolean             offlineMmap;
 
 LOCAL struct {
     GRegex    *regex;
@@ -91,7 +150,10 @@ LOCAL void reader_libpcapfile_monitor_do(struct inotify_event *event)
 
     if (config.debug)
         LOG("Monitor enqueing %s", string->str);
+    MOLOCH_LOCK(files);
     DLL_PUSH_TAIL(s_, &monitorQ, string);
+    MOLOCH_COND_BROADCAST(files);
+    MOLOCH_UNLOCK(files);
     return;
 }
 /******************************************************************************/
@@ -181,7 +243,374 @@ LOCAL void reader_libpcapfile_init_monitor()
 }
 #endif
 /******************************************************************************/
-LOCAL int reader_libpcapfile_process(char *filename)
+LOCAL inline uint16_t reader_libpcapfile_get16(const MolochPcapFileReader_t *reader, const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return reader->mapSwapped ? __builtin_bswap16(v) : v;
+}
+/******************************************************************************/
+LOCAL inline uint32_t reader_libpcapfile_get32(const MolochPcapFileReader_t *reader, const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return reader->mapSwapped ? __builtin_bswap32(v) : v;
+}
+/******************************************************************************/
+LOCAL inline uint64_t reader_libpcapfile_get64(const MolochPcapFileReader_t *reader, const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return reader->mapSwapped ? __builtin_bswap64(v) : v;
+}
+/******************************************************************************/
+// The reverse of moloch_packet_dlt_to_linktype, -1 for anything we leave to libpcap
+LOCAL int reader_libpcapfile_linktype_to_dlt(uint32_t linktype)
+{
+    if (linktype == 101) // LINKTYPE_RAW
+        return DLT_RAW;
+    if (linktype <= 10 || linktype >= 104)
+        return linktype;
+    return -1;
+}
+/******************************************************************************/
+// Called by whoever frees the last packet pointing into the mapping
+LOCAL void reader_libpcapfile_map_release(MolochPacketRef_t *ref)
+{
+    MolochPcapFileMap_t *map = (MolochPcapFileMap_t *)ref;
+
+    munmap(map->data, map->len);
+    MOLOCH_TYPE_FREE(MolochPcapFileMap_t, map);
+}
+/******************************************************************************/
+// Find the first interface for the link type, the records are read from the start of the file
+LOCAL int reader_libpcapfile_map_header_pcapng(MolochPcapFileReader_t *reader, const uint8_t *data, uint64_t len)
+{
+    uint64_t pos = 0;
+
+    while (pos + 12 <= len) {
+        const uint32_t type = reader_libpcapfile_get32(reader, data + pos);
+
+        if (type == 0x0a0d0d0a) {
+            uint32_t bom;
+            memcpy(&bom, data + pos + 8, 4);
+            if (bom == 0x1a2b3c4d)
+                reader->mapSwapped = 0;
+            else if (bom == 0x4d3c2b1a)
+                reader->mapSwapped = 1;
+            else
+                return -1;
+        }
+
+        const uint32_t blen = reader_libpcapfile_get32(reader, data + pos + 4);
+        if (blen < 12 || (blen & 3) || pos + blen > len)
+            return -1;
+
+        if (type == 1) {
+            if (blen < 20)
+                return -1;
+            reader->dlt       = reader_libpcapfile_linktype_to_dlt(reader_libpcapfile_get16(reader, data + pos + 8));
+            reader->snaplen   = reader_libpcapfile_get32(reader, data + pos + 12);
+            reader->mapFormat = MOLOCH_PCAPFILE_PCAPNG;
+            reader->mapPos    = 0;
+            return reader->dlt == -1 ? -1 : 0;
+        }
+
+        // A packet before any interface
+        if (type == 2 || type == 3 || type == 6)
+            return -1;
+
+        pos += blen;
+    }
+    return -1;
+}
+/******************************************************************************/
+/* Figure out if this is a file we can read ourselves, setting the link type,
+ * snaplen and where the first record is.  Returns -1 for anything libpcap
+ * should handle instead.
+ */
+LOCAL int reader_libpcapfile_map_header(MolochPcapFileReader_t *reader, const uint8_t *data, uint64_t len)
+{
+    uint32_t magic;
+    memcpy(&magic, data, 4);
+
+    reader->mapSwapped = 0;
+    reader->mapNsec = 0;
+    reader->numIfs = 0;
+
+    switch (magic) {
+    case 0xa1b2c3d4:
+        break;
+    case 0xd4c3b2a1:
+        reader->mapSwapped = 1;
+        break;
+    case 0xa1b23c4d:
+        reader->mapNsec = 1;
+        break;
+    case 0x4d3cb2a1:
+        reader->mapSwapped = 1;
+        reader->mapNsec = 1;
+        break;
+    case 0x0a0d0d0a:
+        if (reader_libpcapfile_map_header_pcapng(reader, data, len) != 0)
+            return -1;
+        goto snaplen;
+    default:
+        return -1;
+    }
+
+    if (len < 24 || reader_libpcapfile_get16(reader, data + 4) != 2)
+        return -1;
+
+    reader->dlt       = reader_libpcapfile_linktype_to_dlt(reader_libpcapfile_get32(reader, data + 20) & 0xffff);
+    reader->snaplen   = reader_libpcapfile_get32(reader, data + 16);
+    reader->mapFormat = MOLOCH_PCAPFILE_PCAP;
+    reader->mapPos    = 24;
+
+    if (reader->dlt == -1)
+        return -1;
+
+snaplen:
+    // Same as libpcap, bogus snaplens become the max
+    if (reader->snaplen <= 0 || reader->snaplen > MOLOCH_PCAPFILE_MAX_SNAPLEN)
+        reader->snaplen = MOLOCH_PCAPFILE_MAX_SNAPLEN;
+    return 0;
+}
+/******************************************************************************/
+/* Map the file so packets can point into it instead of being copied out of
+ * libpcap's buffer.  Returns -1 if the file should be read with libpcap.
+ * Packets are never modified in place, anything that changes one (fragment
+ * reassembly) builds a new buffer, so the mapping is read only.  The file
+ * must not shrink while mapped or we get SIGBUS, so callers don't use this
+ * for files that might still be written.
+ */
+LOCAL int reader_libpcapfile_map_open(MolochPcapFileReader_t *reader, const char *filename)
+{
+    struct stat sb;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size < 24) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        if (config.debug)
+            LOG("Couldn't map %s, using libpcap - %s", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (reader_libpcapfile_map_header(reader, data, sb.st_size) != 0 ||
+        !(reader->pcap = pcap_open_dead(reader->dlt, reader->snaplen))) {
+        munmap(data, sb.st_size);
+        close(fd);
+        return -1;
+    }
+
+    madvise(data, sb.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(data, sb.st_size, MADV_HUGEPAGE);
+#endif
+
+    reader->map = MOLOCH_TYPE_ALLOC0(MolochPcapFileMap_t);
+    reader->map->ref.release = reader_libpcapfile_map_release;
+    reader->map->ref.refs = 1;
+    reader->map->data = data;
+    reader->map->len = sb.st_size;
+    reader->mapFd = fd;
+    return 0;
+}
+/******************************************************************************/
+LOCAL int reader_libpcapfile_map_if(MolochPcapFileReader_t *reader, const uint8_t *body, uint32_t bodyLen)
+{
+    if (bodyLen < 8 || reader->numIfs >= MOLOCH_PCAPFILE_MAX_IFS) {
+        LOG("ERROR - %s bad or too many interface blocks", reader->offlinePcapFilename);
+        return -1;
+    }
+
+    MolochPcapFileIf_t *pif = &reader->ifs[reader->numIfs++];
+    pif->linktype = reader_libpcapfile_get16(reader, body);
+    pif->snaplen  = reader_libpcapfile_get32(reader, body + 4);
+    pif->tsUnits  = 1000000;
+    pif->tsOffset = 0;
+
+    // Same as libpcap, all the interfaces must share a link type
+    if (reader_libpcapfile_linktype_to_dlt(pif->linktype) != reader->dlt) {
+        LOG("ERROR - %s has an interface with link type %u instead of %d", reader->offlinePcapFilename, pif->linktype, reader->dlt);
+        return -1;
+    }
+
+    // Options are a code, a length and then the value padded to 4 bytes
+    uint32_t pos = 8;
+    while (pos + 4 <= bodyLen) {
+        const uint16_t code = reader_libpcapfile_get16(reader, body + pos);
+        const uint16_t olen = reader_libpcapfile_get16(reader, body + pos + 2);
+        pos += 4;
+
+        if (code == 0 || pos + olen > bodyLen)
+            break;
+
+        if (code == 9 && olen == 1) { // if_tsresol
+            const uint8_t res = body[pos];
+            if ((res & 0x80) && (res & 0x7f) < 64) {
+                pif->tsUnits = 1LLU << (res & 0x7f);
+            } else if (res < 20) {
+                pif->tsUnits = 1;
+                for (int i = 0; i < res; i++)
+                    pif->tsUnits *= 10;
+            } else {
+                LOG("ERROR - %s bad if_tsresol %u", reader->offlinePcapFilename, res);
+                return -1;
+            }
+        } else if (code == 14 && olen == 8) { // if_tsoffset
+            pif->tsOffset = (int64_t)reader_libpcapfile_get64(reader, body + pos);
+        }
+        pos += (olen + 3) & ~3;
+    }
+    return 0;
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_map_ts(const MolochPcapFileIf_t *pif, uint64_t ts, struct pcap_pkthdr *h)
+{
+    const uint64_t frac = ts % pif->tsUnits;
+
+    h->ts.tv_sec = ts / pif->tsUnits + pif->tsOffset;
+    if (pif->tsUnits == 1000000)
+        h->ts.tv_usec = frac;
+    else if (pif->tsUnits < 1000000)
+        h->ts.tv_usec = frac * 1000000 / pif->tsUnits;
+    else if (pif->tsUnits % 1000000 == 0)
+        h->ts.tv_usec = frac / (pif->tsUnits / 1000000);
+    else
+        h->ts.tv_usec = frac / ((double)pif->tsUnits / 1000000);
+}
+/******************************************************************************/
+// Returns 1 and the next packet, 0 at the end of the file or -1 on error
+LOCAL int reader_libpcapfile_map_next_pcap(MolochPcapFileReader_t *reader, struct pcap_pkthdr *h, const uint8_t **bytes, uint64_t *end)
+{
+    const uint8_t  *data = reader->map->data;
+    const uint64_t  len  = reader->map->len;
+    const uint64_t  pos  = reader->mapPos;
+
+    if (pos == len)
+        return 0;
+
+    if (pos + 16 > len) {
+        LOG("ERROR - %s truncated record header at %" PRIu64, reader->offlinePcapFilename, pos);
+        return -1;
+    }
+
+    h->ts.tv_sec  = (int32_t)reader_libpcapfile_get32(reader, data + pos);
+    h->ts.tv_usec = (int32_t)reader_libpcapfile_get32(reader, data + pos + 4);
+    h->caplen     = reader_libpcapfile_get32(reader, data + pos + 8);
+    h->len        = reader_libpcapfile_get32(reader, data + pos + 12);
+
+    if (reader->mapNsec)
+        h->ts.tv_usec /= 1000;
+
+    if (h->caplen > MOLOCH_PCAPFILE_MAX_SNAPLEN || pos + 16 + h->caplen > len) {
+        LOG("ERROR - %s bad or truncated record at %" PRIu64 " caplen: %u", reader->offlinePcapFilename, pos, h->caplen);
+        return -1;
+    }
+
+    *bytes = data + pos + 16;
+    *end = reader->mapPos = pos + 16 + h->caplen;
+    return 1;
+}
+/******************************************************************************/
+// Returns 1 and the next packet, 0 at the end of the file or -1 on error
+LOCAL int reader_libpcapfile_map_next_pcapng(MolochPcapFileReader_t *reader, struct pcap_pkthdr *h, const uint8_t **bytes, uint64_t *end)
+{
+    const uint8_t  *data = reader->map->data;
+    const uint64_t  len  = reader->map->len;
+
+    while (reader->mapPos < len) {
+        const uint64_t pos = reader->mapPos;
+
+        if (pos + 12 > len) {
+            LOG("ERROR - %s truncated block header at %" PRIu64, reader->offlinePcapFilename, pos);
+            return -1;
+        }
+
+        const uint32_t type = reader_libpcapfile_get32(reader, data + pos);
+        if (type == 0x0a0d0d0a) {
+            uint32_t bom;
+            memcpy(&bom, data + pos + 8, 4);
+            if (bom == 0x1a2b3c4d)
+                reader->mapSwapped = 0;
+            else if (bom == 0x4d3c2b1a)
+                reader->mapSwapped = 1;
+            else {
+                LOG("ERROR - %s bad section header at %" PRIu64, reader->offlinePcapFilename, pos);
+                return -1;
+            }
+            reader->numIfs = 0;
+        }
+
+        const uint32_t blen = reader_libpcapfile_get32(reader, data + pos + 4);
+        if (blen < 12 || (blen & 3) || pos + blen > len) {
+            LOG("ERROR - %s bad or truncated block at %" PRIu64 " len: %u", reader->offlinePcapFilename, pos, blen);
+            return -1;
+        }
+        reader->mapPos = pos + blen;
+
+        const uint8_t  *body    = data + pos + 8;
+        const uint32_t  bodyLen = blen - 12;
+
+        switch (type) {
+        case 1: // Interface Description
+            if (reader_libpcapfile_map_if(reader, body, bodyLen) != 0)
+                return -1;
+            break;
+        case 2: // Packet, obsolete
+        case 6: { // Enhanced Packet
+            if (bodyLen < 20)
+                goto bad;
+
+            const uint32_t ifid = (type == 2) ? reader_libpcapfile_get16(reader, body) : reader_libpcapfile_get32(reader, body);
+            if (ifid >= (uint32_t)reader->numIfs)
+                goto bad;
+
+            const uint64_t ts = ((uint64_t)reader_libpcapfile_get32(reader, body + 4) << 32) | reader_libpcapfile_get32(reader, body + 8);
+            h->caplen = reader_libpcapfile_get32(reader, body + 12);
+            h->len    = reader_libpcapfile_get32(reader, body + 16);
+            if (h->caplen > bodyLen - 20)
+                goto bad;
+
+            reader_libpcapfile_map_ts(&reader->ifs[ifid], ts, h);
+            *bytes = body + 20;
+            *end = reader->mapPos;
+            return 1;
+        }
+        case 3: // Simple Packet, no timestamp and always the first interface
+            if (bodyLen < 4 || reader->numIfs == 0)
+                goto bad;
+
+            h->len    = reader_libpcapfile_get32(reader, body);
+            h->caplen = MIN(h->len, bodyLen - 4);
+            if (reader->ifs[0].snaplen)
+                h->caplen = MIN(h->caplen, reader->ifs[0].snaplen);
+            h->ts.tv_sec  = 0;
+            h->ts.tv_usec = 0;
+            *bytes = body + 4;
+            *end = reader->mapPos;
+            return 1;
+        }
+        // Skip everything else
+    }
+    return 0;
+
+bad:
+    LOG("ERROR - %s bad packet block at %" PRIu64, reader->offlinePcapFilename, reader->mapPos);
+    return -1;
+}
+/******************************************************************************/
+LOCAL int reader_libpcapfile_process(MolochPcapFileReader_t *reader, char *filename)
 {
     char         errbuf[1024];
     char         path[PATH_MAX];
@@ -196,18 +625,18 @@ LOCAL int reader_libpcapfile_process(char *filename)
         goto process;
     }
 
-    if (!realpath(filename, offlinePcapFilename)) {
+    if (!realpath(filename, reader->offlinePcapFilename)) {
         LOG("ERROR - pcap open failed - Couldn't realpath file: '%s' with %s (%d)", filename, strerror(errno), errno);
         return 1;
     }
 
-    if (config.pcapSkip && moloch_db_file_exists(offlinePcapFilename, NULL)) {
+    if (config.pcapSkip && moloch_db_file_exists(reader->offlinePcapFilename, NULL)) {
         if (config.debug)
             LOG("Skipping %s", filename);
         return 1;
     }
 
-    if (config.pcapReprocess && !moloch_db_file_exists(offlinePcapFilename, NULL)) {
+    if (config.pcapReprocess && !moloch_db_file_exists(reader->offlinePcapFilename, NULL)) {
         LOG("Can't reprocess %s", filename);
         return 1;
     }
@@ -259,27 +688,90 @@ LOCAL int reader_libpcapfile_process(char *filename)
 process:
     errbuf[0] = 0;
     LOG ("Processing %s", filename);
-    pktsToRead = config.pktsToRead;
-    pcap = pcap_open_offline(filename, errbuf);
+    reader->pktsToRead = config.pktsToRead;
+
+    if (offlineMmap && strcmp(filename, "-") != 0 && reader_libpcapfile_map_open(reader, filename) == 0) {
+        reader_libpcapfile_opened(reader);
+        return 0;
+    }
+
+    reader->pcap = pcap_open_offline(filename, errbuf);
 
-    if (!pcap) {
+    if (!reader->pcap) {
         LOG("Couldn't process '%s' error '%s'", filename, errbuf);
         return 1;
     }
 
-    reader_libpcapfile_opened();
+    reader->dlt     = pcap_datalink(reader->pcap);
+    reader->snaplen = pcap_snapshot(reader->pcap);
+    reader_libpcapfile_opened(reader);
     return 0;
 }
 /******************************************************************************/
-LOCAL int reader_libpcapfile_next()
+/* With pcapSkip or pcapReprocess every file is looked up in the db, look up a
+ * whole group of them at once instead.
+ */
+LOCAL void reader_libpcapfile_prefetch(GPtrArray *filenames)
 {
-    gchar       *fullfilename;
+    if (!config.pcapSkip && !config.pcapReprocess)
+        return;
+
+    GPtrArray *realnames = g_ptr_array_new_with_free_func(g_free);
+    char       realname[PATH_MAX+1];
+
+    for (guint i = 0; i < filenames->len; i++) {
+        if (realpath(g_ptr_array_index(filenames, i), realname))
+            g_ptr_array_add(realnames, g_strdup(realname));
+    }
+
+    moloch_db_file_exists_prefetch((char **)realnames->pdata, realnames->len);
+    g_ptr_array_free(realnames, TRUE);
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_prefetch_dir(const char *dirname)
+{
+    if (!config.pcapSkip && !config.pcapReprocess)
+        return;
+
+    GDir *dir = g_dir_open(dirname, 0, NULL);
+    if (!dir)
+        return;
+
+    GPtrArray   *filenames = g_ptr_array_new_with_free_func(g_free);
+    const gchar *filename;
+
+    while ((filename = g_dir_read_name(dir))) {
+        if (filename[0] == '.' || !g_regex_match(config.offlineRegex, filename, 0, NULL))
+            continue;
+        g_ptr_array_add(filenames, g_build_filename(dirname, filename, NULL));
+    }
+    g_dir_close(dir);
 
-    pcap = 0;
+    reader_libpcapfile_prefetch(filenames);
+    g_ptr_array_free(filenames, TRUE);
+}
+/******************************************************************************/
+/* Returns the next file name to process, which the caller must g_free, or NULL
+ * if there isn't one right now.  Not thread safe, the reader threads hold the
+ * files lock while calling.
+ */
+LOCAL char *reader_libpcapfile_next_name()
+{
+    gchar       *fullfilename;
 
     if (config.pcapReadFiles) {
         static int pcapFilePos = 0;
 
+        if (pcapFilePos == 0 && config.pcapReadFiles[0]) {
+            GPtrArray *filenames = g_ptr_array_new();
+            for (int i = 0; config.pcapReadFiles[i]; i++) {
+                if (strcmp(config.pcapReadFiles[i], "-") != 0)
+                    g_ptr_array_add(filenames, config.pcapReadFiles[i]);
+            }
+            reader_libpcapfile_prefetch(filenames);
+            g_ptr_array_free(filenames, TRUE);
+        }
+
         fullfilename = config.pcapReadFiles[pcapFilePos];
 
         if (!fullfilename) {
@@ -287,11 +779,7 @@ LOCAL int reader_libpcapfile_next()
         }
         pcapFilePos++;
 
-        if (reader_libpcapfile_process(fullfilename)) {
-            return reader_libpcapfile_next();
-        }
-
-        return 1;
+        return g_strdup(fullfilename);
     }
 
 filesDone:
@@ -312,20 +800,20 @@ filesDone:
             pcapFileListsPos++;
             if (!file) {
                 LOG("ERROR - Couldn't open %s", config.pcapFileLists[pcapFileListsPos - 1]);
-                return reader_libpcapfile_next();
+                return reader_libpcapfile_next_name();
             }
         }
 
         if (feof(file)) {
             fclose(file);
             file = NULL;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next_name();
         }
 
         if (!fgets(line, sizeof(line), file)) {
             fclose(file);
             file = NULL;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next_name();
         }
 
         int lineLen = strlen(line);
@@ -335,13 +823,9 @@ filesDone:
 
         g_strstrip(line);
         if (!line[0] || line[0] == '#')
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next_name();
 
-        if (reader_libpcapfile_process(line)) {
-            return reader_libpcapfile_next();
-        }
-
-        return 1;
+        return g_strdup(line);
     }
 
 
@@ -371,6 +855,7 @@ fileListsDone:
             if (error) {
                 LOGEXIT("ERROR - Couldn't open pcap directory: Receive Error: %s", error->message);
             }
+            reader_libpcapfile_prefetch_dir(pcapBase[pcapGDirLevel]);
         }
         while (1) {
             const gchar *filename = g_dir_read_name(pcapGDir[pcapGDirLevel]);
@@ -392,7 +877,7 @@ fileListsDone:
                     continue;
                 pcapBase[pcapGDirLevel+1] = fullfilename;
                 pcapGDirLevel++;
-                return reader_libpcapfile_next();
+                return reader_libpcapfile_next_name();
             }
 
             if (!g_regex_match(config.offlineRegex, filename, 0, NULL)) {
@@ -400,13 +885,7 @@ fileListsDone:
                 continue;
             }
 
-            if (reader_libpcapfile_process(fullfilename)) {
-                g_free(fullfilename);
-                continue;
-            }
-
-            g_free(fullfilename);
-            return 1;
+            return fullfilename;
         }
         g_dir_close(pcapGDir[pcapGDirLevel]);
         pcapGDir[pcapGDirLevel] = 0;
@@ -415,31 +894,122 @@ fileListsDone:
             g_free(pcapBase[pcapGDirLevel]);
             pcapBase[pcapGDirLevel] = 0;
             pcapGDirLevel--;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next_name();
         } else {
             pcapDirPos++;
             pcapGDirLevel = -1;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next_name();
         }
 
     }
 
 dirsDone:
-    while (DLL_COUNT(s_, &monitorQ) > 0) {
+    if (DLL_COUNT(s_, &monitorQ) > 0) {
         MolochString_t *string;
         DLL_POP_HEAD(s_, &monitorQ, string);
         fullfilename = string->str;
         MOLOCH_TYPE_FREE(MolochString_t, string);
+        return fullfilename;
+    }
+    return NULL;
+}
+/******************************************************************************/
+// Main thread version, open the next file that can be processed
+LOCAL int reader_libpcapfile_next()
+{
+    MolochPcapFileReader_t *reader = &readers[0];
+    char                   *filename;
 
-        if (reader_libpcapfile_process(fullfilename)) {
-            g_free(fullfilename);
-            continue;
+    reader->pcap = 0;
+
+    while (1) {
+        MOLOCH_LOCK(files);
+        filename = reader_libpcapfile_next_name();
+        MOLOCH_UNLOCK(files);
+
+        if (!filename)
+            return 0;
+
+        int rc = reader_libpcapfile_process(reader, filename);
+        g_free(filename);
+        if (rc == 0)
+            return 1;
+    }
+}
+/******************************************************************************/
+// Which reader a file must be processed by, -1 for any
+LOCAL int reader_libpcapfile_thread_for(const char *filename)
+{
+    if (!threadRegex)
+        return -1;
+
+    GMatchInfo *match_info = 0;
+    int         num = -1;
+
+    g_regex_match(threadRegex, filename, 0, &match_info);
+    if (g_match_info_matches(match_info)) {
+        // Use the first capture group as the key if there is one
+        char *key = g_match_info_fetch(match_info, g_match_info_get_match_count(match_info) > 1 ? 1 : 0);
+        num = g_str_hash(key) % numReaderThreads;
+        g_free(key);
+    }
+    g_match_info_free(match_info);
+    return num;
+}
+/******************************************************************************/
+/* Reader thread version, open the next file this reader should process.  Files
+ * that belong to another reader are handed to it.  Returns 0 when there are no
+ * more files, in monitor mode waits for more instead.
+ */
+LOCAL int reader_libpcapfile_next_thread(MolochPcapFileReader_t *reader)
+{
+    char *filename;
+
+    reader->pcap = 0;
+
+    while (1) {
+        MOLOCH_LOCK(files);
+        while (1) {
+            if (DLL_COUNT(s_, &reader->pendingQ) > 0) {
+                MolochString_t *string;
+                DLL_POP_HEAD(s_, &reader->pendingQ, string);
+                filename = string->str;
+                MOLOCH_TYPE_FREE(MolochString_t, string);
+                break;
+            }
+
+            filename = reader_libpcapfile_next_name();
+            if (filename) {
+                const int num = reader_libpcapfile_thread_for(filename);
+                if (num == -1 || num == reader->num)
+                    break;
+
+                MolochString_t *string = MOLOCH_TYPE_ALLOC0(MolochString_t);
+                string->str = filename;
+                DLL_PUSH_TAIL(s_, &readers[num].pendingQ, string);
+                MOLOCH_COND_BROADCAST(files);
+                continue;
+            }
+
+            if (!config.pcapMonitor || config.quitting) {
+                MOLOCH_UNLOCK(files);
+                return 0;
+            }
+            MOLOCH_COND_WAIT(files);
+
+            // reader_libpcapfile_stop wakes everyone up when quitting
+            if (config.quitting) {
+                MOLOCH_UNLOCK(files);
+                return 0;
+            }
         }
+        MOLOCH_UNLOCK(files);
 
-        g_free(fullfilename);
-        return 1;
+        int rc = reader_libpcapfile_process(reader, filename);
+        g_free(filename);
+        if (rc == 0)
+            return 1;
     }
-    return 0;
 }
 /******************************************************************************/
 LOCAL gboolean reader_libpcapfile_monitor_gfunc (gpointer UNUSED(user_data))
@@ -454,10 +1024,20 @@ LOCAL gboolean reader_libpcapfile_monitor_gfunc (gpointer UNUSED(user_data))
     return G_SOURCE_CONTINUE;
 }
 /******************************************************************************/
+// Reader threads in monitor mode wait on files for new files, wake them up so they see quitting
+LOCAL void reader_libpcapfile_stop()
+{
+    MOLOCH_LOCK(files);
+    MOLOCH_COND_BROADCAST(files);
+    MOLOCH_UNLOCK(files);
+}
+/******************************************************************************/
 LOCAL int reader_libpcapfile_stats(MolochReaderStats_t *stats)
 {
     struct pcap_stat ps;
-    if (!pcap) {
+    pcap_t          *pcap = readers[0].pcap;
+
+    if (!pcap || numReaderThreads > 1 || readers[0].map) {
         stats->dropped = 0;
         stats->total = 0;
         return 1;
@@ -471,9 +1051,10 @@ LOCAL int reader_libpcapfile_stats(MolochReaderStats_t *stats)
     return 0;
 }
 /******************************************************************************/
-LOCAL void reader_libpcapfile_pcap_cb(u_char *UNUSED(user), const struct pcap_pkthdr *h, const u_char *bytes)
+// end is where the record finishes in the file, ref is set when bytes points into a mapping
+LOCAL void reader_libpcapfile_packet(MolochPcapFileReader_t *reader, const struct pcap_pkthdr *h, const u_char *bytes, uint64_t end, MolochPacketRef_t *ref)
 {
-    MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+    MolochPacket_t *packet = MOLOCH_POOL_ALLOC0(MolochPacket_t);
 
     if (unlikely(h->caplen != h->len)) {
         if (!config.readTruncatedPackets && !config.ignoreErrors) {
@@ -488,74 +1069,181 @@ LOCAL void reader_libpcapfile_pcap_cb(u_char *UNUSED(user), const struct pcap_pk
 
     packet->pkt           = (u_char *)bytes;
     packet->ts            = h->ts;
-    packet->readerFilePos = ftell(offlineFile) - 16 - h->len;
-    packet->readerPos     = readerPos;
-    moloch_packet_batch(&batch, packet);
+    packet->readerFilePos = end - 16 - h->len;
+    packet->readerPos     = reader->readerPos;
+    packet->ref           = ref;
+    moloch_packet_batch(&reader->batch, packet);
 }
 /******************************************************************************/
-LOCAL gboolean reader_libpcapfile_read()
+LOCAL void reader_libpcapfile_pcap_cb(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
+{
+    MolochPcapFileReader_t *reader = (MolochPcapFileReader_t *)user;
+
+    reader_libpcapfile_packet(reader, h, bytes, ftell(reader->offlineFile), NULL);
+}
+/******************************************************************************/
+/* pcap_dispatch for mapped files, returns the number of packets that passed the
+ * bpf, 0 at the end of the file and -1 on error.
+ */
+LOCAL int reader_libpcapfile_map_dispatch(MolochPcapFileReader_t *reader, int cnt)
+{
+    MolochPcapFileMap_t *map = reader->map;
+    struct pcap_pkthdr   h;
+    const uint8_t       *bytes;
+    uint64_t             end;
+    int                  n = 0;
+    int                  rc = 0;
+
+    // Take the refs for the packets up front, a packet dropped while batching releases its ref right away
+    MOLOCH_THREAD_INCR_NUM(map->ref.refs, cnt);
+
+    while (n < cnt) {
+        if (reader->mapFormat == MOLOCH_PCAPFILE_PCAPNG)
+            rc = reader_libpcapfile_map_next_pcapng(reader, &h, &bytes, &end);
+        else
+            rc = reader_libpcapfile_map_next_pcap(reader, &h, &bytes, &end);
+
+        if (rc <= 0)
+            break;
+
+        if (reader->hasBpf && !pcap_offline_filter(&reader->bpf, &h, bytes))
+            continue;
+
+        reader_libpcapfile_packet(reader, &h, bytes, end, &map->ref);
+        n++;
+    }
+
+    __sync_sub_and_fetch(&map->ref.refs, cnt - n);
+
+    if (rc < 0)
+        return -1;
+    return n;
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_close(MolochPcapFileReader_t *reader)
+{
+    if (reader->hasBpf) {
+        pcap_freecode(&reader->bpf);
+        reader->hasBpf = 0;
+    }
+
+    pcap_close(reader->pcap);
+
+    if (reader->map) {
+        close(reader->mapFd);
+        if (MOLOCH_THREAD_DECRNEW(reader->map->ref.refs) == 0)
+            reader_libpcapfile_map_release(&reader->map->ref);
+        reader->map = NULL;
+    }
+}
+/******************************************************************************/
+/* Read the next group of packets from the reader's file.
+ * Returns 1 if packets were read, 0 if paused because of back pressure and -1
+ * when the file is done.
+ */
+LOCAL int reader_libpcapfile_dispatch(MolochPcapFileReader_t *reader)
 {
     // pause reading if too many waiting disk operations
     if (moloch_writer_queue_length() > 10) {
         if (config.debug)
             LOG("Waiting to process more packets, write q: %u", moloch_writer_queue_length());
-        return G_SOURCE_CONTINUE;
+        return 0;
     }
 
     // pause reading if too many waiting ES operations
     if (moloch_http_queue_length(esServer) > 30) {
         if (config.debug)
             LOG("Waiting to process more packets, es q: %d", moloch_http_queue_length(esServer));
-        return G_SOURCE_CONTINUE;
+        return 0;
     }
 
     // pause reading if too many packets are waiting to be processed
     if (moloch_packet_outstanding() > (int)(config.maxPacketsInQueue - offlineDispatchAfter)) {
         if (config.debug)
             LOG("Waiting to process more packets, packet q: %d allow %d, try increasing maxPacketsInQueue (%d)", moloch_packet_outstanding(), (int)(config.maxPacketsInQueue - offlineDispatchAfter), config.maxPacketsInQueue);
-        return G_SOURCE_CONTINUE;
+        return 0;
     }
 
     int r;
-    if (pktsToRead > 0) {
-        r = pcap_dispatch(pcap, MIN(pktsToRead, offlineDispatchAfter), reader_libpcapfile_pcap_cb, NULL);
+    if (reader->pktsToRead > 0) {
+        const int cnt = MIN(reader->pktsToRead, offlineDispatchAfter);
+        if (reader->map)
+            r = reader_libpcapfile_map_dispatch(reader, cnt);
+        else
+            r = pcap_dispatch(reader->pcap, cnt, reader_libpcapfile_pcap_cb, (u_char *)reader);
 
         if (r > 0)
-            pktsToRead -= r;
+            reader->pktsToRead -= r;
 
-        if (pktsToRead == 0)
+        if (reader->pktsToRead == 0)
             r = 0;
     } else {
-        r = pcap_dispatch(pcap, offlineDispatchAfter, reader_libpcapfile_pcap_cb, NULL);
+        if (reader->map)
+            r = reader_libpcapfile_map_dispatch(reader, offlineDispatchAfter);
+        else
+            r = pcap_dispatch(reader->pcap, offlineDispatchAfter, reader_libpcapfile_pcap_cb, (u_char *)reader);
     }
-    moloch_packet_batch_flush(&batch);
+    moloch_packet_batch_flush(&reader->batch);
 
     // Some kind of failure, move to the next file or quit
     if (r <= 0) {
         if (config.pcapDelete && r == 0) {
             if (config.debug)
-                LOG("Deleting %s", offlinePcapFilename);
-            int rc = unlink(offlinePcapFilename);
+                LOG("Deleting %s", reader->offlinePcapFilename);
+            int rc = unlink(reader->offlinePcapFilename);
             if (rc != 0)
-                LOG("Failed to delete file %s %s (%d)", offlinePcapFilename, strerror(errno), errno);
-        }
-        pcap_close(pcap);
-        if (reader_libpcapfile_next()) {
-            return G_SOURCE_REMOVE;
+                LOG("Failed to delete file %s %s (%d)", reader->offlinePcapFilename, strerror(errno), errno);
         }
+        reader_libpcapfile_close(reader);
 
-        if (config.pcapMonitor)
-            g_timeout_add(25, reader_libpcapfile_monitor_gfunc, 0);
-        else {
-            moloch_quit();
-        }
+        MOLOCH_LOCK(files);
+        activeReaders--;
+        MOLOCH_COND_BROADCAST(files);
+        MOLOCH_UNLOCK(files);
+        return -1;
+    }
+
+    return 1;
+}
+/******************************************************************************/
+LOCAL gboolean reader_libpcapfile_read()
+{
+    if (reader_libpcapfile_dispatch(&readers[0]) >= 0)
+        return G_SOURCE_CONTINUE;
+
+    if (reader_libpcapfile_next()) {
         return G_SOURCE_REMOVE;
     }
 
-    return G_SOURCE_CONTINUE;
+    if (config.pcapMonitor)
+        g_timeout_add(25, reader_libpcapfile_monitor_gfunc, 0);
+    else {
+        moloch_quit();
+    }
+    return G_SOURCE_REMOVE;
+}
+/******************************************************************************/
+LOCAL void *reader_libpcapfile_thread(gpointer readerv)
+{
+    MolochPcapFileReader_t *reader = readerv;
+
+    while (reader_libpcapfile_next_thread(reader)) {
+        int rc;
+        while ((rc = reader_libpcapfile_dispatch(reader)) >= 0) {
+            if (rc == 0)
+                usleep(5000);
+        }
+    }
+
+    MOLOCH_LOCK(files);
+    runningReaderThreads--;
+    if (runningReaderThreads == 0)
+        moloch_quit();
+    MOLOCH_UNLOCK(files);
+    return NULL;
 }
 /******************************************************************************/
-LOCAL void reader_libpcapfile_opened()
+LOCAL void reader_libpcapfile_opened(MolochPcapFileReader_t *reader)
 {
     int moloch_db_can_quit();
 
@@ -574,22 +1262,30 @@ LOCAL void reader_libpcapfile_opened()
         }
     }
 
-    moloch_packet_set_dltsnap(pcap_datalink(pcap), pcap_snapshot(pcap));
-
-    offlineFile = pcap_file(pcap);
-
-    if (config.bpf && pcapFileHeader.dlt != DLT_NFLOG) {
-        struct bpf_program   bpf;
-
-        if (pcap_compile(pcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
-            LOGEXIT("ERROR - Couldn't compile bpf filter: '%s' with %s", config.bpf, pcap_geterr(pcap));
-        }
-
-	if (pcap_setfilter(pcap, &bpf) == -1) {
-            LOGEXIT("ERROR - Couldn't set bpf filter: '%s' with %s", config.bpf, pcap_geterr(pcap));
+    const int dlt     = reader->dlt;
+    const int snaplen = reader->snaplen;
+
+    MOLOCH_LOCK(files);
+    /* Packets are decoded using the one global link type, so a file that needs a
+     * different link type, or a larger snaplen, waits for the other readers to
+     * finish their files.  While someone is waiting no new files start.
+     */
+    int waiting = 0;
+    while (activeReaders > 0 &&
+           (dlt != (int)pcapFileHeader.dlt || snaplen > (int)pcapFileHeader.snaplen || dltWaiters > waiting)) {
+        if (!waiting && (dlt != (int)pcapFileHeader.dlt || snaplen > (int)pcapFileHeader.snaplen)) {
+            waiting = 1;
+            dltWaiters++;
         }
-        pcap_freecode(&bpf);
+        MOLOCH_COND_WAIT(files);
     }
+    dltWaiters -= waiting;
+
+    if (activeReaders == 0)
+        moloch_packet_set_dltsnap(dlt, snaplen);
+    activeReaders++;
+
+    reader->offlineFile = pcap_file(reader->pcap);
 
     readerPos++;
     // We've wrapped around all 256 reader items, clear the previous file information
@@ -597,14 +1293,8 @@ LOCAL void reader_libpcapfile_opened()
         g_free(readerFileName[readerPos]);
         readerOutputIds[readerPos] = 0;
     }
-    readerFileName[readerPos] = g_strdup(offlinePcapFilename);
-
-    int fd = pcap_fileno(pcap);
-    if (fd == -1) {
-        g_timeout_add(25, reader_libpcapfile_read, NULL);
-    } else {
-        moloch_watch_fd(fd, MOLOCH_GIO_READ_COND, reader_libpcapfile_read, NULL);
-    }
+    readerFileName[readerPos] = g_strdup(reader->offlinePcapFilename);
+    reader->readerPos = readerPos;
 
     if (filenameOpsNum > 0) {
 
@@ -618,12 +1308,12 @@ LOCAL void reader_libpcapfile_opened()
         int i;
         for (i = 0; i < filenameOpsNum; i++) {
             GMatchInfo *match_info = 0;
-            g_regex_match(filenameOps[i].regex, offlinePcapFilename, 0, &match_info);
+            g_regex_match(filenameOps[i].regex, reader->offlinePcapFilename, 0, &match_info);
             if (g_match_info_matches(match_info)) {
                 GError *error = 0;
                 char *expand = g_match_info_expand_references(match_info, filenameOps[i].expand, &error);
                 if (error) {
-                    LOG("Error expanding '%s' with '%s' - %s", offlinePcapFilename, filenameOps[i].expand, error->message);
+                    LOG("Error expanding '%s' with '%s' - %s", reader->offlinePcapFilename, filenameOps[i].expand, error->message);
                     g_error_free(error);
                 }
                 if (expand) {
@@ -634,6 +1324,40 @@ LOCAL void reader_libpcapfile_opened()
             g_match_info_free(match_info);
         }
     }
+    MOLOCH_UNLOCK(files);
+
+    if (config.bpf && dlt != DLT_NFLOG) {
+        struct bpf_program   bpf;
+
+        // Older libpcaps have a non reentrant filter compiler
+        MOLOCH_LOCK(bpf);
+        if (pcap_compile(reader->pcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+            LOGEXIT("ERROR - Couldn't compile bpf filter: '%s' with %s", config.bpf, pcap_geterr(reader->pcap));
+        }
+        MOLOCH_UNLOCK(bpf);
+
+        // Mapped files are filtered as they are read
+        if (reader->map) {
+            reader->bpf = bpf;
+            reader->hasBpf = 1;
+        } else {
+            if (pcap_setfilter(reader->pcap, &bpf) == -1) {
+                LOGEXIT("ERROR - Couldn't set bpf filter: '%s' with %s", config.bpf, pcap_geterr(reader->pcap));
+            }
+            pcap_freecode(&bpf);
+        }
+    }
+
+    // Reader threads drive themselves
+    if (numReaderThreads > 1)
+        return;
+
+    int fd = reader->map ? reader->mapFd : pcap_fileno(reader->pcap);
+    if (fd == -1) {
+        g_timeout_add(25, reader_libpcapfile_read, NULL);
+    } else {
+        moloch_watch_fd(fd, MOLOCH_GIO_READ_COND, reader_libpcapfile_read, NULL);
+    }
 }
 
 /******************************************************************************/
@@ -688,9 +1412,19 @@ LOCAL void reader_libpcapfile_start() {
     }
     g_strfreev(filenameOpsStr);
 
+    if (numReaderThreads > 1) {
+        runningReaderThreads = numReaderThreads;
+        for (i = 0; i < numReaderThreads; i++) {
+            char name[100];
+            snprintf(name, sizeof(name), "moloch-pcapfile%d", i);
+            g_thread_unref(g_thread_new(name, &reader_libpcapfile_thread, &readers[i]));
+        }
+        return;
+    }
+
     // Now actually start
     reader_libpcapfile_next();
-    if (!pcap) {
+    if (!readers[0].pcap) {
         if (config.pcapMonitor) {
             g_timeout_add(25, reader_libpcapfile_monitor_gfunc, 0);
         } else {
@@ -707,12 +1441,41 @@ void reader_libpcapfile_init(char *UNUSED(name))
         CONFIGEXIT("offlineDispatchAfter (%d) must be less than maxPacketsInQueue (%d) + 1000", offlineDispatchAfter, config.maxPacketsInQueue);
     }
 
+    offlineMmap                 = moloch_config_boolean(NULL, "offlineMmap", TRUE);
+
+    // Files read with --monitor or --copy may still be written to, and a
+    // mapped file shrinking is a SIGBUS
+    if (offlineMmap && (config.pcapMonitor || config.copyPcap)) {
+        if (config.debug)
+            LOG("Not using offlineMmap with --monitor or --copy");
+        offlineMmap = FALSE;
+    }
+
+    numReaderThreads            = moloch_config_int(NULL, "pcapReadThreads", 1, 1, MOLOCH_PCAPFILE_MAX_THREADS);
+    if (numReaderThreads > 1 && config.flushBetween) {
+        LOG("WARNING - --flush processes one file at a time, ignoring pcapReadThreads");
+        numReaderThreads = 1;
+    }
+
+    char *threadRegexStr = moloch_config_str(NULL, "pcapReadThreadRegex", NULL);
+    if (threadRegexStr && threadRegexStr[0]) {
+        threadRegex = g_regex_new(threadRegexStr, 0, 0, 0);
+        if (!threadRegex)
+            CONFIGEXIT("Couldn't compile pcapReadThreadRegex '%s'", threadRegexStr);
+    }
+    g_free(threadRegexStr);
+
     moloch_reader_start         = reader_libpcapfile_start;
+    moloch_reader_stop          = reader_libpcapfile_stop;
     moloch_reader_stats         = reader_libpcapfile_stats;
 
+    DLL_INIT(s_, &monitorQ);
+    for (int i = 0; i < numReaderThreads; i++) {
+        readers[i].num = i;
+        DLL_INIT(s_, &readers[i].pendingQ);
+        moloch_packet_batch_init(&readers[i].batch);
+    }
+
     if (config.pcapMonitor)
         reader_libpcapfile_init_monitor();
-
-    DLL_INIT(s_, &monitorQ);
-    moloch_packet_batch_init(&batch);
 }
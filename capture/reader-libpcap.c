@@ -54,7 +54,7 @@ void reader_libpcap_pcap_cb(u_char *batch, const struct pcap_pkthdr *h, const u_
             h->caplen, h->len);
     }
 
-    MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+    MolochPacket_t *packet = MOLOCH_POOL_ALLOC0(MolochPacket_t);
 
     packet->pkt           = (u_char *)bytes;
     packet->ts            = h->ts;
@@ -106,7 +106,7 @@ gboolean pcapoverip_client_read_cb(gint UNUSED(fd), GIOCondition cond, gpointer
         BSB bsb;
         BSB_INIT(bsb, poic->data + pos , poic->len - pos);
 
-        MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+        MolochPacket_t *packet = MOLOCH_POOL_ALLOC0(MolochPacket_t);
 
         uint32_t caplen = 0;
         uint32_t origlen = 0;
@@ -134,7 +134,7 @@ gboolean pcapoverip_client_read_cb(gint UNUSED(fd), GIOCondition cond, gpointer
             if (!config.ignoreErrors) {
                 LOGEXIT("ERROR - The packet length %u is too large.", caplen);
             } else {
-                MOLOCH_TYPE_FREE(MolochPacket_t, packet);
+                MOLOCH_POOL_FREE(MolochPacket_t, packet);
                 pcapoverip_client_free(poic);
                 return FALSE;
             }
@@ -142,7 +142,7 @@ gboolean pcapoverip_client_read_cb(gint UNUSED(fd), GIOCondition cond, gpointer
         }
 
         if (poic->len - pos < 16 + caplen) { // Not enough data for packet
-            MOLOCH_TYPE_FREE(MolochPacket_t, packet);
+            MOLOCH_POOL_FREE(MolochPacket_t, packet);
             break;
         }
 
@@ -151,7 +151,7 @@ gboolean pcapoverip_client_read_cb(gint UNUSED(fd), GIOCondition cond, gpointer
         packet->readerPos     = poic->interface;
 
         if (config.bpf && bpf_filter(bpfp.bf_insns, packet->pkt, packet->pktlen, packet->pktlen)) {
-            MOLOCH_TYPE_FREE(MolochPacket_t, packet);
+            MOLOCH_POOL_FREE(MolochPacket_t, packet);
         } else {
             moloch_packet_batch(&batch, packet);
         }
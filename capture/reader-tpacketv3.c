@@ -54,16 +54,25 @@ void reader_tpacketv3_init(char *UNUSED(name))
 #define MAX_TPACKETV3_THREADS 12
 
 typedef struct {
-    int                  fd;
-    struct tpacket_req3  req;
-    uint8_t             *map;
-    struct iovec        *rd;
-    uint8_t              interfacePos;
+    MolochPacketRef_t           ref;
+    struct tpacket_block_desc  *tbd;
+    volatile int                held;
+} MolochTPacketV3Block_t;
+
+typedef struct {
+    int                     fd;
+    struct tpacket_req3     req;
+    uint8_t                *map;
+    struct iovec           *rd;
+    MolochTPacketV3Block_t *blocks;
+    uint8_t                 interfacePos;
 } MolochTPacketV3_t;
 
 LOCAL MolochTPacketV3_t infos[MAX_INTERFACES][MAX_TPACKETV3_THREADS];
 
 LOCAL int numThreads;
+LOCAL int zeroCopy;
+LOCAL uint64_t heldWaits;
 
 extern MolochPcapFileHdr_t   pcapFileHeader;
 LOCAL struct bpf_program     bpf;
@@ -91,6 +100,17 @@ int reader_tpacketv3_stats(MolochReaderStats_t *stats)
     return 0;
 }
 /******************************************************************************/
+// Called by whoever drops the last packet pointing into the block
+LOCAL void reader_tpacketv3_block_release(MolochPacketRef_t *ref)
+{
+    MolochTPacketV3Block_t *block = (MolochTPacketV3Block_t *)ref;
+
+    __sync_synchronize();
+    block->tbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    __sync_synchronize();
+    block->held = 0;
+}
+/******************************************************************************/
 LOCAL void *reader_tpacketv3_thread(gpointer infov)
 {
     MolochTPacketV3_t *info = (MolochTPacketV3_t *)infov;
@@ -120,7 +140,14 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
                 }
             }
 
-            LOG("Stats pos:%d info:%d status:%x waiting:%d total cnt:%d total waiting:%d", pos, info->interfacePos, tbd->hdr.bh1.block_status, tbd->hdr.bh1.num_pkts, cnt, waiting);
+            LOG("Stats pos:%d info:%d status:%x waiting:%d total cnt:%d total waiting:%d held waits:%" PRIu64, pos, info->interfacePos, tbd->hdr.bh1.block_status, tbd->hdr.bh1.num_pkts, cnt, waiting, heldWaits);
+        }
+
+        // Packets from the last time around the ring are still being used
+        if (zeroCopy && info->blocks[pos].held) {
+            MOLOCH_THREAD_INCR(heldWaits);
+            usleep(50);
+            continue;
         }
 
         // Wait until the block is owned by moloch
@@ -134,6 +161,14 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
         th = (struct tpacket3_hdr *) ((uint8_t *) tbd + tbd->hdr.bh1.offset_to_first_pkt);
         uint32_t p;
 
+        // Each packet holds a ref, plus one for us until the batch is flushed
+        MolochTPacketV3Block_t *block = NULL;
+        if (zeroCopy) {
+            block = &info->blocks[pos];
+            block->held = 1;
+            block->ref.refs = tbd->hdr.bh1.num_pkts + 1;
+        }
+
         for (p = 0; p < tbd->hdr.bh1.num_pkts; p++) {
             if (unlikely(th->tp_snaplen != th->tp_len)) {
                 LOGEXIT("ERROR - Arkime requires full packet captures caplen: %d pktlen: %d\n"
@@ -141,12 +176,14 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
                     th->tp_snaplen, th->tp_len);
             }
 
-            MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+            MolochPacket_t *packet = MOLOCH_POOL_ALLOC0(MolochPacket_t);
             packet->pkt           = (u_char *)th + th->tp_mac;
             packet->pktlen        = th->tp_len;
             packet->ts.tv_sec     = th->tp_sec;
             packet->ts.tv_usec    = th->tp_nsec/1000;
             packet->readerPos     = info->interfacePos;
+            if (block)
+                packet->ref       = &block->ref;
 
             if ((th->tp_status & TP_STATUS_VLAN_VALID) && th->hv1.tp_vlan_tci) {
                 packet->vlan = th->hv1.tp_vlan_tci & 0xfff;
@@ -158,7 +195,12 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
         }
         moloch_packet_batch_flush(&batch);
 
-        tbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        if (block) {
+            if (MOLOCH_THREAD_DECRNEW(block->ref.refs) == 0)
+                reader_tpacketv3_block_release(&block->ref);
+        } else {
+            tbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        }
         pos = (pos + 1) % info->req.tp_block_nr;
     }
     return NULL;
@@ -187,6 +229,7 @@ void reader_tpacketv3_init(char *UNUSED(name))
 {
     int blocksize = moloch_config_int(NULL, "tpacketv3BlockSize", 1<<21, 1<<16, 1U<<31);
     numThreads = moloch_config_int(NULL, "tpacketv3NumThreads", 2, 1, MAX_TPACKETV3_THREADS);
+    zeroCopy = moloch_config_boolean(NULL, "tpacketv3ZeroCopy", FALSE);
 
     if (blocksize % getpagesize() != 0) {
         CONFIGEXIT("tpacketv3BlockSize=%d not divisible by pagesize %d", blocksize, getpagesize());
@@ -258,6 +301,14 @@ void reader_tpacketv3_init(char *UNUSED(name))
                 infos[i][t].rd[j].iov_len = infos[i][t].req.tp_block_size;
             }
 
+            if (zeroCopy) {
+                infos[i][t].blocks = MOLOCH_SIZE_ALLOC0("tpacketv3 blocks", infos[i][t].req.tp_block_nr * sizeof(MolochTPacketV3Block_t));
+                for (j = 0; j < infos[i][t].req.tp_block_nr; j++) {
+                    infos[i][t].blocks[j].ref.release = reader_tpacketv3_block_release;
+                    infos[i][t].blocks[j].tbd = infos[i][t].rd[j].iov_base;
+                }
+            }
+
             struct sockaddr_ll ll;
             memset(&ll, 0, sizeof(ll));
             ll.sll_family = PF_PACKET;
@@ -55,13 +55,47 @@ typedef struct {
 #define MOLOCH_SAVE_FLAG_FINAL  0x02
 #define MOLOCH_SAVE_FLAG_BOTH   0x03
 
+#define MOLOCH_RULES_STR_MATCH_HEAD      1
+#define MOLOCH_RULES_STR_MATCH_TAIL      2
+#define MOLOCH_RULES_STR_MATCH_CONTAINS  3
+
+/* The head, tail and contains strings of a field are compiled into a prefix
+ * trie, a trie of the reversed strings, and an Aho-Corasick automaton, so one
+ * pass over a value finds every string it matches.  Node 0 is the root, since
+ * nothing points back to the root 0 also means no child.
+ */
+typedef struct {
+    uint8_t             *bytes;     // Sorted
+    uint32_t            *next;
+    uint32_t             fail;      // Contains only, longest suffix that is also in the trie
+    uint32_t             dict;      // Contains only, closest fail node with an out
+    int32_t              out;       // Index into values or -1
+    uint16_t             numNext;
+} MolochRulesTrieNode_t;
+
+typedef struct {
+    MolochRulesTrieNode_t *nodes;
+    uint32_t               numNodes;
+    uint32_t               sizeNodes;
+} MolochRulesTrie_t;
+
+typedef struct {
+    MolochRulesTrie_t    tries[3];  // Indexed by MOLOCH_RULES_STR_MATCH_* - 1
+    gpointer            *values;
+    int                  numValues;
+    int                  sizeValues;
+} MolochRulesStrMatch_t;
+
+typedef gboolean (*MolochRulesStrMatchCb)(gpointer value, gpointer uw);
+
 typedef struct {
     char                *filename;
     char                *name;
     char                *bpf;                      // String version of bpf
-    struct bpf_program   bpfp;
+    int                  bpfNum;                   // Which MolochRulesBpf_t program bpf compiled to
     GHashTable          *hash[MOLOCH_FIELDS_MAX];  // For each non ip field in rule
     GPtrArray           *match[MOLOCH_FIELDS_MAX]; // For any string fields with , modifier or int fields range
+    MolochRulesStrMatch_t *strMatch[MOLOCH_FIELDS_MAX]; // match compiled for string fields
     patricia_tree_t     *tree4[MOLOCH_FIELDS_MAX];
     patricia_tree_t     *tree6[MOLOCH_FIELDS_MAX];
     MolochFieldOps_t     ops;                      // Ops to run on match
@@ -72,7 +106,27 @@ typedef struct {
     uint8_t              log;                      // should we log or not
 } MolochRule_t;
 
-#define MOLOCH_RULES_MAX     100
+/* All the bpf rules of a type are compiled together.  Rules with the same bpf
+ * share a program, and the programs are or'ed together in groups of
+ * MOLOCH_RULES_BPF_GROUP plus once more for all of them, letting libpcap's
+ * optimizer merge the common tests.  Most packets don't match any rule and
+ * are rejected by running the single any program.  Programs using vlan, mpls,
+ * pppoes or geneve are solo, they change how the rest of an expression is
+ * read so they are never merged and always run on their own.
+ */
+#define MOLOCH_RULES_BPF_GROUP 16
+
+typedef struct {
+    struct bpf_program     any;
+    struct bpf_program    *groups;
+    struct bpf_program    *progs;
+    char                 **strs;
+    uint8_t                anyOk;    // any compiled, otherwise fall through to the groups
+    uint8_t               *groupsOk;
+    uint8_t               *solo;
+    int                    num;
+    int                    numSolo;
+} MolochRulesBpf_t;
 
 /* All the information about the rules.  To support reloading while running
  * there can be multiple info variables.
@@ -88,9 +142,12 @@ typedef struct {
     patricia_tree_t       *fieldsTree4[MOLOCH_FIELDS_MAX];
     patricia_tree_t       *fieldsTree6[MOLOCH_FIELDS_MAX];
     GHashTable            *fieldsMatch[MOLOCH_FIELDS_MAX];
+    MolochRulesStrMatch_t *fieldsStrMatch[MOLOCH_FIELDS_MAX]; // fieldsMatch compiled for string fields
 
     int                    rulesLen[MOLOCH_RULE_TYPE_NUM];
-    MolochRule_t          *rules[MOLOCH_RULE_TYPE_NUM][MOLOCH_RULES_MAX+1];
+    int                    rulesSize[MOLOCH_RULE_TYPE_NUM];
+    MolochRule_t         **rules[MOLOCH_RULE_TYPE_NUM];  // NULL terminated
+    MolochRulesBpf_t       bpf[MOLOCH_RULE_TYPE_NUM];
 } MolochRulesInfo_t;
 
 LOCAL MolochRulesInfo_t    current;
@@ -100,9 +157,7 @@ LOCAL char               **rulesFiles;
 LOCAL pcap_t              *deadPcap;
 extern MolochPcapFileHdr_t pcapFileHeader;
 
-#define MOLOCH_RULES_STR_MATCH_HEAD      1
-#define MOLOCH_RULES_STR_MATCH_TAIL      2
-#define MOLOCH_RULES_STR_MATCH_CONTAINS  3
+LOCAL const char          *strMatchNames[] = {"", "head", "tail", "contains"};
 
 typedef union {
     struct {
@@ -114,11 +169,243 @@ typedef union {
 
 LOCAL void moloch_rules_load_add_field_range_match(MolochRule_t *rule, int pos, char *key);
 /******************************************************************************/
+LOCAL inline uint32_t moloch_rules_trie_child(const MolochRulesTrieNode_t *node, uint8_t b)
+{
+    int lo = 0, hi = node->numNext;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (node->bytes[mid] < b)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < node->numNext && node->bytes[lo] == b) ? node->next[lo] : 0;
+}
+/******************************************************************************/
+LOCAL uint32_t moloch_rules_trie_node(MolochRulesTrie_t *trie)
+{
+    if (trie->numNodes >= trie->sizeNodes) {
+        trie->sizeNodes = MAX(trie->sizeNodes * 2, 16);
+        trie->nodes = realloc(trie->nodes, trie->sizeNodes * sizeof(MolochRulesTrieNode_t));
+    }
+    MolochRulesTrieNode_t *node = &trie->nodes[trie->numNodes];
+    memset(node, 0, sizeof(*node));
+    node->out = -1;
+    return trie->numNodes++;
+}
+/******************************************************************************/
+LOCAL void moloch_rules_trie_add(MolochRulesTrie_t *trie, const uint8_t *str, int len, gboolean reverse, int out)
+{
+    if (!trie->numNodes)
+        moloch_rules_trie_node(trie);
+
+    uint32_t n = 0;
+    for (int i = 0; i < len; i++) {
+        const uint8_t b = reverse ? str[len - 1 - i] : str[i];
+        uint32_t child = moloch_rules_trie_child(&trie->nodes[n], b);
+        if (!child) {
+            child = moloch_rules_trie_node(trie);
+
+            // Keep the bytes sorted for the binary search
+            MolochRulesTrieNode_t *node = &trie->nodes[n];
+            node->bytes = realloc(node->bytes, node->numNext + 1);
+            node->next = realloc(node->next, (node->numNext + 1) * sizeof(uint32_t));
+            int j;
+            for (j = node->numNext; j > 0 && node->bytes[j - 1] > b; j--) {
+                node->bytes[j] = node->bytes[j - 1];
+                node->next[j] = node->next[j - 1];
+            }
+            node->bytes[j] = b;
+            node->next[j] = child;
+            node->numNext++;
+        }
+        n = child;
+    }
+
+    if (trie->nodes[n].out == -1)
+        trie->nodes[n].out = out;
+}
+/******************************************************************************/
+// Breadth first so a node's fail node is always done before it
+LOCAL void moloch_rules_trie_fail_links(MolochRulesTrie_t *trie)
+{
+    if (!trie->numNodes)
+        return;
+
+    uint32_t *queue = malloc(trie->numNodes * sizeof(uint32_t));
+    uint32_t  head = 0, tail = 0;
+
+    queue[tail++] = 0;
+    while (head < tail) {
+        const uint32_t n = queue[head++];
+        for (int i = 0; i < trie->nodes[n].numNext; i++) {
+            const uint8_t  b = trie->nodes[n].bytes[i];
+            const uint32_t child = trie->nodes[n].next[i];
+            uint32_t       fail = 0;
+
+            if (n != 0) {
+                uint32_t f = trie->nodes[n].fail;
+                while (f && !moloch_rules_trie_child(&trie->nodes[f], b))
+                    f = trie->nodes[f].fail;
+                fail = moloch_rules_trie_child(&trie->nodes[f], b);
+            }
+
+            trie->nodes[child].fail = fail;
+            trie->nodes[child].dict = trie->nodes[fail].out != -1 ? fail : trie->nodes[fail].dict;
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+}
+/******************************************************************************/
+LOCAL void moloch_rules_str_match_add(MolochRulesStrMatch_t *sm, const uint8_t *akey, gpointer value)
+{
+    if (sm->numValues >= sm->sizeValues) {
+        sm->sizeValues = MAX(sm->sizeValues * 2, 16);
+        sm->values = realloc(sm->values, sm->sizeValues * sizeof(gpointer));
+    }
+    sm->values[sm->numValues] = value;
+    moloch_rules_trie_add(&sm->tries[akey[0] - 1], akey + 2, akey[1], akey[0] == MOLOCH_RULES_STR_MATCH_TAIL, sm->numValues);
+    sm->numValues++;
+}
+/******************************************************************************/
+LOCAL void moloch_rules_str_match_free(MolochRulesStrMatch_t *sm)
+{
+    for (int t = 0; t < 3; t++) {
+        for (uint32_t n = 0; n < sm->tries[t].numNodes; n++) {
+            free(sm->tries[t].nodes[n].bytes);
+            free(sm->tries[t].nodes[n].next);
+        }
+        free(sm->tries[t].nodes);
+    }
+    free(sm->values);
+    MOLOCH_TYPE_FREE(MolochRulesStrMatch_t, sm);
+}
+/******************************************************************************/
+// Compile the fieldsMatch string keys, the values are the rules arrays
+LOCAL MolochRulesStrMatch_t *moloch_rules_str_match_compile_hash(GHashTable *hash)
+{
+    MolochRulesStrMatch_t *sm = MOLOCH_TYPE_ALLOC0(MolochRulesStrMatch_t);
+    GHashTableIter         iter;
+    uint8_t               *akey;
+    GPtrArray             *rules;
+
+    g_hash_table_iter_init (&iter, hash);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&akey, (gpointer *)&rules)) {
+        moloch_rules_str_match_add(sm, akey, rules);
+    }
+    moloch_rules_trie_fail_links(&sm->tries[MOLOCH_RULES_STR_MATCH_CONTAINS - 1]);
+    return sm;
+}
+/******************************************************************************/
+// Compile a rule's match keys, the values are the keys themselves for logging
+LOCAL MolochRulesStrMatch_t *moloch_rules_str_match_compile_array(GPtrArray *array)
+{
+    MolochRulesStrMatch_t *sm = MOLOCH_TYPE_ALLOC0(MolochRulesStrMatch_t);
+
+    for (guint i = 0; i < array->len; i++) {
+        uint8_t *akey = g_ptr_array_index(array, i);
+        moloch_rules_str_match_add(sm, akey, akey);
+    }
+    moloch_rules_trie_fail_links(&sm->tries[MOLOCH_RULES_STR_MATCH_CONTAINS - 1]);
+    return sm;
+}
+/******************************************************************************/
+/* Call cb once for every string that key matches, stopping early if cb
+ * returns FALSE.  Returns FALSE if stopped early.
+ */
+LOCAL gboolean moloch_rules_str_match_run(const MolochRulesStrMatch_t *sm, const char *key, int len, MolochRulesStrMatchCb cb, gpointer uw)
+{
+    const uint8_t         *ukey = (const uint8_t *)key;
+    const MolochRulesTrie_t *trie;
+    const MolochRulesTrieNode_t *nodes;
+    uint32_t               n;
+    int                    i;
+
+    // Head and tail just walk down their trie from the start or end
+    for (int t = MOLOCH_RULES_STR_MATCH_HEAD; t <= MOLOCH_RULES_STR_MATCH_TAIL; t++) {
+        trie = &sm->tries[t - 1];
+        if (!trie->numNodes)
+            continue;
+
+        nodes = trie->nodes;
+        n = 0;
+        for (i = 0; ; i++) {
+            if (nodes[n].out != -1 && !cb(sm->values[nodes[n].out], uw))
+                return FALSE;
+            if (i >= len)
+                break;
+            n = moloch_rules_trie_child(&nodes[n], t == MOLOCH_RULES_STR_MATCH_TAIL ? ukey[len - 1 - i] : ukey[i]);
+            if (!n)
+                break;
+        }
+    }
+
+    trie = &sm->tries[MOLOCH_RULES_STR_MATCH_CONTAINS - 1];
+    if (!trie->numNodes)
+        return TRUE;
+
+    nodes = trie->nodes;
+    if (nodes[0].out != -1 && !cb(sm->values[nodes[0].out], uw))
+        return FALSE;
+
+    // A contains string can be found more than once, only report it the first time
+    uint32_t  seenBuf[64];
+    uint32_t *seen = seenBuf;
+    int       numSeen = 0, sizeSeen = 64;
+    gboolean  ret = TRUE;
+
+    n = 0;
+    for (i = 0; i < len && ret; i++) {
+        uint32_t child;
+        while (!(child = moloch_rules_trie_child(&nodes[n], ukey[i])) && n)
+            n = nodes[n].fail;
+        n = child;
+
+        for (uint32_t d = nodes[n].out != -1 ? n : nodes[n].dict; d && ret; d = nodes[d].dict) {
+            const uint32_t out = nodes[d].out;
+            int s;
+            for (s = 0; s < numSeen && seen[s] != out; s++);
+            if (s < numSeen)
+                continue;
+
+            if (numSeen >= sizeSeen) {
+                sizeSeen *= 2;
+                if (seen == seenBuf) {
+                    seen = malloc(sizeSeen * sizeof(uint32_t));
+                    memcpy(seen, seenBuf, sizeof(seenBuf));
+                } else {
+                    seen = realloc(seen, sizeSeen * sizeof(uint32_t));
+                }
+            }
+            seen[numSeen++] = out;
+            ret = cb(sm->values[out], uw);
+        }
+    }
+
+    if (seen != seenBuf)
+        free(seen);
+    return ret;
+}
+/******************************************************************************/
 LOCAL void moloch_rules_free_array(gpointer data)
 {
     g_ptr_array_free(data, TRUE);
 }
 /******************************************************************************/
+// Add a new rule to the loading list of type, keeping the list NULL terminated
+LOCAL MolochRule_t *moloch_rules_alloc(int type)
+{
+    if (loading.rulesLen[type] + 1 >= loading.rulesSize[type]) {
+        loading.rulesSize[type] = MAX(loading.rulesSize[type] * 2, 16);
+        loading.rules[type] = realloc(loading.rules[type], loading.rulesSize[type] * sizeof(MolochRule_t *));
+    }
+
+    MolochRule_t *rule = loading.rules[type][loading.rulesLen[type]++] = MOLOCH_TYPE_ALLOC0(MolochRule_t);
+    loading.rules[type][loading.rulesLen[type]] = NULL;
+    return rule;
+}
+/******************************************************************************/
 LOCAL void moloch_rules_parser_free_node(YamlNode_t *node)
 {
     if (node->key)
@@ -507,11 +794,7 @@ LOCAL void moloch_rules_parser_load_rule(char *filename, YamlNode_t *parent)
         CONFIGEXIT("%s: Unknown when '%s'", filename, when);
     }
 
-    if (loading.rulesLen[type] >= MOLOCH_RULES_MAX)
-        CONFIGEXIT("Too many %s rules", when);
-
-    int n = loading.rulesLen[type]++;
-    MolochRule_t *rule = loading.rules[type][n] = MOLOCH_TYPE_ALLOC0(MolochRule_t);
+    MolochRule_t *rule = moloch_rules_alloc(type);
     rule->name = g_strdup(name);
     rule->filename = filename;
     rule->saveFlags = saveFlags;
@@ -649,6 +932,7 @@ LOCAL void moloch_rules_parser_load_file(char *filename, YamlNode_t *parent)
     }
 }
 /******************************************************************************/
+LOCAL void moloch_rules_compile(MolochRulesInfo_t *info);
 LOCAL void moloch_rules_load_complete()
 {
     char      **bpfs;
@@ -660,8 +944,7 @@ LOCAL void moloch_rules_load_complete()
     gint start_pos;
     if (bpfs) {
         for (i = 0; bpfs[i]; i++) {
-            int n = loading.rulesLen[MOLOCH_RULE_TYPE_SESSION_SETUP]++;
-            MolochRule_t *rule = loading.rules[MOLOCH_RULE_TYPE_SESSION_SETUP][n] = MOLOCH_TYPE_ALLOC0(MolochRule_t);
+            MolochRule_t *rule = moloch_rules_alloc(MOLOCH_RULE_TYPE_SESSION_SETUP);
             rule->filename = "dontSaveBPFs";
             moloch_field_ops_init(&rule->ops, 1, MOLOCH_FIELD_OPS_FLAGS_COPY);
 
@@ -684,8 +967,7 @@ LOCAL void moloch_rules_load_complete()
     pos = moloch_field_by_exp("_minPacketsBeforeSavingSPI");
     if (bpfs) {
         for (i = 0; bpfs[i]; i++) {
-            int n = loading.rulesLen[MOLOCH_RULE_TYPE_SESSION_SETUP]++;
-            MolochRule_t *rule = loading.rules[MOLOCH_RULE_TYPE_SESSION_SETUP][n] = MOLOCH_TYPE_ALLOC0(MolochRule_t);
+            MolochRule_t *rule = moloch_rules_alloc(MOLOCH_RULE_TYPE_SESSION_SETUP);
             rule->filename = "minPacketsSaveBPFs";
             moloch_field_ops_init(&rule->ops, 1, MOLOCH_FIELD_OPS_FLAGS_COPY);
 
@@ -705,10 +987,62 @@ LOCAL void moloch_rules_load_complete()
     }
     g_regex_unref(regex);
 
+    // Packet threads walk the lists without checking the length
+    int t;
+    for (t = 0; t < MOLOCH_RULE_TYPE_NUM; t++) {
+        if (!loading.rules[t]) {
+            loading.rulesSize[t] = 1;
+            loading.rules[t] = calloc(1, sizeof(MolochRule_t *));
+        }
+    }
+
+    // Compile the head/tail/contains strings of each string field
+    for (pos = 0; pos < MOLOCH_FIELDS_MAX; pos++) {
+        if (loading.fieldsMatch[pos] && !MOLOCH_FIELD_TYPE_IS_INT(config.fields[pos]->type))
+            loading.fieldsStrMatch[pos] = moloch_rules_str_match_compile_hash(loading.fieldsMatch[pos]);
+    }
+
+    MolochRule_t *rule;
+    for (t = 0; t < MOLOCH_RULE_TYPE_NUM; t++) {
+        for (i = 0; (rule = loading.rules[t][i]); i++) {
+            for (int f = 0; f < rule->fieldsLen; f++) {
+                pos = rule->fields[f];
+                if (rule->match[pos] && !MOLOCH_FIELD_TYPE_IS_INT(config.fields[pos]->type))
+                    rule->strMatch[pos] = moloch_rules_str_match_compile_array(rule->match[pos]);
+            }
+        }
+    }
+
+    // Only possible once we know the dlt, otherwise moloch_rules_recompile will do it
+    if (deadPcap)
+        moloch_rules_compile(&loading);
+
     memcpy(&current, &loading, sizeof(loading));
     memset(&loading, 0, sizeof(loading));
 }
 /******************************************************************************/
+LOCAL void moloch_rules_bpf_free(MolochRulesBpf_t *bpf)
+{
+    int i;
+
+    if (!bpf->num)
+        return;
+
+    pcap_freecode(&bpf->any);
+    for (i = 0; i < bpf->num; i++) {
+        pcap_freecode(&bpf->progs[i]);
+    }
+    for (i = 0; i <= (bpf->num - 1) / MOLOCH_RULES_BPF_GROUP; i++) {
+        pcap_freecode(&bpf->groups[i]);
+    }
+    free(bpf->progs);
+    free(bpf->groups);
+    free(bpf->groupsOk);
+    free(bpf->solo);
+    free(bpf->strs);
+    memset(bpf, 0, sizeof(*bpf));
+}
+/******************************************************************************/
 LOCAL void moloch_rules_free(MolochRulesInfo_t *freeing)
 {
     int    i, t, r;
@@ -726,6 +1060,9 @@ LOCAL void moloch_rules_free(MolochRulesInfo_t *freeing)
         if (freeing->fieldsMatch[i]) {
             g_hash_table_destroy(freeing->fieldsMatch[i]);
         }
+        if (freeing->fieldsStrMatch[i]) {
+            moloch_rules_str_match_free(freeing->fieldsStrMatch[i]);
+        }
     }
 
     for (t = 0; t < MOLOCH_RULE_TYPE_NUM; t++) {
@@ -749,11 +1086,16 @@ LOCAL void moloch_rules_free(MolochRulesInfo_t *freeing)
                 if (rule->match[i]) {
                     g_ptr_array_free(rule->match[i], TRUE);
                 }
+                if (rule->strMatch[i]) {
+                    moloch_rules_str_match_free(rule->strMatch[i]);
+                }
             }
 
             moloch_field_ops_free(&rule->ops);
             MOLOCH_TYPE_FREE(MolochRule_t, rule);
         }
+        free(freeing->rules[t]);
+        moloch_rules_bpf_free(&freeing->bpf[t]);
     }
 
     MOLOCH_TYPE_FREE(MolochRulesInfo_t, freeing);
@@ -798,31 +1140,151 @@ void moloch_rules_load(char **names)
     moloch_free_later(freeing, (GDestroyNotify) moloch_rules_free);
 }
 /******************************************************************************/
-/* Called at the start on main thread or each time a new file is open on single thread */
-void moloch_rules_recompile()
+// Does the bpf use a keyword that moves the offsets of the tests after it
+LOCAL gboolean moloch_rules_bpf_is_solo(const char *str)
 {
-    int t, r;
+    static const char *keywords[] = {"vlan", "mpls", "pppoes", "geneve", NULL};
 
-    if (deadPcap)
-        pcap_close(deadPcap);
+    while (*str) {
+        if (!g_ascii_isalnum(*str)) {
+            str++;
+            continue;
+        }
 
-    deadPcap = pcap_open_dead(pcapFileHeader.dlt, pcapFileHeader.snaplen);
+        const char *start = str;
+        while (g_ascii_isalnum(*str) || *str == '_')
+            str++;
+
+        for (int k = 0; keywords[k]; k++) {
+            if ((size_t)(str - start) == strlen(keywords[k]) && strncmp(start, keywords[k], str - start) == 0)
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+/******************************************************************************/
+// Compile the or of the programs first through last, skipping ones that failed or are solo
+LOCAL gboolean moloch_rules_bpf_merge(MolochRulesBpf_t *bpf, struct bpf_program *bpfp, int first, int last)
+{
+    GString *str = g_string_new("");
+    int i;
+
+    for (i = first; i < last; i++) {
+        if (!bpf->progs[i].bf_len || bpf->solo[i])
+            continue;
+        if (str->len)
+            g_string_append(str, " or ");
+        g_string_append_printf(str, "(%s)", bpf->strs[i]);
+    }
+
+    // Nothing valid in the group, leave bf_len 0 so it never matches
+    gboolean ok = str->len == 0 || pcap_compile(deadPcap, bpfp, str->str, 1, PCAP_NETMASK_UNKNOWN) != -1;
+    if (!ok && config.debug)
+        LOG("Couldn't merge bpf rules, will check them one at a time: %s", pcap_geterr(deadPcap));
+
+    g_string_free(str, TRUE);
+    return ok;
+}
+/******************************************************************************/
+LOCAL void moloch_rules_compile(MolochRulesInfo_t *info)
+{
+    int t, r, i;
     MolochRule_t *rule;
+
     for (t = 0; t < MOLOCH_RULE_TYPE_NUM; t++) {
-        for (r = 0; (rule = current.rules[t][r]); r++) {
+        MolochRulesBpf_t *bpf = &info->bpf[t];
+        moloch_rules_bpf_free(bpf);
+
+        // NFLOG has no packet headers for bpf to look at, so nothing matches
+        if (pcapFileHeader.dlt == DLT_NFLOG || !info->rules[t])
+            continue;
+
+        // Rules with the same bpf share a program
+        GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+        for (r = 0; (rule = info->rules[t][r]); r++) {
             if (!rule->bpf)
                 continue;
 
-            pcap_freecode(&rule->bpfp);
-            if (pcapFileHeader.dlt != DLT_NFLOG) {
-                if (pcap_compile(deadPcap, &rule->bpfp, rule->bpf, 1, PCAP_NETMASK_UNKNOWN) == -1 && !config.ignoreErrors) {
+            gpointer num;
+            if (g_hash_table_lookup_extended(seen, rule->bpf, NULL, &num)) {
+                rule->bpfNum = (long)num;
+                continue;
+            }
+
+            if ((bpf->num & (MOLOCH_RULES_BPF_GROUP - 1)) == 0) {
+                bpf->progs = realloc(bpf->progs, (bpf->num + MOLOCH_RULES_BPF_GROUP) * sizeof(struct bpf_program));
+                bpf->strs = realloc(bpf->strs, (bpf->num + MOLOCH_RULES_BPF_GROUP) * sizeof(char *));
+                bpf->solo = realloc(bpf->solo, bpf->num + MOLOCH_RULES_BPF_GROUP);
+            }
+
+            rule->bpfNum = bpf->num++;
+            bpf->strs[rule->bpfNum] = rule->bpf;
+            bpf->solo[rule->bpfNum] = moloch_rules_bpf_is_solo(rule->bpf);
+            bpf->numSolo += bpf->solo[rule->bpfNum];
+            if (pcap_compile(deadPcap, &bpf->progs[rule->bpfNum], rule->bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+                if (!config.ignoreErrors)
                     CONFIGEXIT("Couldn't compile bpf filter %s: '%s' with %s", rule->filename, rule->bpf, pcap_geterr(deadPcap));
-                }
-            } else {
-                rule->bpfp.bf_len = 0;
+                bpf->progs[rule->bpfNum].bf_len = 0;
             }
+            g_hash_table_insert(seen, rule->bpf, (gpointer)(long)rule->bpfNum);
         }
+        g_hash_table_destroy(seen);
+
+        if (!bpf->num)
+            continue;
+
+        // With only one group the any program is the same as the group program
+        int groups = (bpf->num - 1) / MOLOCH_RULES_BPF_GROUP + 1;
+        bpf->groups = calloc(groups, sizeof(struct bpf_program));
+        bpf->groupsOk = calloc(groups, 1);
+        for (i = 0; groups > 1 && i < groups; i++) {
+            int last = MIN((i + 1) * MOLOCH_RULES_BPF_GROUP, bpf->num);
+            if (last - i * MOLOCH_RULES_BPF_GROUP > 1)
+                bpf->groupsOk[i] = moloch_rules_bpf_merge(bpf, &bpf->groups[i], i * MOLOCH_RULES_BPF_GROUP, last);
+        }
+
+        if (bpf->num > 1)
+            bpf->anyOk = moloch_rules_bpf_merge(bpf, &bpf->any, 0, bpf->num);
+    }
+}
+/******************************************************************************/
+/* Called at the start on main thread or each time a new file is open on single thread */
+void moloch_rules_recompile()
+{
+    if (deadPcap)
+        pcap_close(deadPcap);
+
+    deadPcap = pcap_open_dead(pcapFileHeader.dlt, pcapFileHeader.snaplen);
+    moloch_rules_compile(&current);
+}
+/******************************************************************************/
+LOCAL inline gboolean moloch_rules_bpf_run(const struct bpf_program *bpfp, const MolochPacket_t *packet)
+{
+    return bpfp->bf_len && bpf_filter(bpfp->bf_insns, packet->pkt, packet->pktlen, packet->pktlen);
+}
+/******************************************************************************/
+/* Does program n match the packet, only running the group program and program
+ * the first time they are needed.  The state arrays are 0 for not run yet,
+ * 1 for no match and 2 for match.
+ */
+LOCAL gboolean moloch_rules_bpf_check(const MolochRulesBpf_t *bpf, int n, uint8_t *progState, uint8_t *groupState, const MolochPacket_t *packet)
+{
+    if (n >= bpf->num)
+        return FALSE;
+
+    if (!progState[n] && bpf->solo[n]) {
+        progState[n] = moloch_rules_bpf_run(&bpf->progs[n], packet) ? 2 : 1;
+    } else if (!progState[n]) {
+        int g = n / MOLOCH_RULES_BPF_GROUP;
+        if (!groupState[g])
+            groupState[g] = (!bpf->groupsOk[g] || moloch_rules_bpf_run(&bpf->groups[g], packet)) ? 2 : 1;
+
+        if (groupState[g] == 1)
+            progState[n] = 1;
+        else
+            progState[n] = moloch_rules_bpf_run(&bpf->progs[n], packet) ? 2 : 1;
     }
+    return progState[n] == 2;
 }
 /******************************************************************************/
 LOCAL gboolean moloch_rules_check_ip(const MolochRule_t * const rule, const int p, const struct in6_addr *ip, BSB *logStr)
@@ -854,6 +1316,12 @@ LOCAL gboolean moloch_rules_check_ip(const MolochRule_t * const rule, const int
     return TRUE;
 }
 /******************************************************************************/
+LOCAL gboolean moloch_rules_str_match_first_cb(gpointer value, gpointer uw)
+{
+    *(gpointer *)uw = value;
+    return FALSE;
+}
+/******************************************************************************/
 LOCAL gboolean moloch_rules_check_str_match(const MolochRule_t * const rule, int p, const char * const key, BSB *logStr)
 {
 
@@ -864,47 +1332,18 @@ LOCAL gboolean moloch_rules_check_str_match(const MolochRule_t * const rule, int
         return TRUE;
     }
 
-    const GPtrArray * const matches = rule->match[p];
-
-    if (!matches)
+    if (!rule->strMatch[p])
         return FALSE;
 
-    guint len = strlen(key);
-
-    for (guint i = 0; i < matches->len; i++) {
-        uint8_t *akey = g_ptr_array_index(matches, i);
-        if (len < akey[1])
-            continue;
+    const uint8_t *akey = NULL;
+    moloch_rules_str_match_run(rule->strMatch[p], key, strlen(key), moloch_rules_str_match_first_cb, &akey);
+    if (!akey)
+        return FALSE;
 
-        switch (akey[0]) {
-        case MOLOCH_RULES_STR_MATCH_TAIL:
-            if (memcmp(akey+2, key + len - akey[1], akey[1]) == 0) {
-                if (logStr) {
-                    BSB_EXPORT_sprintf(*logStr, "%s,tail: %s, ", config.fields[p]->expression, akey+2);
-                }
-                return TRUE;
-            }
-            break;
-        case MOLOCH_RULES_STR_MATCH_HEAD:
-            if (memcmp(akey+2, key, akey[1]) == 0) {
-                if (logStr) {
-                    BSB_EXPORT_sprintf(*logStr, "%s,head: %s, ", config.fields[p]->expression, akey+2);
-                }
-                return TRUE;
-            }
-            break;
-        case MOLOCH_RULES_STR_MATCH_CONTAINS:
-            if (moloch_memstr(key, len, (char*)akey+2, akey[1]) != 0) {
-                if (logStr) {
-                    BSB_EXPORT_sprintf(*logStr, "%s,contains: %s, ", config.fields[p]->expression, akey+2);
-                }
-                return TRUE;
-            }
-            break;
-        }
+    if (logStr) {
+        BSB_EXPORT_sprintf(*logStr, "%s,%s: %s, ", config.fields[p]->expression, strMatchNames[akey[0]], akey+2);
     }
-
-    return FALSE;
+    return TRUE;
 }
 LOCAL void moloch_rules_check_rule_fields(MolochSession_t * const session, MolochRule_t * const rule, int skipPos, BSB *logStr);
 /******************************************************************************/
@@ -982,25 +1421,25 @@ LOCAL void moloch_rules_check_rule_fields(MolochSession_t * const session, Moloc
                 G_HASH_TABLE_CONTAINS_CHECK(session->port2);
                 break;
             case MOLOCH_FIELD_EXSPECIAL_TCPFLAGS_SYN:
-                G_HASH_TABLE_CONTAINS_CHECK(session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN]);
+                G_HASH_TABLE_CONTAINS_CHECK(session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_SYN]);
                 break;
             case MOLOCH_FIELD_EXSPECIAL_TCPFLAGS_SYN_ACK:
-                G_HASH_TABLE_CONTAINS_CHECK(session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK]);
+                G_HASH_TABLE_CONTAINS_CHECK(session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK]);
                 break;
             case MOLOCH_FIELD_EXSPECIAL_TCPFLAGS_ACK:
-                G_HASH_TABLE_CONTAINS_CHECK(session->tcpFlagCnt[MOLOCH_TCPFLAG_ACK]);
+                G_HASH_TABLE_CONTAINS_CHECK(session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_ACK]);
                 break;
             case MOLOCH_FIELD_EXSPECIAL_TCPFLAGS_PSH:
-                G_HASH_TABLE_CONTAINS_CHECK(session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH]);
+                G_HASH_TABLE_CONTAINS_CHECK(session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_PSH]);
                 break;
             case MOLOCH_FIELD_EXSPECIAL_TCPFLAGS_RST:
-                G_HASH_TABLE_CONTAINS_CHECK(session->tcpFlagCnt[MOLOCH_TCPFLAG_RST]);
+                G_HASH_TABLE_CONTAINS_CHECK(session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_RST]);
                 break;
             case MOLOCH_FIELD_EXSPECIAL_TCPFLAGS_FIN:
-                G_HASH_TABLE_CONTAINS_CHECK(session->tcpFlagCnt[MOLOCH_TCPFLAG_FIN]);
+                G_HASH_TABLE_CONTAINS_CHECK(session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_FIN]);
                 break;
             case MOLOCH_FIELD_EXSPECIAL_TCPFLAGS_URG:
-                G_HASH_TABLE_CONTAINS_CHECK(session->tcpFlagCnt[MOLOCH_TCPFLAG_URG]);
+                G_HASH_TABLE_CONTAINS_CHECK(session->cold->tcpFlagCnt[MOLOCH_TCPFLAG_URG]);
                 break;
             case MOLOCH_FIELD_EXSPECIAL_PACKETS_SRC:
                 G_HASH_TABLE_CONTAINS_CHECK(session->packets[0]);
@@ -1254,6 +1693,18 @@ void moloch_rules_run_field_set_rules(MolochSession_t *session, int pos, GPtrArr
     }
 }
 /******************************************************************************/
+typedef struct {
+    MolochSession_t *session;
+    int              pos;
+} MolochRulesFieldSetInfo_t;
+
+LOCAL gboolean moloch_rules_run_field_set_cb(gpointer value, gpointer uw)
+{
+    MolochRulesFieldSetInfo_t *info = uw;
+    moloch_rules_run_field_set_rules(info->session, info->pos, value);
+    return TRUE;
+}
+/******************************************************************************/
 void moloch_rules_run_field_set(MolochSession_t *session, int pos, const gpointer value)
 {
     if (MOLOCH_FIELD_TYPE_IS_IP(config.fields[pos]->type)) {
@@ -1278,42 +1729,20 @@ void moloch_rules_run_field_set(MolochSession_t *session, int pos, const gpointe
         GPtrArray *rules;
 
         // See if this value matches anything in our matching list
-        if (current.fieldsMatch[pos]) {
+        if (current.fieldsStrMatch[pos]) {
+            MolochRulesFieldSetInfo_t info = {session, pos};
+            moloch_rules_str_match_run(current.fieldsStrMatch[pos], value, strlen(value), moloch_rules_run_field_set_cb, &info);
+        } else if (current.fieldsMatch[pos] && MOLOCH_FIELD_TYPE_IS_INT(config.fields[pos]->type)) {
             GHashTableIter         iter;
+            uint64_t               num;
 
             g_hash_table_iter_init (&iter, current.fieldsMatch[pos]);
-            if (MOLOCH_FIELD_TYPE_IS_INT(config.fields[pos]->type)) {
-                uint64_t               num;
-
-                while (g_hash_table_iter_next (&iter, (gpointer *)&num, (gpointer *)&rules)) {
-                    MolochRuleIntMatch_t match;
-                    match.num = num;
-                    uint32_t test = (uint32_t)(long)value;
-                    if (test >= match.min && test <= match.max) {
-                        moloch_rules_run_field_set_rules(session, pos, rules);
-                    }
-                }
-            } else {
-                uint8_t               *akey;
-                int                    len = strlen(value);
-
-                while (g_hash_table_iter_next (&iter, (gpointer *)&akey, (gpointer *)&rules)) {
-                    if (len < akey[1])
-                        continue;
-
-                    switch (akey[0]) {
-                    case MOLOCH_RULES_STR_MATCH_TAIL:
-                        if (memcmp(akey+2, value + len - akey[1], akey[1]) == 0)
-                            moloch_rules_run_field_set_rules(session, pos, rules);
-                        break;
-                    case MOLOCH_RULES_STR_MATCH_HEAD:
-                        if (memcmp(akey+2, value, akey[1]) == 0)
-                            moloch_rules_run_field_set_rules(session, pos, rules);
-                        break;
-                    case MOLOCH_RULES_STR_MATCH_CONTAINS:
-                        if (moloch_memstr(value, len, (char*)akey+2, akey[1]) != 0)
-                            moloch_rules_run_field_set_rules(session, pos, rules);
-                    }
+            while (g_hash_table_iter_next (&iter, (gpointer *)&num, (gpointer *)&rules)) {
+                MolochRuleIntMatch_t match;
+                match.num = num;
+                uint32_t test = (uint32_t)(long)value;
+                if (test >= match.min && test <= match.max) {
+                    moloch_rules_run_field_set_rules(session, pos, rules);
                 }
             }
         }
@@ -1331,10 +1760,23 @@ void moloch_rules_run_session_setup(MolochSession_t *session, MolochPacket_t *pa
 {
     int r;
     MolochRule_t *rule;
+    const MolochRulesBpf_t *bpf = &current.bpf[MOLOCH_RULE_TYPE_SESSION_SETUP];
+
+    // One pass over the merged program decides if any bpf rule besides the solo ones can match
+    const int bpfNum = bpf->num;
+    const gboolean anyMiss = bpfNum > 0 && bpf->anyOk && !moloch_rules_bpf_run(&bpf->any, packet);
+    gboolean bpfPossible = bpfNum > 0 && (!anyMiss || bpf->numSolo);
+    uint8_t progState[bpfNum + 1];
+    uint8_t groupState[bpfNum / MOLOCH_RULES_BPF_GROUP + 1];
+    if (bpfPossible) {
+        memset(progState, 0, sizeof(progState));
+        memset(groupState, anyMiss ? 1 : 0, sizeof(groupState));
+    }
+
     for (r = 0; (rule = current.rules[MOLOCH_RULE_TYPE_SESSION_SETUP][r]); r++) {
         if (rule->fieldsLen) {
             moloch_rules_check_rule_fields(session, rule, -1, NULL);
-        } else if (rule->bpfp.bf_len && bpf_filter(rule->bpfp.bf_insns, packet->pkt, packet->pktlen, packet->pktlen)) {
+        } else if (bpfPossible && rule->bpf && moloch_rules_bpf_check(bpf, rule->bpfNum, progState, groupState, packet)) {
             moloch_rules_match(session, rule);
         }
     }
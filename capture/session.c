@@ -17,6 +17,9 @@
 
 #include <arpa/inet.h>
 #include "moloch.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /******************************************************************************/
 extern MolochConfig_t        config;
@@ -32,10 +35,44 @@ extern uint32_t             hashSalt;
 LOCAL MolochSessionHead_t   closingQ[MOLOCH_MAX_PACKET_THREADS];
 MolochSessionHead_t         tcpWriteQ[MOLOCH_MAX_PACKET_THREADS];
 
-typedef HASHP_VAR(h_, MolochSessionHash_t, MolochSessionHead_t);
+/* Open addressing session index. A 1 byte control tag per slot is probed 16 at
+ * a time, the slot holds the full hash and session so the session itself is only
+ * touched on a likely match. Grows by migrating a few slots per operation.
+ */
+#define MOLOCH_SESSION_TABLE_GROUP     16
+#define MOLOCH_SESSION_TABLE_MIN       1024
+#define MOLOCH_SESSION_TABLE_MIGRATE   64
+#define MOLOCH_SESSION_CTRL_EMPTY      0x80
+#define MOLOCH_SESSION_CTRL_DELETED    0xfe
+
+typedef struct {
+    uint32_t             hash;
+    MolochSession_t     *session;
+} MolochSessionSlot_t;
 
+typedef struct {
+    uint8_t             *ctrl;
+    MolochSessionSlot_t *slots;
+    uint32_t             mask;
+    uint32_t             used;      // full + deleted
+    uint32_t             count;     // full
+} MolochSessionTab_t;
+
+typedef struct {
+    MolochSessionTab_t   cur;
+    MolochSessionTab_t   old;       // ctrl is set while migrating into cur
+    uint32_t             migratePos;
+    uint32_t             resizes;
+} MolochSessionTable_t;
+
+/* Expiring is driven by one timer per session on the thread's wheel. The timer
+ * is lazy, packets just update lastPacket and the session is rescheduled when
+ * the timer fires early. Rescheduling also moves the session to the tail of
+ * sessionsQ, so the head is still about the least recently active session.
+ */
 LOCAL MolochSessionHead_t   sessionsQ[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
-LOCAL MolochSessionHash_t   sessions[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
+LOCAL MolochSessionTable_t  sessions[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
+LOCAL MolochTimeWheel_t    *sessionWheel[MOLOCH_MAX_PACKET_THREADS];
 LOCAL int needSave[MOLOCH_MAX_PACKET_THREADS];
 
 typedef struct molochsescmd {
@@ -213,9 +250,196 @@ LOCAL gboolean moloch_session_equal(const unsigned char *a, const unsigned char
     return memcmp(a, b, a[0]) == 0;
 }
 /******************************************************************************/
-LOCAL int moloch_session_cmp(const void *keyv, const MolochSession_t *session)
+LOCAL inline uint32_t moloch_session_table_match(const uint8_t *ctrl, uint8_t tag)
+{
+#ifdef __SSE2__
+    const __m128i group = _mm_load_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < MOLOCH_SESSION_TABLE_GROUP; i++) {
+        bits |= (uint32_t)(ctrl[i] == tag) << i;
+    }
+    return bits;
+#endif
+}
+/******************************************************************************/
+// Empty and deleted both have the high bit set, tags never do
+LOCAL inline uint32_t moloch_session_table_match_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < MOLOCH_SESSION_TABLE_GROUP; i++) {
+        bits |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return bits;
+#endif
+}
+/******************************************************************************/
+// The thread is picked from the low bits of hash, so mix before using it here
+LOCAL inline uint32_t moloch_session_table_mix(uint32_t hash)
+{
+    hash *= 0x9e3779b1;
+    return hash ^ (hash >> 15);
+}
+/******************************************************************************/
+LOCAL void moloch_session_tab_alloc(MolochSessionTab_t *tab, uint32_t size)
+{
+    if (posix_memalign((void **)&tab->ctrl, 64, size) != 0)
+        LOGEXIT("ERROR - Couldn't allocate session table of size %u", size);
+    memset(tab->ctrl, MOLOCH_SESSION_CTRL_EMPTY, size);
+    tab->slots = malloc(size * sizeof(MolochSessionSlot_t));
+    tab->mask = size - 1;
+    tab->used = 0;
+    tab->count = 0;
+}
+/******************************************************************************/
+LOCAL void moloch_session_tab_free(MolochSessionTab_t *tab)
+{
+    free(tab->ctrl);
+    free(tab->slots);
+    memset(tab, 0, sizeof(*tab));
+}
+/******************************************************************************/
+LOCAL int moloch_session_tab_find(const MolochSessionTab_t *tab, uint32_t hash, const uint8_t *sessionId)
+{
+    const uint32_t mixed = moloch_session_table_mix(hash);
+    const uint8_t  tag = mixed >> 25;
+    const uint32_t groupMask = tab->mask / MOLOCH_SESSION_TABLE_GROUP;
+    uint32_t       group = mixed & groupMask;
+
+    for (uint32_t step = 1; step <= groupMask + 1; step++) {
+        const uint8_t *ctrl = tab->ctrl + group * MOLOCH_SESSION_TABLE_GROUP;
+        uint32_t bits = moloch_session_table_match(ctrl, tag);
+        while (bits) {
+            const int pos = group * MOLOCH_SESSION_TABLE_GROUP + __builtin_ctz(bits);
+            const MolochSessionSlot_t *slot = &tab->slots[pos];
+            if (slot->hash == hash && memcmp(sessionId, slot->session->sessionId, sessionId[0]) == 0)
+                return pos;
+            bits &= bits - 1;
+        }
+        if (moloch_session_table_match(ctrl, MOLOCH_SESSION_CTRL_EMPTY))
+            return -1;
+        group = (group + step) & groupMask;
+    }
+    return -1;
+}
+/******************************************************************************/
+LOCAL void moloch_session_tab_insert(MolochSessionTab_t *tab, uint32_t hash, MolochSession_t *session)
 {
-    return memcmp(keyv, session->sessionId, MIN(((uint8_t *)keyv)[0], session->sessionId[0])) == 0;
+    const uint32_t mixed = moloch_session_table_mix(hash);
+    const uint32_t groupMask = tab->mask / MOLOCH_SESSION_TABLE_GROUP;
+    uint32_t       group = mixed & groupMask;
+
+    // Resizing keeps used well under the size, so there is always a free slot
+    for (uint32_t step = 1; ; step++) {
+        uint8_t *ctrl = tab->ctrl + group * MOLOCH_SESSION_TABLE_GROUP;
+        uint32_t bits = moloch_session_table_match_free(ctrl);
+        if (bits) {
+            const int i = __builtin_ctz(bits);
+            if (ctrl[i] == MOLOCH_SESSION_CTRL_EMPTY)
+                tab->used++;
+            ctrl[i] = mixed >> 25;
+            tab->slots[group * MOLOCH_SESSION_TABLE_GROUP + i].hash = hash;
+            tab->slots[group * MOLOCH_SESSION_TABLE_GROUP + i].session = session;
+            tab->count++;
+            return;
+        }
+        group = (group + step) & groupMask;
+    }
+}
+/******************************************************************************/
+LOCAL inline void moloch_session_tab_delete(MolochSessionTab_t *tab, int pos)
+{
+    tab->ctrl[pos] = MOLOCH_SESSION_CTRL_DELETED;
+    tab->count--;
+}
+/******************************************************************************/
+LOCAL void moloch_session_table_migrate(MolochSessionTable_t *table, uint32_t max)
+{
+    MolochSessionTab_t *old = &table->old;
+    uint32_t end;
+
+    if (max >= old->mask + 1 - table->migratePos)
+        end = old->mask + 1;
+    else
+        end = table->migratePos + max;
+
+    for (; table->migratePos < end; table->migratePos++) {
+        if (old->ctrl[table->migratePos] & 0x80)
+            continue;
+        MolochSessionSlot_t *slot = &old->slots[table->migratePos];
+        moloch_session_tab_insert(&table->cur, slot->hash, slot->session);
+        moloch_session_tab_delete(old, table->migratePos);
+    }
+
+    if (table->migratePos > old->mask)
+        moloch_session_tab_free(old);
+}
+/******************************************************************************/
+LOCAL MolochSession_t *moloch_session_table_find(MolochSessionTable_t *table, uint32_t hash, const uint8_t *sessionId)
+{
+    int pos = moloch_session_tab_find(&table->cur, hash, sessionId);
+    if (pos >= 0)
+        return table->cur.slots[pos].session;
+
+    if (table->old.ctrl) {
+        pos = moloch_session_tab_find(&table->old, hash, sessionId);
+        if (pos >= 0)
+            return table->old.slots[pos].session;
+    }
+    return NULL;
+}
+/******************************************************************************/
+LOCAL void moloch_session_table_add(MolochSessionTable_t *table, uint32_t hash, MolochSession_t *session)
+{
+    if (table->old.ctrl)
+        moloch_session_table_migrate(table, MOLOCH_SESSION_TABLE_MIGRATE);
+
+    // Over 7/8 used, start moving into a new table. Mostly deleted slots just get rebuilt at the same size.
+    MolochSessionTab_t *cur = &table->cur;
+    if (cur->used + 1 > (cur->mask + 1) / 8 * 7) {
+        const uint32_t count = cur->count + table->old.count;
+        uint32_t size = cur->mask + 1;
+        while (count >= size / 2)
+            size *= 2;
+
+        // Only one migration at a time, whatever is left of the last one goes straight into the new table
+        MolochSessionTab_t full = *cur;
+        moloch_session_tab_alloc(cur, size);
+        if (table->old.ctrl)
+            moloch_session_table_migrate(table, 0xffffffff);
+        if (table->old.ctrl)
+            LOGEXIT("ERROR - Session table migration didn't finish %u/%u", table->migratePos, table->old.mask + 1);
+
+        table->old = full;
+        table->migratePos = 0;
+        table->resizes++;
+    }
+
+    moloch_session_tab_insert(cur, hash, session);
+}
+/******************************************************************************/
+LOCAL void moloch_session_table_remove(MolochSessionTable_t *table, MolochSession_t *session)
+{
+    int pos = moloch_session_tab_find(&table->cur, session->h_hash, session->sessionId);
+    if (pos >= 0) {
+        moloch_session_tab_delete(&table->cur, pos);
+        return;
+    }
+
+    if (table->old.ctrl) {
+        pos = moloch_session_tab_find(&table->old, session->h_hash, session->sessionId);
+        if (pos >= 0)
+            moloch_session_tab_delete(&table->old, pos);
+    }
+}
+/******************************************************************************/
+LOCAL inline uint32_t moloch_session_table_count(const MolochSessionTable_t *table)
+{
+    return table->cur.count + table->old.count;
 }
 /******************************************************************************/
 void moloch_session_add_cmd(MolochSession_t *session, MolochSesCmd sesCmd, gpointer uw1, gpointer uw2, MolochCmd_func func)
@@ -278,6 +502,7 @@ void moloch_session_mark_for_close (MolochSession_t *session, SessionTypes ses)
     session->saveTime = session->lastPacket.tv_sec + 5;
     DLL_REMOVE(q_, &sessionsQ[session->thread][ses], session);
     DLL_PUSH_TAIL(q_, &closingQ[session->thread], session);
+    moloch_timewheel_add(sessionWheel[session->thread], &session->timer, session->saveTime + 1);
 
     if (session->tcp_next) {
         DLL_REMOVE(tcp_, &tcpWriteQ[session->thread], session);
@@ -296,16 +521,16 @@ LOCAL void moloch_session_free (MolochSession_t *session)
     }
     g_array_free(session->fileNumArray, TRUE);
 
-    if (session->rootId && session->rootId != (void *)1L)
-        g_free(session->rootId);
+    if (session->cold->rootId && session->cold->rootId != (void *)1L)
+        g_free(session->cold->rootId);
 
-    if (session->parserInfo) {
+    if (session->cold->parserInfo) {
         int i;
-        for (i = 0; i < session->parserNum; i++) {
-            if (session->parserInfo[i].parserFreeFunc)
-                session->parserInfo[i].parserFreeFunc(session, session->parserInfo[i].uw);
+        for (i = 0; i < session->cold->parserNum; i++) {
+            if (session->cold->parserInfo[i].parserFreeFunc)
+                session->cold->parserInfo[i].parserFreeFunc(session, session->cold->parserInfo[i].uw);
         }
-        free(session->parserInfo);
+        free(session->cold->parserInfo);
     }
 
     if (session->pluginData)
@@ -324,14 +549,13 @@ LOCAL void moloch_session_free (MolochSession_t *session)
         MOLOCH_UNLOCK(stoppedSessions[session->thread].lock);
     }
 
-    MOLOCH_TYPE_FREE(MolochSession_t, session);
+    free(session);
 }
 /******************************************************************************/
 void moloch_session_save(MolochSession_t *session)
 {
-    if (session->h_next) {
-        HASH_REMOVE(h_, sessions[session->thread][session->ses], session);
-    }
+    moloch_session_table_remove(&sessions[session->thread][session->ses], session);
+    moloch_timewheel_del(sessionWheel[session->thread], &session->timer);
 
     if (session->closingQ) {
         DLL_REMOVE(q_, &closingQ[session->thread], session);
@@ -341,11 +565,11 @@ void moloch_session_save(MolochSession_t *session)
     if (mProtocols[session->mProtocol].sFree)
         mProtocols[session->mProtocol].sFree(session);
 
-    if (session->parserInfo) {
+    if (session->cold->parserInfo) {
         int i;
-        for (i = 0; i < session->parserNum; i++) {
-            if (session->parserInfo[i].parserSaveFunc)
-                session->parserInfo[i].parserSaveFunc(session, session->parserInfo[i].uw, TRUE);
+        for (i = 0; i < session->cold->parserNum; i++) {
+            if (session->cold->parserInfo[i].parserSaveFunc)
+                session->cold->parserInfo[i].parserSaveFunc(session, session->cold->parserInfo[i].uw, TRUE);
         }
     }
 
@@ -369,19 +593,19 @@ void moloch_session_save(MolochSession_t *session)
 /******************************************************************************/
 void moloch_session_mid_save(MolochSession_t *session, uint32_t tv_sec)
 {
-    if (session->parserInfo) {
+    if (session->cold->parserInfo) {
         int i;
-        for (i = 0; i < session->parserNum; i++) {
-            if (session->parserInfo[i].parserSaveFunc)
-                session->parserInfo[i].parserSaveFunc(session, session->parserInfo[i].uw, FALSE);
+        for (i = 0; i < session->cold->parserNum; i++) {
+            if (session->cold->parserInfo[i].parserSaveFunc)
+                session->cold->parserInfo[i].parserSaveFunc(session, session->cold->parserInfo[i].uw, FALSE);
         }
     }
 
     if (pluginsCbs & MOLOCH_PLUGIN_PRE_SAVE)
         moloch_plugins_cb_pre_save(session, FALSE);
 
-    if (!session->rootId) {
-        session->rootId = (void *)1L;
+    if (!session->cold->rootId) {
+        session->cold->rootId = (void *)1L;
     }
 
     moloch_rules_run_before_save(session, 0);
@@ -409,9 +633,9 @@ void moloch_session_mid_save(MolochSession_t *session, uint32_t tv_sec)
     session->packets[0] = 0;
     session->packets[1] = 0;
     session->midSave = 0;
-    session->ackTime = 0;
-    session->synTime = 0;
-    memset(session->tcpFlagCnt, 0, sizeof(session->tcpFlagCnt));
+    session->cold->ackTime = 0;
+    session->cold->synTime = 0;
+    memset(session->cold->tcpFlagCnt, 0, sizeof(session->cold->tcpFlagCnt));
 }
 /******************************************************************************/
 gboolean moloch_session_decr_outstanding(MolochSession_t *session)
@@ -623,7 +847,7 @@ MolochSession_t *moloch_session_find(int ses, uint8_t *sessionId)
     uint32_t hash = moloch_session_hash(sessionId);
     int      thread = hash % config.packetThreads;
 
-    HASH_FIND_HASH(h_, sessions[thread][ses], hash, sessionId, session);
+    session = moloch_session_table_find(&sessions[thread][ses], hash, sessionId);
     return session;
 }
 /******************************************************************************/
@@ -639,38 +863,36 @@ MolochSession_t *moloch_session_find_or_create(int mProtocol, uint32_t hash, uin
     int          thread = hash % config.packetThreads;
     SessionTypes ses = mProtocols[mProtocol].ses;
 
-    HASH_FIND_HASH(h_, sessions[thread][ses], hash, sessionId, session);
+    // Keep any resize moving along even when nothing new is being added
+    if (sessions[thread][ses].old.ctrl)
+        moloch_session_table_migrate(&sessions[thread][ses], MOLOCH_SESSION_TABLE_MIGRATE);
+
+    session = moloch_session_table_find(&sessions[thread][ses], hash, sessionId);
 
     if (session) {
-        if (!session->closingQ) {
-            DLL_MOVE_TAIL(q_, &sessionsQ[thread][ses], session);
-        }
         *isNew = 0;
         return session;
     }
     *isNew = 1;
 
-    session = MOLOCH_TYPE_ALLOC0(MolochSession_t);
+    // Cache line aligned so the hot fields really do share lines
+    if (posix_memalign((void **)&session, 64, MOLOCH_SESSION_ALLOC_SIZE) != 0)
+        LOGEXIT("ERROR - Couldn't allocate session");
+    memset(session, 0, MOLOCH_SESSION_ALLOC_SIZE);
+    session->cold = (MolochSessionCold_t *)(session + 1);
     session->ses = ses;
     session->mProtocol = mProtocol;
     session->stopSaving = 0xffff;
 
     memcpy(session->sessionId, sessionId, sessionId[0]);
 
-    HASH_ADD_HASH(h_, sessions[thread][ses], hash, sessionId, session);
+    session->h_hash = hash;
+    moloch_session_table_add(&sessions[thread][ses], hash, session);
     DLL_PUSH_TAIL(q_, &sessionsQ[thread][ses], session);
-
-    if (HASH_BUCKET_COUNT(h_, sessions[thread][ses], hash) > 15) {
-        struct timeval  currentTime;
-        static uint32_t lastError;
-
-        gettimeofday(&currentTime, NULL);
-        if (currentTime.tv_sec - lastError > 30) {
-            lastError = currentTime.tv_sec;
-            char buf[100];
-            LOG("ERROR - Large number of chains: id:%s hash:%u bucket:%u thread:%d ses:%d count:%d size:%d maxStreams[ses]:%d - might want to increase maxStreams see https://arkime.com/settings#maxstreams", moloch_session_id_string(sessionId, buf), hash, hash % sessions[thread][ses].size, thread, ses, HASH_BUCKET_COUNT(h_, sessions[thread][ses], hash), sessions[thread][ses].size, config.maxStreams[ses]);
-        }
-    }
+    uint32_t timeout = config.timeouts[ses];
+    if (ses == SESSION_TCP)
+        timeout = MIN(timeout, config.tcpSaveTimeout);
+    moloch_timewheel_add(sessionWheel[thread], &session->timer, lastPacketSecs[thread] + timeout + 1);
 
     session->filePosArray = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), 100);
     if (config.enablePacketLen) {
@@ -704,17 +926,49 @@ uint32_t moloch_session_monitoring()
 
     for (t = 0; t < config.packetThreads; t++) {
         for (s = 0; s < SESSION_MAX; s++) {
-            count += HASH_COUNT(h_, sessions[t][s]);
+            count += moloch_session_table_count(&sessions[t][s]);
         }
     }
     return count;
 }
 /******************************************************************************/
+LOCAL void moloch_session_timer_fire(MolochSession_t *session, uint32_t now)
+{
+    if (session->closingQ) {
+        if (session->saveTime < now)
+            moloch_session_save(session);
+        else
+            moloch_timewheel_add(sessionWheel[session->thread], &session->timer, session->saveTime + 1);
+        return;
+    }
+
+    // Idle Long Time
+    const uint32_t idle = session->lastPacket.tv_sec + config.timeouts[session->ses];
+    if (idle < now) {
+        moloch_session_save(session);
+        return;
+    }
+
+    // TCP Sessions Open Long Time
+    if (session->tcp_next && session->saveTime < now) {
+        moloch_session_mid_save(session, now);
+    }
+
+    uint32_t expire = idle + 1;
+    if (session->ses == SESSION_TCP && session->saveTime >= now && session->saveTime + 1 < expire)
+        expire = session->saveTime + 1;
+    moloch_timewheel_add(sessionWheel[session->thread], &session->timer, expire);
+
+    // Still active, so sessionsQ stays in rough last packet order for maxStreams and idle seconds
+    DLL_MOVE_TAIL(q_, &sessionsQ[session->thread][session->ses], session);
+}
+/******************************************************************************/
 void moloch_session_process_commands(int thread)
 {
-    // Commands
+    // Commands, drain more when there is a backlog
     int count;
-    for (count = 0; count < 50; count++) {
+    const int cmdBudget = MIN(MAX(DLL_COUNT(cmd_, &sessionCmds[thread]) / 4, 50), 1000);
+    for (count = 0; count < cmdBudget; count++) {
         MolochSesCmd_t *cmd = 0;
         MOLOCH_LOCK(sessionCmds[thread].lock);
         DLL_POP_HEAD(cmd_, &sessionCmds[thread], cmd);
@@ -732,41 +986,23 @@ void moloch_session_process_commands(int thread)
         MOLOCH_TYPE_FREE(MolochSesCmd_t, cmd);
     }
 
-    // Closing Q
-    for (count = 0; count < 10; count++) {
-        MolochSession_t *session = DLL_PEEK_HEAD(q_, &closingQ[thread]);
+    // Expired timers, drain more when there is a backlog
+    MolochTimeWheel_t *wheel = sessionWheel[thread];
+    const uint32_t     now = lastPacketSecs[thread];
+    moloch_timewheel_advance(wheel, now);
 
-        if (session && session->saveTime < (uint64_t)lastPacketSecs[thread]) {
-            moloch_session_save(session);
-        } else {
-            break;
-        }
+    int budget = MIN(MAX(moloch_timewheel_expired_count(wheel) / 8, 10), 1000);
+    MolochTimer_t *timer;
+    for (count = 0; count < budget && (timer = moloch_timewheel_pop(wheel)); count++) {
+        MolochSession_t *session = (MolochSession_t *)((char *)timer - offsetof(MolochSession_t, timer));
+        moloch_session_timer_fire(session, now);
     }
 
-    // Sessions Idle Long Time
+    // Too many sessions, save up to 10 from the head each pass, save always removes from sessionsQ
     int ses;
     for (ses = 0; ses < SESSION_MAX; ses++) {
-        for (count = 0; count < 10; count++) {
-            MolochSession_t *session = DLL_PEEK_HEAD(q_, &sessionsQ[thread][ses]);
-
-            if (session && (DLL_COUNT(q_, &sessionsQ[thread][ses]) > (int)config.maxStreams[ses] ||
-                            ((uint64_t)session->lastPacket.tv_sec + config.timeouts[ses] < (uint64_t)lastPacketSecs[thread]))) {
-
-                moloch_session_save(session);
-            } else {
-                break;
-            }
-        }
-    }
-
-    // TCP Sessions Open Long Time
-    for (count = 0; count < 50; count++) {
-        MolochSession_t *session = DLL_PEEK_HEAD(tcp_, &tcpWriteQ[thread]);
-
-        if (session && (uint64_t)session->saveTime < (uint64_t)lastPacketSecs[thread]) {
-            moloch_session_mid_save(session, lastPacketSecs[thread]);
-        } else {
-            break;
+        for (count = 0; count < 10 && DLL_COUNT(q_, &sessionsQ[thread][ses]) > (int)config.maxStreams[ses]; count++) {
+            moloch_session_save(DLL_PEEK_HEAD(q_, &sessionsQ[thread][ses]));
         }
     }
 }
@@ -811,21 +1047,15 @@ void moloch_session_init()
         MOLOCH_FIELD_TYPE_STR_HASH,  MOLOCH_FIELD_FLAG_CNT | MOLOCH_FIELD_FLAG_LINKED_SESSIONS,
         (char *)NULL);
 
-    int primes[SESSION_MAX];
     int s;
-    for (s = 0; s < SESSION_MAX; s++) {
-        primes[s] = moloch_get_next_prime(config.maxStreams[s]);
-    }
-
-    if (config.debug)
-        LOG("session hash size %d %d %d %d %d %d", primes[SESSION_ICMP], primes[SESSION_UDP], primes[SESSION_TCP], primes[SESSION_SCTP], primes[SESSION_ESP], primes[SESSION_OTHER]);
-
     int t;
     for (t = 0; t < config.packetThreads; t++) {
         for (s = 0; s < SESSION_MAX; s++) {
-            HASHP_INIT(h_, sessions[t][s], primes[s], moloch_session_hash, (HASH_CMP_FUNC)moloch_session_cmp);
+            moloch_session_tab_alloc(&sessions[t][s].cur, MOLOCH_SESSION_TABLE_MIN);
             DLL_INIT(q_, &sessionsQ[t][s]);
         }
+        sessionWheel[t] = malloc(sizeof(MolochTimeWheel_t));
+        moloch_timewheel_init(sessionWheel[t], lastPacketSecs[t]);
 
         DLL_INIT(tcp_, &tcpWriteQ[t]);
         DLL_INIT(q_, &closingQ[t]);
@@ -853,10 +1083,14 @@ LOCAL void moloch_session_flush_close(MolochSession_t *session, gpointer UNUSED(
     int thread = session->thread;
     int i;
 
+    // Every session in the table is on either a sessionsQ or the closingQ
     for (i = 0; i < SESSION_MAX; i++) {
-        HASH_FORALL_POP_HEAD(h_, sessions[thread][i], session,
+        while ((session = DLL_PEEK_HEAD(q_, &sessionsQ[thread][i]))) {
             moloch_session_save(session);
-        );
+        }
+    }
+    while ((session = DLL_PEEK_HEAD(q_, &closingQ[thread]))) {
+        moloch_session_save(session);
     }
     moloch_pq_flush(thread);
 }
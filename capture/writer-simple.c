@@ -2,7 +2,7 @@
 /* writer-simple.c  -- Simple Writer
  *
  * This writer just creates a file per packet thread and queues buffers
- * to be written to disk in a single output thread.
+ * to be encrypted and written to disk by a pool of output threads.
  *
  * Copyright 2012-2017 AOL Inc. All rights reserved.
  *
@@ -32,6 +32,9 @@
 #include <math.h>
 #include "openssl/rand.h"
 #include "openssl/evp.h"
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #ifndef O_NOATIME
 #define O_NOATIME 0
@@ -53,7 +56,6 @@ LOCAL  int                   simpleZstdLevel;
 
 // Information about the current file being written to, all items that are constant per file should be here
 typedef struct {
-    EVP_CIPHER_CTX      *cipher_ctx;
     uint64_t             pos;
     uint64_t             blockStart;
     uint64_t             packetBytesWritten;
@@ -61,7 +63,10 @@ typedef struct {
     uint32_t             posInBlock;
     uint32_t             id;
     int                  fd;
+    uint64_t             queuedPos;  // Where the next buffer handed to the output threads starts
+    int                  refs;       // One for the packet thread plus one per queued buffer
     uint8_t              dek[256];
+    uint8_t              iv[16];
     z_stream             z_strm;
     uint8_t              thread;
 #ifdef HAVE_ZSTD
@@ -78,7 +83,11 @@ typedef struct molochsimple {
     struct molochsimple *simple_next, *simple_prev;
     char                *buf;     // mmap buffer, config.pcapWriteSize + MOLOCH_PACKET_MAX_LEN
     MolochSimpleFile_t  *file;
+    uint64_t             filePos; // Where in the file buf starts
     uint32_t             bufpos;  // Where in buf we are writing to
+    uint32_t             total;   // How much of buf the output thread writes
+    uint32_t             written; // How much of total has been written
+    uint16_t             uringIndex; // 1 based registered buffer index, 0 if not registered
     uint8_t              closing; // This is the last block, close file when done
 } MolochSimple_t;
 
@@ -99,11 +108,17 @@ LOCAL MolochSimpleHead_t     freeList[MOLOCH_MAX_PACKET_THREADS];
 LOCAL uint32_t               pageSize;
 LOCAL enum MolochSimpleMode  simpleMode;
 LOCAL int                    simpleMaxQ;
+LOCAL int                    simpleWriterThreads;
+LOCAL int                    simpleInProgress;
+LOCAL gboolean               simpleUring;
 LOCAL const EVP_CIPHER      *cipher;
 LOCAL int                    openOptions;
 LOCAL struct timeval         lastSave[MOLOCH_MAX_PACKET_THREADS];
 LOCAL struct timeval         fileAge[MOLOCH_MAX_PACKET_THREADS];
 LOCAL uint32_t               firstPacket[MOLOCH_MAX_PACKET_THREADS];
+#ifdef HAVE_ZSTD
+LOCAL ZSTD_CStream          *zstdStrm[MOLOCH_MAX_PACKET_THREADS];
+#endif
 
 #define INDEX_FILES_CACHE_SIZE (MOLOCH_MAX_PACKET_THREADS-1)
 struct {
@@ -127,9 +142,27 @@ struct {
 LOCAL int      uncompressedBits;    // Number of bits used in filepos to store location in block
 LOCAL uint32_t simpleCompressionBlockSize; // Max data that we try and compress, can be represented by uncompressedBits
 
+/******************************************************************************/
+#ifdef HAVE_LIBURING
+LOCAL struct io_uring        uring;
+LOCAL int                    uringDepth;
+LOCAL int                    uringInFlight;    // writes, fsyncs and closes submitted but not completed, simpleQ lock
+LOCAL gboolean               uringFsync;
+LOCAL int                    uringBuffersMax;  // size of the sparse registered buffer table
+LOCAL int                    uringBuffersUsed;
+#endif
+
 /******************************************************************************/
 LOCAL uint32_t writer_simple_queue_length()
 {
+#ifdef HAVE_LIBURING
+    if (simpleUring) {
+        MOLOCH_LOCK(simpleQ);
+        uint32_t len = DLL_COUNT(simple_, &simpleQ) + uringInFlight;
+        MOLOCH_UNLOCK(simpleQ);
+        return len;
+    }
+#endif
     return DLL_COUNT(simple_, &simpleQ);
 }
 /******************************************************************************/
@@ -161,37 +194,28 @@ LOCAL MolochSimple_t *writer_simple_alloc(int thread, MolochSimple_t *previous)
     return info;
 }
 /******************************************************************************/
+/*
+ * Called once the file descriptor has been closed, the zstd stream belongs to
+ * the packet thread and is reused for the next file.
+ */
+LOCAL void writer_simple_file_free(MolochSimpleFile_t *file)
+{
+    moloch_db_update_filesize(file->id, file->pos, file->packetBytesWritten, file->packets);
+
+    if (compressionMode == MOLOCH_COMPRESSION_GZIP)
+        deflateEnd(&file->z_strm);
+
+    MOLOCH_TYPE_FREE(MolochSimpleFile_t, file);
+}
+/******************************************************************************/
 LOCAL void writer_simple_free(MolochSimple_t *info)
 {
     int thread = info->file->thread;
 
-    if (info->closing) {
-        switch(simpleMode) {
-        case MOLOCH_SIMPLE_NORMAL:
-            break;
-        case MOLOCH_SIMPLE_XOR2048:
-            break;
-        case MOLOCH_SIMPLE_AES256CTR:
-            EVP_CIPHER_CTX_free(info->file->cipher_ctx);
-            break;
-        }
-        switch(compressionMode) {
-        case MOLOCH_COMPRESSION_GZIP:
-            deflateEnd(&info->file->z_strm);
-            break;
-#ifdef HAVE_ZSTD
-        case MOLOCH_COMPRESSION_ZSTD:
-            ZSTD_freeCStream(info->file->zstd_strm);
-            break;
-#endif
-        default:
-            break;
-        }
-        MOLOCH_TYPE_FREE(MolochSimpleFile_t, info->file);
-    }
     info->file = 0;
 
-    if (DLL_COUNT(simple_, &freeList[thread]) < 16) {
+    // Registered buffers are never unmapped, the ring still points at them
+    if (DLL_COUNT(simple_, &freeList[thread]) < 16 || info->uringIndex) {
         MOLOCH_LOCK(freeList[thread].lock);
         DLL_PUSH_TAIL(simple_, &freeList[thread], info);
         MOLOCH_UNLOCK(freeList[thread].lock);
@@ -271,8 +295,13 @@ LOCAL void writer_simple_process_buf(int thread, int closing)
         currentInfo[thread] = NULL; // This will cause a new file to be allocated on next packet
     }
 
+    // Buffers always start on a page boundary, which lets the output threads encrypt them independently
+    info->filePos = info->file->queuedPos;
+    info->file->queuedPos += info->bufpos;
+
     // Send to write q to actually write to disk
     MOLOCH_LOCK(simpleQ);
+    MOLOCH_THREAD_INCR(info->file->refs);
     gettimeofday(&lastSave[thread], NULL);
     DLL_PUSH_TAIL(simple_, &simpleQ, info);
     if (DLL_COUNT(simple_, &simpleQ) > 100 && lastSave[thread].tv_sec > lastError + 60) {
@@ -479,6 +508,7 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
         info = currentInfo[thread] = writer_simple_alloc(thread, NULL);
         info->file = MOLOCH_TYPE_ALLOC0(MolochSimpleFile_t);
         info->file->thread = thread;
+        info->file->refs = 1;
 
         switch(compressionMode) {
         case MOLOCH_COMPRESSION_GZIP:
@@ -491,8 +521,13 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
             break;
 #ifdef HAVE_ZSTD
         case MOLOCH_COMPRESSION_ZSTD:
-            info->file->zstd_strm = ZSTD_createCStream();
-            ZSTD_CCtx_setParameter(info->file->zstd_strm, ZSTD_c_compressionLevel, simpleZstdLevel);
+            if (!zstdStrm[thread]) {
+                zstdStrm[thread] = ZSTD_createCStream();
+                ZSTD_CCtx_setParameter(zstdStrm[thread], ZSTD_c_compressionLevel, simpleZstdLevel);
+            } else {
+                ZSTD_CCtx_reset(zstdStrm[thread], ZSTD_reset_session_only);
+            }
+            info->file->zstd_strm = zstdStrm[thread];
             uncompressedBitsArg = (gpointer)(long)uncompressedBits;
             compressionArg = "zstd";
 
@@ -540,18 +575,14 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
             g_free(kekId);
             break;
         case MOLOCH_SIMPLE_AES256CTR: {
-            info->file->cipher_ctx = EVP_CIPHER_CTX_new();
             name = ".arkime";
-            uint8_t dek[32];
-            uint8_t iv[16];
             char    ivhex[33];
-            RAND_bytes(iv, 12);
-            RAND_bytes(dek, 32);
-            memset(iv+12, 0, 4);
+            RAND_bytes(info->file->iv, 12);
+            RAND_bytes(info->file->dek, 32);
+            memset(info->file->iv+12, 0, 4);
             kekId = writer_simple_get_kekId();
-            writer_simple_encrypt_key(kekId, dek, 32, dekhex);
-            moloch_sprint_hex_string(ivhex, iv, 12);
-            EVP_EncryptInit(info->file->cipher_ctx, cipher, dek, iv);
+            writer_simple_encrypt_key(kekId, info->file->dek, 32, dekhex);
+            moloch_sprint_hex_string(ivhex, info->file->iv, 12);
             name = moloch_db_create_file_full(packet->ts.tv_sec, name, 0, 0, &info->file->id,
                                               "encoding", "aes-256-ctr",
                                               "iv", ivhex,
@@ -661,67 +692,267 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
     }
 }
 /******************************************************************************/
+/*
+ * There can be several output threads, so buffers from the same file may be
+ * encrypted and written out of order.  Each buffer knows where in the file it
+ * starts, so it uses pwrite and derives the AES-CTR counter from that position.
+ * The counter is the low 4 bytes of the iv, which the 64G file limit keeps from
+ * wrapping, so the result is the same as encrypting the file as one stream.
+ */
+LOCAL void writer_simple_encrypt(MolochSimple_t *info, EVP_CIPHER_CTX *cipher_ctx)
+{
+    MolochSimpleFile_t *file = info->file;
+
+    info->written = 0;
+    info->total = info->bufpos;
+    if (info->closing) {
+        // Round up to next page size
+        if (info->total % pageSize != 0)
+            info->total = ((info->total/pageSize)+1)*pageSize;
+    }
+
+    switch(simpleMode) {
+    case MOLOCH_SIMPLE_NORMAL:
+        break;
+    case MOLOCH_SIMPLE_XOR2048: {
+        uint32_t i;
+        for (i = 0; i < info->total; i++)
+            info->buf[i] ^= file->dek[i % 256];
+        break;
+    }
+    case MOLOCH_SIMPLE_AES256CTR: {
+        int outl;
+        uint8_t iv[16];
+        uint32_t counter = htonl(info->filePos / 16);
+        memcpy(iv, file->iv, 12);
+        memcpy(iv + 12, &counter, 4);
+        EVP_EncryptInit_ex(cipher_ctx, cipher, NULL, file->dek, iv);
+        if (!EVP_EncryptUpdate(cipher_ctx, (uint8_t *)info->buf, &outl, (uint8_t *)info->buf, info->total))
+            LOGEXIT("ERROR - Encrypting data failed");
+        if ((int)info->total != outl)
+            LOGEXIT("ERROR - Encryption in (%u) and out (%d) didn't match", info->total, outl);
+        break;
+    }
+    }
+}
+/******************************************************************************/
+/*
+ * Release a written buffer, returns the file if this was the last reference
+ * and it is ready to be closed.  The closing buffer also drops the packet
+ * thread's reference.
+ */
+LOCAL MolochSimpleFile_t *writer_simple_written(MolochSimple_t *info)
+{
+    MolochSimpleFile_t *file = info->file;
+    int refs = info->closing ? 2 : 1;
+
+    writer_simple_free(info);
+    if (__sync_sub_and_fetch(&file->refs, refs) == 0) {
+        if (ftruncate(file->fd, file->pos) < 0 && config.debug)
+            LOG("Truncate failed");
+        return file;
+    }
+    return NULL;
+}
+/******************************************************************************/
 LOCAL void *writer_simple_thread(void *UNUSED(arg))
 {
     MolochSimple_t *info;
+    EVP_CIPHER_CTX *cipher_ctx = NULL;
 
     if (config.debug)
         LOG("THREAD %p", (gpointer)pthread_self());
 
+    if (simpleMode == MOLOCH_SIMPLE_AES256CTR)
+        cipher_ctx = EVP_CIPHER_CTX_new();
+
     while (1) {
         MOLOCH_LOCK(simpleQ);
         while (DLL_COUNT(simple_, &simpleQ) == 0) {
             MOLOCH_COND_WAIT(simpleQ);
         }
         DLL_POP_HEAD(simple_, &simpleQ, info);
+        simpleInProgress++;
         MOLOCH_UNLOCK(simpleQ);
 
-        uint32_t pos = 0;
-        uint32_t total = info->bufpos;
-        if (info->closing) {
-            // Round up to next page size
-            if (total % pageSize != 0)
-                total = ((total/pageSize)+1)*pageSize;
+        writer_simple_encrypt(info, cipher_ctx);
+
+        while (info->written < info->total) {
+            int len = pwrite(info->file->fd, info->buf + info->written, info->total - info->written, info->filePos + info->written);
+            if (len >= 0) {
+                info->written += len;
+            } else {
+                LOGEXIT("ERROR - writing %d %s", len, strerror(errno));
+            }
         }
 
-        switch(simpleMode) {
-        case MOLOCH_SIMPLE_NORMAL:
-            break;
-        case MOLOCH_SIMPLE_XOR2048: {
-            uint32_t i;
-            for (i = 0; i < total; i++)
-                info->buf[i] ^= info->file->dek[i % 256];
-            break;
+        MolochSimpleFile_t *file = writer_simple_written(info);
+        if (file) {
+            close(file->fd);
+            writer_simple_file_free(file);
         }
-        case MOLOCH_SIMPLE_AES256CTR: {
-            int outl;
-            if (!EVP_EncryptUpdate(info->file->cipher_ctx, (uint8_t *)info->buf, &outl, (uint8_t *)info->buf, total))
-                LOGEXIT("ERROR - Encrypting data failed");
-            if ((int)total != outl)
-                LOGEXIT("ERROR - Encryption in (%u) and out (%d) didn't match", total, outl);
-            break;
+
+        MOLOCH_LOCK(simpleQ);
+        simpleInProgress--;
+        MOLOCH_UNLOCK(simpleQ);
+    }
+    return NULL;
+}
+#ifdef HAVE_LIBURING
+/******************************************************************************/
+/*
+ * The io_uring output thread keeps up to simpleUringDepth buffers in flight.
+ * Buffers are registered with the ring the first time they are written, and
+ * a file that has been fully written is closed through the ring so rotation
+ * never blocks the thread.  With simpleUringFsync the close is linked behind
+ * an fsync.  Completion data is the buffer for writes, the file with the low
+ * bit set for closes and NULL for the fsyncs.
+ */
+LOCAL struct io_uring_sqe *writer_simple_uring_sqe()
+{
+    struct io_uring_sqe *sqe;
+
+    while (!(sqe = io_uring_get_sqe(&uring))) {
+        io_uring_submit(&uring);
+    }
+    MOLOCH_LOCK(simpleQ);
+    uringInFlight++;
+    MOLOCH_UNLOCK(simpleQ);
+    return sqe;
+}
+/******************************************************************************/
+LOCAL void writer_simple_uring_write(MolochSimple_t *info)
+{
+    if (!info->uringIndex && uringBuffersUsed < uringBuffersMax) {
+        struct iovec iov;
+        iov.iov_base = info->buf;
+        iov.iov_len = config.pcapWriteSize + MOLOCH_PACKET_MAX_LEN;
+        if (io_uring_register_buffers_update_tag(&uring, uringBuffersUsed, &iov, NULL, 1) == 1) {
+            uringBuffersUsed++;
+            info->uringIndex = uringBuffersUsed;
+        } else {
+            LOG("WARNING - Couldn't register simple writer buffer, using unregistered buffers from now on");
+            uringBuffersMax = 0;
         }
+    }
+
+    struct io_uring_sqe *sqe = writer_simple_uring_sqe();
+    if (info->uringIndex) {
+        io_uring_prep_write_fixed(sqe, info->file->fd, info->buf + info->written, info->total - info->written,
+                                  info->filePos + info->written, info->uringIndex - 1);
+    } else {
+        io_uring_prep_write(sqe, info->file->fd, info->buf + info->written, info->total - info->written,
+                            info->filePos + info->written);
+    }
+    io_uring_sqe_set_data(sqe, info);
+}
+/******************************************************************************/
+LOCAL void writer_simple_uring_close(MolochSimpleFile_t *file)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uringFsync) {
+        sqe = writer_simple_uring_sqe();
+        io_uring_prep_fsync(sqe, file->fd, IORING_FSYNC_DATASYNC);
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        io_uring_sqe_set_data(sqe, NULL);
+    }
+
+    sqe = writer_simple_uring_sqe();
+    io_uring_prep_close(sqe, file->fd);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)file | 1));
+}
+/******************************************************************************/
+LOCAL void writer_simple_uring_complete(struct io_uring_cqe *cqe)
+{
+    uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+
+    io_uring_cqe_seen(&uring, cqe);
+    MOLOCH_LOCK(simpleQ);
+    uringInFlight--;
+    MOLOCH_UNLOCK(simpleQ);
+
+    if (!data) {
+        // fsync failures are reported but the close still happens
+        if (res < 0 && res != -ECANCELED)
+            LOG("WARNING - fsync failed %d %s", res, strerror(-res));
+        return;
+    }
+
+    if (data & 1) {
+        MolochSimpleFile_t *file = (MolochSimpleFile_t *)(data & ~(uintptr_t)1);
+        // Canceled because the linked fsync failed, close it ourselves
+        if (res == -ECANCELED)
+            close(file->fd);
+        writer_simple_file_free(file);
+        return;
+    }
+
+    MolochSimple_t *info = (MolochSimple_t *)data;
+    if (res < 0) {
+        LOGEXIT("ERROR - writing %d %s", res, strerror(-res));
+    }
+
+    info->written += res;
+    if (info->written < info->total) {
+        writer_simple_uring_write(info);
+        return;
+    }
+
+    MolochSimpleFile_t *file = writer_simple_written(info);
+    if (file)
+        writer_simple_uring_close(file);
+
+    MOLOCH_LOCK(simpleQ);
+    simpleInProgress--;
+    MOLOCH_UNLOCK(simpleQ);
+}
+/******************************************************************************/
+LOCAL void *writer_simple_uring_thread(void *UNUSED(arg))
+{
+    MolochSimple_t *info;
+    EVP_CIPHER_CTX *cipher_ctx = NULL;
+    struct io_uring_cqe *cqe;
+
+    if (config.debug)
+        LOG("THREAD %p", (gpointer)pthread_self());
+
+    if (simpleMode == MOLOCH_SIMPLE_AES256CTR)
+        cipher_ctx = EVP_CIPHER_CTX_new();
+
+    while (1) {
+        while (io_uring_peek_cqe(&uring, &cqe) == 0) {
+            writer_simple_uring_complete(cqe);
         }
 
-        while (pos < total) {
-            int len = write(info->file->fd, info->buf + pos, total - pos);
-            if (len >= 0) {
-                pos += len;
-            } else {
-                LOGEXIT("ERROR - writing %d %s", len, strerror(errno));
-            }
+        MOLOCH_LOCK(simpleQ);
+        while (DLL_COUNT(simple_, &simpleQ) == 0 && uringInFlight == 0) {
+            MOLOCH_COND_WAIT(simpleQ);
+        }
+        info = NULL;
+        if (simpleInProgress < uringDepth) {
+            DLL_POP_HEAD(simple_, &simpleQ, info);
+            if (info)
+                simpleInProgress++;
         }
-        if (info->closing) {
-            if (ftruncate(info->file->fd, info->file->pos) < 0 && config.debug)
-                LOG("Truncate failed");
-            close(info->file->fd);
-            moloch_db_update_filesize(info->file->id, info->file->pos, info->file->packetBytesWritten, info->file->packets);
+        MOLOCH_UNLOCK(simpleQ);
+
+        if (info) {
+            writer_simple_encrypt(info, cipher_ctx);
+            writer_simple_uring_write(info);
+            io_uring_submit(&uring);
+            continue;
         }
 
-        writer_simple_free(info);
+        // Nothing new we can submit, wait for something to finish
+        io_uring_submit(&uring);
+        if (io_uring_wait_cqe(&uring, &cqe) == 0)
+            writer_simple_uring_complete(cqe);
     }
     return NULL;
 }
+#endif
 /******************************************************************************/
 LOCAL void writer_simple_exit()
 {
@@ -733,8 +964,16 @@ LOCAL void writer_simple_exit()
         }
     }
 
-    // Pause the main thread until our thread finishes
-    while (writer_simple_queue_length() > 0) {
+    // Pause the main thread until our threads finish
+    while (1) {
+        MOLOCH_LOCK(simpleQ);
+        int busy = DLL_COUNT(simple_, &simpleQ) + simpleInProgress;
+#ifdef HAVE_LIBURING
+        busy += uringInFlight;
+#endif
+        MOLOCH_UNLOCK(simpleQ);
+        if (busy == 0)
+            break;
         usleep(10000);
     }
 
@@ -924,6 +1163,8 @@ void writer_simple_init(char *name)
     moloch_writer_write        = writer_simple_write;
 
     simpleMaxQ = moloch_config_int(NULL, "simpleMaxQ", 2000, 50, 0xffff);
+    simpleWriterThreads = moloch_config_int(NULL, "simpleWriterThreads", 1, 1, 32);
+    simpleUring = strcmp(name, "simple-uring") == 0;
     char *mode = moloch_config_str(NULL, "simpleEncoding", NULL);
     char *compression = moloch_config_str(NULL, "simpleCompression", "gzip");
 
@@ -987,7 +1228,7 @@ void writer_simple_init(char *name)
     }
 
     openOptions = O_NOATIME | O_WRONLY | O_CREAT | O_TRUNC;
-    if (strcmp(name, "simple") == 0) {
+    if (strcmp(name, "simple") == 0 || simpleUring) {
 #ifdef O_DIRECT
         openOptions |= O_DIRECT;
 #else
@@ -1032,7 +1273,34 @@ void writer_simple_init(char *name)
         MOLOCH_LOCK_INIT(freeList[thread].lock);
     }
 
-    g_thread_unref(g_thread_new("moloch-simple", &writer_simple_thread, NULL));
+#ifdef HAVE_LIBURING
+    if (simpleUring) {
+        if (simpleWriterThreads > 1)
+            LOG("WARNING - simpleWriterThreads is ignored with pcapWriteMethod=simple-uring, a single thread drives the ring");
+
+        uringDepth = moloch_config_int(NULL, "simpleUringDepth", 32, 2, 1024);
+        uringFsync = moloch_config_boolean(NULL, "simpleUringFsync", FALSE);
+        int rc = io_uring_queue_init(uringDepth * 2 + 2, &uring, 0);
+        if (rc < 0)
+            CONFIGEXIT("io_uring_queue_init failed %d %s, use pcapWriteMethod=simple instead", rc, strerror(-rc));
+
+        uringBuffersMax = moloch_config_int(NULL, "simpleUringBuffers", uringDepth + config.packetThreads * 16, 0, 0xffff);
+        if (uringBuffersMax > 0 && io_uring_register_buffers_sparse(&uring, uringBuffersMax) < 0) {
+            LOG("WARNING - Kernel doesn't support sparse registered buffers, using unregistered buffers");
+            uringBuffersMax = 0;
+        }
+
+        g_thread_unref(g_thread_new("moloch-simple-uring", &writer_simple_uring_thread, NULL));
+        g_timeout_add_seconds(1, writer_simple_check_gfunc, 0);
+        return;
+    }
+#endif
+
+    for (int t = 0; t < simpleWriterThreads; t++) {
+        char name[100];
+        snprintf(name, sizeof(name), "moloch-simple%d", t);
+        g_thread_unref(g_thread_new(name, &writer_simple_thread, NULL));
+    }
 
     g_timeout_add_seconds(1, writer_simple_check_gfunc, 0);
 }
@@ -16,6 +16,7 @@
  * limitations under the License.
  */
 #include "moloch.h"
+#include "arkimeconfig.h"
 #include <inttypes.h>
 #include <errno.h>
 
@@ -64,4 +65,7 @@ void moloch_writers_init()
     moloch_writers_add("inplace", writer_inplace_init);
     moloch_writers_add("simple", writer_simple_init);
     moloch_writers_add("simple-nodirect", writer_simple_init);
+#ifdef HAVE_LIBURING
+    moloch_writers_add("simple-uring", writer_simple_init);
+#endif
 }
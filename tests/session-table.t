@@ -0,0 +1,38 @@
+use Test::More tests => 4;
+use JSON;
+use strict;
+
+# Enough udp sessions open at once that each packet thread's session table
+# resizes several times, with the second packet of every session arriving
+# after all of the resizes. Every session has to be found again, so each one
+# is saved once with both packets.
+my $num = 20000;
+my $pcap = "/tmp/session-table.$$.pcap";
+
+open(my $fh, '>:raw', $pcap) or die "Couldn't create $pcap: $!";
+print $fh pack("LSSlLLL", 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1);
+for my $round (0 .. 1) {
+    for my $i (0 .. $num - 1) {
+        my $payload = "row$round";
+        my $udp = pack("nnnn", 40000 + $i % 1000, 9999, 8 + length($payload), 0) . $payload;
+        my $ip = pack("CCnnnCCnNN", 0x45, 0, 20 + length($udp), $i & 0xffff, 0, 64, 17, 0, 0x0a000000 + $i, 0xc0a80101);
+        my $frame = pack("H12H12n", "000000000002", "000000000001", 0x0800) . $ip . $udp;
+        print $fh pack("LLLL", 1600000000 + $round, $i * 10, length($frame), length($frame)), $frame;
+    }
+}
+close($fh);
+
+my $output = `../capture/capture --tests -c config.test.ini -n test -o maxStreams=100000 -r $pcap 2>&1 1>/dev/null | ./tests.pl --fix`;
+unlink($pcap);
+
+my $json = eval { from_json($output, {relaxed => 1}) };
+ok($json, "capture output is json") or diag($output);
+
+my @sessions = @{$json->{sessions3} || []};
+is(scalar @sessions, $num, "one session per flow");
+
+my %ips = map { $_->{body}->{source}->{ip} => 1 } @sessions;
+is(scalar keys %ips, $num, "every flow has its own session");
+
+my @split = grep { $_->{body}->{network}->{packets} != 2 } @sessions;
+is(scalar @split, 0, "both packets of every flow are in the same session");
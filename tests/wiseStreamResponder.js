@@ -0,0 +1,161 @@
+/******************************************************************************/
+/* wiseStreamResponder.js -- Stand in for wiseService when testing capture
+ *
+ * Answers /fields and /get over http and the framed protocol capture uses
+ * with wiseStreamPort/wiseStreamSocket.  Every lookup gets the same tag back,
+ * without any sources, so it can be used to load test capture's wise plugin.
+ *
+ * node wiseStreamResponder.js [--port 8081] [--streamPort 8082] [--streamHost 127.0.0.1]
+ *                             [--streamSocket path] [--tag wise-stand-in] [--delay ms]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+'use strict';
+
+const http = require('http');
+const net = require('net');
+const fs = require('fs');
+const crypto = require('crypto');
+const querystring = require('querystring');
+
+const opts = { port: 8081, streamPort: 8082, streamHost: '127.0.0.1', streamSocket: undefined, tag: 'wise-stand-in', delay: 0 };
+for (let i = 2; i < process.argv.length; i += 2) {
+  const key = process.argv[i].replace(/^--/, '');
+  if (!(key in opts) || process.argv[i + 1] === undefined) {
+    console.log('Unknown option', process.argv[i]);
+    process.exit(1);
+  }
+  opts[key] = process.argv[i + 1];
+}
+
+// Only one field, the same way wiseService always has tags
+const fields = ['field:tags'];
+let fieldsBuf = Buffer.alloc(10);
+fieldsBuf.writeUInt32BE(Math.floor(Date.now() / 1000), 0);
+fieldsBuf.writeUInt32BE(1, 4);
+fieldsBuf.writeUInt16BE(fields.length, 8);
+for (const field of fields) {
+  const len = Buffer.alloc(2);
+  len.writeUInt16BE(Buffer.byteLength(field) + 1, 0);
+  fieldsBuf = Buffer.concat([fieldsBuf, len, Buffer.from(field), Buffer.alloc(1)]);
+}
+const fieldsMd5 = crypto.createHash('md5').update(fieldsBuf.slice(8)).digest('hex');
+
+// Every query gets one op, add the tag
+const tag = Buffer.from(opts.tag);
+const result = Buffer.concat([Buffer.from([1, 0, tag.length + 1]), tag, Buffer.alloc(1)]);
+
+const stats = { frames: 0, posts: 0, queries: 0 };
+
+// ----------------------------------------------------------------------------
+// Count the queries in a /get body, the values themselves don't matter here
+function countQueries (buf, offset) {
+  let count = 0;
+  while (offset < buf.length) {
+    const type = buf[offset];
+    offset += 1 + ((type & 0x80) ? (type & ~0x80) : 0);
+    offset += 2 + buf.readUInt16BE(offset);
+    count++;
+  }
+  if (offset !== buf.length) {
+    throw new Error('Malformed queries');
+  }
+  return count;
+}
+// ----------------------------------------------------------------------------
+function response (query, count) {
+  const hashes = (query.hashes || '').split(',');
+  const hdr = Buffer.alloc(40);
+  hdr.writeUInt32BE(0, 0);
+  hdr.writeUInt32BE(2, 4);
+  hdr.write(fieldsMd5, 8);
+
+  const bufs = [hdr, hashes.includes(fieldsMd5) ? Buffer.alloc(2) : fieldsBuf.slice(8)];
+  for (let i = 0; i < count; i++) {
+    bufs.push(result);
+  }
+  stats.queries += count;
+  return Buffer.concat(bufs);
+}
+// ----------------------------------------------------------------------------
+http.createServer((req, res) => {
+  const buffers = [];
+  req.on('data', (chunk) => buffers.push(chunk)).once('end', () => {
+    const url = new URL(req.url, 'http://localhost');
+    if (url.pathname === '/fields') {
+      return res.end(fieldsBuf);
+    }
+    if (url.pathname !== '/get') {
+      res.statusCode = 404;
+      return res.end();
+    }
+
+    stats.posts++;
+    let count;
+    try {
+      count = countQueries(Buffer.concat(buffers), 0);
+    } catch (err) {
+      return res.end('Received malformed packet');
+    }
+    const body = response(Object.fromEntries(url.searchParams), count);
+    setTimeout(() => res.end(body), opts.delay);
+  });
+}).listen(opts.port);
+
+// ----------------------------------------------------------------------------
+function processFrame (socket, frame) {
+  const id = frame.readUInt32BE(0);
+  const queryLen = frame.readUInt16BE(4);
+  const query = querystring.parse(frame.toString('utf8', 6, 6 + queryLen));
+  const body = response(query, countQueries(frame, 6 + queryLen));
+
+  const hdr = Buffer.alloc(8);
+  hdr.writeUInt32BE(body.length + 4, 0);
+  hdr.writeUInt32BE(id, 4);
+  stats.frames++;
+  setTimeout(() => {
+    if (!socket.destroyed) { socket.write(Buffer.concat([hdr, body])); }
+  }, opts.delay);
+}
+
+const streamServer = net.createServer((socket) => {
+  let pending = Buffer.alloc(0);
+  socket.on('data', (chunk) => {
+    pending = pending.length ? Buffer.concat([pending, chunk]) : chunk;
+    try {
+      while (pending.length >= 4 && pending.length >= pending.readUInt32BE(0) + 4) {
+        const len = pending.readUInt32BE(0);
+        processFrame(socket, pending.slice(4, len + 4));
+        pending = pending.slice(len + 4);
+      }
+    } catch (err) {
+      console.log('Malformed frame, closing', err);
+      socket.destroy();
+    }
+  }).on('error', (err) => {
+    console.log('Stream error', err);
+  });
+});
+
+if (opts.streamSocket) {
+  if (fs.existsSync(opts.streamSocket)) {
+    fs.unlinkSync(opts.streamSocket);
+  }
+  streamServer.listen(opts.streamSocket);
+} else {
+  streamServer.listen(opts.streamPort, opts.streamHost);
+}
+
+setInterval(() => {
+  console.log('frames: %d posts: %d queries: %d', stats.frames, stats.posts, stats.queries);
+}, 10000);
@@ -23,6 +23,8 @@ const express = require('express');
 const fs = require('fs');
 const http = require('http');
 const https = require('https');
+const net = require('net');
+const querystring = require('querystring');
 const glob = require('glob');
 const async = require('async');
 const sprintf = require('./sprintf.js').sprintf;
@@ -1066,6 +1068,39 @@ function processQueryResponse2 (req, res, queries, results) {
   res.end();
 }
 // ----------------------------------------------------------------------------
+// Parse the binary list of queries capture sends, throws if malformed
+function parseQueries (buf, offset) {
+  const queries = [];
+  while (offset < buf.length) {
+    const type = buf[offset];
+    offset++;
+
+    let typeName;
+    if (type & 0x80) {
+      typeName = buf.toString('utf8', offset, offset + (type & ~0x80));
+      offset += (type & ~0x80);
+    } else {
+      typeName = internals.type2Name[type];
+    }
+
+    if (!typeName) {
+      console.log('Couldn\'t find typeName');
+      throw new Error('Could not make out typeName from query');
+    }
+
+    const len = buf.readUInt16BE(offset);
+    offset += 2;
+
+    const value = buf.toString('utf8', offset, offset + len);
+    if (internals.debug > 1) {
+      console.log('%s', typeName, value);
+    }
+    offset += len;
+    queries.push({ typeName, value });
+  }
+  return queries;
+}
+// ----------------------------------------------------------------------------
 /**
  * POST - Used by capture to lookup all the wise items
  *
@@ -1076,41 +1111,13 @@ function processQueryResponse2 (req, res, queries, results) {
  * @returns {binary} The encoded results
  */
 app.post('/get', function (req, res) {
-  let offset = 0;
-
   const buffers = [];
   req.on('data', (chunk) => {
     buffers.push(chunk);
   }).once('end', (err) => {
-    const queries = [];
+    let queries;
     try {
-      for (const buf = Buffer.concat(buffers); offset < buf.length;) {
-        const type = buf[offset];
-        offset++;
-
-        let typeName;
-        if (type & 0x80) {
-          typeName = buf.toString('utf8', offset, offset + (type & ~0x80));
-          offset += (type & ~0x80);
-        } else {
-          typeName = internals.type2Name[type];
-        }
-
-        if (!typeName) {
-          console.log('Couldn\'t find typeName');
-          throw new Error('Could not make out typeName from query');
-        }
-
-        const len = buf.readUInt16BE(offset);
-        offset += 2;
-
-        const value = buf.toString('utf8', offset, offset + len);
-        if (internals.debug > 1) {
-          console.log('%s', typeName, value);
-        }
-        offset += len;
-        queries.push({ typeName, value });
-      }
+      queries = parseQueries(Buffer.concat(buffers), 0);
     } catch (err) {
       return res.end('Received malformed packet');
     }
@@ -1132,6 +1139,62 @@ app.post('/get', function (req, res) {
   });
 });
 // ----------------------------------------------------------------------------
+// Streaming version of /get used by capture when wiseStreamPort or wiseStreamSocket is set.
+// Request frames are u32 len, u32 id, u16 query len, the /get query string and then the
+// same queries /get takes. Response frames are u32 len, u32 id and the /get?ver=2 reply,
+// written as soon as they are ready so they can be out of order.
+function processStreamFrame (socket, frame) {
+  let id, req, queries;
+  try {
+    id = frame.readUInt32BE(0);
+    const queryLen = frame.readUInt16BE(4);
+    req = { query: querystring.parse(frame.toString('utf8', 6, 6 + queryLen)) };
+    queries = parseQueries(frame, 6 + queryLen);
+  } catch (err) {
+    console.log('ERROR - Received malformed stream frame', err);
+    return socket.destroy();
+  }
+
+  function send (body) {
+    if (socket.destroyed) { return; }
+    const hdr = Buffer.allocUnsafe(8);
+    hdr.writeUInt32BE(body.length + 4, 0);
+    hdr.writeUInt32BE(id, 4);
+    socket.write(Buffer.concat([hdr, body]));
+  }
+
+  async.map(queries, (query, cb) => {
+    processQuery(req, query, cb);
+  }, (err, results) => {
+    if (err) {
+      // An empty reply fails the batch so capture doesn't wait on it forever
+      console.log('Error', err);
+      return send(Buffer.alloc(0));
+    }
+
+    const buffers = [];
+    processQueryResponse2(req, {
+      write: (buf) => buffers.push(buf),
+      end: () => send(Buffer.concat(buffers))
+    }, queries, results);
+  });
+}
+// ----------------------------------------------------------------------------
+function handleStreamConnection (socket) {
+  let pending = Buffer.alloc(0);
+
+  socket.on('data', (chunk) => {
+    pending = pending.length ? Buffer.concat([pending, chunk]) : chunk;
+    while (pending.length >= 4 && pending.length >= pending.readUInt32BE(0) + 4) {
+      const len = pending.readUInt32BE(0);
+      processStreamFrame(socket, pending.slice(4, len + 4));
+      pending = pending.slice(len + 4);
+    }
+  }).on('error', (err) => {
+    console.log('WISE stream error', err);
+  });
+}
+// ----------------------------------------------------------------------------
 /**
  * GET - Used by wise UI to retrieve all the sources
  *
@@ -1850,6 +1913,25 @@ function main () {
         console.log('Express server listening on port %d in %s mode', server.address().port, app.settings.env);
       })
       .listen(getConfig('wiseService', 'port', 8081));
+
+    const streamPort = getConfig('wiseService', 'streamPort');
+    const streamSocket = getConfig('wiseService', 'streamSocket');
+    const streamHost = getConfig('wiseService', 'streamHost', '127.0.0.1');
+    if (streamPort || streamSocket) {
+      if (streamSocket && fs.existsSync(streamSocket)) {
+        fs.unlinkSync(streamSocket);
+      }
+      const streamServer = net.createServer(handleStreamConnection)
+        .on('error', (e) => {
+          console.log("ERROR - couldn't listen for capture streams on", streamSocket || `${streamHost}:${streamPort}`, e);
+          process.exit(1);
+        });
+      if (streamSocket) {
+        streamServer.listen(streamSocket);
+      } else {
+        streamServer.listen(streamPort, streamHost);
+      }
+    }
   }, 2000);
 }
 